@@ -0,0 +1,670 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "iotbroker.h"
+#include "acl.h"
+#include "config.h"
+#include "memmanager.h"
+#include "epoch.h"
+#include "subtree.h"
+#include "debug.h"
+
+/*compiled rules of the acl_file*/
+typedef struct
+{
+    AclNode *anyone; /*topic lines before the first user line, and every pattern line*/
+    AclUser *user; /*sorted by hash*/
+    UINT32 user_num;
+    UINT32 user_size;
+}AclRules;
+
+/*NULL without an acl_file, everything is allowed*/
+STATIC AclRules *g_acl = NULL;
+
+/*bumped by every compile, 0 is never current so a zeroed cache is empty*/
+STATIC UINT32 g_acl_generation = 0;
+
+/*FNV-1a*/
+STATIC UINT32 acl_hash(CONST UINT8 *str, UINT32 len)
+{
+    UINT32 hash = 2166136261u;
+    UINT32 i;
+
+    for(i = 0; i < len; i++)
+    {
+        hash = (hash ^ str[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+STATIC AclNode* new_node(CONST UINT8 *level, UINT32 len)
+{
+    AclNode *node;
+
+    node = (AclNode*)iotbroker_malloc(sizeof(AclNode), MEM_OTHER);
+    assert(node != NULL);
+    memset(node, 0, sizeof(AclNode));
+
+    if(level != NULL)
+    {
+        node->level = (UINT8*)iotbroker_malloc(len + 1, MEM_OTHER);
+        assert(node->level != NULL);
+        memcpy(node->level, level, len);
+        node->level[len] = '\0';
+        node->level_len = len;
+        node->hash = acl_hash(level, len);
+    }
+
+    return node;
+}
+
+STATIC VOID free_node(AclNode *node)
+{
+    UINT32 i;
+
+    INVALID_RETURN_NOVALUE(node != NULL);
+
+    for(i = 0; i < node->num; i++)
+    {
+        free_node(node->child[i]);
+    }
+
+    free_node(node->plus);
+    free_node(node->client);
+    free_node(node->user);
+
+    if(node->child != NULL)
+    {
+        iotbroker_free(node->child);
+    }
+
+    if(node->level != NULL)
+    {
+        iotbroker_free(node->level);
+    }
+
+    iotbroker_free(node);
+}
+
+STATIC VOID free_rules(VOID *ptr)
+{
+    AclRules *rules = (AclRules*)ptr;
+    UINT32 i;
+
+    free_node(rules->anyone);
+
+    for(i = 0; i < rules->user_num; i++)
+    {
+        iotbroker_free(rules->user[i].name);
+        free_node(rules->user[i].root);
+    }
+
+    if(rules->user != NULL)
+    {
+        iotbroker_free(rules->user);
+    }
+
+    iotbroker_free(rules);
+}
+
+/*first index of the named children whose hash is not less than hash*/
+STATIC UINT32 child_lower_bound(AclNode *node, UINT32 hash)
+{
+    UINT32 low = 0, high = node->num;
+
+    while(low < high)
+    {
+        UINT32 mid = (low + high) / 2;
+
+        if(node->child[mid]->hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+STATIC AclNode* find_child(AclNode *node, CONST UINT8 *level, UINT32 len)
+{
+    UINT32 hash = acl_hash(level, len);
+    UINT32 i;
+
+    for(i = child_lower_bound(node, hash); i < node->num && node->child[i]->hash == hash; i++)
+    {
+        AclNode *child = node->child[i];
+
+        if(child->level_len == len && 0 == memcmp(child->level, level, len))
+        {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+/*the named child, added when missing, compile only*/
+STATIC AclNode* get_child(AclNode *node, CONST UINT8 *level, UINT32 len)
+{
+    AclNode *child, **grown;
+    UINT32 pos;
+
+    child = find_child(node, level, len);
+    INVALID_RETURN_VALUE(NULL == child, child);
+
+    child = new_node(level, len);
+    pos = child_lower_bound(node, child->hash);
+
+    grown = (AclNode**)iotbroker_malloc((node->num + 1) * sizeof(AclNode*), MEM_OTHER);
+    assert(grown != NULL);
+    if(node->child != NULL)
+    {
+        memcpy(grown, node->child, pos * sizeof(AclNode*));
+        memcpy(grown + pos + 1, node->child + pos, (node->num - pos) * sizeof(AclNode*));
+        iotbroker_free(node->child);
+    }
+    grown[pos] = child;
+    node->child = grown;
+    node->num++;
+
+    return child;
+}
+
+/*the special child of slot, added when missing*/
+STATIC AclNode* get_special(AclNode **slot)
+{
+    if(NULL == *slot)
+    {
+        *slot = new_node(NULL, 0);
+    }
+
+    return *slot;
+}
+
+/*
+ * Add the path of topic, '#' only as the last level. %c and %u stand for
+ * a whole level of a pattern, elsewhere they are plain names.
+ */
+STATIC UINT32 add_rule(AclNode *root, CONST INT8 *topic, UINT32 access, UINT32 pattern)
+{
+    AclNode *node = root;
+    CONST INT8 *level = topic, *end;
+    UINT32 len;
+
+    for( ; ; )
+    {
+        end = strchr(level, '/');
+        len = (end != NULL) ? (UINT32)(end - level) : strlen(level);
+
+        if(1 == len && '#' == level[0])
+        {
+            INVALID_RETURN_VALUE(NULL == end, FAILED);
+            node->rest |= access;
+            return SUCESS;
+        }
+
+        if(1 == len && '+' == level[0])
+        {
+            node = get_special(&node->plus);
+        }
+        else if(pattern && 2 == len && 0 == memcmp(level, "%c", 2))
+        {
+            node = get_special(&node->client);
+        }
+        else if(pattern && 2 == len && 0 == memcmp(level, "%u", 2))
+        {
+            node = get_special(&node->user);
+        }
+        else
+        {
+            /*a wildcard inside a level is not one*/
+            INVALID_RETURN_VALUE(NULL == memchr(level, '+', len) && NULL == memchr(level, '#', len), FAILED);
+            node = get_child(node, level, len);
+        }
+
+        if(NULL == end)
+        {
+            break;
+        }
+        level = end + 1;
+    }
+
+    node->access |= access;
+
+    return SUCESS;
+}
+
+STATIC INT32 cmp_user(CONST VOID *a, CONST VOID *b)
+{
+    CONST AclUser *ua = (CONST AclUser*)a, *ub = (CONST AclUser*)b;
+
+    if(ua->hash != ub->hash)
+    {
+        return (ua->hash > ub->hash) - (ua->hash < ub->hash);
+    }
+
+    return strcmp(ua->name, ub->name);
+}
+
+STATIC AclNode* find_user(AclRules *rules, CONST UINT8 *name)
+{
+    UINT32 hash, low = 0, high = rules->user_num;
+
+    INVALID_RETURN_VALUE(name != NULL, NULL);
+
+    hash = acl_hash(name, strlen(name));
+    while(low < high)
+    {
+        UINT32 mid = (low + high) / 2;
+
+        if(rules->user[mid].hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for( ; low < rules->user_num && rules->user[low].hash == hash; low++)
+    {
+        if(0 == strcmp(rules->user[low].name, name))
+        {
+            return rules->user[low].root;
+        }
+    }
+
+    return NULL;
+}
+
+/*the section of a user line, sorted and checked for repeats once the file is read*/
+STATIC AclNode* add_user(AclRules *rules, CONST INT8 *name)
+{
+    AclUser *user;
+    UINT32 len = strlen(name);
+
+    if(rules->user_num == rules->user_size)
+    {
+        rules->user_size = (rules->user_size != 0) ? rules->user_size * 2 : 16;
+        user = (AclUser*)iotbroker_malloc(rules->user_size * sizeof(AclUser), MEM_OTHER);
+        assert(user != NULL);
+        if(rules->user != NULL)
+        {
+            memcpy(user, rules->user, rules->user_num * sizeof(AclUser));
+            iotbroker_free(rules->user);
+        }
+        rules->user = user;
+    }
+
+    user = &rules->user[rules->user_num++];
+    user->name = (UINT8*)iotbroker_malloc(len + 1, MEM_OTHER);
+    assert(user->name != NULL);
+    memcpy(user->name, name, len + 1);
+    user->hash = acl_hash(name, len);
+    user->root = new_node(NULL, 0);
+
+    return user->root;
+}
+
+/*"[read|write|readwrite] topic", readwrite when left out*/
+STATIC UINT32 parse_topic_rule(CONST INT8 *value, UINT32 *access, INT8 *topic)
+{
+    INT8 word[ACL_LINE_LEN];
+    INT32 end = 0;
+
+    INVALID_RETURN_VALUE(sscanf(value, "%511s %n", word, &end) == 1, FAILED);
+
+    if(0 == strcmp(word, "read"))
+    {
+        *access = ACL_READ;
+    }
+    else if(0 == strcmp(word, "write"))
+    {
+        *access = ACL_WRITE;
+    }
+    else if(0 == strcmp(word, "readwrite"))
+    {
+        *access = ACL_READ | ACL_WRITE;
+    }
+    else
+    {
+        *access = ACL_READ | ACL_WRITE;
+        strcpy(topic, word);
+        return (value[end] == '\0') ? SUCESS : FAILED;
+    }
+
+    INVALID_RETURN_VALUE(sscanf(value + end, "%511s %n", topic, &end) == 1, FAILED);
+
+    return SUCESS;
+}
+
+/*
+ * "user name" starts the section of a user, "topic [access] topic" adds a
+ * rule to the current section, or for every client before the first user
+ * line, "pattern [access] topic" adds one for every client with %c and %u
+ * standing for the client id and username.
+ */
+STATIC AclRules* compile_file(CONST INT8 *path)
+{
+    INT8 line[ACL_LINE_LEN], word[ACL_LINE_LEN], topic[ACL_LINE_LEN];
+    AclRules *rules;
+    AclNode *section;
+    UINT32 lineno = 0, access, i;
+    INT32 end;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if(NULL == fp)
+    {
+        iotbroker_log(LOG_ERROR, "can not open acl file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    rules = (AclRules*)iotbroker_malloc(sizeof(AclRules), MEM_OTHER);
+    assert(rules != NULL);
+    memset(rules, 0, sizeof(AclRules));
+    rules->anyone = new_node(NULL, 0);
+    section = rules->anyone;
+
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        UINT32 ret = SUCESS;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        end = 0;
+        if(sscanf(line, "%511s %n", word, &end) != 1 || '#' == word[0])
+        {
+            continue;
+        }
+
+        if(0 == strcmp(word, "user"))
+        {
+            INT8 name[ACL_LINE_LEN];
+            INT32 name_end = 0;
+
+            ret = (sscanf(line + end, "%511s %n", name, &name_end) == 1 && '\0' == line[end + name_end]) ? SUCESS : FAILED;
+            if(SUCESS == ret)
+            {
+                section = add_user(rules, name);
+            }
+        }
+        else if(0 == strcmp(word, "topic") || 0 == strcmp(word, "pattern"))
+        {
+            UINT32 pattern = ('p' == word[0]);
+
+            ret = parse_topic_rule(line + end, &access, topic);
+            if(SUCESS == ret)
+            {
+                ret = add_rule(pattern ? rules->anyone : section, topic, access, pattern);
+            }
+        }
+        else
+        {
+            ret = FAILED;
+        }
+
+        if(ret != SUCESS)
+        {
+            iotbroker_log(LOG_ERROR, "acl file %s:%u: invalid rule \"%s\"", path, lineno, line);
+            fclose(fp);
+            free_rules(rules);
+            return NULL;
+        }
+    }
+    fclose(fp);
+
+    qsort(rules->user, rules->user_num, sizeof(AclUser), cmp_user);
+    for(i = 1; i < rules->user_num; i++)
+    {
+        if(0 == cmp_user(&rules->user[i - 1], &rules->user[i]))
+        {
+            iotbroker_log(LOG_ERROR, "acl file %s: user %s listed twice", path, rules->user[i].name);
+            free_rules(rules);
+            return NULL;
+        }
+    }
+
+    iotbroker_log(LOG_INFO, "acl file %s: %u users", path, rules->user_num);
+
+    return rules;
+}
+
+UINT32 iotbroker_acl_load()
+{
+    CONST INT8 *path = iotbroker_config_get()->acl_file;
+    AclRules *rules = NULL, *old = g_acl;
+
+    if(path[0] != '\0')
+    {
+        rules = compile_file(path);
+        INVALID_RETURN_VALUE(rules != NULL, FAILED);
+    }
+
+    g_acl = rules;
+    g_acl_generation++;
+
+    if(old != NULL)
+    {
+        iotbroker_epoch_defer(old, free_rules);
+    }
+
+    return SUCESS;
+}
+
+/*the level of the topic equals str*/
+STATIC UINT32 level_is(CONST UINT8 *level, UINT32 len, CONST UINT8 *str)
+{
+    return str != NULL && strlen(str) == len && 0 == memcmp(level, str, len);
+}
+
+/*
+ * Some rule below node grants access to the topic from level on, NULL past
+ * its last level. Wildcards do not match a first level starting with '$'.
+ */
+STATIC UINT32 match_topic(AclNode *node, CONST UINT8 *level, Client *c, UINT32 access, UINT32 first)
+{
+    UINT32 wild = !(first && level != NULL && '$' == level[0]);
+    CONST UINT8 *end, *next;
+    AclNode *child;
+    UINT32 len;
+
+    if(wild && (node->rest & access))
+    {
+        return TRUE;
+    }
+
+    if(NULL == level)
+    {
+        return (node->access & access) != 0;
+    }
+
+    end = strchr(level, '/');
+    len = (end != NULL) ? (UINT32)(end - level) : strlen(level);
+    next = (end != NULL) ? end + 1 : NULL;
+
+    child = find_child(node, level, len);
+    if(child != NULL && match_topic(child, next, c, access, FALSE))
+    {
+        return TRUE;
+    }
+
+    if(wild && node->plus != NULL && match_topic(node->plus, next, c, access, FALSE))
+    {
+        return TRUE;
+    }
+
+    if(node->client != NULL && level_is(level, len, c->client_id) && match_topic(node->client, next, c, access, FALSE))
+    {
+        return TRUE;
+    }
+
+    return node->user != NULL && level_is(level, len, c->username) && match_topic(node->user, next, c, access, FALSE);
+}
+
+/*
+ * Some rule below node grants read to every topic the filter matches from
+ * level on: its levels cover the ones of the filter one by one, '#' covers
+ * the rest, '+' only '+' or a name.
+ */
+STATIC UINT32 contain_filter(AclNode *node, CONST UINT8 *level, Client *c, UINT32 first)
+{
+    UINT32 wild = !(first && level != NULL && '$' == level[0]);
+    CONST UINT8 *end, *next;
+    AclNode *child;
+    UINT32 len;
+
+    if(wild && (node->rest & ACL_READ))
+    {
+        return TRUE;
+    }
+
+    if(NULL == level)
+    {
+        return (node->access & ACL_READ) != 0;
+    }
+
+    end = strchr(level, '/');
+    len = (end != NULL) ? (UINT32)(end - level) : strlen(level);
+    next = (end != NULL) ? end + 1 : NULL;
+
+    /*only a '#' rule covers a '#' filter, checked above*/
+    if(1 == len && '#' == level[0])
+    {
+        return FALSE;
+    }
+
+    if(1 == len && '+' == level[0])
+    {
+        return node->plus != NULL && contain_filter(node->plus, next, c, FALSE);
+    }
+
+    child = find_child(node, level, len);
+    if(child != NULL && contain_filter(child, next, c, FALSE))
+    {
+        return TRUE;
+    }
+
+    if(wild && node->plus != NULL && contain_filter(node->plus, next, c, FALSE))
+    {
+        return TRUE;
+    }
+
+    if(node->client != NULL && level_is(level, len, c->client_id) && contain_filter(node->client, next, c, FALSE))
+    {
+        return TRUE;
+    }
+
+    return node->user != NULL && level_is(level, len, c->username) && contain_filter(node->user, next, c, FALSE);
+}
+
+STATIC UINT32 check_publish(AclRules *rules, Client *client, CONST UINT8 *topic)
+{
+    AclNode *user = find_user(rules, client->username);
+
+    return match_topic(rules->anyone, topic, client, ACL_WRITE, TRUE)
+        || (user != NULL && match_topic(user, topic, client, ACL_WRITE, TRUE));
+}
+
+/*a client publishing to a few topics over and over walks the rules once for each*/
+UINT32 iotbroker_acl_publish(Client *client, CONST UINT8 *topic)
+{
+    AclRules *rules = g_acl;
+    AclCache *cache;
+    AclCacheEntry *e;
+    UINT32 len, hash, allow, i;
+
+    INVALID_RETURN_VALUE(rules != NULL, TRUE);
+
+    len = strlen(topic);
+    if(0 == len)
+    {
+        return check_publish(rules, client, topic);
+    }
+
+    cache = client->acl_cache;
+    if(NULL == cache)
+    {
+        cache = client->acl_cache = (AclCache*)iotbroker_malloc(sizeof(AclCache), MEM_SESSION);
+        assert(cache != NULL);
+        memset(cache, 0, sizeof(AclCache));
+    }
+
+    /*the copies are kept, only the decisions are stale*/
+    if(cache->generation != g_acl_generation)
+    {
+        for(i = 0; i < ACL_CACHE_SIZE; i++)
+        {
+            cache->entry[i].len = 0;
+        }
+        cache->generation = g_acl_generation;
+    }
+
+    hash = acl_hash(topic, len);
+    e = &cache->entry[hash & (ACL_CACHE_SIZE - 1)];
+    if(e->len == len && e->hash == hash && 0 == memcmp(e->topic, topic, len))
+    {
+        return e->allow;
+    }
+
+    allow = check_publish(rules, client, topic);
+
+    if(e->size < len)
+    {
+        iotbroker_free(e->topic);
+        e->topic = (UINT8*)iotbroker_malloc(len, MEM_SESSION);
+        assert(e->topic != NULL);
+        e->size = len;
+    }
+
+    e->hash = hash;
+    e->allow = allow;
+    e->len = len;
+    memcpy(e->topic, topic, len);
+
+    return allow;
+}
+
+UINT32 iotbroker_acl_subscribe(Client *client, CONST UINT8 *filter)
+{
+    AclRules *rules = g_acl;
+    AclNode *user;
+    UINT32 prefix_len = strlen(SUBTREE_CONFLATE_PREFIX);
+
+    INVALID_RETURN_VALUE(rules != NULL, TRUE);
+
+    /*a conflated subscription reads what the plain filter does*/
+    if(0 == strncmp(filter, SUBTREE_CONFLATE_PREFIX, prefix_len))
+    {
+        filter += prefix_len;
+    }
+
+    user = find_user(rules, client->username);
+
+    return contain_filter(rules->anyone, filter, client, TRUE)
+        || (user != NULL && contain_filter(user, filter, client, TRUE));
+}
+
+VOID iotbroker_acl_cache_free(Client *client)
+{
+    UINT32 i;
+
+    INVALID_RETURN_NOVALUE(client->acl_cache != NULL);
+
+    for(i = 0; i < ACL_CACHE_SIZE; i++)
+    {
+        iotbroker_free(client->acl_cache->entry[i].topic);
+    }
+    iotbroker_free(client->acl_cache);
+    client->acl_cache = NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef _ACL_H_
+#define _ACL_H_
+
+#include "iotbroker.h"
+#include "session.h"
+
+/*longest rule line of the acl_file*/
+#define ACL_LINE_LEN 512
+
+/*publish decisions a client remembers, power of 2*/
+#define ACL_CACHE_SIZE 8
+
+enum acl_access
+{
+    ACL_READ = 0x01, /*subscribe*/
+    ACL_WRITE = 0x02, /*publish*/
+};
+
+/*
+ * One topic level of the compiled rules, the rules mirror the subscription
+ * tree: a rule is the path of its levels, its access is kept in the node
+ * of its last level. The rules are immutable once compiled.
+ */
+typedef struct acl_node
+{
+    UINT8 *level; /*level name, NULL for the root and the special levels*/
+    UINT32 level_len;
+    UINT32 hash; /*level hash*/
+    UINT8 access; /*acl_access of the rules ending at this level*/
+    UINT8 rest; /*acl_access of the rules ending with '#' below, it covers this level and all below*/
+    UINT32 num; /*named children*/
+    struct acl_node **child; /*named children sorted by hash*/
+    struct acl_node *plus; /*'+' level*/
+    struct acl_node *client; /*"%c" level, the client id*/
+    struct acl_node *user; /*"%u" level, the username*/
+}AclNode;
+
+/*topic rules of a user section*/
+typedef struct
+{
+    UINT8 *name;
+    UINT32 hash;
+    AclNode *root;
+}AclUser;
+
+/*a publish decision, the topic copy is kept for the next one of the slot*/
+typedef struct
+{
+    UINT8 *topic; /*copy of the topic, not terminated*/
+    UINT32 hash; /*topic hash*/
+    UINT16 len; /*topic length, 0 for an unused entry*/
+    UINT16 size; /*bytes of the copy*/
+    UINT8 allow;
+}AclCacheEntry;
+
+/*
+ * Direct mapped by topic hash, allocated by the first publish checked.
+ * Compiling new rules bumps the generation, which empties every cache.
+ */
+typedef struct acl_cache
+{
+    UINT32 generation;
+    AclCacheEntry entry[ACL_CACHE_SIZE];
+}AclCache;
+
+/*
+ * Compile the rules of the configured acl_file, at start and on reload.
+ * Without an acl_file everything is allowed. A file that fails to parse
+ * keeps the running rules, FAILED.
+ */
+UINT32 iotbroker_acl_load();
+
+/*the client may publish to topic, TRUE or FALSE*/
+UINT32 iotbroker_acl_publish(Client *client, CONST UINT8 *topic);
+
+/*every topic filter matches the client may subscribe to, TRUE or FALSE*/
+UINT32 iotbroker_acl_subscribe(Client *client, CONST UINT8 *filter);
+
+VOID iotbroker_acl_cache_free(Client *client);
+
+#endif
@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "iotbroker.h"
+#include "auth.h"
+#include "config.h"
+#include "memmanager.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "packet_handle.h"
+#include "net.h"
+#include "debug.h"
+
+#define AUTH_SCHEME "$pbkdf2-sha256$"
+
+/*salt of the entries -p writes*/
+#define AUTH_SALT_LEN 16
+
+/*entries of the password_file sorted by name hash*/
+typedef struct
+{
+    AuthUser *user;
+    UINT32 num;
+    UINT32 size;
+    AuthUser dummy; /*unknown names are hashed against it, random, nothing matches it*/
+}AuthUsers;
+
+/*a credential digest verified against the password_file of generation*/
+typedef struct
+{
+    UINT32 generation;
+    UINT8 key[SHA256_LEN];
+}AuthCacheEntry;
+
+/*NULL without a password_file, every CONNECT is accepted*/
+STATIC AuthUsers *g_auth_users = NULL;
+
+/*bumped by every load, 0 marks an unused cache entry*/
+STATIC UINT32 g_auth_generation = 0;
+
+/*keys the cache digests, the cache holds nothing a password can be tried against offline*/
+STATIC UINT8 g_auth_secret[SHA256_LEN];
+
+/*direct mapped by digest, NULL when auth_cache_size is 0*/
+STATIC AuthCacheEntry *g_auth_cache = NULL;
+
+STATIC UINT32 g_auth_cache_mask = 0;
+
+/*checks sent to the workers and not answered yet, event loop only*/
+STATIC UINT32 g_auth_pending = 0;
+
+/*the queue to the workers and the list of checks done, under g_auth_lock*/
+STATIC pthread_mutex_t g_auth_lock = PTHREAD_MUTEX_INITIALIZER;
+STATIC pthread_cond_t g_auth_cond = PTHREAD_COND_INITIALIZER;
+STATIC AuthJob *g_auth_queue_head = NULL;
+STATIC AuthJob *g_auth_queue_tail = NULL;
+STATIC AuthJob *g_auth_done = NULL;
+
+/*a worker finishing a check wakes the event loop*/
+STATIC INT32 g_auth_eventfd = -1;
+
+/*FNV-1a*/
+STATIC UINT32 auth_hash(CONST UINT8 *str, UINT32 len)
+{
+    UINT32 hash = 2166136261u;
+    UINT32 i;
+
+    for(i = 0; i < len; i++)
+    {
+        hash = (hash ^ str[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+STATIC UINT32 random_bytes(UINT8 *buf, UINT32 len)
+{
+    FILE *fp;
+    UINT32 ret;
+
+    fp = fopen("/dev/urandom", "r");
+    INVALID_RETURN_VALUE(fp != NULL, FAILED);
+
+    ret = (fread(buf, 1, len, fp) == len) ? SUCESS : FAILED;
+    fclose(fp);
+
+    return ret;
+}
+
+/*value of a hex digit, -1 for another character*/
+STATIC INT32 hex_value(INT8 c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/*bytes of the hex string, FAILED when it is not one or longer than max*/
+STATIC UINT32 hex_decode(CONST INT8 *str, UINT32 len, UINT8 *out, UINT32 max, UINT32 *out_len)
+{
+    UINT32 i;
+
+    INVALID_RETURN_VALUE(len % 2 == 0 && len / 2 <= max, FAILED);
+
+    for(i = 0; i < len / 2; i++)
+    {
+        INT32 high = hex_value(str[2 * i]), low = hex_value(str[2 * i + 1]);
+
+        INVALID_RETURN_VALUE(high >= 0 && low >= 0, FAILED);
+        out[i] = (UINT8)((high << 4) | low);
+    }
+    *out_len = len / 2;
+
+    return SUCESS;
+}
+
+STATIC VOID print_hex(CONST UINT8 *data, UINT32 len)
+{
+    UINT32 i;
+
+    for(i = 0; i < len; i++)
+    {
+        printf("%02x", data[i]);
+    }
+}
+
+/*equal in the same time whatever byte differs*/
+STATIC UINT32 digest_equal(CONST UINT8 *a, CONST UINT8 *b)
+{
+    UINT8 diff = 0;
+    UINT32 i;
+
+    for(i = 0; i < SHA256_LEN; i++)
+    {
+        diff |= a[i] ^ b[i];
+    }
+
+    return 0 == diff;
+}
+
+STATIC VOID free_password(UINT8 *password, UINT32 len)
+{
+    INVALID_RETURN_NOVALUE(password != NULL);
+
+    memset(password, 0, len);
+    iotbroker_free(password);
+}
+
+STATIC VOID free_users(VOID *ptr)
+{
+    AuthUsers *users = (AuthUsers*)ptr;
+    UINT32 i;
+
+    for(i = 0; i < users->num; i++)
+    {
+        iotbroker_free(users->user[i].name);
+    }
+
+    if(users->user != NULL)
+    {
+        iotbroker_free(users->user);
+    }
+
+    iotbroker_free(users);
+}
+
+STATIC INT32 cmp_user(CONST VOID *a, CONST VOID *b)
+{
+    CONST AuthUser *ua = (CONST AuthUser*)a, *ub = (CONST AuthUser*)b;
+
+    if(ua->hash != ub->hash)
+    {
+        return (ua->hash > ub->hash) - (ua->hash < ub->hash);
+    }
+
+    return strcmp(ua->name, ub->name);
+}
+
+STATIC CONST AuthUser* find_user(AuthUsers *users, CONST UINT8 *name)
+{
+    UINT32 hash, low = 0, high = users->num;
+
+    hash = auth_hash(name, strlen(name));
+    while(low < high)
+    {
+        UINT32 mid = (low + high) / 2;
+
+        if(users->user[mid].hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for( ; low < users->num && users->user[low].hash == hash; low++)
+    {
+        if(0 == strcmp(users->user[low].name, name))
+        {
+            return &users->user[low];
+        }
+    }
+
+    return NULL;
+}
+
+/*"name:$pbkdf2-sha256$iterations$salt$hash" into a new entry of users*/
+STATIC UINT32 parse_entry(AuthUsers *users, INT8 *line)
+{
+    INT8 *name = line, *salt, *digest, *end;
+    AuthUser *user;
+    ULONG iterations;
+    UINT32 len;
+
+    end = strchr(line, ':');
+    INVALID_RETURN_VALUE(end != NULL && end != line, FAILED);
+    *end++ = '\0';
+
+    INVALID_RETURN_VALUE(0 == strncmp(end, AUTH_SCHEME, strlen(AUTH_SCHEME)), FAILED);
+    end += strlen(AUTH_SCHEME);
+
+    errno = 0;
+    iterations = strtoul(end, &salt, 10);
+    INVALID_RETURN_VALUE(0 == errno && salt != end && '$' == *salt && iterations != 0 && iterations <= 0xFFFFFFFF, FAILED);
+    salt++;
+
+    digest = strchr(salt, '$');
+    INVALID_RETURN_VALUE(digest != NULL, FAILED);
+    digest++;
+
+    if(users->num == users->size)
+    {
+        users->size = (users->size != 0) ? users->size * 2 : 16;
+        user = (AuthUser*)iotbroker_malloc(users->size * sizeof(AuthUser), MEM_OTHER);
+        assert(user != NULL);
+        if(users->user != NULL)
+        {
+            memcpy(user, users->user, users->num * sizeof(AuthUser));
+            iotbroker_free(users->user);
+        }
+        users->user = user;
+    }
+
+    user = &users->user[users->num];
+    user->iterations = iterations;
+    INVALID_RETURN_VALUE(hex_decode(salt, digest - 1 - salt, user->salt, AUTH_SALT_MAX, &user->salt_len) == SUCESS, FAILED);
+    INVALID_RETURN_VALUE(hex_decode(digest, strlen(digest), user->digest, SHA256_LEN, &len) == SUCESS
+        && SHA256_LEN == len, FAILED);
+
+    len = strlen(name);
+    user->name = (UINT8*)iotbroker_malloc(len + 1, MEM_OTHER);
+    assert(user->name != NULL);
+    memcpy(user->name, name, len + 1);
+    user->hash = auth_hash(name, len);
+    users->num++;
+
+    return SUCESS;
+}
+
+STATIC AuthUsers* load_file(CONST INT8 *path)
+{
+    INT8 line[AUTH_LINE_LEN];
+    AuthUsers *users;
+    UINT32 lineno = 0, i;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if(NULL == fp)
+    {
+        iotbroker_log(LOG_ERROR, "can not open password file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    users = (AuthUsers*)iotbroker_malloc(sizeof(AuthUsers), MEM_OTHER);
+    assert(users != NULL);
+    memset(users, 0, sizeof(AuthUsers));
+
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if('\0' == line[0] || '#' == line[0])
+        {
+            continue;
+        }
+
+        if(parse_entry(users, line) != SUCESS)
+        {
+            /*the name only, the rest of the line is a password hash*/
+            iotbroker_log(LOG_ERROR, "password file %s:%u: invalid entry of %s", path, lineno, line);
+            fclose(fp);
+            free_users(users);
+            return NULL;
+        }
+    }
+    fclose(fp);
+
+    /*an unknown name costs the hash of the first entry, the reply time does not tell names apart*/
+    users->dummy.iterations = (users->num != 0) ? users->user[0].iterations : AUTH_ITERATIONS;
+    users->dummy.salt_len = (users->num != 0) ? users->user[0].salt_len : AUTH_SALT_LEN;
+    if(random_bytes(users->dummy.salt, users->dummy.salt_len) != SUCESS
+        || random_bytes(users->dummy.digest, SHA256_LEN) != SUCESS)
+    {
+        iotbroker_log(LOG_ERROR, "password file %s: can not read /dev/urandom", path);
+        free_users(users);
+        return NULL;
+    }
+
+    qsort(users->user, users->num, sizeof(AuthUser), cmp_user);
+    for(i = 1; i < users->num; i++)
+    {
+        if(0 == cmp_user(&users->user[i - 1], &users->user[i]))
+        {
+            iotbroker_log(LOG_ERROR, "password file %s: user %s listed twice", path, users->user[i].name);
+            free_users(users);
+            return NULL;
+        }
+    }
+
+    iotbroker_log(LOG_INFO, "password file %s: %u users", path, users->num);
+
+    return users;
+}
+
+UINT32 iotbroker_auth_load()
+{
+    CONST INT8 *path = iotbroker_config_get()->password_file;
+    AuthUsers *users = NULL, *old = g_auth_users;
+
+    if(path[0] != '\0')
+    {
+        users = load_file(path);
+        INVALID_RETURN_VALUE(users != NULL, FAILED);
+    }
+
+    g_auth_users = users;
+    g_auth_generation++;
+
+    if(old != NULL)
+    {
+        iotbroker_epoch_defer(old, free_users);
+    }
+
+    return SUCESS;
+}
+
+/*cache key of the credentials, keyed by the secret of this process*/
+STATIC VOID cache_key(CONST UINT8 *username, CONST UINT8 *password, UINT32 password_len, UINT8 key[SHA256_LEN])
+{
+    Sha256 ctx;
+
+    iotbroker_sha256_init(&ctx);
+    iotbroker_sha256_update(&ctx, g_auth_secret, SHA256_LEN);
+    iotbroker_sha256_update(&ctx, username, strlen(username) + 1);
+    iotbroker_sha256_update(&ctx, password, password_len);
+    iotbroker_sha256_final(&ctx, key);
+}
+
+STATIC AuthCacheEntry* cache_slot(CONST UINT8 key[SHA256_LEN])
+{
+    UINT32 index = key[0] | (key[1] << 8) | (key[2] << 16) | ((UINT32)key[3] << 24);
+
+    return &g_auth_cache[index & g_auth_cache_mask];
+}
+
+STATIC UINT32 cache_has(CONST UINT8 key[SHA256_LEN])
+{
+    AuthCacheEntry *e;
+
+    INVALID_RETURN_VALUE(g_auth_cache != NULL, FALSE);
+
+    e = cache_slot(key);
+
+    return e->generation == g_auth_generation && 0 == memcmp(e->key, key, SHA256_LEN);
+}
+
+STATIC VOID cache_add(CONST UINT8 key[SHA256_LEN])
+{
+    AuthCacheEntry *e;
+
+    INVALID_RETURN_NOVALUE(g_auth_cache != NULL);
+
+    e = cache_slot(key);
+    e->generation = g_auth_generation;
+    memcpy(e->key, key, SHA256_LEN);
+}
+
+STATIC VOID* auth_worker(VOID *arg)
+{
+    UINT8 digest[SHA256_LEN];
+    U64 one = 1;
+    AuthJob *job;
+
+    for( ; ; )
+    {
+        pthread_mutex_lock(&g_auth_lock);
+        while(NULL == g_auth_queue_head)
+        {
+            pthread_cond_wait(&g_auth_cond, &g_auth_lock);
+        }
+        job = g_auth_queue_head;
+        g_auth_queue_head = job->next;
+        if(NULL == g_auth_queue_head)
+        {
+            g_auth_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&g_auth_lock);
+
+        iotbroker_pbkdf2_sha256(job->password, job->password_len, job->user.salt, job->user.salt_len,
+            job->user.iterations, digest, SHA256_LEN);
+        job->allow = digest_equal(digest, job->user.digest);
+
+        pthread_mutex_lock(&g_auth_lock);
+        job->next = g_auth_done;
+        g_auth_done = job;
+        pthread_mutex_unlock(&g_auth_lock);
+
+        /*a full counter still wakes the event loop*/
+        if(write(g_auth_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            perror("eventfd write error:");
+        }
+    }
+
+    return NULL;
+}
+
+VOID iotbroker_auth_init(INT32 epollfd)
+{
+    CONST Config *config = iotbroker_config_get();
+    struct epoll_event ev;
+    pthread_t tid;
+    UINT32 i, size;
+
+    if(random_bytes(g_auth_secret, SHA256_LEN) != SUCESS)
+    {
+        perror("/dev/urandom error:");
+        exit(FAILED);
+    }
+
+    /*a power of 2 up to auth_cache_size*/
+    for(size = 1; size * 2 <= config->auth_cache_size; size *= 2);
+    if(config->auth_cache_size != 0)
+    {
+        g_auth_cache = (AuthCacheEntry*)iotbroker_malloc(size * sizeof(AuthCacheEntry), MEM_SESSION);
+        assert(g_auth_cache != NULL);
+        memset(g_auth_cache, 0, size * sizeof(AuthCacheEntry));
+        g_auth_cache_mask = size - 1;
+    }
+
+    g_auth_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(g_auth_eventfd < 0)
+    {
+        perror("eventfd error:");
+        exit(FAILED);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = g_auth_eventfd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, g_auth_eventfd, &ev) != SUCESS)
+    {
+        perror("epoll_ctl error:");
+        exit(FAILED);
+    }
+
+    /*the workers hash only, they touch no session, message or tree*/
+    for(i = 0; i < config->auth_workers; i++)
+    {
+        if(pthread_create(&tid, NULL, auth_worker, NULL) != SUCESS)
+        {
+            perror("pthread_create error:");
+            exit(FAILED);
+        }
+        pthread_detach(tid);
+    }
+}
+
+UINT32 iotbroker_auth_check(Client *client, UINT8 *password)
+{
+    UINT32 password_len = (password != NULL) ? strlen(password) : 0;
+    CONST AuthUser *user;
+    UINT8 key[SHA256_LEN];
+    AuthJob *job;
+
+    if(NULL == g_auth_users)
+    {
+        free_password(password, password_len);
+        return CONNECT_RET_OK;
+    }
+
+    if(NULL == client->username)
+    {
+        free_password(password, password_len);
+        if(iotbroker_config_get()->allow_anonymous)
+        {
+            return CONNECT_RET_OK;
+        }
+        iotbroker_metrics_add(METRIC_AUTH_FAILED, 1);
+        return CONNECT_RET_UNAUTHORIZED;
+    }
+
+    if(NULL == password)
+    {
+        iotbroker_metrics_add(METRIC_AUTH_FAILED, 1);
+        return CONNECT_RET_INVALID_USERNAME_PASSWD;
+    }
+
+    /*an unknown name is refused once hashed as a listed one would be*/
+    user = find_user(g_auth_users, client->username);
+    if(NULL == user)
+    {
+        user = &g_auth_users->dummy;
+    }
+
+    /*a reconnect storm presents the same credentials over and over*/
+    cache_key(client->username, password, password_len, key);
+    if(cache_has(key))
+    {
+        free_password(password, password_len);
+        iotbroker_metrics_add(METRIC_AUTH_CACHED, 1);
+        return CONNECT_RET_OK;
+    }
+
+    if(g_auth_pending >= AUTH_QUEUE_MAX)
+    {
+        free_password(password, password_len);
+        iotbroker_metrics_add(METRIC_CONNECT_REFUSED, 1);
+        return CONNECT_RET_SERVER_UNAVAILABLE;
+    }
+
+    job = (AuthJob*)iotbroker_malloc(sizeof(AuthJob), MEM_SESSION);
+    assert(job != NULL);
+    job->next = NULL;
+    job->client = client;
+    job->generation = g_auth_generation;
+    memcpy(job->key, key, SHA256_LEN);
+    job->password = password;
+    job->password_len = password_len;
+    job->user = *user;
+    job->user.name = NULL;
+    job->allow = FALSE;
+
+    client->auth_job = job;
+    g_auth_pending++;
+    iotbroker_metrics_add(METRIC_AUTH_PENDING, 1);
+
+    pthread_mutex_lock(&g_auth_lock);
+    if(g_auth_queue_tail != NULL)
+    {
+        g_auth_queue_tail->next = job;
+    }
+    else
+    {
+        g_auth_queue_head = job;
+    }
+    g_auth_queue_tail = job;
+    pthread_cond_signal(&g_auth_cond);
+    pthread_mutex_unlock(&g_auth_lock);
+
+    return AUTH_PENDING;
+}
+
+VOID iotbroker_auth_cancel(Client *client)
+{
+    INVALID_RETURN_NOVALUE(client->auth_job != NULL);
+
+    /*freed once the worker is done with it*/
+    client->auth_job->client = NULL;
+    client->auth_job = NULL;
+}
+
+/*answer a check done, in the event loop*/
+STATIC VOID finish_job(AuthJob *job)
+{
+    Client *client = job->client;
+    UINT8 con_ret;
+
+    g_auth_pending--;
+    iotbroker_metrics_add(METRIC_AUTH_PENDING, -1);
+    iotbroker_metrics_add(METRIC_AUTH_HASHED, 1);
+
+    free_password(job->password, job->password_len);
+    job->password = NULL;
+
+    if(client != NULL)
+    {
+        client->auth_job = NULL;
+
+        if(job->generation != g_auth_generation)
+        {
+            /*checked against a password_file replaced meanwhile, the client tries again*/
+            con_ret = CONNECT_RET_SERVER_UNAVAILABLE;
+        }
+        else if(job->allow)
+        {
+            cache_add(job->key);
+            con_ret = CONNECT_RET_OK;
+        }
+        else
+        {
+            iotbroker_metrics_add(METRIC_AUTH_FAILED, 1);
+            con_ret = CONNECT_RET_INVALID_USERNAME_PASSWD;
+        }
+
+        iotbroker_net_connect_done(client->sock_fd, con_ret);
+    }
+
+    memset(job->key, 0, SHA256_LEN);
+    iotbroker_free(job);
+}
+
+UINT32 iotbroker_auth_handle_event(INT32 fd)
+{
+    AuthJob *job, *done = NULL, *next;
+    U64 count;
+
+    INVALID_RETURN_VALUE(fd >= 0 && fd == g_auth_eventfd, FALSE);
+
+    if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("eventfd read error:");
+    }
+
+    pthread_mutex_lock(&g_auth_lock);
+    job = g_auth_done;
+    g_auth_done = NULL;
+    pthread_mutex_unlock(&g_auth_lock);
+
+    /*pushed last first, answered in the order they finished*/
+    for( ; job != NULL; job = next)
+    {
+        next = job->next;
+        job->next = done;
+        done = job;
+    }
+
+    for(job = done; job != NULL; job = next)
+    {
+        next = job->next;
+        finish_job(job);
+    }
+
+    return TRUE;
+}
+
+UINT32 iotbroker_auth_print_entry(CONST INT8 *username)
+{
+    INT8 password[AUTH_LINE_LEN];
+    UINT8 salt[AUTH_SALT_LEN], digest[SHA256_LEN];
+
+    if(strchr(username, ':') != NULL || '\0' == username[0])
+    {
+        fprintf(stderr, "invalid username %s\n", username);
+        return FAILED;
+    }
+
+    if(NULL == fgets(password, sizeof(password), stdin) || random_bytes(salt, AUTH_SALT_LEN) != SUCESS)
+    {
+        fprintf(stderr, "no password on stdin\n");
+        return FAILED;
+    }
+    password[strcspn(password, "\r\n")] = '\0';
+
+    iotbroker_pbkdf2_sha256(password, strlen(password), salt, AUTH_SALT_LEN, AUTH_ITERATIONS, digest, SHA256_LEN);
+    memset(password, 0, sizeof(password));
+
+    printf("%s:%s%u$", username, AUTH_SCHEME, AUTH_ITERATIONS);
+    print_hex(salt, AUTH_SALT_LEN);
+    printf("$");
+    print_hex(digest, SHA256_LEN);
+    printf("\n");
+
+    return SUCESS;
+}
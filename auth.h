@@ -0,0 +1,83 @@
+#ifndef _AUTH_H_
+#define _AUTH_H_
+
+#include "iotbroker.h"
+#include "session.h"
+#include "sha256.h"
+
+/*longest line of the password_file*/
+#define AUTH_LINE_LEN 512
+
+/*longest salt of a password_file entry*/
+#define AUTH_SALT_MAX 64
+
+/*iterations of the entries -p writes*/
+#define AUTH_ITERATIONS 20000
+
+/*defaults of auth_workers and auth_cache_size*/
+#define AUTH_WORKERS 2
+#define AUTH_CACHE_SIZE 4096
+
+/*credential checks waiting for a worker, more CONNECTs are refused*/
+#define AUTH_QUEUE_MAX 4096
+
+/*iotbroker_auth_check sent the credentials to the workers, no CONNACK yet*/
+#define AUTH_PENDING 0xFF
+
+/*a password_file entry, username:$pbkdf2-sha256$iterations$salt$hash with hex salt and hash*/
+typedef struct
+{
+    UINT8 *name;
+    UINT32 hash; /*name hash*/
+    UINT32 iterations;
+    UINT32 salt_len;
+    UINT8 salt[AUTH_SALT_MAX];
+    UINT8 digest[SHA256_LEN];
+}AuthUser;
+
+/*
+ * A credential check in the workers. The event loop owns client, the
+ * workers only read the credentials and the entry, and write allow.
+ */
+typedef struct auth_job
+{
+    struct auth_job *next;
+    Client *client; /*NULL once the client is gone*/
+    UINT32 generation; /*password_file the entry comes from*/
+    UINT8 key[SHA256_LEN]; /*cache key of the credentials*/
+    UINT8 *password;
+    UINT32 password_len;
+    AuthUser user; /*copy of the entry, name not owned*/
+    UINT8 allow;
+}AuthJob;
+
+/*
+ * Load the password_file, at start and on reload. Without one every
+ * CONNECT is accepted. A file that fails to parse keeps the running
+ * entries, FAILED.
+ */
+UINT32 iotbroker_auth_load();
+
+/*start the workers, their completions wake epollfd*/
+VOID iotbroker_auth_init(INT32 epollfd);
+
+/*
+ * Check the credentials of a CONNECT, client->username set already, the
+ * password is taken over. A CONNECT return code, or AUTH_PENDING when the
+ * password is hashed by the workers: the client reads nothing meanwhile
+ * and iotbroker_net_connect_done sends the CONNACK once it is checked.
+ * Credentials verified recently are accepted from the cache, an unknown
+ * username is hashed too and refused after.
+ */
+UINT32 iotbroker_auth_check(Client *client, UINT8 *password);
+
+/*the client goes away with its check still in the workers*/
+VOID iotbroker_auth_cancel(Client *client);
+
+/*fd is the completion eventfd, the checks done are answered, TRUE; FALSE for another fd*/
+UINT32 iotbroker_auth_handle_event(INT32 fd);
+
+/*hash the password read from stdin, print the password_file line of username*/
+UINT32 iotbroker_auth_print_entry(CONST INT8 *username);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "iotbroker.h"
+#include "debug.h"
+#include "session.h"
+#include "bench_conn.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+DOUBLE bench_now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*CONNECT, protocol level 4, clean session, keepalive 0*/
+STATIC INT32 build_connect(UINT8 *buf, CONST INT8 *prefix, UINT32 id)
+{
+    INT8 client_id[CLIENT_ID_INLINE_LEN];
+    UINT32 id_len, pos = 0;
+
+    id_len = snprintf(client_id, sizeof(client_id), "%s%u", prefix, id);
+
+    buf[pos++] = 0x10;
+    buf[pos++] = 10 + 2 + id_len;
+    buf[pos++] = 0;
+    buf[pos++] = 4;
+    memcpy(buf + pos, "MQTT", 4);
+    pos += 4;
+    buf[pos++] = 4;
+    buf[pos++] = 0x02;
+    buf[pos++] = 0;
+    buf[pos++] = 0;
+    buf[pos++] = 0;
+    buf[pos++] = id_len;
+    memcpy(buf + pos, client_id, id_len);
+    pos += id_len;
+
+    return pos;
+}
+
+VOID bench_conn_init(BenchConn *bc, CONST INT8 *host, UINT32 port, UINT32 sources, CONST INT8 *id_prefix)
+{
+    struct rlimit rl;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    memset(bc, 0, sizeof(BenchConn));
+    bc->max_fd = rl.rlim_cur;
+    bc->state = (UINT8*)calloc(bc->max_fd, 1);
+    bc->start = (DOUBLE*)calloc(bc->max_fd, sizeof(DOUBLE));
+    assert(bc->state != NULL && bc->start != NULL);
+
+    bc->server.sin_family = AF_INET;
+    bc->server.sin_port = htons(port);
+    inet_pton(AF_INET, host, &bc->server.sin_addr);
+
+    bc->sources = sources;
+    bc->id_prefix = id_prefix;
+    bc->epollfd = epoll_create1(0);
+}
+
+/*start the handshake of the n-th connection, -1 when it failed at once*/
+STATIC INT32 open_conn(BenchConn *bc, UINT32 n)
+{
+    struct epoll_event ev;
+    INT32 fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    INVALID_RETURN_VALUE(fd >= 0, -1);
+
+    if(bc->sources > 1)
+    {
+        struct sockaddr_in local;
+
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + n % bc->sources);
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        if(bind(fd, (struct sockaddr*)&local, sizeof(local)) != SUCESS)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    bc->start[fd] = bench_now_sec();
+    if(connect(fd, (struct sockaddr*)&bc->server, sizeof(bc->server)) != SUCESS && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+
+    ev.events = EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(bc->epollfd, EPOLL_CTL_ADD, fd, &ev);
+    bc->state[fd] = BS_CONNECTING;
+
+    return fd;
+}
+
+UINT32 bench_conn_open(BenchConn *bc, UINT32 *opened, UINT32 total, UINT32 window)
+{
+    UINT32 failed = 0;
+
+    while(*opened < total && (0 == window || bc->pending < window))
+    {
+        if(open_conn(bc, *opened) < 0)
+        {
+            failed++;
+        }
+        else
+        {
+            bc->pending++;
+        }
+        (*opened)++;
+    }
+
+    return failed;
+}
+
+UINT32 bench_conn_poll(BenchConn *bc, INT32 timeout, INT32 *fds, UINT32 *failed)
+{
+    struct epoll_event events[BENCH_CONN_EVENTS];
+    UINT32 connected = 0;
+    INT32 i, num;
+
+    num = epoll_wait(bc->epollfd, events, BENCH_CONN_EVENTS, timeout);
+    for(i = 0; i < num; i++)
+    {
+        INT32 fd = events[i].data.fd;
+        UINT8 buf[64];
+        INT32 err = 0;
+        socklen_t err_len = sizeof(err);
+
+        if(BS_CONNECTING == bc->state[fd])
+        {
+            struct epoll_event ev;
+
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            if(err != 0 || write(fd, buf, build_connect(buf, bc->id_prefix, fd)) <= 0)
+            {
+                goto conn_failed;
+            }
+
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(bc->epollfd, EPOLL_CTL_MOD, fd, &ev);
+            bc->state[fd] = BS_WAIT_CONNACK;
+        }
+        else if(BS_WAIT_CONNACK == bc->state[fd])
+        {
+            if(read(fd, buf, sizeof(buf)) < 4 || buf[0] != 0x20 || buf[3] != 0)
+            {
+                goto conn_failed;
+            }
+
+            /*connected, nothing more to watch*/
+            bc->start[fd] = bench_now_sec() - bc->start[fd];
+            epoll_ctl(bc->epollfd, EPOLL_CTL_DEL, fd, NULL);
+            bc->state[fd] = BS_CONNECTED;
+            bc->pending--;
+            fds[connected++] = fd;
+        }
+        continue;
+
+conn_failed:
+        bench_conn_close(bc, fd);
+        (*failed)++;
+    }
+
+    return connected;
+}
+
+VOID bench_conn_close(BenchConn *bc, INT32 fd)
+{
+    struct linger lg = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    epoll_ctl(bc->epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+
+    if(BS_CONNECTING == bc->state[fd] || BS_WAIT_CONNACK == bc->state[fd])
+    {
+        bc->pending--;
+    }
+    bc->state[fd] = BS_FREE;
+}
@@ -0,0 +1,60 @@
+#ifndef _BENCH_CONN_H_
+#define _BENCH_CONN_H_
+
+#include <netinet/in.h>
+
+#include "iotbroker.h"
+
+/*
+ * MQTT handshakes of many clients from one epoll, shared by bench_idle and
+ * bench_storm: non blocking connect(), CONNECT once the socket is writable,
+ * then CONNACK. Source addresses rotate over 127.0.0.2 and up so that the
+ * ephemeral port range of one address is no limit.
+ */
+
+/*epoll events taken per bench_conn_poll*/
+#define BENCH_CONN_EVENTS 256
+
+enum bench_conn_state
+{
+    BS_FREE,
+    BS_CONNECTING,
+    BS_WAIT_CONNACK,
+    BS_CONNECTED,
+};
+
+typedef struct
+{
+    INT32 epollfd;
+    struct sockaddr_in server;
+    UINT32 sources; /*source addresses to rotate over, 1 binds none*/
+    CONST INT8 *id_prefix; /*client ids are the prefix and the fd*/
+    UINT32 max_fd; /*RLIMIT_NOFILE, raised to the hard limit*/
+    UINT8 *state; /*enum bench_conn_state, indexed by fd*/
+    DOUBLE *start; /*connect() time, the handshake time once BS_CONNECTED, indexed by fd*/
+    UINT32 pending; /*handshakes in flight*/
+}BenchConn;
+
+DOUBLE bench_now_sec();
+
+/*raise the fd limit, resolve the broker address and create the epoll*/
+VOID bench_conn_init(BenchConn *bc, CONST INT8 *host, UINT32 port, UINT32 sources, CONST INT8 *id_prefix);
+
+/*
+ * Start handshakes until *opened reaches total, keeping at most window of
+ * them in flight, 0 no cap. Return the connections that failed at once.
+ */
+UINT32 bench_conn_open(BenchConn *bc, UINT32 *opened, UINT32 total, UINT32 window);
+
+/*
+ * Wait up to timeout ms and advance the handshakes. The fds that got their
+ * CONNACK leave the epoll, stay open and are stored in fds, at most
+ * BENCH_CONN_EVENTS of them, their number is returned. Failed handshakes
+ * are closed and added to *failed.
+ */
+UINT32 bench_conn_poll(BenchConn *bc, INT32 timeout, INT32 *fds, UINT32 *failed);
+
+/*reset, no TIME_WAIT left to exhaust the ports of the next connections, a handshake in flight is given up*/
+VOID bench_conn_close(BenchConn *bc, INT32 fd);
+
+#endif
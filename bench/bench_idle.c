@@ -0,0 +1,113 @@
+/*
+ * Idle connection scale benchmark.
+ *
+ * Opens n connections to the broker, sends CONNECT on each, waits for all
+ * CONNACKs and keeps the sockets open. The broker resident memory is sampled
+ * before and after, so the user space cost of one idle connection is
+ * (after - before) / n. One million connections need "ulimit -n" and
+ * fs.nr_open above 1M on both sides, and several source addresses (-s) to
+ * get past the ephemeral port range of a single address.
+ *
+ * usage: bench_idle [-h host] [-p port] [-n conns] [-s source addrs]
+ *                   [-w connect window, 0 none] [-P broker pid] [-H hold seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iotbroker.h"
+#include "debug.h"
+#include "session.h"
+#include "bench_conn.h"
+
+/*broker VmRSS in bytes, 0 when unknown*/
+STATIC ULONG read_rss(INT32 pid)
+{
+    INT8 path[64], line[256];
+    ULONG kb = 0;
+    FILE *fp;
+
+    INVALID_RETURN_VALUE(pid > 0, 0);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    fp = fopen(path, "r");
+    INVALID_RETURN_VALUE(fp != NULL, 0);
+
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        if(0 == strncmp(line, "VmRSS:", 6))
+        {
+            kb = strtoul(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+
+    return kb * 1024;
+}
+
+int main(int argc, char **argv)
+{
+    CONST INT8 *host = "127.0.0.1";
+    UINT32 port = 1883, total = 10000, sources = 1, window = 1000, hold = 0;
+    INT32 pid = 0, opt, fds[BENCH_CONN_EVENTS];
+    UINT32 opened = 0, idle = 0, failed = 0;
+    BenchConn bc;
+    ULONG rss_before, rss_after;
+    DOUBLE start, elapsed;
+
+    while((opt = getopt(argc, argv, "h:p:n:s:w:P:H:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': total = atoi(optarg); break;
+            case 's': sources = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'P': pid = atoi(optarg); break;
+            case 'H': hold = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-n conns] [-s source addrs] "
+                    "[-w window, 0 none] [-P broker pid] [-H hold seconds]\n", argv[0]);
+                return FAILED;
+        }
+    }
+
+    bench_conn_init(&bc, host, port, sources, "idle");
+    rss_before = read_rss(pid);
+    start = bench_now_sec();
+
+    while(idle + failed < total)
+    {
+        /*keep at most window handshakes in flight*/
+        failed += bench_conn_open(&bc, &opened, total, window);
+
+        /*idle from now on, the connections stay open*/
+        idle += bench_conn_poll(&bc, 1000, fds, &failed);
+    }
+
+    elapsed = bench_now_sec() - start;
+
+    /*let the broker settle before sampling*/
+    sleep(1);
+    rss_after = read_rss(pid);
+
+    printf("connections      : %u idle, %u failed\n", idle, failed);
+    printf("connect time     : %.2f s, %.0f connects/s\n", elapsed, idle / elapsed);
+    printf("design budget    : %lu bytes/conn (Client %lu + table slot %lu)\n",
+        (ULONG)(sizeof(Client) + sizeof(Client*)), (ULONG)sizeof(Client), (ULONG)sizeof(Client*));
+    if(pid > 0 && idle > 0)
+    {
+        printf("broker rss       : %lu -> %lu bytes\n", rss_before, rss_after);
+        printf("measured         : %.1f bytes/conn\n", (DOUBLE)(rss_after - rss_before) / idle);
+    }
+
+    if(hold > 0)
+    {
+        sleep(hold);
+    }
+
+    return SUCESS;
+}
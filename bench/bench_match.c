@@ -0,0 +1,458 @@
+/*
+ * Subscription matching benchmark.
+ *
+ * Builds a subtree of n synthetic filters spread over c fake clients,
+ * then publishes p topics through it and unsubscribes every filter again,
+ * all in process with no socket. It reports the subscribe, publish match
+ * and unsubscribe rates and the subtree memory per filter. The workloads
+ * are:
+ *   deep   8 levels of 16 names, exact filters, 5% with one '+'
+ *   plus   5 levels of 64 names, every level '+' with 30% chance
+ *   hash   6 levels of 32 names, "#" dashboards under 1 to 4 levels, 20% exact
+ *   zipf   4 levels of 128 names, exact filters of Zipf ranked topics
+ *   mixed  deep names, 60% exact, 25% '+' and 15% '#'
+ * There are as many distinct topics in use as filters. Filters take them
+ * uniformly, zipf by popularity, published topics are Zipf ranked (-s
+ * exponent), so hot topics repeat and have subscribers as in the field.
+ * Filter i and topic j only depend on the seed and the index, a run is
+ * repeatable. Build with "make DEBUG=0 bench" and judge matcher changes
+ * with it, from 10k to 10M filters.
+ *
+ * usage: bench_match [-w workload] [-n filters] [-c clients] [-p publishes]
+ *                    [-s zipf exponent] [-S seed] [-o key=value]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iotbroker.h"
+#include "debug.h"
+#include "config.h"
+#include "session.h"
+#include "message.h"
+#include "subtree.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "memmanager.h"
+#include "epoch.h"
+#include "timer.h"
+
+/*broker options passed with -o*/
+#define MATCH_MAX_OPTIONS 32
+
+/*longest generated filter or topic, 8 levels of "l7_16777215/"*/
+#define MATCH_TOPIC_LEN 128
+
+/*publishes between two queue resets, the reset is not timed*/
+#define MATCH_BATCH 256
+
+/*operations between two epoch quiescent points*/
+#define MATCH_QUIESCENT_EVERY 4096
+
+enum match_workload
+{
+    WL_DEEP,
+    WL_PLUS,
+    WL_HASH,
+    WL_ZIPF,
+    WL_MIXED,
+    WL_NUM,
+};
+
+typedef struct
+{
+    CONST INT8 *name;
+    UINT32 depth; /*levels of a topic*/
+    UINT32 names; /*names per level*/
+}Workload;
+
+STATIC CONST Workload g_workloads[WL_NUM] = {
+    {"deep", 8, 16},
+    {"plus", 5, 64},
+    {"hash", 6, 32},
+    {"zipf", 4, 128},
+    {"mixed", 8, 16},
+};
+
+STATIC CONST Workload *g_wl;
+
+STATIC UINT32 g_wl_type;
+
+STATIC U64 g_seed = 1;
+
+STATIC DOUBLE g_zipf_s = 1.0;
+
+/*distinct topics in use, one per filter, ranked by popularity*/
+STATIC U64 g_topics;
+
+STATIC Client *g_clients;
+
+STATIC UINT32 g_client_num = 1000;
+
+STATIC DOUBLE now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*splitmix64, one generator state per filter or topic index*/
+STATIC U64 next_rand(U64 *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+/*uniform in [0, 1)*/
+STATIC DOUBLE next_double(U64 *state)
+{
+    return ((unsigned long long)next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*Zipf rank in [0, n), inverting the continuous distribution*/
+STATIC U64 next_zipf(U64 *state, DOUBLE n)
+{
+    DOUBLE u = next_double(state), x;
+
+    if(fabs(g_zipf_s - 1.0) < 1e-9)
+    {
+        x = pow(n, u);
+    }
+    else
+    {
+        x = pow((pow(n, 1.0 - g_zipf_s) - 1.0) * u + 1.0, 1.0 / (1.0 - g_zipf_s));
+    }
+
+    return ((U64)x > 0) ? (U64)x - 1 : 0;
+}
+
+/*decimal, snprintf costs more than the subtree on short topics*/
+STATIC UINT32 append_num(INT8 *buf, UINT32 len, UINT32 num)
+{
+    INT8 digits[12];
+    UINT32 i = 0;
+
+    do
+    {
+        digits[i++] = '0' + num % 10;
+        num /= 10;
+    }while(num != 0);
+
+    while(i > 0)
+    {
+        buf[len++] = digits[--i];
+    }
+
+    return len;
+}
+
+/*
+ * Write the topic of rank, its levels "l<level>_<name>", into buf.
+ * wildcard gives the single levels to replace with '+', bit per level,
+ * hash_level cuts the filter there with "#", 0 for none.
+ */
+STATIC VOID make_topic(INT8 *buf, U64 rank, UINT32 wildcard, UINT32 hash_level)
+{
+    U64 state = rank ^ 0x5DEECE66DULL;
+    UINT32 level, len = 0;
+    U64 bits = next_rand(&state);
+
+    for(level = 0; level < g_wl->depth; level++)
+    {
+        UINT32 name = (UINT32)(bits % g_wl->names);
+
+        bits /= g_wl->names;
+        if(bits < g_wl->names)
+        {
+            bits = next_rand(&state);
+        }
+
+        if(level != 0)
+        {
+            buf[len++] = TOPIC_LEVEL_SEPARATOR;
+        }
+
+        if(hash_level != 0 && level == hash_level)
+        {
+            buf[len++] = TOPIC_WILDCARD_MULTI;
+            break;
+        }
+
+        if(wildcard & (1U << level))
+        {
+            buf[len++] = TOPIC_WILDCARD_SINGLE;
+            continue;
+        }
+
+        buf[len++] = 'l';
+        len = append_num(buf, len, level);
+        buf[len++] = '_';
+        len = append_num(buf, len, name);
+    }
+
+    buf[len] = '\0';
+}
+
+/*filter i of the workload, subscribed by client i % clients*/
+STATIC VOID make_filter(INT8 *buf, U64 i)
+{
+    U64 state = g_seed * 0x100000001B3ULL + i;
+    U64 rank = next_rand(&state) % g_topics;
+    UINT32 wildcard = 0, hash_level = 0, level;
+    DOUBLE kind = next_double(&state);
+
+    switch(g_wl_type)
+    {
+        case WL_DEEP:
+            if(kind < 0.05)
+            {
+                wildcard = 1U << (next_rand(&state) % g_wl->depth);
+            }
+            break;
+
+        case WL_PLUS:
+            for(level = 0; level < g_wl->depth; level++)
+            {
+                if(next_double(&state) < 0.3)
+                {
+                    wildcard |= 1U << level;
+                }
+            }
+            break;
+
+        case WL_HASH:
+            if(kind >= 0.2)
+            {
+                hash_level = 1 + next_rand(&state) % 4;
+            }
+            break;
+
+        case WL_ZIPF:
+            rank = next_zipf(&state, g_topics);
+            break;
+
+        default:
+            if(kind >= 0.85)
+            {
+                hash_level = 1 + next_rand(&state) % (g_wl->depth - 1);
+            }
+            else if(kind >= 0.6)
+            {
+                wildcard = 1U << (next_rand(&state) % g_wl->depth);
+            }
+            break;
+    }
+
+    make_topic(buf, rank, wildcard, hash_level);
+}
+
+/*topic j to publish, Zipf ranked*/
+STATIC VOID make_publish_topic(INT8 *buf, U64 j)
+{
+    U64 state = (g_seed ^ 0xA5A5A5A5ULL) * 0x100000001B3ULL + j;
+
+    make_topic(buf, next_zipf(&state, g_topics), 0, 0);
+}
+
+/*
+ * Forget what the publishes queued, without writing it anywhere. The
+ * message store lives on the stack of main and holds no real references.
+ */
+STATIC VOID reset_queues()
+{
+    UINT32 i;
+
+    for(i = 0; i < g_client_num; i++)
+    {
+        MessageQueue *mq = &g_clients[i].mq;
+
+        iotbroker_metrics_add(METRIC_MSG_QUEUED, -(INT32)(mq->tail - mq->head));
+        mq->head = mq->send = mq->tail;
+        mq->dead = 0;
+    }
+}
+
+/*same start up as main, without listeners, timers or signals*/
+STATIC VOID broker_init(INT32 optc, INT8 **optv)
+{
+    INT8 *argv[2 + 2 * MATCH_MAX_OPTIONS];
+    INT32 argc = 0, i;
+
+    argv[argc++] = "bench_match";
+    for(i = 0; i < optc; i++)
+    {
+        argv[argc++] = "-o";
+        argv[argc++] = optv[i];
+    }
+    argv[argc] = NULL;
+
+    /*the broker parses its own command line with getopt again*/
+    optind = 0;
+    if(iotbroker_config_init(argc, argv) != SUCESS)
+    {
+        exit(FAILED);
+    }
+
+    iotbroker_timer_init();
+    iotbroker_epoch_init();
+    iotbroker_epoch_register();
+    iotbroker_metrics_register();
+    iotbroker_recorder_register();
+    iotbroker_message_store_init();
+    iotbroker_subtree_init();
+}
+
+STATIC VOID usage(CONST INT8 *name)
+{
+    UINT32 i;
+
+    fprintf(stderr, "usage: %s [-w workload] [-n filters] [-c clients] [-p publishes]\n"
+        "       [-s zipf exponent] [-S seed] [-o key=value]\nworkloads:", name);
+    for(i = 0; i < WL_NUM; i++)
+    {
+        fprintf(stderr, " %s", g_workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    INT8 *options[MATCH_MAX_OPTIONS], *workload = "mixed";
+    INT8 topic[MATCH_TOPIC_LEN];
+    INT32 opt, option_num = 0;
+    U64 filters = 100000, publishes = 1000000, i, fanout = 0, matched = 0;
+    DOUBLE start, sub_time, pub_time = 0, unsub_time;
+    TopicPacket tp;
+    MessageStore ms;
+    MemStats before, after;
+    UINT32 subs;
+
+    while((opt = getopt(argc, argv, "w:n:c:p:s:S:o:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'w': workload = optarg; break;
+            case 'n': filters = strtoull(optarg, NULL, 0); break;
+            case 'c': g_client_num = atoi(optarg); break;
+            case 'p': publishes = strtoull(optarg, NULL, 0); break;
+            case 's': g_zipf_s = atof(optarg); break;
+            case 'S': g_seed = strtoull(optarg, NULL, 0); break;
+            case 'o':
+                if(option_num < MATCH_MAX_OPTIONS)
+                {
+                    options[option_num++] = optarg;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return FAILED;
+        }
+    }
+
+    for(g_wl_type = 0; g_wl_type < WL_NUM; g_wl_type++)
+    {
+        if(0 == strcmp(workload, g_workloads[g_wl_type].name))
+        {
+            break;
+        }
+    }
+
+    if(WL_NUM == g_wl_type || 0 == g_client_num || g_zipf_s <= 0)
+    {
+        usage(argv[0]);
+        return FAILED;
+    }
+    g_wl = &g_workloads[g_wl_type];
+    g_topics = MAX(filters, 1);
+
+    broker_init(option_num, options);
+
+    /*fake subscribers, never in the session table, already in the ready list*/
+    g_clients = (Client*)calloc(g_client_num, sizeof(Client));
+    assert(g_clients != NULL);
+    for(i = 0; i < g_client_num; i++)
+    {
+        g_clients[i].sock_fd = -1;
+        g_clients[i].ready = CLIENT_READY(READY_OUTPUT);
+        iotbroker_message_queue_init(&g_clients[i].mq);
+        INIT_LIST_HEAD(&g_clients[i].sub_head);
+    }
+
+    memset(&tp, 0, sizeof(tp));
+    tp.topic = topic;
+    tp.qos = 1;
+
+    iotbroker_mem_stats(MEM_SUBTREE, &before);
+
+    start = now_sec();
+    for(i = 0; i < filters; i++)
+    {
+        make_filter(topic, i);
+        iotbroker_subtree_sub(&tp, &g_clients[i % g_client_num]);
+    }
+    sub_time = now_sec() - start;
+
+    iotbroker_mem_stats(MEM_SUBTREE, &after);
+    subs = iotbroker_subtree_count();
+
+    memset(&ms, 0, sizeof(ms));
+    ms.packet = &tp;
+    INIT_LIST_HEAD(&ms.list_mount);
+
+    for(i = 0; i < publishes; )
+    {
+        U64 end = MIN(i + MATCH_BATCH, publishes);
+
+        start = now_sec();
+        for( ; i < end; i++)
+        {
+            make_publish_topic(topic, i);
+            ms.refer_count = 1;
+            iotbroker_subtree_pub(&ms);
+            fanout += ms.refer_count - 1;
+            matched += (ms.refer_count > 1);
+        }
+        pub_time += now_sec() - start;
+
+        reset_queues();
+        iotbroker_epoch_quiescent();
+    }
+
+    start = now_sec();
+    for(i = 0; i < filters; i++)
+    {
+        make_filter(topic, i);
+        iotbroker_subtree_unsub(&tp, &g_clients[i % g_client_num]);
+
+        if(0 == i % MATCH_QUIESCENT_EVERY)
+        {
+            iotbroker_epoch_quiescent();
+        }
+    }
+    unsub_time = now_sec() - start;
+
+    iotbroker_epoch_quiescent();
+
+    printf("workload %s, %llu filters, %u subscriptions, %u clients, zipf %.2f, seed %llu\n",
+        g_wl->name, filters, subs, g_client_num, g_zipf_s, g_seed);
+    printf("subscribe   %10.0f /s  %8.1f ns/op\n",
+        filters / sub_time, sub_time * 1e9 / MAX(filters, 1));
+    printf("publish     %10.0f /s  %8.1f ns/op, %llu matched, %.2f deliveries per publish\n",
+        publishes / pub_time, pub_time * 1e9 / MAX(publishes, 1), matched, (DOUBLE)fanout / MAX(publishes, 1));
+    printf("unsubscribe %10.0f /s  %8.1f ns/op, %u left\n",
+        filters / unsub_time, unsub_time * 1e9 / MAX(filters, 1), iotbroker_subtree_count());
+    printf("memory      %10.1f bytes per subscription, %llu subtree bytes\n",
+        (DOUBLE)(after.bytes - before.bytes) / MAX(subs, 1), (unsigned long long)(after.bytes - before.bytes));
+
+    return SUCESS;
+}
@@ -0,0 +1,405 @@
+/*
+ * Capture replay benchmark.
+ *
+ * Feeds a capture_file written by the broker back in, connection by
+ * connection. In process (-i) the bytes go straight through the broker
+ * parser, handle_packet and the subtree, the replies are written to
+ * /dev/null and no timer runs, so the same capture does the same work on
+ * every run; build with "make DEBUG=0 bench". Otherwise the streams are
+ * sent to a running broker over loopback and its replies are read and
+ * dropped. The speed factor keeps the recorded gaps (1), scales them, or
+ * replays at full speed (0).
+ *
+ * usage: bench_replay [-i] [-h host] [-p port] [-s speed] [-o key=value] capture
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "iotbroker.h"
+#include "debug.h"
+#include "capture.h"
+#include "config.h"
+#include "protocol.h"
+#include "session.h"
+#include "message.h"
+#include "subtree.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "epoch.h"
+#include "timer.h"
+#include "net.h"
+
+/*broker options passed with -o*/
+#define REPLAY_MAX_OPTIONS 32
+
+STATIC INT32 *g_conn_fd; /*local fd of each captured connection, -1 when closed*/
+
+STATIC UINT32 g_conn_max;
+
+STATIC UINT32 g_inprocess = FALSE;
+
+STATIC INT32 g_epollfd = -1;
+
+STATIC U64 g_bytes_back = 0; /*bytes the broker sent over loopback*/
+
+STATIC DOUBLE now_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*same start up as main, without listeners, timers or signals*/
+STATIC VOID broker_init(INT32 optc, INT8 **optv)
+{
+    INT8 *argv[2 + 2 * REPLAY_MAX_OPTIONS];
+    INT32 argc = 0, i;
+
+    argv[argc++] = "bench_replay";
+    for(i = 0; i < optc; i++)
+    {
+        argv[argc++] = "-o";
+        argv[argc++] = optv[i];
+    }
+    argv[argc] = NULL;
+
+    /*the broker parses its own command line with getopt again*/
+    optind = 0;
+    if(iotbroker_config_init(argc, argv) != SUCESS)
+    {
+        exit(FAILED);
+    }
+
+    iotbroker_timer_init();
+    iotbroker_epoch_init();
+    iotbroker_epoch_register();
+    iotbroker_metrics_register();
+    iotbroker_recorder_register();
+    iotbroker_message_store_init();
+    iotbroker_subtree_init();
+}
+
+/*read and drop whatever the broker sent back, return the ready sockets*/
+STATIC INT32 drain(INT32 timeout)
+{
+    struct epoll_event events[64];
+    INT8 buf[65536];
+    INT32 i, num, ret;
+
+    num = epoll_wait(g_epollfd, events, 64, timeout);
+    for(i = 0; i < num; i++)
+    {
+        while((ret = read(events[i].data.fd, buf, sizeof(buf))) > 0)
+        {
+            g_bytes_back += ret;
+        }
+
+        if(0 == ret)
+        {
+            epoll_ctl(g_epollfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+        }
+    }
+
+    return num;
+}
+
+STATIC INT32 open_conn(struct sockaddr_in *server)
+{
+    struct epoll_event ev;
+    INT32 fd;
+
+    if(g_inprocess)
+    {
+        fd = open("/dev/null", O_WRONLY);
+        INVALID_RETURN_VALUE(fd >= 0, -1);
+
+        iotbroker_session_add(fd, "127.0.0.1", 0);
+        return fd;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    INVALID_RETURN_VALUE(fd >= 0, -1);
+
+    if(connect(fd, (struct sockaddr*)server, sizeof(*server)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(g_epollfd, EPOLL_CTL_ADD, fd, &ev);
+
+    return fd;
+}
+
+STATIC VOID close_conn(INT32 fd)
+{
+    if(g_inprocess)
+    {
+        /*what the broker does when the peer goes away*/
+        iotbroker_session_clean(fd);
+    }
+    else
+    {
+        epoll_ctl(g_epollfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    close(fd);
+}
+
+/*FAILED when the broker dropped the connection*/
+STATIC UINT32 send_data(INT32 fd, UINT8 *data, UINT32 len)
+{
+    if(g_inprocess)
+    {
+        INVALID_RETURN_VALUE(SUCESS == iotbroker_receive_bytes(fd, data, len), FAILED);
+
+        iotbroker_net_flush();
+        return SUCESS;
+    }
+
+    while(len > 0)
+    {
+        INT32 ret = write(fd, data, len);
+
+        if(ret < 0)
+        {
+            INVALID_RETURN_VALUE(EAGAIN == errno || EINTR == errno, FAILED);
+
+            /*the broker pushes back, let it write its replies*/
+            drain(1);
+            continue;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return SUCESS;
+}
+
+int main(int argc, char **argv)
+{
+    INT8 *host = "127.0.0.1", *options[REPLAY_MAX_OPTIONS];
+    INT32 opt, port = 1883, option_num = 0;
+    DOUBLE speed = 1.0, start, elapsed, recorded = 0;
+    U64 records = 0, conns = 0, bytes = 0, failed = 0, dropped = 0, skipped = 0;
+    CONST CaptureHeader *header;
+    struct sockaddr_in server;
+    struct rlimit rl;
+    struct stat st;
+    UINT8 *base, *pos, *end;
+    UINT32 i;
+    INT32 fd;
+
+    while((opt = getopt(argc, argv, "ih:p:s:o:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'i': g_inprocess = TRUE; break;
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            case 'o':
+                if(option_num < REPLAY_MAX_OPTIONS)
+                {
+                    options[option_num++] = optarg;
+                }
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if(optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-i] [-h host] [-p port] [-s speed, 0 full] [-o key=value] capture\n", argv[0]);
+        return FAILED;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(CaptureHeader))
+    {
+        fprintf(stderr, "can not read %s\n", argv[optind]);
+        return FAILED;
+    }
+
+    base = (UINT8*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    assert(base != MAP_FAILED);
+    close(fd);
+
+    header = (CONST CaptureHeader*)base;
+    if(memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 || header->record_size != sizeof(CaptureRecord))
+    {
+        fprintf(stderr, "%s is not a capture file\n", argv[optind]);
+        return FAILED;
+    }
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    /*captured fds stay below the broker's limit, which is this one at most*/
+    g_conn_max = (rl.rlim_cur < (1 << 24)) ? rl.rlim_cur : (1 << 24);
+    g_conn_fd = (INT32*)malloc(g_conn_max * sizeof(INT32));
+    assert(g_conn_fd != NULL);
+    memset(g_conn_fd, 0xFF, g_conn_max * sizeof(INT32));
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, host, &server.sin_addr);
+
+    if(g_inprocess)
+    {
+        broker_init(option_num, options);
+    }
+    else
+    {
+        g_epollfd = epoll_create1(0);
+    }
+
+    start = now_sec();
+    pos = base + sizeof(CaptureHeader);
+    end = base + st.st_size;
+
+    while(pos + sizeof(CaptureRecord) <= end)
+    {
+        CaptureRecord rec;
+        UINT8 *data = pos + sizeof(CaptureRecord);
+
+        /*records follow the data unaligned*/
+        memcpy(&rec, pos, sizeof(rec));
+
+        if(data + rec.len > end)
+        {
+            break;
+        }
+        pos = data + rec.len;
+        records++;
+
+        /*sleep until the record is due*/
+        recorded += rec.delta / 1e6;
+        if(speed > 0)
+        {
+            DOUBLE wait = start + recorded / speed - now_sec();
+
+            if(wait > 0)
+            {
+                usleep(wait * 1e6);
+            }
+        }
+
+        if(rec.conn >= g_conn_max)
+        {
+            skipped++;
+            continue;
+        }
+
+        if(g_inprocess)
+        {
+            iotbroker_time_update();
+        }
+
+        switch(rec.type)
+        {
+            case CAP_OPEN:
+                g_conn_fd[rec.conn] = open_conn(&server);
+                conns++;
+                if(g_conn_fd[rec.conn] < 0)
+                {
+                    failed++;
+                }
+                break;
+
+            case CAP_DATA:
+                if(g_conn_fd[rec.conn] < 0)
+                {
+                    skipped++;
+                    break;
+                }
+
+                bytes += rec.len;
+                if(send_data(g_conn_fd[rec.conn], data, rec.len) != SUCESS)
+                {
+                    close_conn(g_conn_fd[rec.conn]);
+                    g_conn_fd[rec.conn] = -1;
+                    dropped++;
+                }
+                break;
+
+            case CAP_CLOSE:
+                if(g_conn_fd[rec.conn] >= 0)
+                {
+                    close_conn(g_conn_fd[rec.conn]);
+                    g_conn_fd[rec.conn] = -1;
+                }
+                break;
+
+            default:
+                skipped++;
+                break;
+        }
+
+        if(g_inprocess)
+        {
+            iotbroker_epoch_quiescent();
+        }
+        else
+        {
+            drain(0);
+        }
+    }
+
+    elapsed = now_sec() - start;
+
+    printf("records          : %lld, %lld skipped\n", records, skipped);
+    printf("connections      : %lld, %lld failed, %lld closed by the broker\n", conns, failed, dropped);
+    printf("replayed         : %lld bytes in %.3f s (recorded %.3f s)\n", bytes, elapsed, recorded);
+    printf("throughput       : %.0f records/s, %.1f MB/s\n", records / elapsed, bytes / elapsed / 1e6);
+
+    if(g_inprocess)
+    {
+        U64 value[METRIC_NUM];
+
+        iotbroker_metrics_read(value);
+        printf("messages         : %lld in, %lld out, %lld dropped\n",
+            value[METRIC_MSG_IN_QOS0] + value[METRIC_MSG_IN_QOS1] + value[METRIC_MSG_IN_QOS2],
+            value[METRIC_MSG_OUT_QOS0] + value[METRIC_MSG_OUT_QOS1] + value[METRIC_MSG_OUT_QOS2],
+            value[METRIC_MSG_DROPPED]);
+    }
+    else
+    {
+        /*let the last replies arrive*/
+        while(drain(200) > 0);
+        printf("received         : %lld bytes\n", g_bytes_back);
+    }
+
+    for(i = 0; i < g_conn_max; i++)
+    {
+        if(g_conn_fd[i] >= 0)
+        {
+            close_conn(g_conn_fd[i]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Reconnect storm benchmark.
+ *
+ * n devices connect to the broker at once, each sends CONNECT as soon as
+ * its socket is writable and waits for CONNACK. Once all are in, every
+ * connection is dropped together, as after a network flap, and the storm
+ * starts again, r rounds in total. Each round reports the connects per
+ * second and the time from connect() to CONNACK, median, p99 and worst.
+ * A window (-w) caps the handshakes in flight, 0 sends them all at once.
+ * Many connections need "ulimit -n" raised on both sides and several
+ * source addresses (-s) past the ephemeral port range of one address.
+ *
+ * usage: bench_storm [-h host] [-p port] [-n conns] [-r rounds]
+ *                    [-w window, 0 none] [-s source addrs]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "iotbroker.h"
+#include "debug.h"
+#include "bench_conn.h"
+
+/*a handshake not done by then counts as failed*/
+#define STORM_TIMEOUT 30.0
+
+STATIC INT32 cmp_double(CONST VOID *a, CONST VOID *b)
+{
+    DOUBLE x = *(CONST DOUBLE*)a, y = *(CONST DOUBLE*)b;
+
+    return (x > y) - (x < y);
+}
+
+/*one storm, fills the fds of the connected devices and the handshake times*/
+STATIC UINT32 storm(BenchConn *bc, UINT32 total, UINT32 window, INT32 *fds, DOUBLE *times, UINT32 *out_failed)
+{
+    UINT32 opened = 0, connected = 0, failed = 0, i, num;
+    DOUBLE deadline = bench_now_sec() + STORM_TIMEOUT;
+
+    while(connected + failed < total && bench_now_sec() < deadline)
+    {
+        failed += bench_conn_open(bc, &opened, total, window);
+
+        num = bench_conn_poll(bc, 100, fds + connected, &failed);
+        for(i = 0; i < num; i++, connected++)
+        {
+            times[connected] = bc->start[fds[connected]];
+        }
+    }
+
+    /*the handshakes still in flight at the deadline*/
+    failed += total - connected - failed;
+
+    *out_failed = failed;
+    return connected;
+}
+
+int main(int argc, char **argv)
+{
+    CONST INT8 *host = "127.0.0.1";
+    UINT32 port = 1883, total = 10000, sources = 1, window = 0, rounds = 3;
+    UINT32 round, connected, failed, i, j;
+    INT32 opt, *fds;
+    BenchConn bc;
+    DOUBLE start, elapsed, *times;
+
+    while((opt = getopt(argc, argv, "h:p:n:r:w:s:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': total = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 's': sources = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-n conns] [-r rounds] "
+                    "[-w window, 0 none] [-s source addrs]\n", argv[0]);
+                return FAILED;
+        }
+    }
+
+    bench_conn_init(&bc, host, port, sources, "storm");
+
+    fds = (INT32*)calloc(total, sizeof(INT32));
+    times = (DOUBLE*)calloc(total, sizeof(DOUBLE));
+    assert(fds != NULL && times != NULL);
+
+    printf("round  connected  failed  connects/s  connack p50 ms  p99 ms   max ms\n");
+    for(round = 1; round <= rounds; round++)
+    {
+        start = bench_now_sec();
+        connected = storm(&bc, total, window, fds, times, &failed);
+        elapsed = bench_now_sec() - start;
+
+        qsort(times, connected, sizeof(DOUBLE), cmp_double);
+        printf("%5u  %9u  %6u  %10.0f  %14.2f  %6.2f  %7.2f\n", round, connected, failed,
+            connected / elapsed,
+            (connected > 0) ? times[connected / 2] * 1e3 : 0,
+            (connected > 0) ? times[(UINT32)(connected * 0.99)] * 1e3 : 0,
+            (connected > 0) ? times[connected - 1] * 1e3 : 0);
+
+        /*the flap, every device drops at once*/
+        for(i = 0; i < connected; i++)
+        {
+            bench_conn_close(&bc, fds[i]);
+        }
+
+        /*and the sockets of the failed handshakes*/
+        for(j = 0; j < bc.max_fd; j++)
+        {
+            if(bc.state[j] != BS_FREE)
+            {
+                bench_conn_close(&bc, j);
+            }
+        }
+    }
+
+    return SUCESS;
+}
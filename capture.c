@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "iotbroker.h"
+#include "capture.h"
+#include "config.h"
+#include "memmanager.h"
+#include "timer.h"
+#include "debug.h"
+
+STATIC FILE *g_capture_fp = NULL;
+
+STATIC INT8 *g_capture_buf = NULL;
+
+STATIC U64 g_capture_last_us = 0;
+
+/*a crash loses at most a second of traffic*/
+STATIC TimerNode g_capture_timer;
+
+STATIC VOID write_record(UINT32 type, INT32 fd, CONST UINT8 *data, UINT32 len)
+{
+    CaptureRecord rec;
+    U64 now = iotbroker_time_now_us();
+    U64 delta = now - g_capture_last_us;
+
+    g_capture_last_us = now;
+
+    rec.delta = (delta > 0xFFFFFFFF) ? 0xFFFFFFFF : delta;
+    rec.conn = fd;
+    rec.len = len;
+    rec.type = type;
+    memset(rec.reserved, 0, sizeof(rec.reserved));
+
+    if(fwrite(&rec, sizeof(rec), 1, g_capture_fp) != 1
+        || (len != 0 && fwrite(data, len, 1, g_capture_fp) != 1))
+    {
+        iotbroker_log(LOG_ERROR, "capture stopped: %s", strerror(errno));
+        fclose(g_capture_fp);
+        g_capture_fp = NULL;
+        iotbroker_timer_del(&g_capture_timer);
+    }
+}
+
+VOID iotbroker_capture_open(INT32 fd)
+{
+    INVALID_RETURN_NOVALUE(g_capture_fp != NULL);
+
+    write_record(CAP_OPEN, fd, NULL, 0);
+}
+
+VOID iotbroker_capture_data(INT32 fd, CONST UINT8 *data, UINT32 len)
+{
+    INVALID_RETURN_NOVALUE(g_capture_fp != NULL);
+
+    write_record(CAP_DATA, fd, data, len);
+}
+
+VOID iotbroker_capture_close(INT32 fd)
+{
+    INVALID_RETURN_NOVALUE(g_capture_fp != NULL);
+
+    write_record(CAP_CLOSE, fd, NULL, 0);
+}
+
+STATIC VOID capture_timer_expired(TimerNode *tn)
+{
+    fflush(g_capture_fp);
+
+    iotbroker_timer_add(tn, 1000);
+}
+
+VOID iotbroker_capture_init()
+{
+    CONST INT8 *path = iotbroker_config_get()->capture_file;
+    CaptureHeader header;
+
+    INVALID_RETURN_NOVALUE(path[0] != '\0');
+
+    g_capture_fp = fopen(path, "w");
+    if(NULL == g_capture_fp)
+    {
+        iotbroker_log(LOG_ERROR, "can not open capture file %s: %s", path, strerror(errno));
+        return;
+    }
+
+    g_capture_buf = (INT8*)iotbroker_malloc(CAPTURE_BUF_SIZE, MEM_OTHER);
+    assert(g_capture_buf != NULL);
+    setvbuf(g_capture_fp, g_capture_buf, _IOFBF, CAPTURE_BUF_SIZE);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(CaptureRecord);
+    fwrite(&header, sizeof(header), 1, g_capture_fp);
+
+    g_capture_last_us = iotbroker_time_now_us();
+
+    iotbroker_timer_node_init(&g_capture_timer, capture_timer_expired);
+    iotbroker_timer_add(&g_capture_timer, 1000);
+
+    iotbroker_log(LOG_INFO, "capturing inbound traffic to %s", path);
+}
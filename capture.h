@@ -0,0 +1,45 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include "iotbroker.h"
+
+#define CAPTURE_MAGIC "IOTBCAP1"
+
+/*stdio buffer of the capture file, flushed every second as well*/
+#define CAPTURE_BUF_SIZE (1024 * 1024)
+
+enum capture_type
+{
+    CAP_OPEN, /*connection accepted*/
+    CAP_DATA, /*bytes read from the connection*/
+    CAP_CLOSE, /*connection closed*/
+};
+
+/*file header, followed by the records*/
+typedef struct
+{
+    INT8 magic[8]; /*CAPTURE_MAGIC*/
+    UINT32 record_size; /*sizeof(CaptureRecord)*/
+    UINT32 reserved;
+}CaptureHeader;
+
+/*16 bytes, followed by len bytes of data and no padding, host byte order*/
+typedef struct
+{
+    UINT32 delta; /*microseconds since the previous record*/
+    UINT32 conn; /*socket fd, a CAP_CLOSE comes before the fd is reused*/
+    UINT32 len;
+    UINT8 type; /*capture_type*/
+    UINT8 reserved[3];
+}CaptureRecord;
+
+/*start capturing to the configured capture_file, when set*/
+VOID iotbroker_capture_init();
+
+VOID iotbroker_capture_open(INT32 fd);
+
+VOID iotbroker_capture_data(INT32 fd, CONST UINT8 *data, UINT32 len);
+
+VOID iotbroker_capture_close(INT32 fd);
+
+#endif
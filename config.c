@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <assert.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "iotbroker.h"
+#include "config.h"
+#include "debug.h"
+#include "list.h"
+#include "net.h"
+#include "protocol.h"
+#include "session.h"
+#include "memmanager.h"
+#include "recorder.h"
+#include "ratelimit.h"
+#include "overload.h"
+#include "mqtt5.h"
+#include "acl.h"
+#include "auth.h"
+
+typedef struct
+{
+    CONST INT8 *name; /*key in the config file*/
+    UINT32 offset; /*offset in Config*/
+    UINT32 min;
+    UINT32 max;
+    UINT32 hot; /*applied on reload*/
+}ConfigItem;
+
+STATIC CONST ConfigItem g_config_items[] = {
+    {"listen_backlog", offsetof(Config, listen_backlog), 1, 65535, FALSE},
+    {"threads", offsetof(Config, threads), 1, 256, FALSE},
+    {"session_table_size", offsetof(Config, session_table_size), 16, 1 << 24, FALSE},
+    {"auth_workers", offsetof(Config, auth_workers), 1, 64, FALSE},
+    {"auth_cache_size", offsetof(Config, auth_cache_size), 0, 1 << 24, FALSE},
+    {"epoll_batch", offsetof(Config, epoll_batch), 1, 65536, TRUE},
+    {"accept_batch", offsetof(Config, accept_batch), 1, 65536, TRUE},
+    {"read_budget", offsetof(Config, read_budget), 0, 1 << 30, TRUE},
+    {"packet_budget", offsetof(Config, packet_budget), 0, 1 << 30, TRUE},
+    {"max_packet_size", offsetof(Config, max_packet_size), 2, 268435455, TRUE},
+    {"max_send_buffer", offsetof(Config, max_send_buffer), 1024, 1 << 30, TRUE},
+    {"batch_delay", offsetof(Config, batch_delay), 0, 1000000, TRUE},
+    {"batch_bytes", offsetof(Config, batch_bytes), 1, 1 << 30, TRUE},
+    {"max_queued_messages", offsetof(Config, max_queued_messages), 0, 1 << 30, TRUE},
+    {"max_inflight", offsetof(Config, max_inflight), 0, 65535, TRUE},
+    {"client_msg_rate", offsetof(Config, client_msg_rate), 0, 1 << 30, TRUE},
+    {"client_byte_rate", offsetof(Config, client_byte_rate), 0, 1 << 30, TRUE},
+    {"shed_memory_mb", offsetof(Config, shed_memory_mb), 0, 1 << 24, TRUE},
+    {"shed_loop_lag", offsetof(Config, shed_loop_lag), 0, 60000, TRUE},
+    {"shed_queue_depth", offsetof(Config, shed_queue_depth), 0, 1 << 30, TRUE},
+    {"message_expiry_default", offsetof(Config, message_expiry_default), 0, 1 << 30, TRUE},
+    {"connect_timeout", offsetof(Config, connect_timeout), 0, 3600, TRUE},
+    {"keepalive_default", offsetof(Config, keepalive_default), 0, 65535, TRUE},
+    {"keepalive_max", offsetof(Config, keepalive_max), 0, 65535, TRUE},
+    {"topic_alias_max", offsetof(Config, topic_alias_max), 0, 1024, TRUE},
+    {"metrics_interval", offsetof(Config, metrics_interval), 0, 86400, TRUE},
+    {"mem_profile_rate", offsetof(Config, mem_profile_rate), 0, 1 << 30, TRUE},
+    {"allow_anonymous", offsetof(Config, allow_anonymous), 0, 1, TRUE},
+};
+
+#define CONFIG_ITEM_NUM (sizeof(g_config_items) / sizeof(g_config_items[0]))
+
+STATIC Config g_config;
+
+STATIC CONST INT8 *g_config_file = NULL;
+
+STATIC INT8 *g_config_overrides[CONFIG_MAX_OVERRIDES];
+
+STATIC UINT32 g_config_override_num = 0;
+
+STATIC volatile sig_atomic_t g_config_reload_requested = FALSE;
+
+STATIC VOID set_defaults(Config *c)
+{
+    memset(c, 0, sizeof(Config));
+
+    strncpy(c->listener[0].address, IPADDRESS, INET_ADDRSTRLEN - 1);
+    c->listener[0].port = PORT;
+    c->listener_num = 1;
+    c->listen_backlog = LISTENQ;
+    c->threads = 1;
+    c->session_table_size = SESSION_TABLE_MIN_SIZE;
+    c->auth_workers = AUTH_WORKERS;
+    c->auth_cache_size = AUTH_CACHE_SIZE;
+
+    c->epoll_batch = EPOLLEVENTS;
+    c->accept_batch = ACCEPT_BATCH;
+    c->read_budget = READ_BUDGET;
+    c->packet_budget = PACKET_BUDGET;
+    c->max_packet_size = PACKET_MAX_LEN;
+    c->max_send_buffer = SEND_BUF_MAX_LEN;
+    c->batch_delay = BATCH_DELAY;
+    c->batch_bytes = BATCH_BYTES;
+    c->max_queued_messages = 0;
+    c->max_inflight = MAX_INFLIGHT;
+    c->client_msg_rate = 0;
+    c->client_byte_rate = 0;
+    c->rate_limit_action = RATE_LIMIT_PAUSE;
+    c->shed_memory_mb = 0;
+    c->shed_loop_lag = 0;
+    c->shed_queue_depth = SHED_QUEUE_DEPTH;
+    c->message_expiry_default = 0;
+    c->connect_timeout = 10;
+    c->keepalive_default = 0;
+    c->keepalive_max = 0;
+    c->topic_alias_max = TOPIC_ALIAS_MAX;
+    c->log_level = LOG_INFO;
+    c->metrics_interval = 10;
+    c->mem_profile_rate = 0;
+    strncpy(c->recorder_file, RECORDER_DEFAULT_FILE, CONFIG_LINE_LEN - 1);
+    c->allow_anonymous = TRUE;
+}
+
+/*strip the blanks around str in place*/
+STATIC INT8* trim(INT8 *str)
+{
+    INT8 *end;
+
+    while(' ' == *str || '\t' == *str)
+    {
+        str++;
+    }
+
+    end = str + strlen(str);
+    while(end > str && (' ' == end[-1] || '\t' == end[-1] || '\n' == end[-1] || '\r' == end[-1]))
+    {
+        end--;
+    }
+    *end = '\0';
+
+    return str;
+}
+
+/*"address:port" or "port"*/
+STATIC UINT32 parse_listener(CONST INT8 *value, ListenerConfig *lc)
+{
+    CONST INT8 *colon;
+    struct in_addr addr;
+    INT8 *end;
+    ULONG port;
+
+    memset(lc, 0, sizeof(ListenerConfig));
+
+    colon = strrchr(value, ':');
+    if(NULL == colon)
+    {
+        strncpy(lc->address, IPADDRESS, INET_ADDRSTRLEN - 1);
+        colon = value - 1;
+    }
+    else
+    {
+        if(colon - value >= INET_ADDRSTRLEN)
+        {
+            return FAILED;
+        }
+        memcpy(lc->address, value, colon - value);
+
+        if(inet_pton(AF_INET, lc->address, &addr) != 1)
+        {
+            return FAILED;
+        }
+    }
+
+    port = strtoul(colon + 1, &end, 10);
+    if(end == colon + 1 || *end != '\0' || 0 == port || port > 65535)
+    {
+        return FAILED;
+    }
+    lc->port = port;
+
+    return SUCESS;
+}
+
+/*"address:port" or "port", then "latency" or "throughput"*/
+STATIC UINT32 parse_listener_mode(CONST INT8 *value, ListenerConfig *lc)
+{
+    INT8 address[CONFIG_LINE_LEN];
+    CONST INT8 *mode;
+
+    mode = strpbrk(value, " \t");
+    if(NULL == mode)
+    {
+        return parse_listener(value, lc);
+    }
+
+    memcpy(address, value, mode - value);
+    address[mode - value] = '\0';
+    INVALID_RETURN_VALUE(SUCESS == parse_listener(address, lc), FAILED);
+
+    mode += strspn(mode, " \t");
+    if(0 == strcmp(mode, "throughput"))
+    {
+        lc->mode = LISTENER_THROUGHPUT;
+    }
+    else if(strcmp(mode, "latency") != 0)
+    {
+        return FAILED;
+    }
+
+    return SUCESS;
+}
+
+/*"prefix msgs/s bytes/s"*/
+STATIC UINT32 parse_topic_limit(CONST INT8 *value, TopicLimitConfig *tl)
+{
+    INT8 prefix[CONFIG_LINE_LEN];
+    ULONG msg_rate, byte_rate;
+    INT32 end = 0;
+
+    memset(tl, 0, sizeof(TopicLimitConfig));
+
+    if(sscanf(value, "%255s %lu %lu %n", prefix, &msg_rate, &byte_rate, &end) != 3 || value[end] != '\0'
+        || strlen(prefix) >= CONFIG_TOPIC_PREFIX_LEN || msg_rate > (1 << 30) || byte_rate > (1 << 30))
+    {
+        return FAILED;
+    }
+
+    strcpy(tl->prefix, prefix);
+    tl->msg_rate = msg_rate;
+    tl->byte_rate = byte_rate;
+
+    return SUCESS;
+}
+
+/*"prefix seconds"*/
+STATIC UINT32 parse_message_expiry(CONST INT8 *value, MessageExpiryConfig *me)
+{
+    INT8 prefix[CONFIG_LINE_LEN];
+    ULONG seconds;
+    INT32 end = 0;
+
+    memset(me, 0, sizeof(MessageExpiryConfig));
+
+    if(sscanf(value, "%255s %lu %n", prefix, &seconds, &end) != 2 || value[end] != '\0'
+        || strlen(prefix) >= CONFIG_TOPIC_PREFIX_LEN || seconds > 0xFFFFFFFFUL)
+    {
+        return FAILED;
+    }
+
+    strcpy(me->prefix, prefix);
+    me->seconds = seconds;
+
+    return SUCESS;
+}
+
+STATIC UINT32 apply_option(Config *c, CONST INT8 *key, CONST INT8 *value, UINT32 *listener_set)
+{
+    UINT32 i;
+
+    if(0 == strcmp(key, "listener"))
+    {
+        /*the first listener line replaces the default one*/
+        if(!*listener_set)
+        {
+            c->listener_num = 0;
+            *listener_set = TRUE;
+        }
+
+        if(c->listener_num >= CONFIG_MAX_LISTENERS
+            || parse_listener_mode(value, &c->listener[c->listener_num]) != SUCESS)
+        {
+            return FAILED;
+        }
+        c->listener_num++;
+
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "http_listener"))
+    {
+        return parse_listener(value, &c->http_listener);
+    }
+
+    if(0 == strcmp(key, "topic_limit"))
+    {
+        if(c->topic_limit_num >= CONFIG_MAX_TOPIC_LIMITS
+            || parse_topic_limit(value, &c->topic_limit[c->topic_limit_num]) != SUCESS)
+        {
+            return FAILED;
+        }
+        c->topic_limit_num++;
+
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "message_expiry"))
+    {
+        if(c->message_expiry_num >= CONFIG_MAX_MESSAGE_EXPIRY
+            || parse_message_expiry(value, &c->message_expiry[c->message_expiry_num]) != SUCESS)
+        {
+            return FAILED;
+        }
+        c->message_expiry_num++;
+
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "rate_limit_action"))
+    {
+        if(0 == strcmp(value, "pause"))
+        {
+            c->rate_limit_action = RATE_LIMIT_PAUSE;
+        }
+        else if(0 == strcmp(value, "disconnect"))
+        {
+            c->rate_limit_action = RATE_LIMIT_DISCONNECT;
+        }
+        else
+        {
+            return FAILED;
+        }
+
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "log_level"))
+    {
+        return iotbroker_log_parse_level(value, &c->log_level);
+    }
+
+    if(0 == strcmp(key, "capture_file"))
+    {
+        INVALID_RETURN_VALUE(strlen(value) < CONFIG_LINE_LEN, FAILED);
+
+        strcpy(c->capture_file, value);
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "recorder_file"))
+    {
+        INVALID_RETURN_VALUE(strlen(value) < RECORDER_PATH_LEN, FAILED);
+
+        strcpy(c->recorder_file, value);
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "acl_file"))
+    {
+        INVALID_RETURN_VALUE(strlen(value) < CONFIG_LINE_LEN, FAILED);
+
+        strcpy(c->acl_file, value);
+        return SUCESS;
+    }
+
+    if(0 == strcmp(key, "password_file"))
+    {
+        INVALID_RETURN_VALUE(strlen(value) < CONFIG_LINE_LEN, FAILED);
+
+        strcpy(c->password_file, value);
+        return SUCESS;
+    }
+
+    for(i = 0; i < CONFIG_ITEM_NUM; i++)
+    {
+        CONST ConfigItem *item = &g_config_items[i];
+        ULONG num;
+        INT8 *end;
+
+        if(strcmp(key, item->name) != 0)
+        {
+            continue;
+        }
+
+        num = strtoul(value, &end, 10);
+        if(end == value || *end != '\0' || num < item->min || num > item->max)
+        {
+            return FAILED;
+        }
+
+        *(UINT32*)((UINT8*)c + item->offset) = num;
+        return SUCESS;
+    }
+
+    return FAILED;
+}
+
+/*"key = value" or "key=value"*/
+STATIC UINT32 apply_line(Config *c, INT8 *line, UINT32 *listener_set)
+{
+    INT8 *key, *value, *sep;
+
+    sep = strchr(line, '=');
+    INVALID_RETURN_VALUE(sep != NULL, FAILED);
+
+    *sep = '\0';
+    key = trim(line);
+    value = trim(sep + 1);
+
+    return apply_option(c, key, value, listener_set);
+}
+
+STATIC UINT32 load_config(Config *c)
+{
+    INT8 line[CONFIG_LINE_LEN], override[CONFIG_LINE_LEN];
+    UINT32 listener_set = FALSE, line_num = 0, i;
+    FILE *fp;
+
+    set_defaults(c);
+
+    if(g_config_file != NULL)
+    {
+        fp = fopen(g_config_file, "r");
+        if(NULL == fp)
+        {
+            iotbroker_log(LOG_ERROR, "can not open config file %s", g_config_file);
+            return FAILED;
+        }
+
+        while(fgets(line, sizeof(line), fp) != NULL)
+        {
+            INT8 *comment, *content;
+
+            line_num++;
+
+            comment = strchr(line, '#');
+            if(comment != NULL)
+            {
+                *comment = '\0';
+            }
+
+            content = trim(line);
+            if('\0' == *content)
+            {
+                continue;
+            }
+
+            if(apply_line(c, content, &listener_set) != SUCESS)
+            {
+                iotbroker_log(LOG_ERROR, "%s:%u: invalid setting", g_config_file, line_num);
+                fclose(fp);
+                return FAILED;
+            }
+        }
+        fclose(fp);
+    }
+
+    /*command line wins over the file*/
+    for(i = 0; i < g_config_override_num; i++)
+    {
+        strncpy(override, g_config_overrides[i], CONFIG_LINE_LEN - 1);
+        override[CONFIG_LINE_LEN - 1] = '\0';
+
+        if(apply_line(c, override, &listener_set) != SUCESS)
+        {
+            iotbroker_log(LOG_ERROR, "invalid option -o %s", g_config_overrides[i]);
+            return FAILED;
+        }
+    }
+
+    /*the client queues, and the conflation tables indexing them, have a single writer*/
+    if(c->threads > 1)
+    {
+        iotbroker_log(LOG_WARN, "threads = %u, only one event loop thread is supported yet", c->threads);
+        c->threads = 1;
+    }
+
+    return SUCESS;
+}
+
+STATIC VOID usage(CONST INT8 *name)
+{
+    UINT32 i;
+
+    printf("usage: %s [-c config file] [-o key=value]...\n", name);
+    printf("       %s -p username < password, print its password_file line\n", name);
+    printf("keys: listener http_listener log_level topic_limit message_expiry rate_limit_action");
+    for(i = 0; i < CONFIG_ITEM_NUM; i++)
+    {
+        printf(" %s", g_config_items[i].name);
+    }
+    printf("\n");
+}
+
+UINT32 iotbroker_config_init(INT32 argc, INT8 **argv)
+{
+    INT32 opt;
+
+    while((opt = getopt(argc, argv, "c:o:p:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                g_config_file = optarg;
+                break;
+
+            case 'o':
+                if(g_config_override_num >= CONFIG_MAX_OVERRIDES)
+                {
+                    iotbroker_log(LOG_ERROR, "too many -o options");
+                    return FAILED;
+                }
+                g_config_overrides[g_config_override_num++] = optarg;
+                break;
+
+            case 'p':
+                /*a password_file line for the password on stdin, nothing else runs*/
+                exit(iotbroker_auth_print_entry(optarg));
+
+            default:
+                usage(argv[0]);
+                return FAILED;
+        }
+    }
+
+    if(load_config(&g_config) != SUCESS)
+    {
+        return FAILED;
+    }
+
+    iotbroker_log_set_level(g_config.log_level);
+    iotbroker_mem_set_profile_rate(g_config.mem_profile_rate);
+    iotbroker_recorder_set_file(g_config.recorder_file);
+
+    return SUCESS;
+}
+
+CONST Config* iotbroker_config_get()
+{
+    return &g_config;
+}
+
+VOID iotbroker_config_request_reload()
+{
+    g_config_reload_requested = TRUE;
+}
+
+VOID iotbroker_config_reload()
+{
+    Config c;
+
+    INVALID_RETURN_NOVALUE(g_config_reload_requested);
+    g_config_reload_requested = FALSE;
+
+    if(load_config(&c) != SUCESS)
+    {
+        iotbroker_log(LOG_ERROR, "reload failed, keep the running settings");
+        return;
+    }
+
+    if(c.listener_num != g_config.listener_num
+        || memcmp(c.listener, g_config.listener, sizeof(c.listener)) != 0
+        || c.listen_backlog != g_config.listen_backlog
+        || c.threads != g_config.threads
+        || c.session_table_size != g_config.session_table_size
+        || c.auth_workers != g_config.auth_workers
+        || c.auth_cache_size != g_config.auth_cache_size
+        || memcmp(&c.http_listener, &g_config.http_listener, sizeof(c.http_listener)) != 0
+        || strcmp(c.capture_file, g_config.capture_file) != 0)
+    {
+        iotbroker_log(LOG_WARN, "listener, listen_backlog, threads, session_table_size, auth_workers, "
+            "auth_cache_size, http_listener and capture_file changes take effect after restart");
+    }
+
+    g_config.epoll_batch = c.epoll_batch;
+    g_config.accept_batch = c.accept_batch;
+    g_config.read_budget = c.read_budget;
+    g_config.packet_budget = c.packet_budget;
+    g_config.max_packet_size = c.max_packet_size;
+    g_config.max_send_buffer = c.max_send_buffer;
+    g_config.batch_delay = c.batch_delay;
+    g_config.batch_bytes = c.batch_bytes;
+    g_config.max_queued_messages = c.max_queued_messages;
+    g_config.max_inflight = c.max_inflight;
+    g_config.client_msg_rate = c.client_msg_rate;
+    g_config.client_byte_rate = c.client_byte_rate;
+    g_config.rate_limit_action = c.rate_limit_action;
+    g_config.shed_memory_mb = c.shed_memory_mb;
+    g_config.shed_loop_lag = c.shed_loop_lag;
+    g_config.shed_queue_depth = c.shed_queue_depth;
+    memcpy(g_config.topic_limit, c.topic_limit, sizeof(c.topic_limit));
+    g_config.topic_limit_num = c.topic_limit_num;
+    memcpy(g_config.message_expiry, c.message_expiry, sizeof(c.message_expiry));
+    g_config.message_expiry_num = c.message_expiry_num;
+    g_config.message_expiry_default = c.message_expiry_default;
+    g_config.connect_timeout = c.connect_timeout;
+    g_config.keepalive_default = c.keepalive_default;
+    g_config.keepalive_max = c.keepalive_max;
+    g_config.topic_alias_max = c.topic_alias_max;
+    g_config.log_level = c.log_level;
+    g_config.metrics_interval = c.metrics_interval;
+    g_config.mem_profile_rate = c.mem_profile_rate;
+    memcpy(g_config.recorder_file, c.recorder_file, sizeof(c.recorder_file));
+    memcpy(g_config.acl_file, c.acl_file, sizeof(c.acl_file));
+    memcpy(g_config.password_file, c.password_file, sizeof(c.password_file));
+    g_config.allow_anonymous = c.allow_anonymous;
+
+    iotbroker_log_set_level(g_config.log_level);
+    iotbroker_mem_set_profile_rate(g_config.mem_profile_rate);
+    iotbroker_recorder_set_file(g_config.recorder_file);
+    if(iotbroker_acl_load() != SUCESS)
+    {
+        iotbroker_log(LOG_ERROR, "acl_file rejected, keep the running rules");
+    }
+    if(iotbroker_auth_load() != SUCESS)
+    {
+        iotbroker_log(LOG_ERROR, "password_file rejected, keep the running users");
+    }
+    iotbroker_record(REC_RELOAD, -1, 0, 0);
+    iotbroker_log(LOG_INFO, "config reloaded");
+}
@@ -0,0 +1,114 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <netinet/in.h>
+
+#include "iotbroker.h"
+
+#define CONFIG_MAX_LISTENERS 8
+
+/*longest line of the config file*/
+#define CONFIG_LINE_LEN 256
+
+/*most -o overrides on the command line*/
+#define CONFIG_MAX_OVERRIDES 32
+
+/*most topic_limit lines, and the longest prefix*/
+#define CONFIG_MAX_TOPIC_LIMITS 16
+#define CONFIG_TOPIC_PREFIX_LEN 64
+
+/*most message_expiry lines*/
+#define CONFIG_MAX_MESSAGE_EXPIRY 16
+
+/*what the clients of a listener trade, see iotbroker_write_packet*/
+enum listener_mode
+{
+    LISTENER_LATENCY, /*TCP_NODELAY, deliveries written in the round they are queued*/
+    LISTENER_THROUGHPUT, /*deliveries held for batch_delay or batch_bytes, written corked*/
+};
+
+typedef struct
+{
+    UINT8 address[INET_ADDRSTRLEN]; /*bind address*/
+    UINT16 port; /*listen port*/
+    UINT8 mode; /*enum listener_mode*/
+}ListenerConfig;
+
+/*publishes on topics starting with prefix, per second over all clients, 0 no limit*/
+typedef struct
+{
+    INT8 prefix[CONFIG_TOPIC_PREFIX_LEN];
+    UINT32 msg_rate;
+    UINT32 byte_rate;
+}TopicLimitConfig;
+
+/*messages on topics starting with prefix expire seconds after they were published, 0 never*/
+typedef struct
+{
+    INT8 prefix[CONFIG_TOPIC_PREFIX_LEN];
+    UINT32 seconds;
+}MessageExpiryConfig;
+
+/*
+ * Runtime settings. "config file" lines are "key = value", '#' starts a
+ * comment, command line "-o key=value" overrides the file. Settings marked
+ * hot are applied again on SIGHUP, the others need a restart.
+ */
+typedef struct
+{
+    ListenerConfig listener[CONFIG_MAX_LISTENERS]; /*listener = address:port [latency|throughput], repeatable*/
+    UINT32 listener_num;
+    UINT32 listen_backlog; /*listen_backlog*/
+    UINT32 threads; /*threads, event loop threads*/
+    UINT32 session_table_size; /*session_table_size, fd slots allocated at start*/
+    ListenerConfig http_listener; /*http_listener = address:port of the metrics and admin port, port 0 off*/
+    INT8 capture_file[CONFIG_LINE_LEN]; /*capture_file recording the inbound traffic, empty off*/
+    UINT32 auth_workers; /*auth_workers threads hashing passwords*/
+    UINT32 auth_cache_size; /*auth_cache_size credential digests verified recently, 0 none*/
+
+    UINT32 epoll_batch; /*epoll_batch, hot*/
+    UINT32 accept_batch; /*accept_batch, connections accepted per listener and round, hot*/
+    UINT32 read_budget; /*read_budget bytes read from a client per round, 0 no limit, hot*/
+    UINT32 packet_budget; /*packet_budget packets handled per client, direction and round, 0 no limit, hot*/
+    UINT32 max_packet_size; /*max_packet_size, hot*/
+    UINT32 max_send_buffer; /*max_send_buffer, hot*/
+    UINT32 batch_delay; /*batch_delay microseconds a throughput listener holds deliveries, hot*/
+    UINT32 batch_bytes; /*batch_bytes of held deliveries written at once, hot*/
+    UINT32 max_queued_messages; /*max_queued_messages per client, 0 no limit, hot*/
+    UINT32 max_inflight; /*max_inflight QoS1 and QoS2 messages unacknowledged per client, 0 no limit, hot*/
+    UINT32 client_msg_rate; /*client_msg_rate, publishes per second of a client, 0 no limit, hot*/
+    UINT32 client_byte_rate; /*client_byte_rate, publish bytes per second of a client, 0 no limit, hot*/
+    UINT32 rate_limit_action; /*rate_limit_action, pause|disconnect, hot*/
+    UINT32 shed_memory_mb; /*shed_memory_mb of tracked heap that starts shedding, 0 never, hot*/
+    UINT32 shed_loop_lag; /*shed_loop_lag, busy milliseconds per loop iteration that start shedding, 0 never, hot*/
+    UINT32 shed_queue_depth; /*shed_queue_depth, unsent messages of a lagging subscriber, hot*/
+    TopicLimitConfig topic_limit[CONFIG_MAX_TOPIC_LIMITS]; /*topic_limit = prefix msgs/s bytes/s, repeatable, hot*/
+    UINT32 topic_limit_num;
+    MessageExpiryConfig message_expiry[CONFIG_MAX_MESSAGE_EXPIRY]; /*message_expiry = prefix seconds, repeatable, hot*/
+    UINT32 message_expiry_num;
+    UINT32 message_expiry_default; /*message_expiry_default seconds of the topics no prefix matches, 0 never, hot*/
+    UINT32 connect_timeout; /*connect_timeout seconds to wait for CONNECT, 0 never, hot*/
+    UINT32 keepalive_default; /*keepalive_default seconds for clients sending 0, 0 never, hot*/
+    UINT32 keepalive_max; /*keepalive_max seconds, 0 no cap, hot*/
+    UINT32 topic_alias_max; /*topic_alias_max of an MQTT 5.0 client in each direction, 0 none, hot*/
+    UINT32 log_level; /*log_level, error|warn|info|debug, hot*/
+    UINT32 metrics_interval; /*metrics_interval seconds between $SYS publications, 0 never, hot*/
+    UINT32 mem_profile_rate; /*mem_profile_rate, bytes between sampled allocation sites, 0 off, hot*/
+    INT8 recorder_file[CONFIG_LINE_LEN]; /*recorder_file written on a fatal signal or SIGUSR1, empty none, hot*/
+    INT8 acl_file[CONFIG_LINE_LEN]; /*acl_file of topic rules, empty allows everything, hot*/
+    INT8 password_file[CONFIG_LINE_LEN]; /*password_file of the users, empty accepts every CONNECT, hot*/
+    UINT32 allow_anonymous; /*allow_anonymous CONNECTs without a username along a password_file, hot*/
+}Config;
+
+/*parse the command line and load the config file, FAILED on bad settings*/
+UINT32 iotbroker_config_init(INT32 argc, INT8 **argv);
+
+CONST Config* iotbroker_config_get();
+
+/*async signal safe, the reload happens in iotbroker_config_reload*/
+VOID iotbroker_config_request_reload();
+
+/*reload the config file if requested, keeping the restart only settings*/
+VOID iotbroker_config_reload();
+
+#endif
@@ -1,9 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
 #include <assert.h>
 
 #include "debug.h"
 #include "iotbroker.h" 
 
+STATIC UINT32 g_log_level = LOG_INFO;
+
+STATIC CONST INT8 *g_log_level_str[] = {
+    "error",
+    "warn",
+    "info",
+    "debug",
+};
+
 VOID print_hex2num(INT8 *data, UINT32 len)
 {
     UINT32 i, j;
@@ -35,3 +47,57 @@ VOID print_hex2num(INT8 *data, UINT32 len)
     printf("=====================================\n");
 }
 
+
+VOID iotbroker_log_set_level(UINT32 level)
+{
+    g_log_level = (level < LOG_LEVEL_NUM) ? level : LOG_DEBUG;
+}
+
+UINT32 iotbroker_log_get_level()
+{
+    return g_log_level;
+}
+
+UINT32 iotbroker_log_parse_level(CONST INT8 *str, UINT32 *level)
+{
+    UINT32 i;
+    INT8 *end;
+    
+    assert(str != NULL && level != NULL);
+    
+    for(i = 0; i < LOG_LEVEL_NUM; i++)
+    {
+        if(0 == strcmp(str, g_log_level_str[i]))
+        {
+            *level = i;
+            return SUCESS;
+        }
+    }
+    
+    i = strtoul(str, &end, 10);
+    if(end == str || *end != '\0' || i >= LOG_LEVEL_NUM)
+    {
+        return FAILED;
+    }
+    
+    *level = i;
+    return SUCESS;
+}
+
+VOID iotbroker_log(UINT32 level, CONST INT8 *fmt, ...)
+{
+    va_list ap;
+    
+    INVALID_RETURN_NOVALUE(level <= g_log_level);
+    
+    printf("[%s] ", g_log_level_str[level]);
+    
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    
+    printf("\n");
+    
+    /*no line lost when stdout is a file*/
+    fflush(stdout);
+}
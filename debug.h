@@ -15,6 +15,24 @@
         if(!(exp))return (value);\
     }while(0)
 
+enum log_level
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_LEVEL_NUM,
+};
+
 VOID print_hex2num(INT8 *data, UINT32 len);
 
+VOID iotbroker_log_set_level(UINT32 level);
+
+UINT32 iotbroker_log_get_level();
+
+/*level by name or number, FAILED when unknown*/
+UINT32 iotbroker_log_parse_level(CONST INT8 *str, UINT32 *level);
+
+VOID iotbroker_log(UINT32 level, CONST INT8 *fmt, ...);
+
 #endif
@@ -0,0 +1,185 @@
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "iotbroker.h"
+#include "memmanager.h"
+#include "epoch.h"
+#include "debug.h"
+
+STATIC U64 g_epoch = 1;
+
+STATIC EpochThread *g_epoch_threads = NULL;
+
+STATIC pthread_mutex_t g_epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+STATIC __thread EpochThread *t_epoch_thread = NULL;
+
+/*free all objects on a limbo list*/
+STATIC VOID free_limbo(EpochLimbo *limbo)
+{
+    EpochRetired *er, *er_tmp;
+
+    /*detach first, a destructor may retire more objects*/
+    er = limbo->head;
+    limbo->head = NULL;
+
+    while(er != NULL)
+    {
+        er_tmp = er->next;
+        er->free_fn(er->ptr);
+        iotbroker_free(er);
+        er = er_tmp;
+    }
+}
+
+/*free the limbo lists retired at least two epochs ago*/
+STATIC VOID reclaim_limbo(EpochThread *et, U64 global)
+{
+    UINT32 i;
+
+    for(i = 0; i < EPOCH_LIMBO_NUM; i++)
+    {
+        EpochLimbo *limbo = &et->limbo[i];
+
+        if(limbo->head != NULL && limbo->epoch + 2 <= global)
+        {
+            free_limbo(limbo);
+        }
+    }
+}
+
+/*advance the global epoch when every online thread has observed it*/
+STATIC UINT32 try_advance(U64 global)
+{
+    EpochThread *et;
+    UINT32 ret;
+
+    /*another thread is scanning and will advance it*/
+    if(pthread_mutex_trylock(&g_epoch_lock) != SUCESS)
+    {
+        return FALSE;
+    }
+
+    for(et = g_epoch_threads; et != NULL; et = et->next)
+    {
+        if(__atomic_load_n(&et->online, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&et->local_epoch, __ATOMIC_ACQUIRE) != global)
+        {
+            pthread_mutex_unlock(&g_epoch_lock);
+            return FALSE;
+        }
+    }
+
+    ret = __atomic_compare_exchange_n(&g_epoch, &global, global + 1, FALSE,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&g_epoch_lock);
+
+    return ret;
+}
+
+VOID iotbroker_epoch_init()
+{
+    __atomic_store_n(&g_epoch, 1, __ATOMIC_RELEASE);
+}
+
+VOID iotbroker_epoch_register()
+{
+    EpochThread *et;
+
+    INVALID_RETURN_NOVALUE(NULL == t_epoch_thread);
+
+    et = (EpochThread*)iotbroker_malloc(sizeof(EpochThread), MEM_OTHER);
+    assert(et != NULL);
+    memset(et, 0, sizeof(EpochThread));
+
+    pthread_mutex_lock(&g_epoch_lock);
+    et->local_epoch = __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+    et->online = TRUE;
+    et->next = g_epoch_threads;
+    __atomic_store_n(&g_epoch_threads, et, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_epoch_lock);
+
+    t_epoch_thread = et;
+}
+
+VOID iotbroker_epoch_quiescent()
+{
+    EpochThread *et = t_epoch_thread;
+    U64 global;
+
+    INVALID_RETURN_NOVALUE(et != NULL);
+
+    global = __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+    if(et->local_epoch != global)
+    {
+        __atomic_store_n(&et->local_epoch, global, __ATOMIC_RELEASE);
+        reclaim_limbo(et, global);
+    }
+
+    /*we are quiescent as well, observe the new epoch at once*/
+    if(try_advance(global))
+    {
+        __atomic_store_n(&et->local_epoch, global + 1, __ATOMIC_RELEASE);
+        reclaim_limbo(et, global + 1);
+    }
+}
+
+VOID iotbroker_epoch_offline()
+{
+    EpochThread *et = t_epoch_thread;
+
+    INVALID_RETURN_NOVALUE(et != NULL);
+
+    __atomic_store_n(&et->online, FALSE, __ATOMIC_RELEASE);
+}
+
+VOID iotbroker_epoch_online()
+{
+    EpochThread *et = t_epoch_thread;
+
+    INVALID_RETURN_NOVALUE(et != NULL);
+
+    __atomic_store_n(&et->local_epoch, __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    __atomic_store_n(&et->online, TRUE, __ATOMIC_SEQ_CST);
+
+    /*the epoch may advanced before we were visible*/
+    __atomic_store_n(&et->local_epoch, __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELEASE);
+    reclaim_limbo(et, et->local_epoch);
+}
+
+VOID iotbroker_epoch_defer(VOID *ptr, epoch_free_fn free_fn)
+{
+    EpochThread *et = t_epoch_thread;
+    EpochRetired *er;
+    EpochLimbo *limbo;
+    U64 global;
+
+    assert(ptr != NULL && free_fn != NULL);
+
+    /*no reader registered, nobody can hold the object*/
+    if(NULL == __atomic_load_n(&g_epoch_threads, __ATOMIC_ACQUIRE))
+    {
+        free_fn(ptr);
+        return;
+    }
+    assert(et != NULL);
+
+    er = (EpochRetired*)iotbroker_malloc(sizeof(EpochRetired), MEM_OTHER);
+    assert(er != NULL);
+    er->ptr = ptr;
+    er->free_fn = free_fn;
+
+    global = __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+    limbo = &et->limbo[global % EPOCH_LIMBO_NUM];
+
+    /*the slot still holds a list at least three epochs old*/
+    if(limbo->head != NULL && limbo->epoch != global)
+    {
+        free_limbo(limbo);
+    }
+
+    limbo->epoch = global;
+    er->next = limbo->head;
+    limbo->head = er;
+}
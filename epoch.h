@@ -0,0 +1,48 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include "iotbroker.h"
+
+/*limbo lists, objects retired in epoch e are freed once the global epoch reaches e + 2*/
+#define EPOCH_LIMBO_NUM 3
+
+typedef VOID (*epoch_free_fn)(VOID *ptr);
+
+typedef struct epoch_retired
+{
+    VOID *ptr; /*retired object*/
+    epoch_free_fn free_fn; /*destructor*/
+    struct epoch_retired *next;
+}EpochRetired;
+
+typedef struct epoch_limbo
+{
+    U64 epoch; /*epoch the objects were retired in*/
+    EpochRetired *head;
+}EpochLimbo;
+
+typedef struct epoch_thread
+{
+    U64 local_epoch; /*last global epoch observed at a quiescent point*/
+    UINT32 online; /*FALSE while blocked outside the broker structures*/
+    EpochLimbo limbo[EPOCH_LIMBO_NUM]; /*per thread retired lists*/
+    struct epoch_thread *next;
+}EpochThread;
+
+VOID iotbroker_epoch_init();
+
+/*register the calling thread as a reader of the shared structures*/
+VOID iotbroker_epoch_register();
+
+/*the calling thread holds no reference to any shared object*/
+VOID iotbroker_epoch_quiescent();
+
+/*extended quiescent state, e.g. while blocked in epoll_wait*/
+VOID iotbroker_epoch_offline();
+
+VOID iotbroker_epoch_online();
+
+/*free the object after every registered thread passed a quiescent point*/
+VOID iotbroker_epoch_defer(VOID *ptr, epoch_free_fn free_fn);
+
+#endif
@@ -0,0 +1,986 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <ctype.h>
+#include <assert.h>
+#include <malloc.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "iotbroker.h"
+#include "http.h"
+#include "config.h"
+#include "debug.h"
+#include "memmanager.h"
+#include "metrics.h"
+#include "session.h"
+#include "subtree.h"
+#include "timer.h"
+#include "recorder.h"
+
+enum http_state
+{
+    HS_READ, /*waiting for the request*/
+    HS_SCAN, /*walking the session table*/
+    HS_WRITE, /*sending the response*/
+};
+
+enum http_job
+{
+    HJ_SESSIONS,
+    HJ_QUEUES,
+    HJ_SUBSCRIPTIONS,
+};
+
+typedef struct
+{
+    INT32 fd;
+    UINT32 depth;
+}QueueDepth;
+
+typedef struct
+{
+    INT32 fd; /*-1 when the slot is free*/
+    UINT8 state; /*enum http_state*/
+    UINT8 job; /*enum http_job*/
+    TimerNode timer; /*closes slow connections*/
+
+    INT8 request[HTTP_REQUEST_MAX_LEN + 1];
+    UINT32 request_len;
+
+    INT8 *out; /*body, then the whole response*/
+    UINT32 out_len;
+    UINT32 out_size;
+    UINT32 out_pos; /*bytes sent*/
+
+    UINT32 cursor; /*next session table slot to scan*/
+    UINT32 limit; /*entries wanted*/
+    UINT32 found; /*entries found so far*/
+    QueueDepth *top; /*min heap of the deepest queues*/
+    UINT32 depth; /*levels of the subscription prefixes*/
+    UINT8 *prefix; /*last subscription prefix reported, NULL before the first*/
+}HttpConn;
+
+STATIC HttpConn g_http_conns[HTTP_MAX_CONNS];
+
+STATIC UINT32 g_http_conn_num = 0;
+
+STATIC UINT32 g_http_scan_num = 0;
+
+STATIC INT32 g_http_listenfd = -1;
+
+STATIC INT32 g_http_epollfd = -1;
+
+STATIC VOID http_epoll_ctl(INT32 op, INT32 fd, UINT32 events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if(epoll_ctl(g_http_epollfd, op, fd, &ev) != SUCESS)
+    {
+        perror("epoll_ctl error:");
+    }
+}
+
+STATIC HttpConn* find_conn(INT32 fd)
+{
+    UINT32 i;
+
+    for(i = 0; i < HTTP_MAX_CONNS; i++)
+    {
+        if(g_http_conns[i].fd == fd)
+        {
+            return &g_http_conns[i];
+        }
+    }
+
+    return NULL;
+}
+
+STATIC VOID close_conn(HttpConn *hc)
+{
+    http_epoll_ctl(EPOLL_CTL_DEL, hc->fd, 0);
+    close(hc->fd);
+
+    iotbroker_timer_del(&hc->timer);
+
+    if(HS_SCAN == hc->state)
+    {
+        g_http_scan_num--;
+    }
+
+    if(hc->out != NULL)
+    {
+        iotbroker_free(hc->out);
+    }
+
+    if(hc->top != NULL)
+    {
+        iotbroker_free(hc->top);
+    }
+
+    if(hc->prefix != NULL)
+    {
+        iotbroker_free(hc->prefix);
+    }
+
+    memset(hc, 0, sizeof(HttpConn));
+    hc->fd = -1;
+    g_http_conn_num--;
+}
+
+STATIC VOID conn_timeout(TimerNode *tn)
+{
+    HttpConn *hc = container_of(tn, HttpConn, timer);
+
+    iotbroker_record(REC_TIMER, hc->fd, REC_TIMER_HTTP, hc->state);
+    close_conn(hc);
+}
+
+/*append to the response body*/
+STATIC VOID out_printf(HttpConn *hc, CONST INT8 *fmt, ...)
+{
+    va_list ap;
+    INT32 len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if(hc->out_len + len + 1 > hc->out_size)
+    {
+        UINT32 size = (hc->out_size != 0) ? hc->out_size : 1024;
+        INT8 *out;
+
+        while(size < hc->out_len + len + 1)
+        {
+            size *= 2;
+        }
+
+        out = (INT8*)iotbroker_malloc(size, MEM_ADMIN);
+        assert(out != NULL);
+
+        if(hc->out != NULL)
+        {
+            memcpy(out, hc->out, hc->out_len);
+            iotbroker_free(hc->out);
+        }
+
+        hc->out = out;
+        hc->out_size = size;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(hc->out + hc->out_len, len + 1, fmt, ap);
+    va_end(ap);
+
+    hc->out_len += len;
+}
+
+/*a JSON string, NULL as null*/
+STATIC VOID out_json_str(HttpConn *hc, CONST UINT8 *str)
+{
+    if(NULL == str)
+    {
+        out_printf(hc, "null");
+        return;
+    }
+
+    out_printf(hc, "\"");
+    for( ; *str != '\0'; str++)
+    {
+        if('"' == *str || '\\' == *str)
+        {
+            out_printf(hc, "\\%c", *str);
+        }
+        else if(*str < 0x20)
+        {
+            out_printf(hc, "\\u%04x", *str);
+        }
+        else
+        {
+            out_printf(hc, "%c", *str);
+        }
+    }
+    out_printf(hc, "\"");
+}
+
+STATIC VOID send_response(HttpConn *hc);
+
+/*put the status line and headers in front of the body and start sending*/
+STATIC VOID finish_response(HttpConn *hc, UINT32 status, CONST INT8 *content_type)
+{
+    INT8 header[256];
+    CONST INT8 *reason;
+    UINT32 header_len;
+    INT8 *out;
+
+    switch(status)
+    {
+        case 200: reason = "OK"; break;
+        case 400: reason = "Bad Request"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        default: reason = "Error"; break;
+    }
+
+    header_len = snprintf(header, sizeof(header),
+        "HTTP/1.0 %u %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+        status, reason, content_type, hc->out_len);
+
+    out = (INT8*)iotbroker_malloc(header_len + hc->out_len, MEM_ADMIN);
+    assert(out != NULL);
+    memcpy(out, header, header_len);
+    if(hc->out != NULL)
+    {
+        memcpy(out + header_len, hc->out, hc->out_len);
+        iotbroker_free(hc->out);
+    }
+
+    hc->out = out;
+    hc->out_len += header_len;
+    hc->out_size = hc->out_len;
+    hc->out_pos = 0;
+
+    if(HS_SCAN == hc->state)
+    {
+        g_http_scan_num--;
+    }
+    hc->state = HS_WRITE;
+
+    send_response(hc);
+}
+
+STATIC VOID finish_error(HttpConn *hc, UINT32 status)
+{
+    hc->out_len = 0;
+    out_printf(hc, "%u\n", status);
+    finish_response(hc, status, "text/plain");
+}
+
+STATIC VOID send_response(HttpConn *hc)
+{
+    while(hc->out_pos < hc->out_len)
+    {
+        INT32 ret = write(hc->fd, hc->out + hc->out_pos, hc->out_len - hc->out_pos);
+
+        if(ret < 0)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+
+            if(EAGAIN == errno || EWOULDBLOCK == errno)
+            {
+                http_epoll_ctl(EPOLL_CTL_MOD, hc->fd, EPOLLOUT);
+                return;
+            }
+
+            break;
+        }
+
+        hc->out_pos += ret;
+    }
+
+    close_conn(hc);
+}
+
+/*value of a query parameter, NULL when missing*/
+STATIC CONST INT8* query_value(CONST INT8 *query, CONST INT8 *name)
+{
+    UINT32 name_len = strlen(name);
+    CONST INT8 *p = query;
+
+    while(p != NULL && *p != '\0')
+    {
+        if(0 == strncmp(p, name, name_len) && '=' == p[name_len])
+        {
+            return p + name_len + 1;
+        }
+
+        p = strchr(p, '&');
+        if(p != NULL)
+        {
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+/*numeric query parameter, def when missing*/
+STATIC UINT32 query_param(CONST INT8 *query, CONST INT8 *name, UINT32 def)
+{
+    CONST INT8 *value = query_value(query, name);
+
+    return (value != NULL) ? strtoul(value, NULL, 10) : def;
+}
+
+/*decode a percent encoded query value into buf, FAILED when malformed or too long*/
+STATIC UINT32 url_decode(CONST INT8 *value, UINT8 *buf, UINT32 size)
+{
+    UINT32 len = 0;
+    INT8 hex[3] = {0};
+
+    for( ; *value != '\0' && *value != '&'; value++)
+    {
+        INVALID_RETURN_VALUE(len + 1 < size, FAILED);
+
+        if(*value != '%')
+        {
+            buf[len++] = *value;
+            continue;
+        }
+
+        INVALID_RETURN_VALUE(isxdigit(value[1]) && isxdigit(value[2]), FAILED);
+        hex[0] = value[1];
+        hex[1] = value[2];
+        buf[len++] = strtoul(hex, NULL, 16);
+        value += 2;
+    }
+    buf[len] = '\0';
+
+    return SUCESS;
+}
+
+STATIC UINT32 query_limit(CONST INT8 *query, CONST INT8 *name)
+{
+    UINT32 limit = query_param(query, name, HTTP_DEFAULT_LIMIT);
+
+    if(0 == limit)
+    {
+        limit = HTTP_DEFAULT_LIMIT;
+    }
+
+    return (limit > HTTP_MAX_LIMIT) ? HTTP_MAX_LIMIT : limit;
+}
+
+/*metric name in Prometheus form, '/' becomes '_'*/
+STATIC VOID prometheus_name(INT8 *buf, UINT32 size, CONST INT8 *name, CONST INT8 *suffix)
+{
+    INT8 *p;
+
+    snprintf(buf, size, "iotbroker_%s%s", name, suffix);
+    for(p = buf; *p != '\0'; p++)
+    {
+        if('/' == *p)
+        {
+            *p = '_';
+        }
+    }
+}
+
+STATIC VOID serve_metrics(HttpConn *hc)
+{
+    STATIC CONST DOUBLE quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    U64 value[METRIC_NUM];
+    Histogram *h;
+    INT8 name[128];
+    UINT32 i, j;
+
+    iotbroker_metrics_read(value);
+
+    out_printf(hc, "# TYPE iotbroker_uptime_seconds gauge\niotbroker_uptime_seconds %u\n", iotbroker_time_sec());
+
+    for(i = 0; i < METRIC_NUM; i++)
+    {
+        UINT32 gauge = (i >= METRIC_GAUGE_FIRST);
+
+        prometheus_name(name, sizeof(name), iotbroker_metrics_name(i), gauge ? "" : "_total");
+        out_printf(hc, "# TYPE %s %s\n%s %lld\n", name, gauge ? "gauge" : "counter", name, value[i]);
+    }
+
+    h = (Histogram*)iotbroker_malloc(sizeof(Histogram), MEM_ADMIN);
+    assert(h != NULL);
+
+    for(i = 0; i < HIST_NUM; i++)
+    {
+        iotbroker_metrics_read_histogram(i, h);
+
+        prometheus_name(name, sizeof(name), iotbroker_histogram_name(i), "_seconds");
+        out_printf(hc, "# TYPE %s summary\n", name);
+        for(j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++)
+        {
+            out_printf(hc, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[j],
+                iotbroker_histogram_percentile(h, quantiles[j] * 100) / 1e6);
+        }
+        out_printf(hc, "%s_sum %.6f\n%s_count %lld\n", name, h->sum / 1e6, name, h->total);
+    }
+
+    iotbroker_free(h);
+
+    /*one group per metric family*/
+    for(i = 0; i < 3; i++)
+    {
+        STATIC CONST INT8 *families[] = {"memory_bytes", "memory_blocks", "memory_peak_bytes"};
+
+        out_printf(hc, "# TYPE iotbroker_%s gauge\n", families[i]);
+        for(j = 0; j < MEM_TAG_NUM; j++)
+        {
+            MemStats stats;
+
+            iotbroker_mem_stats(j, &stats);
+            out_printf(hc, "iotbroker_%s{subsystem=\"%s\"} %lld\n", families[i], iotbroker_mem_tag_name(j),
+                (0 == i) ? stats.bytes : (1 == i) ? stats.blocks : stats.peak);
+        }
+    }
+
+    finish_response(hc, 200, "text/plain; version=0.0.4");
+}
+
+STATIC VOID prefix_handler(CONST UINT8 *prefix, UINT32 count, VOID *arg)
+{
+    HttpConn *hc = (HttpConn*)arg;
+
+    out_printf(hc, "%s", (hc->found++ != 0) ? ",\n" : "\n");
+    out_printf(hc, "{\"prefix\":");
+    out_json_str(hc, prefix);
+    out_printf(hc, ",\"count\":%u}", count);
+
+    /*the next slice resumes after it*/
+    if(NULL == hc->prefix)
+    {
+        hc->prefix = (UINT8*)iotbroker_malloc(SUBTREE_PREFIX_MAX_LEN, MEM_ADMIN);
+        assert(hc->prefix != NULL);
+    }
+    strcpy(hc->prefix, prefix);
+}
+
+/*most live bytes first*/
+STATIC INT32 compare_site(CONST VOID *a, CONST VOID *b)
+{
+    CONST MemSite *sa = (CONST MemSite*)a;
+    CONST MemSite *sb = (CONST MemSite*)b;
+
+    return (sa->live_bytes < sb->live_bytes) - (sa->live_bytes > sb->live_bytes);
+}
+
+STATIC VOID serve_memory(HttpConn *hc, CONST INT8 *query)
+{
+    U64 value[METRIC_NUM];
+    UINT32 clients = iotbroker_session_count();
+    UINT32 slots = iotbroker_session_table_size();
+    UINT32 limit = query_limit(query, "limit");
+    MemSite *sites;
+    UINT32 i, num;
+
+    iotbroker_metrics_read(value);
+
+    out_printf(hc, "{\"clients\":{\"count\":%u,\"bytes\":%lld},\n", clients, (U64)(clients * sizeof(Client)));
+    out_printf(hc, "\"session_table\":{\"slots\":%u,\"bytes\":%lld},\n", slots, (U64)(slots * sizeof(Client*)));
+    out_printf(hc, "\"subscriptions\":{\"count\":%lld,\"bytes\":%lld},\n",
+        value[METRIC_SUBSCRIPTIONS], value[METRIC_SUBSCRIPTIONS] * (U64)sizeof(SubNode));
+    out_printf(hc, "\"queue_entries\":{\"count\":%lld,\"bytes\":%lld},\n",
+        value[METRIC_MSG_QUEUED], value[METRIC_MSG_QUEUED] * (U64)sizeof(MessageEntry));
+    out_printf(hc, "\"store\":{\"messages\":%lld,\"bytes\":%lld},\n",
+        value[METRIC_STORE_MESSAGES], value[METRIC_STORE_BYTES]);
+
+    out_printf(hc, "\"subsystems\":{");
+    for(i = 0; i <= MEM_TAG_NUM; i++)
+    {
+        MemStats stats;
+
+        iotbroker_mem_stats(i, &stats);
+        out_printf(hc, "%s\n\"%s\":{\"bytes\":%lld,\"blocks\":%lld,\"peak\":%lld}", (i != 0) ? "," : "",
+            iotbroker_mem_tag_name(i), stats.bytes, stats.blocks, stats.peak);
+    }
+    out_printf(hc, "},\n");
+
+    /*sampled call sites, empty unless mem_profile_rate is set*/
+    sites = (MemSite*)iotbroker_malloc(MEM_SITE_MAX * sizeof(MemSite), MEM_ADMIN);
+    assert(sites != NULL);
+
+    num = iotbroker_mem_sites(sites, MEM_SITE_MAX);
+    qsort(sites, num, sizeof(MemSite), compare_site);
+
+    out_printf(hc, "\"sites\":[");
+    for(i = 0; i < num && i < limit; i++)
+    {
+        out_printf(hc, "%s\n{\"site\":", (i != 0) ? "," : "");
+        out_json_str(hc, sites[i].site);
+        out_printf(hc, ",\"subsystem\":\"%s\",\"samples\":%lld,\"live_samples\":%lld,\"live_bytes\":%lld}",
+            iotbroker_mem_tag_name(sites[i].tag), sites[i].samples, sites[i].live_samples, sites[i].live_bytes);
+    }
+    out_printf(hc, "]");
+
+    iotbroker_free(sites);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    {
+        struct mallinfo2 mi = mallinfo2();
+
+        out_printf(hc, ",\n\"malloc\":{\"arena\":%zu,\"mmap\":%zu,\"in_use\":%zu,\"free\":%zu}",
+            mi.arena, mi.hblkhd, mi.uordblks, mi.fordblks);
+    }
+#endif
+
+    out_printf(hc, "}\n");
+
+    finish_response(hc, 200, "application/json");
+}
+
+STATIC VOID recorder_line(CONST INT8 *line, UINT32 len, VOID *arg)
+{
+    out_printf((HttpConn*)arg, "%.*s", len, line);
+}
+
+STATIC VOID serve_recorder(HttpConn *hc)
+{
+    iotbroker_recorder_dump(recorder_line, hc);
+
+    finish_response(hc, 200, "text/plain");
+}
+
+STATIC VOID start_scan(HttpConn *hc, UINT8 job, UINT32 cursor, UINT32 limit)
+{
+    hc->state = HS_SCAN;
+    hc->job = job;
+    hc->cursor = cursor;
+    hc->limit = limit;
+    hc->found = 0;
+    g_http_scan_num++;
+
+    if(HJ_QUEUES == job)
+    {
+        hc->top = (QueueDepth*)iotbroker_malloc(limit * sizeof(QueueDepth), MEM_ADMIN);
+        assert(hc->top != NULL);
+        out_printf(hc, "{\"clients\":[");
+    }
+    else if(HJ_SUBSCRIPTIONS == job)
+    {
+        out_printf(hc, "{\"total\":%u,\"prefixes\":[", iotbroker_subtree_count());
+    }
+    else
+    {
+        out_printf(hc, "{\"sessions\":[");
+    }
+}
+
+STATIC VOID serve_subscriptions(HttpConn *hc, CONST INT8 *query)
+{
+    CONST INT8 *cursor = query_value(query, "cursor");
+
+    hc->depth = query_param(query, "depth", 1);
+    if(0 == hc->depth)
+    {
+        hc->depth = 1;
+    }
+
+    /*the cursor is the last prefix of the previous page*/
+    if(cursor != NULL)
+    {
+        hc->prefix = (UINT8*)iotbroker_malloc(SUBTREE_PREFIX_MAX_LEN, MEM_ADMIN);
+        assert(hc->prefix != NULL);
+
+        if(url_decode(cursor, hc->prefix, SUBTREE_PREFIX_MAX_LEN) != SUCESS)
+        {
+            finish_error(hc, 400);
+            return;
+        }
+    }
+
+    start_scan(hc, HJ_SUBSCRIPTIONS, 0, query_limit(query, "limit"));
+}
+
+STATIC VOID handle_request(HttpConn *hc)
+{
+    INT8 *method, *path, *query, *save = NULL;
+
+    method = strtok_r(hc->request, " ", &save);
+    path = strtok_r(NULL, " \r\n", &save);
+    if(NULL == method || NULL == path)
+    {
+        finish_error(hc, 400);
+        return;
+    }
+
+    if(strcmp(method, "GET") != 0)
+    {
+        finish_error(hc, 405);
+        return;
+    }
+
+    query = strchr(path, '?');
+    if(query != NULL)
+    {
+        *query++ = '\0';
+    }
+
+    if(0 == strcmp(path, "/metrics"))
+    {
+        serve_metrics(hc);
+    }
+    else if(0 == strcmp(path, "/subscriptions"))
+    {
+        serve_subscriptions(hc, query);
+    }
+    else if(0 == strcmp(path, "/memory"))
+    {
+        serve_memory(hc, query);
+    }
+    else if(0 == strcmp(path, "/recorder"))
+    {
+        serve_recorder(hc);
+    }
+    else if(0 == strcmp(path, "/sessions"))
+    {
+        start_scan(hc, HJ_SESSIONS, query_param(query, "cursor", 0), query_limit(query, "limit"));
+    }
+    else if(0 == strcmp(path, "/queues"))
+    {
+        start_scan(hc, HJ_QUEUES, 0, query_limit(query, "top"));
+    }
+    else
+    {
+        finish_error(hc, 404);
+    }
+}
+
+STATIC UINT32 queue_depth(Client *c)
+{
+    return c->mq.tail - c->mq.head - c->mq.dead;
+}
+
+/*keep the deepest queues, top[0] is the shallowest kept*/
+STATIC VOID heap_push(HttpConn *hc, INT32 fd, UINT32 depth)
+{
+    QueueDepth *top = hc->top;
+    UINT32 i, child;
+
+    if(hc->found < hc->limit)
+    {
+        /*sift up*/
+        i = hc->found++;
+        while(i > 0 && top[(i - 1) / 2].depth > depth)
+        {
+            top[i] = top[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        top[i].fd = fd;
+        top[i].depth = depth;
+        return;
+    }
+
+    INVALID_RETURN_NOVALUE(depth > top[0].depth);
+
+    /*replace the shallowest and sift down*/
+    i = 0;
+    for( ; ; )
+    {
+        child = 2 * i + 1;
+        if(child >= hc->found)
+        {
+            break;
+        }
+        if(child + 1 < hc->found && top[child + 1].depth < top[child].depth)
+        {
+            child++;
+        }
+        if(top[child].depth >= depth)
+        {
+            break;
+        }
+        top[i] = top[child];
+        i = child;
+    }
+    top[i].fd = fd;
+    top[i].depth = depth;
+}
+
+STATIC INT32 cmp_depth_desc(CONST VOID *a, CONST VOID *b)
+{
+    CONST QueueDepth *qa = (CONST QueueDepth*)a, *qb = (CONST QueueDepth*)b;
+
+    return (qa->depth < qb->depth) - (qa->depth > qb->depth);
+}
+
+STATIC VOID out_session(HttpConn *hc, Client *c)
+{
+    out_printf(hc, "{\"fd\":%d,\"client_id\":", c->sock_fd);
+    out_json_str(hc, c->client_id);
+    out_printf(hc, ",\"address\":\"%s\",\"port\":%u,\"state\":%d,\"keepalive\":%u,\"queued\":%u,\"inflight\":%u,\"inflight_window\":%u,\"tx_bytes\":%u}",
+        c->address, c->port, c->state, c->keepalive, queue_depth(c), c->mq.inflight,
+        iotbroker_session_inflight_window(c), c->tx_len);
+}
+
+STATIC VOID finish_queues(HttpConn *hc)
+{
+    UINT32 i, n = 0;
+
+    qsort(hc->top, hc->found, sizeof(QueueDepth), cmp_depth_desc);
+
+    for(i = 0; i < hc->found; i++)
+    {
+        Client *c = NULL;
+
+        /*the client may be gone since it was scanned*/
+        iotbroker_session_get(hc->top[i].fd, &c);
+        if(NULL == c)
+        {
+            continue;
+        }
+
+        out_printf(hc, "%s", (n++ != 0) ? ",\n" : "\n");
+        out_session(hc, c);
+    }
+    out_printf(hc, "]}\n");
+
+    finish_response(hc, 200, "application/json");
+}
+
+/*
+ * Walk the next slice of the subscription tree, resumed after the last
+ * prefix reported: the tree may change between the slices.
+ */
+STATIC VOID scan_prefixes(HttpConn *hc)
+{
+    UINT32 more;
+
+    more = iotbroker_subtree_prefix(hc->depth, hc->prefix, MIN(HTTP_SCAN_PREFIXES, hc->limit - hc->found),
+        prefix_handler, hc);
+
+    INVALID_RETURN_NOVALUE(!more || hc->found == hc->limit);
+
+    if(more)
+    {
+        out_printf(hc, "],\"next_cursor\":");
+        out_json_str(hc, hc->prefix);
+        out_printf(hc, "}\n");
+    }
+    else
+    {
+        out_printf(hc, "],\"next_cursor\":null}\n");
+    }
+
+    finish_response(hc, 200, "application/json");
+}
+
+/*scan the next slice of the session table*/
+STATIC VOID run_scan(HttpConn *hc)
+{
+    UINT32 size = iotbroker_session_table_size();
+    UINT32 end = hc->cursor + HTTP_SCAN_BATCH;
+
+    if(HJ_SUBSCRIPTIONS == hc->job)
+    {
+        scan_prefixes(hc);
+        return;
+    }
+
+    for( ; hc->cursor < size && hc->cursor < end; hc->cursor++)
+    {
+        Client *c = NULL;
+
+        iotbroker_session_get(hc->cursor, &c);
+        if(NULL == c)
+        {
+            continue;
+        }
+
+        if(HJ_QUEUES == hc->job)
+        {
+            if(queue_depth(c) != 0)
+            {
+                heap_push(hc, hc->cursor, queue_depth(c));
+            }
+            continue;
+        }
+
+        if(hc->found == hc->limit)
+        {
+            out_printf(hc, "],\"next_cursor\":%u}\n", hc->cursor);
+            finish_response(hc, 200, "application/json");
+            return;
+        }
+
+        out_printf(hc, "%s", (hc->found++ != 0) ? ",\n" : "\n");
+        out_session(hc, c);
+    }
+
+    INVALID_RETURN_NOVALUE(hc->cursor >= size);
+
+    if(HJ_QUEUES == hc->job)
+    {
+        finish_queues(hc);
+        return;
+    }
+
+    out_printf(hc, "],\"next_cursor\":null}\n");
+    finish_response(hc, 200, "application/json");
+}
+
+STATIC VOID handle_conn_read(HttpConn *hc)
+{
+    INT32 ret;
+
+    for( ; ; )
+    {
+        ret = read(hc->fd, hc->request + hc->request_len, HTTP_REQUEST_MAX_LEN - hc->request_len);
+        if(ret < 0 && EINTR == errno)
+        {
+            continue;
+        }
+
+        if(ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            return;
+        }
+
+        if(ret <= 0)
+        {
+            close_conn(hc);
+            return;
+        }
+
+        hc->request_len += ret;
+        hc->request[hc->request_len] = '\0';
+
+        if(strstr(hc->request, "\r\n\r\n") != NULL || strstr(hc->request, "\n\n") != NULL)
+        {
+            break;
+        }
+
+        if(hc->request_len == HTTP_REQUEST_MAX_LEN)
+        {
+            finish_error(hc, 400);
+            return;
+        }
+    }
+
+    /*one request per connection, the rest of the input is ignored*/
+    http_epoll_ctl(EPOLL_CTL_MOD, hc->fd, 0);
+    handle_request(hc);
+}
+
+STATIC VOID handle_accept(INT32 listenfd)
+{
+    INT32 fd, i;
+
+    for( ; ; )
+    {
+        fd = accept(listenfd, NULL, NULL);
+        INVALID_RETURN_NOVALUE(fd >= 0);
+
+        if(g_http_conn_num == HTTP_MAX_CONNS)
+        {
+            close(fd);
+            continue;
+        }
+
+        for(i = 0; g_http_conns[i].fd != -1; i++)
+        {
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        memset(&g_http_conns[i], 0, sizeof(HttpConn));
+        g_http_conns[i].fd = fd;
+        g_http_conns[i].state = HS_READ;
+        iotbroker_timer_node_init(&g_http_conns[i].timer, conn_timeout);
+        iotbroker_timer_add(&g_http_conns[i].timer, HTTP_TIMEOUT_MS);
+        g_http_conn_num++;
+
+        http_epoll_ctl(EPOLL_CTL_ADD, fd, EPOLLIN);
+    }
+}
+
+VOID iotbroker_http_init(INT32 epollfd)
+{
+    CONST ListenerConfig *lc = &iotbroker_config_get()->http_listener;
+    struct sockaddr_in servaddr;
+    INT32 reuse = 1;
+    UINT32 i;
+
+    for(i = 0; i < HTTP_MAX_CONNS; i++)
+    {
+        g_http_conns[i].fd = -1;
+    }
+
+    INVALID_RETURN_NOVALUE(lc->port != 0);
+
+    g_http_epollfd = epollfd;
+
+    g_http_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(-1 == g_http_listenfd)
+    {
+        perror("socket error:");
+        exit(FAILED);
+    }
+
+    setsockopt(g_http_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    inet_pton(AF_INET, lc->address, &servaddr.sin_addr);
+    servaddr.sin_port = htons(lc->port);
+
+    if(bind(g_http_listenfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) != SUCESS)
+    {
+        iotbroker_log(LOG_ERROR, "bind %s:%u error: %s", lc->address, lc->port, strerror(errno));
+        exit(FAILED);
+    }
+
+    listen(g_http_listenfd, HTTP_MAX_CONNS);
+    fcntl(g_http_listenfd, F_SETFL, fcntl(g_http_listenfd, F_GETFL) | O_NONBLOCK);
+    http_epoll_ctl(EPOLL_CTL_ADD, g_http_listenfd, EPOLLIN);
+
+    iotbroker_log(LOG_INFO, "http listening on %s:%u", lc->address, lc->port);
+}
+
+UINT32 iotbroker_http_handle_event(INT32 fd, UINT32 events)
+{
+    HttpConn *hc;
+
+    INVALID_RETURN_VALUE(g_http_listenfd != -1, FALSE);
+
+    if(fd == g_http_listenfd)
+    {
+        handle_accept(fd);
+        return TRUE;
+    }
+
+    INVALID_RETURN_VALUE(g_http_conn_num != 0, FALSE);
+
+    hc = find_conn(fd);
+    INVALID_RETURN_VALUE(hc != NULL, FALSE);
+
+    if(HS_READ == hc->state)
+    {
+        handle_conn_read(hc);
+    }
+    else if(HS_WRITE == hc->state)
+    {
+        send_response(hc);
+    }
+
+    return TRUE;
+}
+
+VOID iotbroker_http_run()
+{
+    UINT32 i;
+
+    INVALID_RETURN_NOVALUE(g_http_scan_num != 0);
+
+    for(i = 0; i < HTTP_MAX_CONNS; i++)
+    {
+        if(g_http_conns[i].fd != -1 && HS_SCAN == g_http_conns[i].state)
+        {
+            run_scan(&g_http_conns[i]);
+        }
+    }
+}
+
+UINT32 iotbroker_http_pending()
+{
+    return g_http_scan_num != 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include "iotbroker.h"
+
+/*admin connections served at a time, the extra ones are closed*/
+#define HTTP_MAX_CONNS 16
+
+/*request line and headers*/
+#define HTTP_REQUEST_MAX_LEN 2048
+
+/*a connection not done within this is closed*/
+#define HTTP_TIMEOUT_MS 5000
+
+/*session table slots scanned per event loop iteration*/
+#define HTTP_SCAN_BATCH 4096
+
+/*subscription prefixes reported per event loop iteration*/
+#define HTTP_SCAN_PREFIXES 256
+
+/*entries per page unless ?limit= asks otherwise*/
+#define HTTP_DEFAULT_LIMIT 100
+
+#define HTTP_MAX_LIMIT 1000
+
+/*
+ * Side port serving, one request per connection:
+ *   /metrics                             Prometheus text format
+ *   /sessions?cursor=&limit=             sessions from fd cursor on
+ *   /subscriptions?depth=&cursor=&limit= subscription count per filter prefix after prefix cursor
+ *   /queues?top=                         clients with the deepest queues
+ *   /memory?limit=                       memory by subsystem and sampled sites
+ *   /recorder                            flight recorder, as dumped on SIGUSR1
+ * Everything is served from the event loop, scans over the session table
+ * advance HTTP_SCAN_BATCH slots per iteration, walks of the subscription
+ * tree HTTP_SCAN_PREFIXES prefixes.
+ */
+VOID iotbroker_http_init(INT32 epollfd);
+
+/*handle the event if fd belongs to the side port, FALSE otherwise*/
+UINT32 iotbroker_http_handle_event(INT32 fd, UINT32 events);
+
+/*advance the pending scans*/
+VOID iotbroker_http_run();
+
+/*TRUE while a scan waits for the next iteration*/
+UINT32 iotbroker_http_pending();
+
+#endif
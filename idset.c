@@ -0,0 +1,164 @@
+#include <string.h>
+#include <assert.h>
+
+#include "iotbroker.h"
+#include "idset.h"
+#include "memmanager.h"
+#include "debug.h"
+
+#define IDSET_IDS(set) ((UINT16*)(set)->data)
+
+#define IDSET_BIT(set, id) ((set)->data[(id) >> 3] & (1 << ((id) & 7)))
+
+/*first slot of ids not below id*/
+STATIC UINT32 lower_bound(PacketIdSet *set, UINT16 id)
+{
+    UINT16 *ids = IDSET_IDS(set);
+    UINT32 low = 0, high = set->num, mid;
+
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+        if(ids[mid] < id)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+STATIC PacketIdSet* new_set(UINT32 size, UINT32 bytes)
+{
+    PacketIdSet *set;
+
+    set = (PacketIdSet*)iotbroker_malloc(sizeof(PacketIdSet) + bytes, MEM_SESSION);
+    assert(set != NULL);
+    set->num = 0;
+    set->size = size;
+
+    return set;
+}
+
+/*a full sparse set doubles, past IDSET_SPARSE_MAX it turns into a bitmap*/
+STATIC PacketIdSet* grow_set(PacketIdSet *set)
+{
+    PacketIdSet *grown;
+    UINT16 *ids = IDSET_IDS(set);
+    UINT32 i;
+
+    if(set->size < IDSET_SPARSE_MAX)
+    {
+        grown = new_set(set->size * 2, set->size * 2 * sizeof(UINT16));
+        memcpy(grown->data, set->data, set->num * sizeof(UINT16));
+    }
+    else
+    {
+        grown = new_set(0, IDSET_BITMAP_SIZE);
+        memset(grown->data, 0, IDSET_BITMAP_SIZE);
+        for(i = 0; i < set->num; i++)
+        {
+            grown->data[ids[i] >> 3] |= 1 << (ids[i] & 7);
+        }
+    }
+    grown->num = set->num;
+
+    iotbroker_free(set);
+
+    return grown;
+}
+
+UINT32 iotbroker_idset_add(PacketIdSet **set, UINT16 id)
+{
+    PacketIdSet *s = *set;
+    UINT32 pos;
+
+    if(NULL == s)
+    {
+        s = *set = new_set(IDSET_MIN_SIZE, IDSET_MIN_SIZE * sizeof(UINT16));
+    }
+
+    if(0 == s->size)
+    {
+        INVALID_RETURN_VALUE(!IDSET_BIT(s, id), FALSE);
+        s->data[id >> 3] |= 1 << (id & 7);
+        s->num++;
+        return TRUE;
+    }
+
+    pos = lower_bound(s, id);
+    INVALID_RETURN_VALUE(pos == s->num || IDSET_IDS(s)[pos] != id, FALSE);
+
+    if(s->num == s->size)
+    {
+        s = *set = grow_set(s);
+        if(0 == s->size)
+        {
+            s->data[id >> 3] |= 1 << (id & 7);
+            s->num++;
+            return TRUE;
+        }
+    }
+
+    memmove(IDSET_IDS(s) + pos + 1, IDSET_IDS(s) + pos, (s->num - pos) * sizeof(UINT16));
+    IDSET_IDS(s)[pos] = id;
+    s->num++;
+
+    return TRUE;
+}
+
+UINT32 iotbroker_idset_has(PacketIdSet *set, UINT16 id)
+{
+    UINT32 pos;
+
+    INVALID_RETURN_VALUE(set != NULL, FALSE);
+
+    if(0 == set->size)
+    {
+        return IDSET_BIT(set, id) != 0;
+    }
+
+    pos = lower_bound(set, id);
+
+    return pos < set->num && IDSET_IDS(set)[pos] == id;
+}
+
+UINT32 iotbroker_idset_del(PacketIdSet **set, UINT16 id)
+{
+    PacketIdSet *s = *set;
+    UINT32 pos;
+
+    INVALID_RETURN_VALUE(s != NULL, FALSE);
+
+    if(0 == s->size)
+    {
+        INVALID_RETURN_VALUE(IDSET_BIT(s, id), FALSE);
+        s->data[id >> 3] &= ~(1 << (id & 7));
+    }
+    else
+    {
+        pos = lower_bound(s, id);
+        INVALID_RETURN_VALUE(pos < s->num && IDSET_IDS(s)[pos] == id, FALSE);
+        memmove(IDSET_IDS(s) + pos, IDSET_IDS(s) + pos + 1, (s->num - pos - 1) * sizeof(UINT16));
+    }
+
+    /*an idle client holds nothing*/
+    if(0 == --s->num)
+    {
+        iotbroker_idset_free(set);
+    }
+
+    return TRUE;
+}
+
+VOID iotbroker_idset_free(PacketIdSet **set)
+{
+    INVALID_RETURN_NOVALUE(*set != NULL);
+
+    iotbroker_free(*set);
+    *set = NULL;
+}
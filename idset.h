@@ -0,0 +1,37 @@
+#ifndef _IDSET_H_
+#define _IDSET_H_
+
+#include "iotbroker.h"
+
+/*first capacity of a sparse set*/
+#define IDSET_MIN_SIZE 8
+
+/*ids a sparse set holds at most, as many bytes as the bitmap of every id*/
+#define IDSET_SPARSE_MAX 4096
+
+/*bytes of the bitmap of every 16 bit id*/
+#define IDSET_BITMAP_SIZE (65536 / 8)
+
+/*
+ * Set of 16 bit packet ids. Sparse it is a sorted array, 2 bytes an id,
+ * dense a bitmap of every id, 8 KB. A set is allocated by the first add
+ * and released by the last delete, so the pointer to it is NULL when empty.
+ */
+typedef struct
+{
+    UINT32 num; /*ids in the set*/
+    UINT32 size; /*capacity of a sparse set, 0 once a bitmap*/
+    UINT8 data[]; /*UINT16 ids, or the bitmap*/
+}PacketIdSet;
+
+/*add id, FALSE when it was there already*/
+UINT32 iotbroker_idset_add(PacketIdSet **set, UINT16 id);
+
+UINT32 iotbroker_idset_has(PacketIdSet *set, UINT16 id);
+
+/*delete id, FALSE when it was not there*/
+UINT32 iotbroker_idset_del(PacketIdSet **set, UINT16 id);
+
+VOID iotbroker_idset_free(PacketIdSet **set);
+
+#endif
@@ -17,9 +17,13 @@
 
 #define CONST const
 
+/*"make DEBUG=0" drops the debug dumps, needed for any load test*/
+#ifndef IOTBROKER_NO_DEBUG
 #define DEBUG
+#endif
 
-#define MIN(a,b) (a)<(b)?(a):(b)
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 
 /********************************typedef****************************************/
 typedef void VOID;
@@ -43,6 +43,17 @@ static inline void list_add_tail(struct list_head *new, struct list_head *head)
     __list_add(new, head->prev, head);
 }
 
+// 添加new节点(RCU)：new节点初始化完成后才对无锁遍历的读者可见。
+static inline void list_add_rcu(struct list_head *new, struct list_head *head)
+{
+    struct list_head *next = head->next;
+
+    new->next = next;
+    new->prev = head;
+    __atomic_store_n(&head->next, new, __ATOMIC_RELEASE);
+    next->prev = new;
+}
+
 // 从双链表中删除entry节点。
 static inline void __list_del(struct list_head * prev, struct list_head * next)
 {
@@ -69,6 +80,14 @@ static inline void list_del_init(struct list_head *entry)
     INIT_LIST_HEAD(entry);
 }
 
+// 从双链表中删除entry节点(RCU)：保留entry->next，正在遍历的读者可以继续前进，
+// entry节点必须等所有读者经过静止点之后才能释放。
+static inline void list_del_rcu(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    __atomic_store_n(&entry->prev->next, entry->next, __ATOMIC_RELEASE);
+}
+
 // 用new节点取代old节点
 static inline void list_replace(struct list_head *old,
                 struct list_head *new)
@@ -86,7 +105,9 @@ static inline int list_empty(const struct list_head *head)
 }
 
 // 获取"MEMBER成员"在"结构体TYPE"中的位置偏移
+#ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
 
 // 根据"结构体(type)变量"中的"域成员变量(member)的指针(ptr)"来获取指向整个结构体变量的指针
 #define container_of(ptr, type, member) ({          \
@@ -101,6 +122,11 @@ static inline int list_empty(const struct list_head *head)
     for (pos = (head)->next, n = pos->next; pos != (head); \
         pos = n, n = pos->next)
 
+// 无锁遍历双向链表(RCU)，写者需要使用list_add_rcu/list_del_rcu
+#define list_for_each_rcu(pos, head) \
+    for (pos = __atomic_load_n(&(head)->next, __ATOMIC_ACQUIRE); pos != (head); \
+        pos = __atomic_load_n(&pos->next, __ATOMIC_ACQUIRE))
+
 #define list_entry(ptr, type, member) \
     container_of(ptr, type, member)
 
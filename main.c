@@ -1,4 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -9,23 +13,106 @@
 #include "net.h"
 #include "message.h"
 #include "subtree.h"
+#include "session.h"
+#include "epoch.h"
+#include "timer.h"
+#include "config.h"
+#include "metrics.h"
+#include "http.h"
+#include "memmanager.h"
+#include "recorder.h"
+#include "capture.h"
+#include "overload.h"
+#include "acl.h"
+#include "auth.h"
 #include "iotbroker.h"
 
+STATIC VOID handle_sighup(INT32 signo)
+{
+    iotbroker_config_request_reload();
+}
+
 int main(int argc, char **argv)
 {
-	UINT32 ret, listenfd, epollfd;
-    struct epoll_event events[EPOLLEVENTS];
-    
+    INT32 ret, epollfd;
+    UINT32 batch;
+    U64 busy_start;
+    struct epoll_event *events;
+
+    if(iotbroker_config_init(argc, argv) != SUCESS)
+    {
+        return FAILED;
+    }
+
+    if(iotbroker_acl_load() != SUCESS || iotbroker_auth_load() != SUCESS)
+    {
+        return FAILED;
+    }
+
+    signal(SIGHUP, handle_sighup);
+    iotbroker_recorder_init();
+
+    iotbroker_timer_init();
+    iotbroker_epoch_init();
+    iotbroker_epoch_register();
+    iotbroker_metrics_register();
+    iotbroker_recorder_register();
     iotbroker_message_store_init();
-    iotbroker_net_init(&listenfd, &epollfd);    
-        
+    iotbroker_subtree_init();
+    iotbroker_metrics_init();
+    iotbroker_net_init(&epollfd);
+    iotbroker_http_init(epollfd);
+    iotbroker_auth_init(epollfd);
+    iotbroker_capture_init();
+
+    batch = iotbroker_config_get()->epoll_batch;
+    events = (struct epoll_event*)iotbroker_malloc(batch * sizeof(struct epoll_event), MEM_OTHER);
+    assert(events != NULL);
+
     for ( ; ; )
     {
-        ret = epoll_wait(epollfd, events, EPOLLEVENTS, -1);
-        iotbroker_handle_events(epollfd, events, ret, listenfd);
+        /*blocked threads must not hold back reclamation*/
+        iotbroker_epoch_offline();
+        /*a pending admin scan continues in the next iteration without sleeping*/
+        /*so does a client with work its budgets left*/
+        ret = epoll_wait(epollfd, events, batch,
+            (iotbroker_http_pending() || iotbroker_session_ready_pending()) ? 0
+            : iotbroker_net_timeout(iotbroker_timer_next_timeout()));
+        iotbroker_epoch_online();
+
+        iotbroker_time_update();
+        busy_start = iotbroker_time_now_us();
+
+        iotbroker_handle_events(epollfd, events, MAX(ret, 0));
+
+        iotbroker_timer_run();
+
+        iotbroker_http_run();
+
+        /*delivery latency is taken against the clock of the flush*/
+        iotbroker_time_update();
+        iotbroker_net_flush();
+
+        /*SIGHUP and SIGUSR1 only set a flag, reload and dump between iterations*/
+        iotbroker_config_reload();
+        iotbroker_recorder_run();
+        if(iotbroker_config_get()->epoll_batch != batch)
+        {
+            batch = iotbroker_config_get()->epoll_batch;
+            iotbroker_free(events);
+            events = (struct epoll_event*)iotbroker_malloc(batch * sizeof(struct epoll_event), MEM_OTHER);
+            assert(events != NULL);
+        }
+
+        /*watermarks are checked against the work of the iteration just done*/
+        iotbroker_time_update();
+        iotbroker_overload_update(iotbroker_time_now_us() - busy_start);
+
+        /*quiescent point, no reference to shared objects survives an iteration*/
+        iotbroker_epoch_quiescent();
     }
 
     close(epollfd);
-	
+
     return 0;
 }
@@ -1,38 +1,236 @@
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "iotbroker.h"
 #include "memmanager.h"
+#include "debug.h"
+
+typedef struct
+{
+    size_t size; /*bytes requested*/
+    UINT16 tag;
+    UINT16 site; /*index + 1 in g_mem_sites when sampled, 0 otherwise*/
+    UINT32 weight; /*bytes the sample stands for*/
+}MemHeader;
+
+STATIC CONST INT8 *g_mem_tag_name[MEM_TAG_NUM + 1] = {
+    "session",
+    "subtree",
+    "message",
+    "queue",
+    "protocol",
+    "admin",
+    "other",
+    "total",
+};
+
+/*index MEM_TAG_NUM holds the sum of every tag*/
+STATIC MemStats g_mem_stats[MEM_TAG_NUM + 1];
+
+STATIC UINT32 g_mem_profile_rate = 0;
+
+/*open addressing on the site pointer, only touched by sampled blocks*/
+STATIC MemSite g_mem_sites[MEM_SITE_MAX];
+
+STATIC pthread_mutex_t g_mem_site_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*bytes left before the next sample of this thread*/
+STATIC __thread LONG t_mem_sample_left = 0;
+
+STATIC __thread UINT32 t_mem_random = 2463534242U;
+
+/*raise the high-water mark, the CAS only runs on a new peak*/
+STATIC VOID update_peak(U64 *peak, U64 value)
+{
+    U64 old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+    while(value > old)
+    {
+        if(__atomic_compare_exchange_n(peak, &old, value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+}
+
+STATIC VOID account(UINT32 tag, LONG bytes, LONG blocks)
+{
+    U64 now;
+
+    now = __atomic_add_fetch(&g_mem_stats[tag].bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_mem_stats[tag].blocks, blocks, __ATOMIC_RELAXED);
+    if(bytes > 0)
+    {
+        update_peak(&g_mem_stats[tag].peak, now);
+    }
+
+    now = __atomic_add_fetch(&g_mem_stats[MEM_TAG_NUM].bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_mem_stats[MEM_TAG_NUM].blocks, blocks, __ATOMIC_RELAXED);
+    if(bytes > 0)
+    {
+        update_peak(&g_mem_stats[MEM_TAG_NUM].peak, now);
+    }
+}
+
+/*
+ * Next gap between samples, uniform in [rate / 2, rate * 3 / 2) so that
+ * allocations repeating with the period of the rate are not always missed.
+ */
+STATIC LONG next_sample_gap(UINT32 rate)
+{
+    t_mem_random ^= t_mem_random << 13;
+    t_mem_random ^= t_mem_random >> 17;
+    t_mem_random ^= t_mem_random << 5;
+
+    return rate / 2 + t_mem_random % rate;
+}
+
+/*count the block at its call site, the index + 1 of the site or 0*/
+STATIC UINT16 sample_site(CONST INT8 *site, UINT32 tag, UINT32 weight)
+{
+    UINT32 i, slot;
+
+    slot = ((ULONG)site >> 3) % MEM_SITE_MAX;
+
+    pthread_mutex_lock(&g_mem_site_lock);
+    for(i = 0; i < MEM_SITE_MAX; i++, slot = (slot + 1) % MEM_SITE_MAX)
+    {
+        MemSite *ms = &g_mem_sites[slot];
+
+        if(NULL == ms->site)
+        {
+            ms->site = site;
+            ms->tag = tag;
+        }
+
+        if(ms->site == site)
+        {
+            ms->samples++;
+            ms->live_samples++;
+            ms->live_bytes += weight;
+            pthread_mutex_unlock(&g_mem_site_lock);
+            return slot + 1;
+        }
+    }
+    pthread_mutex_unlock(&g_mem_site_lock);
+
+    return 0;
+}
+
+STATIC VOID unsample_site(UINT16 site, UINT32 weight)
+{
+    MemSite *ms = &g_mem_sites[site - 1];
+
+    pthread_mutex_lock(&g_mem_site_lock);
+    ms->live_samples--;
+    ms->live_bytes -= weight;
+    pthread_mutex_unlock(&g_mem_site_lock);
+}
 
 /*malloc memory*/
-VOID* iotbroker_malloc(size_t size)
+VOID* iotbroker_malloc_at(size_t size, UINT32 tag, CONST INT8 *site)
 {
-    VOID *p = malloc(size);
-#ifdef DEBUG
-    if(size > 1024 * 4)
+    MemHeader *h;
+    UINT32 rate;
+
+    assert(tag < MEM_TAG_NUM);
+
+    h = (MemHeader*)malloc(MEM_HEADER_SIZE + size);
+    if(NULL == h)
     {
-        printf("=====================================\n");
-        printf(" malloc may be error, please check!!!\n");
-        printf("=====================================\n");
-        assert(0);
+        return NULL;
     }
 
+    h->size = size;
+    h->tag = tag;
+    h->site = 0;
+    h->weight = 0;
+
+    account(tag, size, 1);
+
+    rate = __atomic_load_n(&g_mem_profile_rate, __ATOMIC_RELAXED);
+    if(rate != 0)
+    {
+        t_mem_sample_left -= size;
+        if(t_mem_sample_left < 0)
+        {
+            h->weight = (size > rate) ? ((size >> 32) ? 0xFFFFFFFF : size) : rate;
+            h->site = sample_site(site, tag, h->weight);
+            t_mem_sample_left = next_sample_gap(rate);
+        }
+    }
+
+#ifdef DEBUG
     printf("\nmalloc mem as follow:\n");
     printf("=====================================\n");
-    printf("     address:%p, size:%ld\n", p, size);
+    printf("     address:%p, size:%ld, tag:%s, site:%s\n",
+        (INT8*)h + MEM_HEADER_SIZE, size, g_mem_tag_name[tag], site);
     printf("=====================================\n");
 #endif
-    return p;
+    return (INT8*)h + MEM_HEADER_SIZE;
 }
 
 /*free memory*/
 VOID iotbroker_free(VOID* ptr)
 {
+    MemHeader *h;
+
+    INVALID_RETURN_NOVALUE(ptr != NULL);
+
+    h = (MemHeader*)((INT8*)ptr - MEM_HEADER_SIZE);
 #ifdef DEBUG
     printf("\nfree mem as follow:\n");
     printf("=====================================\n");
-    printf("     address:%p\n", ptr);
+    printf("     address:%p, size:%ld, tag:%s\n", ptr, h->size, g_mem_tag_name[h->tag]);
     printf("=====================================\n");
 #endif
-    free(ptr);
+    account(h->tag, -(LONG)h->size, -1);
+
+    if(h->site != 0)
+    {
+        unsample_site(h->site, h->weight);
+    }
+
+    free(h);
+}
+
+VOID iotbroker_mem_stats(UINT32 tag, MemStats *stats)
+{
+    assert(tag <= MEM_TAG_NUM && stats != NULL);
+
+    stats->bytes = __atomic_load_n(&g_mem_stats[tag].bytes, __ATOMIC_RELAXED);
+    stats->blocks = __atomic_load_n(&g_mem_stats[tag].blocks, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&g_mem_stats[tag].peak, __ATOMIC_RELAXED);
+}
+
+CONST INT8* iotbroker_mem_tag_name(UINT32 tag)
+{
+    INVALID_RETURN_VALUE(tag <= MEM_TAG_NUM, NULL);
+
+    return g_mem_tag_name[tag];
+}
+
+VOID iotbroker_mem_set_profile_rate(UINT32 rate)
+{
+    __atomic_store_n(&g_mem_profile_rate, rate, __ATOMIC_RELAXED);
+}
+
+UINT32 iotbroker_mem_sites(MemSite *sites, UINT32 max)
+{
+    UINT32 i, num = 0;
+
+    assert(sites != NULL);
+
+    pthread_mutex_lock(&g_mem_site_lock);
+    for(i = 0; i < MEM_SITE_MAX && num < max; i++)
+    {
+        if(g_mem_sites[i].site != NULL)
+        {
+            sites[num++] = g_mem_sites[i];
+        }
+    }
+    pthread_mutex_unlock(&g_mem_site_lock);
+
+    return num;
 }
@@ -1,8 +1,72 @@
 #ifndef _MEM_MANAGER_H_
 #define _MEM_MANAGER_H_
 
-VOID* iotbroker_malloc(size_t size);
+#include "iotbroker.h"
+
+/*subsystem an allocation is accounted to*/
+enum mem_tag
+{
+    MEM_SESSION, /*clients, session table, ready list*/
+    MEM_SUBTREE, /*tree nodes, child tables, subscriptions*/
+    MEM_MESSAGE, /*message store and the published packets it owns*/
+    MEM_QUEUE, /*per client delivery rings*/
+    MEM_PROTOCOL, /*decoded packets, socket buffers*/
+    MEM_ADMIN, /*metrics and the http side port*/
+    MEM_OTHER, /*epoch bookkeeping, event arrays*/
+    MEM_TAG_NUM,
+};
+
+/*
+ * Every block starts with a 16 byte header holding its size and tag, so
+ * a block is accounted to the subsystem that allocated it wherever it is
+ * freed, and the alignment of malloc is kept.
+ */
+#define MEM_HEADER_SIZE 16
+
+/*call sites tracked by the sampling profile, later ones are not sampled*/
+#define MEM_SITE_MAX 256
+
+typedef struct
+{
+    U64 bytes; /*live bytes requested, headers excluded*/
+    U64 blocks; /*live blocks*/
+    U64 peak; /*high-water mark of bytes*/
+}MemStats;
+
+typedef struct
+{
+    CONST INT8 *site; /*"file:line"*/
+    UINT32 tag;
+    U64 samples; /*sampled allocations*/
+    U64 live_samples; /*sampled blocks not freed yet*/
+    U64 live_bytes; /*estimate of the live bytes allocated here*/
+}MemSite;
+
+#define MEM_STR(x) #x
+
+#define MEM_XSTR(x) MEM_STR(x)
+
+/*the call site is a string literal, its address identifies it*/
+#define iotbroker_malloc(size, tag) iotbroker_malloc_at((size), (tag), __FILE__ ":" MEM_XSTR(__LINE__))
+
+VOID* iotbroker_malloc_at(size_t size, UINT32 tag, CONST INT8 *site);
 
 VOID iotbroker_free(VOID* ptr);
 
+/*live usage of the tag, MEM_TAG_NUM for the sum of every tag*/
+VOID iotbroker_mem_stats(UINT32 tag, MemStats *stats);
+
+/*"session", "subtree", ..., "total" for MEM_TAG_NUM*/
+CONST INT8* iotbroker_mem_tag_name(UINT32 tag);
+
+/*
+ * Record the call site of about one allocation per rate bytes, 0 stops
+ * sampling. A sample stands for max(size, rate) bytes, which makes the
+ * live_bytes of a site an estimate of its real usage.
+ */
+VOID iotbroker_mem_set_profile_rate(UINT32 rate);
+
+/*copy at most max sampled sites, return the number copied*/
+UINT32 iotbroker_mem_sites(MemSite *sites, UINT32 max);
+
 #endif
@@ -1,37 +1,122 @@
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "protocol.h"
 #include "message.h"
 #include "memmanager.h"
 #include "list.h"
+#include "epoch.h"
+#include "debug.h"
+#include "metrics.h"
+#include "timer.h"
+#include "config.h"
+#include "session.h"
 
 STATIC MessageStore *g_message_store_head;
 
-STATIC VOID display_message_store()
+STATIC pthread_mutex_t g_message_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*live messages with an expiry, atomic, the sweep idles at 0*/
+STATIC UINT32 g_message_expiring = 0;
+
+/*the sweep goes over the queues of the session table a slice per run*/
+STATIC TimerNode g_expiry_timer;
+
+STATIC UINT32 g_sweep_fd = 0;
+
+STATIC UINT32 g_sweep_seq = 0;
+
+STATIC UINT32 g_sweep_resume = FALSE; /*the last run stopped inside the queue of g_sweep_fd*/
+
+/*
+ * Reclaim the expired messages of the queues nobody drains, the offline
+ * and the stalled subscribers. At most EXPIRY_SWEEP_ENTRIES entries and
+ * EXPIRY_SWEEP_SLOTS table slots a run, so a large backlog costs several
+ * runs instead of one long stall of the event loop.
+ */
+STATIC VOID sweep_expired(TimerNode *tn)
 {
-    struct list_head *pos;
+    UINT32 size = iotbroker_session_table_size();
+    UINT32 now = iotbroker_time_sec();
+    UINT32 slots = 0, entries = 0;
     
-    printf("\nmessage store table as follow:\n");
-    printf("=====================================\n");
+    if(0 == __atomic_load_n(&g_message_expiring, __ATOMIC_RELAXED))
+    {
+        iotbroker_timer_add(tn, 1000);
+        return;
+    }
     
-    list_for_each(pos, &g_message_store_head->list_mount)
+    while(slots < EXPIRY_SWEEP_SLOTS && entries < EXPIRY_SWEEP_ENTRIES)
     {
-        TopicPacket *tp;
-        MessageStore *ms = container_of(pos, MessageStore, list_mount);
+        Client *c = NULL;
+        MessageQueue *mq;
+        
+        /*one pass over the table a run at most*/
+        if(g_sweep_fd >= size)
+        {
+            g_sweep_fd = 0;
+            g_sweep_resume = FALSE;
+            break;
+        }
         
-        tp = ms->packet;
+        iotbroker_session_get(g_sweep_fd, &c);
+        if(c != NULL)
+        {
+            mq = &c->mq;
+            
+            /*only the entries waiting to be published, the sent ones are acked or not*/
+            if(!g_sweep_resume || g_sweep_seq - mq->send > mq->tail - mq->send)
+            {
+                g_sweep_seq = mq->send;
+            }
+            
+            for( ; g_sweep_seq != mq->tail && entries < EXPIRY_SWEEP_ENTRIES; g_sweep_seq++, entries++)
+            {
+                iotbroker_message_queue_expire(mq, g_sweep_seq, now);
+            }
+            
+            if(g_sweep_seq != mq->tail)
+            {
+                g_sweep_resume = TRUE;
+                break;
+            }
+            
+            iotbroker_message_queue_shrink(mq);
+        }
         
-        printf("%s: %s | %d\n", tp->topic, tp->content, ms->refer_count);
+        g_sweep_fd++;
+        g_sweep_resume = FALSE;
+        slots++;
     }
-    printf("=====================================\n");
+    
+    iotbroker_timer_add(tn, EXPIRY_SWEEP_INTERVAL);
 }
 
 VOID iotbroker_message_store_init()
 {
-    g_message_store_head = (MessageStore*)iotbroker_malloc(sizeof(MessageStore));
+    g_message_store_head = (MessageStore*)iotbroker_malloc(sizeof(MessageStore), MEM_MESSAGE);
     assert(g_message_store_head != NULL);
     
     INIT_LIST_HEAD(&g_message_store_head->list_mount);
+    
+    iotbroker_timer_node_init(&g_expiry_timer, sweep_expired);
+    iotbroker_timer_add(&g_expiry_timer, 1000);
+}
+
+/*bytes accounted to the store for a message*/
+STATIC U64 message_store_bytes(MessageStore *ms)
+{
+    TopicPacket *tp = ms->packet;
+    U64 bytes = sizeof(MessageStore);
+    
+    INVALID_RETURN_VALUE(tp != NULL, bytes);
+    
+    bytes += sizeof(TopicPacket);
+    bytes += (tp->topic != NULL) ? strlen(tp->topic) + 1 : 0;
+    bytes += (tp->content != NULL) ? tp->content_len + 1 : 0;
+    
+    return bytes;
 }
 
 VOID iotbroker_message_store_insert(TopicPacket *tp, MessageStore **ms)
@@ -40,49 +125,314 @@ VOID iotbroker_message_store_insert(TopicPacket *tp, MessageStore **ms)
     
     assert(tp != NULL && ms != NULL);
     
-    tmp_ms = (MessageStore*)iotbroker_malloc(sizeof(MessageStore));
+    tmp_ms = (MessageStore*)iotbroker_malloc(sizeof(MessageStore), MEM_MESSAGE);
     assert(tmp_ms != NULL);
-    tmp_ms->refer_count = 0;
+    tmp_ms->refer_count = 1; /*held by the publisher until the routine end*/
+    tmp_ms->expire = 0;
     tmp_ms->packet = tp;
+    tmp_ms->ingest_time = iotbroker_time_now_us();
+    
+    iotbroker_metrics_add(METRIC_STORE_MESSAGES, 1);
+    iotbroker_metrics_add(METRIC_STORE_BYTES, message_store_bytes(tmp_ms));
     
+    pthread_mutex_lock(&g_message_store_lock);
     list_add(&tmp_ms->list_mount, &g_message_store_head->list_mount);
+    pthread_mutex_unlock(&g_message_store_lock);
     *ms = tmp_ms;
+}
 
-#ifdef DEBUG
-    display_message_store();
-#endif
+VOID iotbroker_message_store_expire(MessageStore *ms, UINT32 seconds)
+{
+    UINT32 now = iotbroker_time_sec();
+    
+    INVALID_RETURN_NOVALUE(seconds != 0);
+    
+    /*0 is never, the first second of the clock expires a second late*/
+    ms->expire = (now + seconds > now) ? MAX(now + seconds, 1) : 0xFFFFFFFF;
+    
+    __atomic_add_fetch(&g_message_expiring, 1, __ATOMIC_RELAXED);
 }
 
-VOID iotbroker_message_store_deref(MessageStore *ms)
+UINT32 iotbroker_message_expiry_default(CONST UINT8 *topic)
+{
+    CONST Config *config = iotbroker_config_get();
+    UINT32 i;
+    
+    /*the first prefix listed wins*/
+    for(i = 0; i < config->message_expiry_num; i++)
+    {
+        CONST INT8 *prefix = config->message_expiry[i].prefix;
+        
+        if(0 == strncmp(topic, prefix, strlen(prefix)))
+        {
+            return config->message_expiry[i].seconds;
+        }
+    }
+    
+    return config->message_expiry_default;
+}
+
+/*free the message after every reader passed a quiescent point*/
+STATIC VOID free_message_store(VOID *ptr)
+{
+    MessageStore *ms = (MessageStore*)ptr;
+    
+    iotbroker_metrics_add(METRIC_STORE_MESSAGES, -1);
+    iotbroker_metrics_add(METRIC_STORE_BYTES, -message_store_bytes(ms));
+    
+    if(ms->expire != 0)
+    {
+        __atomic_sub_fetch(&g_message_expiring, 1, __ATOMIC_RELAXED);
+    }
+    
+    if(ms->packet != NULL)
+    {
+        TopicPacket *tp = ms->packet;
+        
+        if(tp->topic != NULL)
+        {
+            iotbroker_free(tp->topic);
+        }
+        
+        if(tp->content != NULL)
+        {
+            iotbroker_free(tp->content);
+        }
+        
+        iotbroker_free(tp);
+    }
+    
+    iotbroker_free(ms);
+}
+
+VOID iotbroker_message_store_ref(MessageStore *ms)
 {
     assert(ms != NULL);
     
-    ms->refer_count--;
+    __atomic_add_fetch(&ms->refer_count, 1, __ATOMIC_RELAXED);
+}
+
+VOID iotbroker_message_store_deref(MessageStore *ms)
+{
+    assert(ms != NULL);
     
     /*no refrence, delete it*/
-    if(ms->refer_count == 0)
+    if(0 == __atomic_sub_fetch(&ms->refer_count, 1, __ATOMIC_ACQ_REL))
+    {
+        pthread_mutex_lock(&g_message_store_lock);
+        list_del(&ms->list_mount);
+        pthread_mutex_unlock(&g_message_store_lock);
+        
+        iotbroker_epoch_defer(ms, free_message_store);
+    }
+}
+
+/*an outgoing message waiting for PUBACK, PUBREC or PUBCOMP is in flight*/
+STATIC VOID account_removed_entry(MessageQueue *mq, MessageEntry *me)
+{
+    iotbroker_metrics_add(METRIC_MSG_QUEUED, -1);
+    
+    if(PS_WAIT_FOR_PUBACK == me->ps || PS_WAIT_FOR_PUBREC == me->ps || PS_WAIT_FOR_PUBCOMP == me->ps)
+    {
+        iotbroker_metrics_add(METRIC_MSG_INFLIGHT, -1);
+        mq->inflight--;
+    }
+}
+
+VOID iotbroker_message_queue_init(MessageQueue *mq)
+{
+    assert(mq != NULL);
+    
+    memset(mq, 0, sizeof(MessageQueue));
+}
+
+/*reclaim the removed entries at the head*/
+STATIC VOID trim_message_queue(MessageQueue *mq)
+{
+    while(mq->head != mq->tail && NULL == MESSAGE_QUEUE_ENTRY(mq, mq->head)->ms)
+    {
+        mq->head++;
+        mq->dead--;
+    }
+    
+    if((INT32)(mq->send - mq->head) < 0)
+    {
+        mq->send = mq->head;
+    }
+}
+
+/*squeeze out the removed entries, keeping the order*/
+STATIC VOID compact_message_queue(MessageQueue *mq)
+{
+    UINT32 r, w, send;
+    
+    w = mq->head;
+    send = mq->head;
+    
+    for(r = mq->head; r != mq->tail; r++)
     {
-        if(ms->packet != NULL)
+        MessageEntry *me = MESSAGE_QUEUE_ENTRY(mq, r);
+        
+        if(NULL == me->ms)
         {
-            TopicPacket *tp = ms->packet;
-            
-            if(tp->topic != NULL)
-            {
-                iotbroker_free(tp->topic);
-            }
-            
-            if(tp->content != NULL)
+            continue;
+        }
+        
+        if((INT32)(r - mq->send) < 0)
+        {
+            send++;
+        }
+        
+        if(w != r)
+        {
+            *MESSAGE_QUEUE_ENTRY(mq, w) = *me;
+        }
+        w++;
+    }
+    
+    mq->send = send;
+    mq->tail = w;
+    mq->dead = 0;
+    mq->compactions++;
+}
+
+STATIC VOID grow_message_queue(MessageQueue *mq)
+{
+    MessageEntry *entry;
+    UINT32 order, capacity, seq;
+    
+    order = (mq->entry != NULL) ? mq->order + 1 : MESSAGE_QUEUE_MIN_ORDER;
+    capacity = 1U << order;
+    
+    entry = (MessageEntry*)iotbroker_malloc(capacity * sizeof(MessageEntry), MEM_QUEUE);
+    assert(entry != NULL);
+    
+    for(seq = mq->head; seq != mq->tail; seq++)
+    {
+        entry[seq & (capacity - 1)] = *MESSAGE_QUEUE_ENTRY(mq, seq);
+    }
+    
+    if(mq->entry != NULL)
+    {
+        iotbroker_free(mq->entry);
+    }
+    
+    mq->entry = entry;
+    mq->order = order;
+}
+
+MessageEntry* iotbroker_message_queue_push(MessageQueue *mq)
+{
+    MessageEntry *me;
+    
+    assert(mq != NULL);
+    
+    if(mq->tail - mq->head == MESSAGE_QUEUE_CAPACITY(mq))
+    {
+        if(mq->dead > MESSAGE_QUEUE_CAPACITY(mq) / 2)
+        {
+            compact_message_queue(mq);
+        }
+        else
+        {
+            grow_message_queue(mq);
+        }
+    }
+    
+    me = MESSAGE_QUEUE_ENTRY(mq, mq->tail);
+    memset(me, 0, sizeof(MessageEntry));
+    me->stamp = (UINT32)iotbroker_time_now_us();
+    mq->tail++;
+    
+    iotbroker_metrics_add(METRIC_MSG_QUEUED, 1);
+    
+    return me;
+}
+
+MessageEntry* iotbroker_message_queue_find(MessageQueue *mq, UINT16 packet_id, UINT8 ps, UINT32 *out_seq)
+{
+    UINT32 seq;
+    
+    assert(mq != NULL);
+    
+    for(seq = mq->head; seq != mq->tail; seq++)
+    {
+        MessageEntry *me = MESSAGE_QUEUE_ENTRY(mq, seq);
+        
+        if(me->ms != NULL && me->packet_id == packet_id && me->ps == ps)
+        {
+            if(out_seq != NULL)
             {
-                iotbroker_free(tp->content);
+                *out_seq = seq;
             }
-            
-            iotbroker_free(tp);
+            return me;
         }
+    }
+    
+    return NULL;
+}
+
+VOID iotbroker_message_queue_remove(MessageQueue *mq, UINT32 seq)
+{
+    MessageEntry *me;
+    
+    assert(mq != NULL);
+    
+    me = MESSAGE_QUEUE_ENTRY(mq, seq);
+    INVALID_RETURN_NOVALUE(me->ms != NULL);
+    
+    account_removed_entry(mq, me);
+    me->ms = NULL;
+    mq->dead++;
+    
+    trim_message_queue(mq);
+}
+
+UINT32 iotbroker_message_queue_expire(MessageQueue *mq, UINT32 seq, UINT32 now_sec)
+{
+    MessageEntry *me = MESSAGE_QUEUE_ENTRY(mq, seq);
+    
+    INVALID_RETURN_VALUE(me->ms != NULL && MD_OUT == me->dir && PS_WAIT_TO_PUBLISH == me->ps, FALSE);
+    INVALID_RETURN_VALUE(MESSAGE_STORE_EXPIRED(me->ms, now_sec), FALSE);
+    
+    iotbroker_metrics_add(METRIC_MSG_EXPIRED, 1);
+    iotbroker_message_store_deref(me->ms);
+    iotbroker_message_queue_remove(mq, seq);
+    
+    return TRUE;
+}
+
+VOID iotbroker_message_queue_shrink(MessageQueue *mq)
+{
+    assert(mq != NULL);
+    
+    INVALID_RETURN_NOVALUE(mq->head == mq->tail && mq->entry != NULL);
+    
+    iotbroker_free(mq->entry);
+    mq->entry = NULL;
+}
+
+VOID iotbroker_message_queue_clean(MessageQueue *mq)
+{
+    UINT32 seq;
+    
+    assert(mq != NULL);
+    
+    for(seq = mq->head; seq != mq->tail; seq++)
+    {
+        MessageEntry *me = MESSAGE_QUEUE_ENTRY(mq, seq);
         
-        list_del(&ms->list_mount);
-        iotbroker_free(ms);
+        if(me->ms != NULL)
+        {
+            account_removed_entry(mq, me);
+            iotbroker_message_store_deref(me->ms);
+        }
     }
-#ifdef DEBUG
-    display_message_store();
-#endif
+    
+    if(mq->entry != NULL)
+    {
+        iotbroker_free(mq->entry);
+    }
+    
+    iotbroker_message_queue_init(mq);
 }
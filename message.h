@@ -4,12 +4,6 @@
 #include "protocol.h"
 #include "list.h"
 
-enum queue_state
-{
-    QS_WAIT,
-    QS_INFLIGHT,
-};
-
 enum publish_state
 {
     PS_WAIT_TO_PUBLISH,
@@ -28,26 +22,100 @@ enum message_dir
 typedef struct
 {
     TopicPacket *packet; /*packet reference*/
-    UINT32 refer_count; /*reference count*/
+    UINT32 refer_count; /*reference count, atomic*/
+    UINT32 expire; /*seconds clock the message expires at, 0 never*/
+    U64 ingest_time; /*cached microsecond clock when the publish was read*/
     struct list_head list_mount; /*mount point in the message list*/
 }MessageStore;
 
+/*queue entry, 16 bytes so that four of them share a cache line*/
 typedef struct
 {
-    enum queue_state qs; /*message state in the queue*/
-    enum publish_state ps; /*message publish state*/
-    UINT8 resend_count; /*resend count*/
-    UINT8 qos; /*qos*/
-    enum message_dir dir;
+    MessageStore *ms; /*point to the message store, NULL when removed*/
     UINT16 packet_id; /*packet id*/
-    struct list_head list_mount; /*mount point in the queue*/
-    MessageStore *ms; /*point to the message store*/
+    UINT8 qos : 2; /*qos*/
+    UINT8 dir : 1; /*enum message_dir*/
+    UINT8 ps : 5; /*message publish state, enum publish_state*/
+    UINT8 resend_count; /*resend count*/
+    UINT32 stamp; /*low 32 bits of the microsecond clock when queued, then when written*/
+}MessageEntry;
+
+/*
+ * Microseconds since the stamp. The stamp wraps every 71 minutes, an entry
+ * is never older than its message, so the age is exact while the message
+ * is younger than that, MESSAGE_ENTRY_AGE_VALID tells.
+ */
+#define MESSAGE_ENTRY_AGE(me, now_us) ((UINT32)((UINT32)(now_us) - (me)->stamp))
+#define MESSAGE_ENTRY_AGE_VALID(me, now_us) ((now_us) - (me)->ms->ingest_time <= 0xFFFFFFFFULL)
+
+/*
+ * Per client delivery ring. head, send and tail are free running sequence
+ * numbers, the entry of a sequence is entry[seq & ((1 << order) - 1)]:
+ * [head, send) was handed to the client or waits for an ack,
+ * [send, tail) waits to be published.
+ */
+typedef struct
+{
+    MessageEntry *entry; /*ring buffer of 1 << order entries, NULL when released*/
+    UINT32 head; /*sequence of the oldest entry*/
+    UINT32 send; /*sequence of the first entry not handled by the drain*/
+    UINT32 tail; /*sequence of the next free entry*/
+    UINT32 dead; /*removed entries in [head, tail)*/
+    UINT32 inflight; /*outgoing entries waiting for PUBACK, PUBREC or PUBCOMP*/
+    UINT8 order; /*log2 of the entry number, kept in a byte so that the queue fits 32 bytes*/
+    UINT16 compactions; /*bumped, and wraps, when a compaction renumbers the entries*/
 }MessageQueue;
 
+#define MESSAGE_QUEUE_MIN_ORDER 3
+
+/*the expiry sweep runs this often while messages may expire, else once a second*/
+#define EXPIRY_SWEEP_INTERVAL 100
+
+/*queue entries, and session table slots, the sweep looks at per run*/
+#define EXPIRY_SWEEP_ENTRIES 1024
+#define EXPIRY_SWEEP_SLOTS 4096
+
+#define MESSAGE_STORE_EXPIRED(ms, now_sec) ((ms)->expire != 0 && (now_sec) >= (ms)->expire)
+
+#define MESSAGE_QUEUE_CAPACITY(mq) ((mq)->entry != NULL ? 1U << (mq)->order : 0)
+
+#define MESSAGE_QUEUE_ENTRY(mq, seq) (&(mq)->entry[(seq) & ((1U << (mq)->order) - 1)])
+
 VOID iotbroker_message_store_init();
 
+VOID iotbroker_message_store_ref(MessageStore *ms);
+
 VOID iotbroker_message_store_deref(MessageStore *ms);
 
 VOID iotbroker_message_store_insert(TopicPacket *tp, MessageStore **ms);
 
+/*the message expires seconds from now, 0 never*/
+VOID iotbroker_message_store_expire(MessageStore *ms, UINT32 seconds);
+
+/*message_expiry of the first prefix topic starts with, else message_expiry_default*/
+UINT32 iotbroker_message_expiry_default(CONST UINT8 *topic);
+
+VOID iotbroker_message_queue_init(MessageQueue *mq);
+
+/*append an entry, the returned pointer is valid until the next append*/
+MessageEntry* iotbroker_message_queue_push(MessageQueue *mq);
+
+/*find the entry of packet id in publish state ps*/
+MessageEntry* iotbroker_message_queue_find(MessageQueue *mq, UINT16 packet_id, UINT8 ps, UINT32 *out_seq);
+
+/*remove the entry, the message store reference is not released*/
+VOID iotbroker_message_queue_remove(MessageQueue *mq, UINT32 seq);
+
+/*
+ * Remove the entry of seq when it waits to be published and its message
+ * expired, return TRUE when removed.
+ */
+UINT32 iotbroker_message_queue_expire(MessageQueue *mq, UINT32 seq, UINT32 now_sec);
+
+/*release the ring buffer of an empty queue, the sequence numbers go on*/
+VOID iotbroker_message_queue_shrink(MessageQueue *mq);
+
+/*release every entry and the ring buffer*/
+VOID iotbroker_message_queue_clean(MessageQueue *mq);
+
 #endif
@@ -0,0 +1,312 @@
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "iotbroker.h"
+#include "memmanager.h"
+#include "metrics.h"
+#include "message.h"
+#include "subtree.h"
+#include "packet_handle.h"
+#include "timer.h"
+#include "config.h"
+#include "debug.h"
+#include "recorder.h"
+
+/*topic of each metric under METRICS_TOPIC_PREFIX*/
+STATIC CONST INT8 *g_metrics_name[METRIC_NUM] = {
+    "messages/received/qos0",
+    "messages/received/qos1",
+    "messages/received/qos2",
+    "messages/sent/qos0",
+    "messages/sent/qos1",
+    "messages/sent/qos2",
+    "messages/dropped",
+    "messages/conflated",
+    "messages/rate_limited",
+    "messages/shed",
+    "messages/duplicate",
+    "messages/expired",
+    "acl/denied",
+    "auth/hashed",
+    "auth/cached",
+    "auth/failed",
+    "clients/refused",
+    "bytes/received",
+    "bytes/sent",
+    "clients/total",
+    "clients/connected",
+    "subscriptions/count",
+    "messages/queued",
+    "messages/inflight",
+    "store/messages/count",
+    "store/messages/bytes",
+    "load/shedding",
+    "load/loop_busy_us",
+    "auth/pending",
+};
+
+/*topic of each histogram, values in microseconds*/
+STATIC CONST INT8 *g_histogram_name[HIST_NUM] = {
+    "latency/delivery/qos0",
+    "latency/delivery/qos1",
+    "latency/delivery/qos2",
+    "latency/queue/qos0",
+    "latency/queue/qos1",
+    "latency/queue/qos2",
+    "latency/ack/qos1",
+    "latency/ack/qos2",
+};
+
+/*percentiles published for every histogram*/
+STATIC CONST struct
+{
+    CONST INT8 *name;
+    DOUBLE percentile;
+}g_histogram_percentiles[] = {
+    {"p50", 50.0},
+    {"p90", 90.0},
+    {"p99", 99.0},
+    {"p999", 99.9},
+};
+
+/*shared by the threads never registered, e.g. before main registers*/
+STATIC MetricsThread g_metrics_unregistered;
+
+STATIC MetricsThread *g_metrics_threads = &g_metrics_unregistered;
+
+STATIC pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread MetricsThread *t_metrics_thread = &g_metrics_unregistered;
+
+/*checks the interval every second, so that a reload takes effect*/
+STATIC TimerNode g_metrics_timer;
+
+STATIC UINT32 g_metrics_last_publish = 0;
+
+VOID iotbroker_metrics_register()
+{
+    MetricsThread *mt;
+
+    INVALID_RETURN_NOVALUE(t_metrics_thread == &g_metrics_unregistered);
+
+    mt = (MetricsThread*)iotbroker_malloc(sizeof(MetricsThread), MEM_ADMIN);
+    assert(mt != NULL);
+    memset(mt, 0, sizeof(MetricsThread));
+
+    pthread_mutex_lock(&g_metrics_lock);
+    mt->next = g_metrics_threads;
+    g_metrics_threads = mt;
+    pthread_mutex_unlock(&g_metrics_lock);
+
+    t_metrics_thread = mt;
+}
+
+VOID iotbroker_metrics_read(U64 value[METRIC_NUM])
+{
+    MetricsThread *mt;
+    UINT32 i;
+
+    memset(value, 0, METRIC_NUM * sizeof(U64));
+
+    pthread_mutex_lock(&g_metrics_lock);
+    for(mt = g_metrics_threads; mt != NULL; mt = mt->next)
+    {
+        for(i = 0; i < METRIC_NUM; i++)
+        {
+            value[i] += __atomic_load_n(&mt->value[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+CONST INT8* iotbroker_metrics_name(UINT32 id)
+{
+    INVALID_RETURN_VALUE(id < METRIC_NUM, NULL);
+
+    return g_metrics_name[id];
+}
+
+VOID iotbroker_metrics_read_histogram(UINT32 id, Histogram *h)
+{
+    MetricsThread *mt;
+    UINT32 i;
+
+    assert(id < HIST_NUM && h != NULL);
+
+    memset(h, 0, sizeof(Histogram));
+
+    pthread_mutex_lock(&g_metrics_lock);
+    for(mt = g_metrics_threads; mt != NULL; mt = mt->next)
+    {
+        Histogram *src = &mt->hist[id];
+        U64 max;
+
+        for(i = 0; i < HIST_BUCKET_NUM; i++)
+        {
+            h->count[i] += __atomic_load_n(&src->count[i], __ATOMIC_RELAXED);
+        }
+        h->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+        h->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+
+        max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+        if(max > h->max)
+        {
+            h->max = max;
+        }
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+/*largest value of the bucket*/
+STATIC U64 bucket_upper_bound(UINT32 bucket)
+{
+    UINT32 shift;
+
+    INVALID_RETURN_VALUE(bucket >= HIST_SUB_COUNT, bucket);
+
+    shift = bucket / HIST_SUB_COUNT - 1;
+
+    return ((U64)(bucket % HIST_SUB_COUNT + HIST_SUB_COUNT + 1) << shift) - 1;
+}
+
+U64 iotbroker_histogram_percentile(CONST Histogram *h, DOUBLE percentile)
+{
+    U64 rank, seen = 0;
+    UINT32 i;
+
+    assert(h != NULL);
+
+    INVALID_RETURN_VALUE(h->total != 0, 0);
+
+    rank = (U64)(h->total * percentile / 100.0 + 0.5);
+    if(0 == rank)
+    {
+        rank = 1;
+    }
+
+    for(i = 0; i < HIST_BUCKET_NUM; i++)
+    {
+        seen += h->count[i];
+        if(seen >= rank)
+        {
+            /*never above what was really recorded*/
+            return MIN(bucket_upper_bound(i), h->max);
+        }
+    }
+
+    return h->max;
+}
+
+CONST INT8* iotbroker_histogram_name(UINT32 id)
+{
+    INVALID_RETURN_VALUE(id < HIST_NUM, NULL);
+
+    return g_histogram_name[id];
+}
+
+/*publish one value through the subtree like any client message*/
+STATIC VOID publish_metric(CONST INT8 *name, U64 value)
+{
+    TopicPacket *tp;
+    MessageStore *ms;
+    INT8 content[24];
+    UINT32 len;
+
+    tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket), MEM_MESSAGE);
+    assert(tp != NULL);
+    memset(tp, 0, sizeof(TopicPacket));
+
+    len = strlen(METRICS_TOPIC_PREFIX) + strlen(name) + 1;
+    tp->topic = (UINT8*)iotbroker_malloc(len, MEM_MESSAGE);
+    assert(tp->topic != NULL);
+    tp->topic_len = snprintf(tp->topic, len, "%s%s", METRICS_TOPIC_PREFIX, name);
+
+    len = snprintf(content, sizeof(content), "%lld", value) + 1;
+    tp->content = (UINT8*)iotbroker_malloc(len, MEM_MESSAGE);
+    assert(tp->content != NULL);
+    memcpy(tp->content, content, len);
+    tp->content_len = len - 1;
+
+    tp->qos = QOS0;
+    tp->retain = TRUE;
+
+    iotbroker_message_store_insert(tp, &ms);
+    iotbroker_subtree_pub(ms);
+    iotbroker_message_store_deref(ms);
+}
+
+/*merged histogram, 4.7 KB is kept off the stack*/
+STATIC Histogram g_metrics_hist;
+
+STATIC VOID publish_metrics()
+{
+    U64 value[METRIC_NUM];
+    UINT32 i;
+
+    iotbroker_metrics_read(value);
+
+    publish_metric("uptime", iotbroker_time_sec());
+    for(i = 0; i < METRIC_NUM; i++)
+    {
+        publish_metric(g_metrics_name[i], value[i]);
+    }
+
+    for(i = 0; i <= MEM_TAG_NUM; i++)
+    {
+        MemStats stats;
+        INT8 name[64];
+
+        iotbroker_mem_stats(i, &stats);
+
+        snprintf(name, sizeof(name), "memory/%s/bytes", iotbroker_mem_tag_name(i));
+        publish_metric(name, stats.bytes);
+
+        snprintf(name, sizeof(name), "memory/%s/blocks", iotbroker_mem_tag_name(i));
+        publish_metric(name, stats.blocks);
+
+        snprintf(name, sizeof(name), "memory/%s/peak", iotbroker_mem_tag_name(i));
+        publish_metric(name, stats.peak);
+    }
+
+    for(i = 0; i < HIST_NUM; i++)
+    {
+        INT8 name[64];
+        UINT32 j;
+
+        iotbroker_metrics_read_histogram(i, &g_metrics_hist);
+
+        snprintf(name, sizeof(name), "%s/count", g_histogram_name[i]);
+        publish_metric(name, g_metrics_hist.total);
+
+        snprintf(name, sizeof(name), "%s/max", g_histogram_name[i]);
+        publish_metric(name, g_metrics_hist.max);
+
+        for(j = 0; j < sizeof(g_histogram_percentiles) / sizeof(g_histogram_percentiles[0]); j++)
+        {
+            snprintf(name, sizeof(name), "%s/%s", g_histogram_name[i], g_histogram_percentiles[j].name);
+            publish_metric(name, iotbroker_histogram_percentile(&g_metrics_hist, g_histogram_percentiles[j].percentile));
+        }
+    }
+}
+
+STATIC VOID metrics_timer_expired(TimerNode *tn)
+{
+    UINT32 interval = iotbroker_config_get()->metrics_interval;
+    UINT32 now = iotbroker_time_sec();
+
+    if(interval != 0 && now - g_metrics_last_publish >= interval)
+    {
+        g_metrics_last_publish = now;
+        iotbroker_record(REC_TIMER, -1, REC_TIMER_METRICS, now);
+        publish_metrics();
+    }
+
+    iotbroker_timer_add(tn, 1000);
+}
+
+VOID iotbroker_metrics_init()
+{
+    iotbroker_timer_node_init(&g_metrics_timer, metrics_timer_expired);
+    iotbroker_timer_add(&g_metrics_timer, 1000);
+}
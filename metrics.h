@@ -0,0 +1,167 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "iotbroker.h"
+
+/*prefix of the broker metric topics*/
+#define METRICS_TOPIC_PREFIX "$SYS/broker/"
+
+enum metric_id
+{
+    /*counters*/
+    METRIC_MSG_IN_QOS0,
+    METRIC_MSG_IN_QOS1,
+    METRIC_MSG_IN_QOS2,
+    METRIC_MSG_OUT_QOS0,
+    METRIC_MSG_OUT_QOS1,
+    METRIC_MSG_OUT_QOS2,
+    METRIC_MSG_DROPPED,
+    METRIC_MSG_CONFLATED,
+    METRIC_MSG_RATE_LIMITED,
+    METRIC_MSG_SHED,
+    METRIC_MSG_DUPLICATE,
+    METRIC_MSG_EXPIRED,
+    METRIC_ACL_DENIED,
+    METRIC_AUTH_HASHED,
+    METRIC_AUTH_CACHED,
+    METRIC_AUTH_FAILED,
+    METRIC_CONNECT_REFUSED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_CLIENTS_TOTAL,
+
+    /*gauges, a thread may hold a negative share*/
+    METRIC_GAUGE_FIRST,
+    METRIC_CLIENTS_CONNECTED = METRIC_GAUGE_FIRST,
+    METRIC_SUBSCRIPTIONS,
+    METRIC_MSG_QUEUED,
+    METRIC_MSG_INFLIGHT,
+    METRIC_STORE_MESSAGES,
+    METRIC_STORE_BYTES,
+    METRIC_SHEDDING,
+    METRIC_LOOP_LAG,
+    METRIC_AUTH_PENDING,
+
+    METRIC_NUM,
+};
+
+enum histogram_id
+{
+    HIST_DELIVERY_QOS0, /*ingest to write, per qos of the delivery*/
+    HIST_DELIVERY_QOS1,
+    HIST_DELIVERY_QOS2,
+    HIST_QUEUE_QOS0, /*time spent in the client queue*/
+    HIST_QUEUE_QOS1,
+    HIST_QUEUE_QOS2,
+    HIST_ACK_QOS1, /*PUBLISH written to PUBACK*/
+    HIST_ACK_QOS2, /*PUBLISH written to PUBCOMP*/
+    HIST_NUM,
+};
+
+/*
+ * Log-linear buckets as in HdrHistogram: values below 2^HIST_SUB_BITS have
+ * their own bucket, every power of two above is split into 2^HIST_SUB_BITS
+ * buckets, so a bucket is at most 1/16 of its value wide. Microseconds up
+ * to 2^HIST_MAX_BITS, about 12 days, larger values land in the last bucket.
+ */
+#define HIST_SUB_BITS 4
+
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+
+#define HIST_MAX_BITS 40
+
+#define HIST_BUCKET_NUM (HIST_SUB_COUNT * (HIST_MAX_BITS - HIST_SUB_BITS + 1))
+
+typedef struct
+{
+    U64 count[HIST_BUCKET_NUM];
+    U64 total; /*recorded values*/
+    U64 sum; /*sum of the recorded values*/
+    U64 max; /*largest recorded value*/
+}Histogram;
+
+/*
+ * Every thread updates its own block without atomics read-modify-write,
+ * readers sum the blocks when metrics are published.
+ */
+typedef struct metrics_thread
+{
+    U64 value[METRIC_NUM];
+    Histogram hist[HIST_NUM];
+    struct metrics_thread *next;
+}MetricsThread;
+
+extern __thread MetricsThread *t_metrics_thread;
+
+/*single writer, a relaxed store keeps the readers from tearing*/
+static inline VOID iotbroker_metrics_add(UINT32 id, U64 n)
+{
+    U64 *value = &t_metrics_thread->value[id];
+
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static inline UINT32 iotbroker_histogram_bucket(U64 value)
+{
+    UINT32 msb;
+
+    if(value < HIST_SUB_COUNT)
+    {
+        return value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    if(msb >= HIST_MAX_BITS)
+    {
+        return HIST_BUCKET_NUM - 1;
+    }
+
+    /*the top HIST_SUB_BITS + 1 bits select the bucket*/
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + ((value >> (msb - HIST_SUB_BITS)) - HIST_SUB_COUNT);
+}
+
+/*record a value in microseconds, single writer like the counters*/
+static inline VOID iotbroker_metrics_record(UINT32 id, U64 value)
+{
+    Histogram *h = &t_metrics_thread->hist[id];
+    U64 *count = &h->count[iotbroker_histogram_bucket(value)];
+
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if(value > h->max)
+    {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/*a value too large to be measured, counted in the last bucket but not in sum and max*/
+static inline VOID iotbroker_metrics_overflow(UINT32 id)
+{
+    Histogram *h = &t_metrics_thread->hist[id];
+    U64 *count = &h->count[HIST_BUCKET_NUM - 1];
+
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+}
+
+/*start publishing on the $SYS topics, after the timer and the subtree*/
+VOID iotbroker_metrics_init();
+
+/*give the calling thread its own counters*/
+VOID iotbroker_metrics_register();
+
+/*sum of every thread*/
+VOID iotbroker_metrics_read(U64 value[METRIC_NUM]);
+
+CONST INT8* iotbroker_metrics_name(UINT32 id);
+
+/*merge of every thread*/
+VOID iotbroker_metrics_read_histogram(UINT32 id, Histogram *h);
+
+/*upper bound of the bucket holding the percentile, 0 when empty*/
+U64 iotbroker_histogram_percentile(CONST Histogram *h, DOUBLE percentile);
+
+CONST INT8* iotbroker_histogram_name(UINT32 id);
+
+#endif
@@ -0,0 +1,188 @@
+#include <string.h>
+#include <assert.h>
+
+#include "iotbroker.h"
+#include "mqtt5.h"
+#include "config.h"
+#include "memmanager.h"
+#include "debug.h"
+
+/*encoding of every property, indexed by identifier*/
+STATIC CONST UINT8 g_property_type[PROP_SHARED_SUB_AVAILABLE + 1] = {
+    [PROP_PAYLOAD_FORMAT] = PROP_TYPE_BYTE,
+    [PROP_MESSAGE_EXPIRY] = PROP_TYPE_INT32,
+    [PROP_CONTENT_TYPE] = PROP_TYPE_STRING,
+    [PROP_RESPONSE_TOPIC] = PROP_TYPE_STRING,
+    [PROP_CORRELATION_DATA] = PROP_TYPE_STRING,
+    [PROP_SUBSCRIPTION_ID] = PROP_TYPE_VARINT,
+    [PROP_SESSION_EXPIRY] = PROP_TYPE_INT32,
+    [PROP_ASSIGNED_CLIENT_ID] = PROP_TYPE_STRING,
+    [PROP_SERVER_KEEPALIVE] = PROP_TYPE_INT16,
+    [PROP_AUTH_METHOD] = PROP_TYPE_STRING,
+    [PROP_AUTH_DATA] = PROP_TYPE_STRING,
+    [PROP_REQUEST_PROBLEM_INFO] = PROP_TYPE_BYTE,
+    [PROP_WILL_DELAY] = PROP_TYPE_INT32,
+    [PROP_REQUEST_RESPONSE_INFO] = PROP_TYPE_BYTE,
+    [PROP_RESPONSE_INFO] = PROP_TYPE_STRING,
+    [PROP_SERVER_REFERENCE] = PROP_TYPE_STRING,
+    [PROP_REASON_STRING] = PROP_TYPE_STRING,
+    [PROP_RECEIVE_MAX] = PROP_TYPE_INT16,
+    [PROP_TOPIC_ALIAS_MAX] = PROP_TYPE_INT16,
+    [PROP_TOPIC_ALIAS] = PROP_TYPE_INT16,
+    [PROP_MAX_QOS] = PROP_TYPE_BYTE,
+    [PROP_RETAIN_AVAILABLE] = PROP_TYPE_BYTE,
+    [PROP_USER_PROPERTY] = PROP_TYPE_PAIR,
+    [PROP_MAX_PACKET_SIZE] = PROP_TYPE_INT32,
+    [PROP_WILDCARD_SUB_AVAILABLE] = PROP_TYPE_BYTE,
+    [PROP_SUB_ID_AVAILABLE] = PROP_TYPE_BYTE,
+    [PROP_SHARED_SUB_AVAILABLE] = PROP_TYPE_BYTE,
+};
+
+/*FNV-1a*/
+STATIC UINT32 topic_hash(CONST UINT8 *topic)
+{
+    UINT32 hash = 2166136261U;
+
+    while(*topic != '\0')
+    {
+        hash = (hash ^ *topic++) * 16777619U;
+    }
+
+    return hash;
+}
+
+/*a copy accounted to the session*/
+STATIC UINT8* copy_topic(CONST UINT8 *topic)
+{
+    UINT32 len = strlen(topic);
+    UINT8 *copy;
+
+    copy = (UINT8*)iotbroker_malloc(len + 1, MEM_SESSION);
+    assert(copy != NULL);
+    memcpy(copy, topic, len + 1);
+
+    return copy;
+}
+
+UINT32 iotbroker_mqtt5_property_type(UINT8 id)
+{
+    INVALID_RETURN_VALUE(id < sizeof(g_property_type), PROP_TYPE_INVALID);
+
+    return g_property_type[id];
+}
+
+SessionV5* iotbroker_mqtt5_new(CONST Mqtt5Properties *props)
+{
+    UINT32 alias_max = iotbroker_config_get()->topic_alias_max;
+    SessionV5 *v5;
+
+    v5 = (SessionV5*)iotbroker_malloc(sizeof(SessionV5), MEM_SESSION);
+    assert(v5 != NULL);
+    memset(v5, 0, sizeof(SessionV5));
+
+    v5->receive_max = (props->receive_max != 0) ? props->receive_max : MQTT5_RECEIVE_MAX;
+    v5->alias_in_max = alias_max;
+    v5->alias_out_max = MIN(props->topic_alias_max, alias_max);
+
+    return v5;
+}
+
+VOID iotbroker_mqtt5_free(SessionV5 *v5)
+{
+    UINT32 i;
+
+    INVALID_RETURN_NOVALUE(v5 != NULL);
+
+    if(v5->alias_in != NULL)
+    {
+        for(i = 0; i < v5->alias_in_max; i++)
+        {
+            if(v5->alias_in[i] != NULL)
+            {
+                iotbroker_free(v5->alias_in[i]);
+            }
+        }
+        iotbroker_free(v5->alias_in);
+    }
+
+    if(v5->alias_out != NULL)
+    {
+        for(i = 0; i < v5->alias_out_max; i++)
+        {
+            if(v5->alias_out[i].topic != NULL)
+            {
+                iotbroker_free(v5->alias_out[i].topic);
+            }
+        }
+        iotbroker_free(v5->alias_out);
+    }
+
+    iotbroker_free(v5);
+}
+
+UINT32 iotbroker_mqtt5_alias_in_set(SessionV5 *v5, UINT16 alias, CONST UINT8 *topic)
+{
+    INVALID_RETURN_VALUE(alias != 0 && alias <= v5->alias_in_max, FAILED);
+
+    if(NULL == v5->alias_in)
+    {
+        v5->alias_in = (UINT8**)iotbroker_malloc(v5->alias_in_max * sizeof(UINT8*), MEM_SESSION);
+        assert(v5->alias_in != NULL);
+        memset(v5->alias_in, 0, v5->alias_in_max * sizeof(UINT8*));
+    }
+
+    if(v5->alias_in[alias - 1] != NULL)
+    {
+        iotbroker_free(v5->alias_in[alias - 1]);
+    }
+    v5->alias_in[alias - 1] = copy_topic(topic);
+
+    return SUCESS;
+}
+
+CONST UINT8* iotbroker_mqtt5_alias_in_get(SessionV5 *v5, UINT16 alias)
+{
+    INVALID_RETURN_VALUE(alias != 0 && alias <= v5->alias_in_max && v5->alias_in != NULL, NULL);
+
+    return v5->alias_in[alias - 1];
+}
+
+/*
+ * Direct mapped: a topic can only take the alias its hash points to and
+ * takes it over from the one there before, so a lookup is one compare.
+ * A collision costs the full topic once more, not a wrong binding.
+ */
+UINT16 iotbroker_mqtt5_alias_out(SessionV5 *v5, CONST UINT8 *topic, UINT32 *known)
+{
+    TopicAliasOut *slot;
+    UINT32 hash;
+
+    *known = FALSE;
+    INVALID_RETURN_VALUE(v5->alias_out_max != 0, 0);
+
+    if(NULL == v5->alias_out)
+    {
+        v5->alias_out = (TopicAliasOut*)iotbroker_malloc(v5->alias_out_max * sizeof(TopicAliasOut), MEM_SESSION);
+        assert(v5->alias_out != NULL);
+        memset(v5->alias_out, 0, v5->alias_out_max * sizeof(TopicAliasOut));
+    }
+
+    hash = topic_hash(topic);
+    slot = &v5->alias_out[hash % v5->alias_out_max];
+
+    if(slot->topic != NULL && slot->hash == hash && 0 == strcmp(slot->topic, topic))
+    {
+        *known = TRUE;
+    }
+    else
+    {
+        if(slot->topic != NULL)
+        {
+            iotbroker_free(slot->topic);
+        }
+        slot->hash = hash;
+        slot->topic = copy_topic(topic);
+    }
+
+    return (slot - v5->alias_out) + 1;
+}
@@ -0,0 +1,118 @@
+#ifndef _MQTT5_H_
+#define _MQTT5_H_
+
+#include "iotbroker.h"
+
+/*protocol level of MQTT 5.0*/
+#define MQTT5_LEVEL 5
+
+/*default of topic_alias_max*/
+#define TOPIC_ALIAS_MAX 32
+
+/*receive maximum of a client sending none*/
+#define MQTT5_RECEIVE_MAX 65535
+
+/*==============property identifiers start===============*/
+#define PROP_PAYLOAD_FORMAT 0x01
+#define PROP_MESSAGE_EXPIRY 0x02
+#define PROP_CONTENT_TYPE 0x03
+#define PROP_RESPONSE_TOPIC 0x08
+#define PROP_CORRELATION_DATA 0x09
+#define PROP_SUBSCRIPTION_ID 0x0B
+#define PROP_SESSION_EXPIRY 0x11
+#define PROP_ASSIGNED_CLIENT_ID 0x12
+#define PROP_SERVER_KEEPALIVE 0x13
+#define PROP_AUTH_METHOD 0x15
+#define PROP_AUTH_DATA 0x16
+#define PROP_REQUEST_PROBLEM_INFO 0x17
+#define PROP_WILL_DELAY 0x18
+#define PROP_REQUEST_RESPONSE_INFO 0x19
+#define PROP_RESPONSE_INFO 0x1A
+#define PROP_SERVER_REFERENCE 0x1C
+#define PROP_REASON_STRING 0x1F
+#define PROP_RECEIVE_MAX 0x21
+#define PROP_TOPIC_ALIAS_MAX 0x22
+#define PROP_TOPIC_ALIAS 0x23
+#define PROP_MAX_QOS 0x24
+#define PROP_RETAIN_AVAILABLE 0x25
+#define PROP_USER_PROPERTY 0x26
+#define PROP_MAX_PACKET_SIZE 0x27
+#define PROP_WILDCARD_SUB_AVAILABLE 0x28
+#define PROP_SUB_ID_AVAILABLE 0x29
+#define PROP_SHARED_SUB_AVAILABLE 0x2A
+/*==============property identifiers end===============*/
+
+/*==============reason codes start===============*/
+#define REASON_SUCCESS 0x00
+#define REASON_UNSPECIFIED 0x80
+#define REASON_MALFORMED_PACKET 0x81
+#define REASON_PROTOCOL_ERROR 0x82
+#define REASON_UNSUPPORTED_PROTOCOL_VERSION 0x84
+#define REASON_CLIENT_ID_NOT_VALID 0x85
+#define REASON_BAD_USERNAME_PASSWORD 0x86
+#define REASON_NOT_AUTHORIZED 0x87
+#define REASON_SERVER_UNAVAILABLE 0x88
+#define REASON_TOPIC_ALIAS_INVALID 0x94
+/*==============reason codes end===============*/
+
+/*encoding of a property value*/
+enum property_type
+{
+    PROP_TYPE_INVALID,
+    PROP_TYPE_BYTE,
+    PROP_TYPE_INT16,
+    PROP_TYPE_INT32,
+    PROP_TYPE_VARINT,
+    PROP_TYPE_STRING, /*utf-8 string or binary data, 2 byte length*/
+    PROP_TYPE_PAIR, /*two strings*/
+};
+
+/*the properties the broker acts on, 0 when absent, the others are skipped*/
+typedef struct
+{
+    UINT32 receive_max;
+    UINT32 topic_alias_max;
+    UINT32 topic_alias;
+    UINT32 message_expiry; /*seconds, 0 never as when absent*/
+}Mqtt5Properties;
+
+/*alias the broker gave a topic toward the client*/
+typedef struct
+{
+    UINT32 hash;
+    UINT8 *topic; /*NULL while unused*/
+}TopicAliasOut;
+
+/*
+ * State of an MQTT 5.0 session, set up by CONNECT, NULL for MQTT 3.1.1.
+ * The alias tables are allocated by the first alias in their direction.
+ */
+typedef struct
+{
+    UINT16 receive_max; /*Receive Maximum of CONNECT*/
+    UINT16 alias_in_max; /*Topic Alias Maximum of CONNACK*/
+    UINT16 alias_out_max; /*Topic Alias Maximum of CONNECT, bounded by topic_alias_max*/
+    UINT8 **alias_in; /*topic of inbound alias i + 1*/
+    TopicAliasOut *alias_out; /*direct mapped by topic hash, alias i + 1*/
+}SessionV5;
+
+/*how the value of property id is encoded*/
+UINT32 iotbroker_mqtt5_property_type(UINT8 id);
+
+SessionV5* iotbroker_mqtt5_new(CONST Mqtt5Properties *props);
+
+VOID iotbroker_mqtt5_free(SessionV5 *v5);
+
+/*the client bound alias to topic, FAILED when alias is out of range*/
+UINT32 iotbroker_mqtt5_alias_in_set(SessionV5 *v5, UINT16 alias, CONST UINT8 *topic);
+
+/*topic of an inbound alias, NULL when the client never bound it*/
+CONST UINT8* iotbroker_mqtt5_alias_in_get(SessionV5 *v5, UINT16 alias);
+
+/*
+ * Alias of topic toward the client, 0 when it takes none. *known is TRUE
+ * when the client has the binding already and the topic can be left out.
+ */
+UINT16 iotbroker_mqtt5_alias_out(SessionV5 *v5, CONST UINT8 *topic, UINT32 *known);
+
+#endif
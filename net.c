@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /*accept4*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,8 +10,12 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 
 #include "net.h"
 #include "iotbroker.h"
@@ -17,6 +23,11 @@
 #include "debug.h"
 #include "memmanager.h"
 #include "session.h"
+#include "config.h"
+#include "timer.h"
+#include "http.h"
+#include "recorder.h"
+#include "auth.h"
 
 /*accept the connect*/
 STATIC VOID handle_accept(INT32 epollfd, INT32 listenfd);
@@ -24,11 +35,11 @@ STATIC VOID handle_accept(INT32 epollfd, INT32 listenfd);
 /*handle read event*/
 STATIC VOID handle_read(INT32 epollfd, INT32 fd);
 
-/*handle write event*/
-STATIC VOID handle_write(INT32 epollfd, INT32 fd);
+/*handle write event, flush writes the deliveries a throughput client holds*/
+STATIC VOID handle_write(INT32 epollfd, INT32 fd, UINT32 flush);
 
 /*handle disconnect event*/
-STATIC VOID handle_disconnect(INT32 epollfd, INT32 fd);
+STATIC VOID handle_disconnect(INT32 epollfd, INT32 fd, UINT32 reason, UINT32 error);
 
 /*add epoll event*/
 STATIC VOID add_event(INT32 epollfd,INT32 fd,INT32 state);
@@ -39,89 +50,354 @@ STATIC VOID modify_event(INT32 epollfd,INT32 fd,INT32 state);
 /*delete epoll event*/
 STATIC VOID delete_event(INT32 epollfd,INT32 fd,INT32 state);
 
+/*register EPOLLOUT only while the client has unsent bytes*/
+STATIC VOID update_event(INT32 epollfd, INT32 fd);
+
+/*raise the fd limit to the hard limit*/
+STATIC VOID raise_fd_limit()
+{
+    struct rlimit rl;
+    
+    if(getrlimit(RLIMIT_NOFILE, &rl) != SUCESS)
+    {
+        perror("getrlimit error:");
+        return;
+    }
+    
+    rl.rlim_cur = rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl) != SUCESS)
+    {
+        perror("setrlimit error:");
+    }
+}
+
+
+/*listen sockets, one per configured listener*/
+STATIC INT32 g_listen_fds[CONFIG_MAX_LISTENERS];
+
+STATIC UINT32 g_listen_num = 0;
+
+STATIC INT32 g_epollfd = -1;
+
+/*microsecond clock the batching window closes, 0 when no delivery is held*/
+STATIC U64 g_batch_deadline = 0;
+
+/*retries the clients the rate limits paused, armed while there are some*/
+STATIC TimerNode g_resume_timer;
+
+STATIC UINT32 is_listener(INT32 fd)
+{
+    UINT32 i;
+
+    for(i = 0; i < g_listen_num; i++)
+    {
+        if(g_listen_fds[i] == fd)
+        {
+            return TRUE;
+        }
+    }
 
-VOID iotbroker_net_init(INT32 *out_listenfd, INT32 *out_epollfd)
+    return FALSE;
+}
+
+STATIC INT32 open_listener(CONST ListenerConfig *lc, UINT32 backlog)
 {
-    INT32 listenfd, epollfd;
+    INT32 listenfd;
+    INT32 reuse = 1;
     struct sockaddr_in servaddr;
 
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    /*non blocking, handle_accept drains it until EAGAIN*/
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if(-1 == listenfd)
     {
         perror("socket error:");
         exit(FAILED);
     }
 
+    /*restart without waiting for the TIME_WAIT of a million sockets*/
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
-    inet_pton(AF_INET, IPADDRESS, &servaddr.sin_addr);
-    servaddr.sin_port = htons(PORT);
+    inet_pton(AF_INET, lc->address, &servaddr.sin_addr);
+    servaddr.sin_port = htons(lc->port);
 
     if (bind(listenfd,(struct sockaddr*)&servaddr,sizeof(servaddr)) != SUCESS)
     {
-        perror("bind error: ");
+        iotbroker_log(LOG_ERROR, "bind %s:%u error: %s", lc->address, lc->port, strerror(errno));
         exit(FAILED);
     }
 
-    listen(listenfd, LISTENQ);
+    listen(listenfd, backlog);
+    iotbroker_log(LOG_INFO, "listening on %s:%u", lc->address, lc->port);
 
-    epollfd = epoll_create(FDSIZE);
-    add_event(epollfd, listenfd, EPOLLIN);
-    
-    *out_listenfd = listenfd;
-    *out_epollfd = epollfd;
+    return listenfd;
 }
 
-VOID iotbroker_handle_events(INT32 epollfd, struct epoll_event *events, INT32 num, INT32 listenfd)
+/*the buckets refilled meanwhile, the ones still short pause again*/
+STATIC VOID resume_expired(TimerNode *tn)
+{
+    INT32 fd;
+
+    iotbroker_session_ready_round(READY_PAUSED);
+    while(SUCESS == iotbroker_session_ready_pop(READY_PAUSED, &fd))
+    {
+        handle_read(g_epollfd, fd);
+    }
+}
+
+VOID iotbroker_net_init(INT32 *out_epollfd)
+{
+    CONST Config *config = iotbroker_config_get();
+    UINT32 i;
+
+    /*a peer closing early must not kill the broker*/
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    g_epollfd = epoll_create1(0);
+    iotbroker_timer_node_init(&g_resume_timer, resume_expired);
+
+    for(i = 0; i < config->listener_num; i++)
+    {
+        g_listen_fds[i] = open_listener(&config->listener[i], config->listen_backlog);
+        g_listen_num++;
+        add_event(g_epollfd, g_listen_fds[i], EPOLLIN);
+    }
+
+    *out_epollfd = g_epollfd;
+}
+
+VOID iotbroker_net_close(INT32 fd, UINT32 reason)
+{
+    handle_disconnect(g_epollfd, fd, reason, 0);
+}
+
+VOID iotbroker_net_connect_done(INT32 fd, UINT8 con_ret)
+{
+    UINT32 ret;
+
+    ret = iotbroker_connect_done(fd, con_ret);
+    if(ret != SUCESS)
+    {
+        handle_disconnect(g_epollfd, fd, CLOSE_READ_ERROR, ret);
+        return;
+    }
+
+    update_event(g_epollfd, fd);
+}
+
+/*the client is waiting for its CONNECT to be read*/
+STATIC UINT32 is_connecting(INT32 fd)
+{
+    Client *client = NULL;
+
+    iotbroker_session_get(fd, &client);
+
+    return (client != NULL && CS_WAIT_FOR_CONNECT == client->state);
+}
+
+/*the client was stopped by its read budget in an earlier round, or its rate*/
+STATIC UINT32 is_input_ready(Client *client)
+{
+    return (client->ready & (CLIENT_READY(READY_INPUT) | CLIENT_READY(READY_PAUSED))) != 0;
+}
+
+/*
+ * Under a reconnect storm most of the events are new clients. Their
+ * CONNECTs are read first, so the CONNACKs leave in this round's flush,
+ * then the established clients are served, then the ones an earlier
+ * round left input to, each within its budgets. The listeners come last:
+ * the accepted sockets have nothing to read before the next round anyway,
+ * and the listen backlog holds the rest meanwhile.
+ */
+VOID iotbroker_handle_events(INT32 epollfd, struct epoll_event *events, INT32 num)
 {
     INT32 i;
     INT32 fd;
 
+    /*the clients marked from now on are served in the next round*/
+    iotbroker_session_ready_round(READY_INPUT);
+
     for(i = 0; i < num; i++)
     {
         fd = events[i].data.fd;
 
-        if((fd == listenfd) && (events[i].events & EPOLLIN))
+        if(!is_listener(fd) && is_connecting(fd))
         {
-            /*the event from listen sock*/
-            handle_accept(epollfd, listenfd);
+            handle_read(epollfd, fd);
+            events[i].events = 0;
+        }
+    }
+
+    for(i = 0; i < num; i++)
+    {
+        Client *client = NULL;
+        
+        fd = events[i].data.fd;
+
+        if(0 == events[i].events || is_listener(fd))
+        {
+            continue;
+        }
+        
+        /*the auth workers, the side port, or closed earlier in this round*/
+        iotbroker_session_get(fd, &client);
+        if(NULL == client)
+        {
+            if(!iotbroker_auth_handle_event(fd))
+            {
+                iotbroker_http_handle_event(fd, events[i].events);
+            }
+            continue;
+        }
+        
+        if(events[i].events & EPOLLOUT)
+        {
+            /*write event, a client the socket held back has nothing to batch for*/
+            handle_write(epollfd, fd, TRUE);
+        }
+        
+        /*a paused client is not polled for input, but hang ups are reported anyway*/
+        if((events[i].events & (EPOLLERR | EPOLLHUP)) && client->epoll_paused)
+        {
+            handle_disconnect(epollfd, fd, CLOSE_READ_ERROR, ERROR_SOCK_CLIENT_CLOSE);
+            continue;
         }
-        else if(events[i].events & EPOLLIN)
+        
+        /*a client with input left is read once, with the others left*/
+        if((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !is_input_ready(client))
         {   
             /*read event*/
             handle_read(epollfd, fd);
         }
-        else if(events[i].events & EPOLLOUT)
+    }
+
+    while(SUCESS == iotbroker_session_ready_pop(READY_INPUT, &fd))
+    {
+        handle_read(epollfd, fd);
+    }
+
+    for(i = 0; i < num; i++)
+    {
+        fd = events[i].data.fd;
+
+        if(events[i].events != 0 && is_listener(fd))
         {
-            /*write event*/
-            handle_write(epollfd, fd);
+            /*the event from listen sock*/
+            handle_accept(epollfd, fd);
         }
     }
 }
 
-STATIC VOID handle_accept(INT32 epollfd, INT32 listenfd)
+VOID iotbroker_net_flush()
 {
-    INT32 clifd;
-    struct sockaddr_in cliaddr;
-    socklen_t cliaddrlen = sizeof(struct sockaddr);
+    INT32 fd;
+    
+    /*the window closed, the held deliveries leave together*/
+    if(g_batch_deadline != 0 && iotbroker_time_now_us() >= g_batch_deadline)
+    {
+        g_batch_deadline = 0;
+        iotbroker_session_ready_round(READY_BATCH);
+        while(SUCESS == iotbroker_session_ready_pop(READY_BATCH, &fd))
+        {
+            handle_write(g_epollfd, fd, TRUE);
+        }
+    }
+    
+    /*a client its budget stops is served again in the next round*/
+    iotbroker_session_ready_round(READY_OUTPUT);
+    while(SUCESS == iotbroker_session_ready_pop(READY_OUTPUT, &fd))
+    {
+        handle_write(g_epollfd, fd, FALSE);
+    }
     
-    clifd = accept(listenfd, (struct sockaddr*)&cliaddr, &cliaddrlen);
-    if (clifd < 0)
+    /*the first delivery held opens the window*/
+    if(0 == g_batch_deadline && iotbroker_session_ready_num(READY_BATCH) != 0)
     {
-        perror("accpet error:");
+        g_batch_deadline = iotbroker_time_now_us() + iotbroker_config_get()->batch_delay;
     }
-    else
-    {   
+}
+
+INT32 iotbroker_net_timeout(INT32 timeout)
+{
+    U64 now = iotbroker_time_now_us();
+    INT32 wait;
+    
+    INVALID_RETURN_VALUE(g_batch_deadline != 0, timeout);
+    
+    /*epoll_wait counts milliseconds, round up rather than spin*/
+    wait = (g_batch_deadline > now) ? (g_batch_deadline - now + 999) / 1000 : 0;
+    
+    return (timeout < 0 || wait < timeout) ? wait : timeout;
+}
+
+/*
+ * Take up to accept_batch connections, the listen socket is level
+ * triggered and reports the rest in the next round.
+ */
+STATIC VOID handle_accept(INT32 epollfd, INT32 listenfd)
+{
+    CONST Config *config = iotbroker_config_get();
+    UINT32 batch = config->accept_batch;
+    UINT32 mode = LISTENER_LATENCY;
+    UINT32 i;
+
+    for(i = 0; i < g_listen_num; i++)
+    {
+        if(g_listen_fds[i] == listenfd)
+        {
+            mode = config->listener[i].mode;
+        }
+    }
+
+    for(i = 0; i < batch; i++)
+    {
+        INT32 clifd, nodelay = 1;
+        Client *client = NULL;
+        struct sockaddr_in cliaddr;
+        socklen_t cliaddrlen = sizeof(cliaddr);
+
+        clifd = accept4(listenfd, (struct sockaddr*)&cliaddr, &cliaddrlen, SOCK_NONBLOCK);
+        if(clifd < 0)
+        {
+            /*the peer gave up while queued, try the next one*/
+            if(ECONNABORTED == errno || EINTR == errno)
+            {
+                continue;
+            }
+
+            /*out of fds, the rest wait in the backlog until some close*/
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                iotbroker_log(LOG_WARN, "accept error: %s", strerror(errno));
+            }
+            return;
+        }
+
 #ifdef DEBUG    
-        printf("accept a new client: %s:%d\n", inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
+        printf("accept a new client: %s:%d\n", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
 #endif  
-        iotbroker_session_add(clifd, inet_ntoa(cliaddr.sin_addr), cliaddr.sin_port);
-        add_event(epollfd, clifd, EPOLLIN | EPOLLOUT);
+        iotbroker_record(REC_ACCEPT, clifd, 0, ntohs(cliaddr.sin_port));
+        iotbroker_session_add(clifd, inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
+        add_event(epollfd, clifd, EPOLLIN);
+
+        /*latency clients send small packets at once, throughput ones leave Nagle to coalesce acks*/
+        if(LISTENER_LATENCY == mode)
+        {
+            setsockopt(clifd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        else
+        {
+            iotbroker_session_get(clifd, &client);
+            client->batching = TRUE;
+        }
     }
 }
 
-STATIC VOID handle_disconnect(INT32 epollfd, INT32 fd)
+STATIC VOID handle_disconnect(INT32 epollfd, INT32 fd, UINT32 reason, UINT32 error)
 {
+    iotbroker_record(REC_CLOSE, fd, reason, error);
     delete_event(epollfd,fd,EPOLLIN | EPOLLOUT);
     close(fd); 
     iotbroker_session_clean(fd);  
@@ -139,26 +415,31 @@ STATIC VOID handle_read(INT32 epollfd, INT32 fd)
             \tfail: %d\n", __FILE__, __LINE__, ret);
         perror("read error:");
 #endif
-        handle_disconnect(epollfd, fd);
+        handle_disconnect(epollfd, fd, CLOSE_READ_ERROR, ret);
+        return;
     }
-
+    
+    update_event(epollfd, fd);
 }
 
-STATIC VOID handle_write(INT32 epollfd, INT32 fd)
+STATIC VOID handle_write(INT32 epollfd, INT32 fd, UINT32 flush)
 {
     UINT32 ret;
     
-    ret = iotbroker_write_packet(fd);
+    ret = iotbroker_write_packet(fd, flush);
     
     if(ret != SUCESS)
     {
 #ifdef DEBUG
         printf("%s %d\n\
             \tfail: %d\n", __FILE__, __LINE__, ret);
-        perror("read error:");
+        perror("write error:");
 #endif
-        handle_disconnect(epollfd, fd);
+        handle_disconnect(epollfd, fd, CLOSE_WRITE_ERROR, ret);
+        return;
     }
+    
+    update_event(epollfd, fd);
 }
 
 STATIC VOID add_event(INT32 epollfd, INT32 fd, INT32 state)
@@ -205,3 +486,30 @@ STATIC VOID modify_event(INT32 epollfd, INT32 fd, INT32 state)
         perror("epoll_ctl error:");
     }
 }
+
+STATIC VOID update_event(INT32 epollfd, INT32 fd)
+{
+    Client *client = NULL;
+    UINT8 epoll_out, epoll_paused;
+    
+    iotbroker_session_get(fd, &client);
+    INVALID_RETURN_NOVALUE(client != NULL);
+    
+    epoll_out = (client->tx_len != 0);
+    epoll_paused = ((client->ready & CLIENT_READY(READY_PAUSED)) != 0);
+    
+    /*retried every tick, the buckets refill meanwhile*/
+    if(epoll_paused && !iotbroker_timer_pending(&g_resume_timer))
+    {
+        iotbroker_timer_add(&g_resume_timer, TIMER_TICK_MS);
+    }
+    
+    /*resumed by iotbroker_net_connect_done*/
+    epoll_paused |= (CS_AUTHENTICATING == client->state);
+    
+    INVALID_RETURN_NOVALUE(epoll_out != client->epoll_out || epoll_paused != client->epoll_paused);
+    
+    modify_event(epollfd, fd, (epoll_paused ? 0 : EPOLLIN) | (epoll_out ? EPOLLOUT : 0));
+    client->epoll_out = epoll_out;
+    client->epoll_paused = epoll_paused;
+}
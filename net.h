@@ -1,17 +1,43 @@
 #ifndef _NET_H_
 #define _NET_H_
 
+#include <sys/epoll.h>
+
 #include "iotbroker.h"
 
 #define IPADDRESS   "0.0.0.0"
 #define PORT        1883
 #define MAXSIZE     1024
-#define LISTENQ     5
-#define FDSIZE      1000
+#define LISTENQ     4096
 #define EPOLLEVENTS 100
+#define ACCEPT_BATCH 64
+
+/*open the configured listeners*/
+VOID iotbroker_net_init(INT32 *out_epollfd);
+
+/*serve the events of epoll_wait and the clients an earlier round left input to, every round*/
+VOID iotbroker_handle_events(INT32 epollfd, struct epoll_event *events, INT32 num);
+
+/*deliver what the iteration queued, after the events and the timers*/
+VOID iotbroker_net_flush();
+
+/*epoll_wait timeout, shortened to the close of the batching window*/
+INT32 iotbroker_net_timeout(INT32 timeout);
+
+/*why a client connection was dropped, kept by the flight recorder*/
+enum close_reason
+{
+    CLOSE_READ_ERROR, /*read failed, the peer closed or sent a bad packet*/
+    CLOSE_WRITE_ERROR, /*write failed or the send buffer overflowed*/
+    CLOSE_CONNECT_TIMEOUT, /*no CONNECT in time*/
+    CLOSE_KEEPALIVE, /*keep alive expired*/
+    CLOSE_REASON_NUM,
+};
 
-VOID iotbroker_net_init(INT32 *out_listenfd, INT32 *out_epollfd);
+/*drop a client connection, used by timers*/
+VOID iotbroker_net_close(INT32 fd, UINT32 reason);
 
-VOID iotbroker_handle_events(INT32 epollfd, struct epoll_event *events, INT32 num, INT32 listenfd);
+/*the credential check of the CONNECT on fd finished, send the CONNACK and read again*/
+VOID iotbroker_net_connect_done(INT32 fd, UINT8 con_ret);
 
 #endif
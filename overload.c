@@ -0,0 +1,53 @@
+#include "iotbroker.h"
+#include "overload.h"
+#include "config.h"
+#include "memmanager.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "debug.h"
+
+/*busy microseconds of an iteration, averaged over the last eight or so*/
+STATIC U64 g_loop_lag = 0;
+
+STATIC UINT32 g_shedding = FALSE;
+
+VOID iotbroker_overload_update(U64 busy_us)
+{
+    CONST Config *config = iotbroker_config_get();
+    U64 mem_high = (U64)config->shed_memory_mb << 20;
+    U64 lag_high = (U64)config->shed_loop_lag * 1000;
+    U64 lag = g_loop_lag - g_loop_lag / 8 + busy_us / 8;
+    MemStats stats;
+    UINT32 over, under;
+
+    iotbroker_metrics_add(METRIC_LOOP_LAG, lag - g_loop_lag);
+    g_loop_lag = lag;
+
+    iotbroker_mem_stats(MEM_TAG_NUM, &stats);
+
+    over = (mem_high != 0 && stats.bytes >= mem_high) || (lag_high != 0 && lag >= lag_high);
+    under = (0 == mem_high || stats.bytes < mem_high / 100 * SHED_RECOVER_PERCENT)
+        && (0 == lag_high || lag < lag_high / 100 * SHED_RECOVER_PERCENT);
+
+    if(!g_shedding && over)
+    {
+        g_shedding = TRUE;
+        iotbroker_metrics_add(METRIC_SHEDDING, 1);
+        iotbroker_record(REC_OVERLOAD, -1, TRUE, stats.bytes >> 20);
+        iotbroker_log(LOG_WARN, "overloaded, heap %lld MB, loop busy %lld us, shedding load",
+            stats.bytes >> 20, lag);
+    }
+    else if(g_shedding && under)
+    {
+        g_shedding = FALSE;
+        iotbroker_metrics_add(METRIC_SHEDDING, -1);
+        iotbroker_record(REC_OVERLOAD, -1, FALSE, stats.bytes >> 20);
+        iotbroker_log(LOG_INFO, "load back to normal, heap %lld MB, loop busy %lld us",
+            stats.bytes >> 20, lag);
+    }
+}
+
+UINT32 iotbroker_overload_shedding()
+{
+    return g_shedding;
+}
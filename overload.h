@@ -0,0 +1,23 @@
+#ifndef _OVERLOAD_H_
+#define _OVERLOAD_H_
+
+#include "iotbroker.h"
+
+/*percent of a watermark the broker has to fall under to stop shedding*/
+#define SHED_RECOVER_PERCENT 90
+
+/*default of shed_queue_depth*/
+#define SHED_QUEUE_DEPTH 16
+
+/*
+ * Feed the busy time of an event loop iteration, once per iteration. The
+ * broker sheds load while the tracked heap is over shed_memory_mb or the
+ * smoothed busy time over shed_loop_lag, until both are back under
+ * SHED_RECOVER_PERCENT of their watermark.
+ */
+VOID iotbroker_overload_update(U64 busy_us);
+
+/*new CONNECTs get CONNACK server unavailable, QoS0 to lagging subscribers is dropped*/
+UINT32 iotbroker_overload_shedding();
+
+#endif
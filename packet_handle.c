@@ -9,6 +9,13 @@
 #include "session.h"
 #include "message.h"
 #include "subtree.h"
+#include "metrics.h"
+#include "probe.h"
+#include "recorder.h"
+#include "timer.h"
+#include "overload.h"
+#include "acl.h"
+#include "auth.h"
 
 STATIC CONST INT8* PROTOCOL_NAME = "MQTT";
 
@@ -23,14 +30,14 @@ STATIC INT32 handle_pubrel(Client *client, Packet *packet, Packet **out_packet);
 STATIC INT32 handle_pubrec(Client *client, Packet *packet, Packet **out_packet);
 STATIC INT32 handle_pubcomp(Client *client, Packet *packet);
 
-STATIC VOID send_connack(Packet **packet, UINT8 sp, UINT8 con_ret);
+STATIC VOID send_connack(Packet **packet, Client *client, UINT8 level, UINT8 sp, UINT8 con_ret);
 STATIC VOID send_pingresp(Packet **out_packet);
 STATIC VOID send_puback(Packet **packet, UINT16 packet_id);
 STATIC VOID send_pubrec(Packet ** packet, UINT16 packet_id);
 STATIC VOID send_pubrel(Packet ** packet, UINT16 packet_id);
 STATIC VOID send_pubcomp(Packet **packet, UINT16 packet_id);
-STATIC VOID send_suback(Packet **packet, UINT16 packet_id, struct sub_topic_ret *sub_ret_head, UINT16 size);
-STATIC VOID send_unsuback(Packet **packet, UINT16 packet_id);
+STATIC VOID send_suback(Packet **packet, Client *client, UINT16 packet_id, struct sub_topic_ret *sub_ret_head, UINT16 size);
+STATIC VOID send_unsuback(Packet **packet, Client *client, UINT16 packet_id, UINT16 size);
 
 /*read 16 bit data from load data*/
 STATIC UINT16 read_uint16(Packet *packet)
@@ -57,36 +64,173 @@ STATIC UINT8 read_uint8(Packet *packet)
     return data;
 }
 
-/*read string from load data*/
-STATIC VOID read_str(Packet *packet, UINT8 **dst)
+/*read 32 bit data from load data*/
+STATIC UINT32 read_uint32(Packet *packet)
 {
-    UINT16 len;
+    UINT32 data;
+    
+    data = (UINT32)read_uint16(packet) << 16;
+    data |= read_uint16(packet);
+    
+    return data;
+}
+
+/*bytes left in the load, 0 once a length field pointed past it*/
+STATIC UINT32 load_left(Packet *packet)
+{
+    INT32 left = packet->remain_len - (INT32)packet->load_pos;
+    
+    return (left > 0) ? left : 0;
+}
+
+/*read string from load data, accounted to tag*/
+STATIC VOID read_str(Packet *packet, UINT8 **dst, UINT32 tag)
+{
+    UINT32 len;
     UINT8 *str;
     
     len = read_uint16(packet);
-    str = (UINT8*)iotbroker_malloc(len + 1);
+    len = MIN(len, load_left(packet));
+    str = (UINT8*)iotbroker_malloc(len + 1, tag);
     assert(str != NULL);
-    memset(str, 0, len + 1);
-    strncpy(str, packet->load + packet->load_pos, len);
+    memcpy(str, packet->load + packet->load_pos, len);
+    str[len] = '\0';
     packet->load_pos += len;
     
     *dst = str;
 }
 
-/*read the remain byte as a string*/
-STATIC VOID read_remain_str(Packet *packet, UINT8 **dst)
+/*read a variable byte integer ending before end, FAILED when malformed*/
+STATIC UINT32 read_varint(Packet *packet, UINT32 end, UINT32 *value)
 {
-    UINT16 len;
+    UINT32 multiplier = 1, i;
+    UINT8 byte;
+    
+    *value = 0;
+    for(i = 0; i < 4 && packet->load_pos < end; i++)
+    {
+        byte = read_uint8(packet);
+        *value += (byte & 0x7F) * multiplier;
+        if(0 == (byte & 0x80))
+        {
+            return SUCESS;
+        }
+        multiplier *= 128;
+    }
+    
+    return FAILED;
+}
+
+/*skip a string or binary property ending before end, FAILED when it does not fit*/
+STATIC UINT32 skip_str(Packet *packet, UINT32 end)
+{
+    UINT32 len;
+    
+    INVALID_RETURN_VALUE(packet->load_pos + 2 <= end, FAILED);
+    len = read_uint16(packet);
+    INVALID_RETURN_VALUE(packet->load_pos + len <= end, FAILED);
+    packet->load_pos += len;
+    
+    return SUCESS;
+}
+
+/*
+ * Read the properties of an MQTT 5.0 packet, the ones the broker acts on
+ * into props, the others skipped. FAILED when malformed.
+ */
+STATIC UINT32 read_properties(Packet *packet, Mqtt5Properties *props)
+{
+    UINT32 len, end, value = 0;
+    UINT8 id;
+    
+    memset(props, 0, sizeof(Mqtt5Properties));
+    
+    INVALID_RETURN_VALUE(read_varint(packet, packet->remain_len, &len) == SUCESS, FAILED);
+    INVALID_RETURN_VALUE(len <= load_left(packet), FAILED);
+    end = packet->load_pos + len;
+    
+    while(packet->load_pos < end)
+    {
+        id = read_uint8(packet);
+        switch(iotbroker_mqtt5_property_type(id))
+        {
+            case PROP_TYPE_BYTE:
+                INVALID_RETURN_VALUE(packet->load_pos + 1 <= end, FAILED);
+                value = read_uint8(packet);
+                break;
+                
+            case PROP_TYPE_INT16:
+                INVALID_RETURN_VALUE(packet->load_pos + 2 <= end, FAILED);
+                value = read_uint16(packet);
+                break;
+                
+            case PROP_TYPE_INT32:
+                INVALID_RETURN_VALUE(packet->load_pos + 4 <= end, FAILED);
+                value = read_uint32(packet);
+                break;
+                
+            case PROP_TYPE_VARINT:
+                INVALID_RETURN_VALUE(read_varint(packet, end, &value) == SUCESS, FAILED);
+                break;
+                
+            case PROP_TYPE_PAIR:
+                INVALID_RETURN_VALUE(skip_str(packet, end) == SUCESS, FAILED);
+                /*fall through, the value of the pair*/
+            case PROP_TYPE_STRING:
+                INVALID_RETURN_VALUE(skip_str(packet, end) == SUCESS, FAILED);
+                continue;
+                
+            default:
+                return FAILED;
+        }
+        
+        switch(id)
+        {
+            case PROP_RECEIVE_MAX:
+                INVALID_RETURN_VALUE(value != 0, FAILED);
+                props->receive_max = value;
+                break;
+                
+            case PROP_TOPIC_ALIAS_MAX:
+                props->topic_alias_max = value;
+                break;
+                
+            case PROP_TOPIC_ALIAS:
+                INVALID_RETURN_VALUE(value != 0, FAILED);
+                props->topic_alias = value;
+                break;
+                
+            case PROP_MESSAGE_EXPIRY:
+                props->message_expiry = value;
+                break;
+                
+            default:
+                break;
+        }
+    }
+    
+    return SUCESS;
+}
+
+/*
+ * Read the remain bytes as is, a payload may be binary and larger than
+ * 64 KB. A zero is still appended for the debug dumps, return the length.
+ */
+STATIC UINT32 read_remain_str(Packet *packet, UINT8 **dst, UINT32 tag)
+{
+    UINT32 len;
     UINT8 *str;
     
-    len = packet->remain_len - packet->load_pos;
-    str = (UINT8*)iotbroker_malloc(len + 1);
+    len = load_left(packet);
+    str = (UINT8*)iotbroker_malloc(len + 1, tag);
     assert(str != NULL);
-    memset(str, 0, len + 1);
-    strncpy(str, packet->load + packet->load_pos, len);
+    memcpy(str, packet->load + packet->load_pos, len);
+    str[len] = '\0';
     packet->load_pos += len;
     
     *dst = str;
+    
+    return len;
 }
 
 /*write the uint16 data into packet load*/
@@ -105,6 +249,13 @@ STATIC VOID write_uint8(Packet *packet, UINT8 data)
     packet->load[packet->load_pos++] = data;
 }
 
+/*write a property of two bytes*/
+STATIC VOID write_property16(Packet *packet, UINT8 id, UINT16 data)
+{
+    write_uint8(packet, id);
+    write_uint16(packet, data);
+}
+
 STATIC VOID write_str(Packet *packet, UINT8 *str)
 {
     UINT16 len;
@@ -116,11 +267,8 @@ STATIC VOID write_str(Packet *packet, UINT8 *str)
     packet->load_pos += len; 
 }
 
-STATIC VOID write_remain_str(Packet *packet, UINT8 *str)
+STATIC VOID write_remain_str(Packet *packet, UINT8 *str, UINT32 len)
 {
-    UINT16 len;
-    
-    len = strlen(str);
     memcpy(packet->load + packet->load_pos, str, len);
     packet->load_pos += len; 
 }
@@ -130,14 +278,15 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
     UINT16 protocol_name_len, client_id_len;
     UINT8 *protocol_name = NULL;
     UINT8 *client_id = NULL;
-    INT8 protocol_level;
+    UINT8 protocol_level;
     UINT8 connect_flags;
+    Mqtt5Properties props;
     UINT16 keepalive;
     UINT8 *will_topic = NULL, *will_msg = NULL;
     UINT8 *username = NULL, *password = NULL;
-    UINT8 session_present, connection_ret;
+    UINT8 session_present = FALSE, connection_ret;
         
-    read_str(packet, &protocol_name);
+    read_str(packet, &protocol_name, MEM_PROTOCOL);
     
 #ifdef DEBUG
     printf("\n%s %d \n\
@@ -149,7 +298,7 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
     /*check protocol name*/
     if(strlen(protocol_name) > PROTOCOL_NAME_LEN || strcmp(protocol_name, PROTOCOL_NAME) != 0)
     {
-        printf("invalid protocol name!\n");
+        iotbroker_log(LOG_WARN, "%s:%d invalid protocol name", client->address, client->port);
         iotbroker_free(protocol_name);
         protocol_name = NULL;
         return HANDLE_RET_CLOSE_CLIENT;
@@ -167,16 +316,26 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
 
     if(protocol_level > PROTOCOL_MAX_LEVEL)
     {
-        printf("invalid protocol level!\n");
+        iotbroker_log(LOG_WARN, "%s:%d invalid protocol level %d", client->address, client->port, protocol_level);
+        iotbroker_session_state_mod(client->sock_fd, CS_DISCONNECT);
         connection_ret = CONNECT_RET_INVALID_PROTOCOL_LEVEL;
         goto handle_connect_ack;
     }
     
+    /*overloaded, the client retries later or elsewhere*/
+    if(iotbroker_overload_shedding())
+    {
+        iotbroker_metrics_add(METRIC_CONNECT_REFUSED, 1);
+        iotbroker_session_state_mod(client->sock_fd, CS_DISCONNECT);
+        connection_ret = CONNECT_RET_SERVER_UNAVAILABLE;
+        goto handle_connect_ack;
+    }
+    
     /*connect flags*/
     connect_flags = read_uint8(packet);
     if(CONNECT_FLAG_RESERVED & connect_flags)
     {
-        printf("invalid control flags in pos 0!\n");
+        iotbroker_log(LOG_WARN, "%s:%d invalid connect flags", client->address, client->port);
         return HANDLE_RET_CLOSE_CLIENT;
     }
     
@@ -188,8 +347,27 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
     __FILE__, __LINE__, keepalive);
 #endif    
     
+    /*the keep alive starts with CONNECT, bounded by the config*/
+    keepalive = iotbroker_session_keepalive(client, keepalive);
+    
+    /*properties of MQTT 5.0*/
+    if(MQTT5_LEVEL == protocol_level)
+    {
+        if(read_properties(packet, &props) != SUCESS)
+        {
+            iotbroker_log(LOG_WARN, "%s:%d malformed connect properties", client->address, client->port);
+            return HANDLE_RET_CLOSE_CLIENT;
+        }
+        
+        if(client->v5 != NULL)
+        {
+            iotbroker_mqtt5_free(client->v5);
+        }
+        client->v5 = iotbroker_mqtt5_new(&props);
+    }
+
     /*client id*/
-    read_str(packet, &client_id);
+    read_str(packet, &client_id, MEM_SESSION);
 #ifdef DEBUG
     printf("\n%s %d \n\
         \tclient id : %s\n\
@@ -200,20 +378,30 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
     /*will*/
     if(connect_flags & CONNECT_FLAG_WILL_FLAG)
     {
-        read_str(packet, &will_topic);
-        read_str(packet, &will_msg);
+        if(MQTT5_LEVEL == protocol_level && read_properties(packet, &props) != SUCESS)
+        {
+            iotbroker_log(LOG_WARN, "%s:%d malformed will properties", client->address, client->port);
+            iotbroker_free(client_id);
+            return HANDLE_RET_CLOSE_CLIENT;
+        }
+        
+        read_str(packet, &will_topic, MEM_PROTOCOL);
+        read_str(packet, &will_msg, MEM_PROTOCOL);
 #ifdef DEBUG
         printf("\n%s %d \n\
         \twill topic : %s\n\
         \twill msg : %s\n",
          __FILE__, __LINE__, will_topic, will_msg);
 #endif
+        /*wills are not published yet, they used to leak here*/
+        iotbroker_free(will_topic);
+        iotbroker_free(will_msg);
     }
     
     /*username*/
     if(connect_flags & CONNECT_FLAG_USERNAME)
     {
-        read_str(packet, &username);
+        read_str(packet, &username, MEM_SESSION);
 #ifdef DEBUG
         printf("\n%s %d \n\
         \tusername: %s\n",
@@ -222,9 +410,9 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
     }
     
     /*password*/
-    if(connect_flags & CONNECT_FLAG_USERNAME)
+    if(connect_flags & CONNECT_FLAG_PASSWORD)
     {
-        read_str(packet, &password);
+        read_str(packet, &password, MEM_SESSION);
 #ifdef DEBUG
         printf("\n%s %d \n\
         \tpassword: %s\n",
@@ -237,41 +425,101 @@ STATIC INT32 handle_connect(Client *client, Packet *packet, Packet **out_packet)
         iotbroker_session_setid(client->sock_fd, client_id);
     }
     
-    if(username != NULL || password != NULL)
+    if(username != NULL)
     {
-        iotbroker_session_auth(client->sock_fd, username, password);
+        iotbroker_session_auth(client->sock_fd, username);
+    }
+    
+    /*the password is hashed off the event loop, the CONNACK waits for it*/
+    connection_ret = iotbroker_auth_check(client, password);
+    if(AUTH_PENDING == connection_ret)
+    {
+        iotbroker_session_state_mod(client->sock_fd, CS_AUTHENTICATING);
+        return SUCESS;
     }
-
-	/*TODO:check auth*/
-    connection_ret = CONNECT_RET_OK;
-    session_present = FALSE;
     
-    iotbroker_session_state_mod(client->sock_fd, CS_CONNECTING);
+    return handle_connect_done(client, connection_ret, out_packet);
     
 handle_connect_ack:
-    send_connack(out_packet, session_present, connection_ret);
+    send_connack(out_packet, client, protocol_level, session_present, connection_ret);
+    
+    return SUCESS;
+}
+
+INT32 handle_connect_done(Client *client, UINT8 con_ret, Packet **out_packet)
+{
+    /*refused, the connection is closed once the CONNACK is out*/
+    iotbroker_session_state_mod(client->sock_fd, (CONNECT_RET_OK == con_ret) ? CS_CONNECTING : CS_DISCONNECT);
+    
+    send_connack(out_packet, client, (client->v5 != NULL) ? MQTT5_LEVEL : PROTOCOL_LEVEL_311, FALSE, con_ret);
     
     return SUCESS;
 }
 
-STATIC VOID send_connack(Packet **packet, UINT8 sp, UINT8 con_ret)
+/*reason code of MQTT 5.0 for a return code of 3.1.1*/
+STATIC UINT8 connack_reason(UINT8 con_ret)
+{
+    switch(con_ret)
+    {
+        case CONNECT_RET_OK: return REASON_SUCCESS;
+        case CONNECT_RET_INVALID_PROTOCOL_LEVEL: return REASON_UNSUPPORTED_PROTOCOL_VERSION;
+        case CONNECT_RET_INVALID_CLIENTID: return REASON_CLIENT_ID_NOT_VALID;
+        case CONNECT_RET_SERVER_UNAVAILABLE: return REASON_SERVER_UNAVAILABLE;
+        case CONNECT_RET_INVALID_USERNAME_PASSWD: return REASON_BAD_USERNAME_PASSWORD;
+        case CONNECT_RET_UNAUTHORIZED: return REASON_NOT_AUTHORIZED;
+        default: return REASON_UNSPECIFIED;
+    }
+}
+
+/*
+ * An accepted MQTT 5.0 client learns the aliases it may use and that
+ * retained messages and shared subscriptions are not available.
+ */
+STATIC VOID send_connack(Packet **packet, Client *client, UINT8 level, UINT8 sp, UINT8 con_ret)
 {   
     Packet *p;
-    INT8 *load;
+    UINT32 props_len = 0;
     
-    p = (Packet*)iotbroker_malloc(sizeof(Packet));
+    p = (Packet*)iotbroker_malloc(sizeof(Packet), MEM_PROTOCOL);
     assert(p != NULL);
     memset(p, 0, sizeof(Packet));
     
     p->type = CONNACK;
     p->remain_len = 2;
     
-    load = (INT8*)iotbroker_malloc(p->remain_len);
-    assert(load != NULL);
-    load[p->load_pos++] = sp & 0x01;
-    load[p->load_pos++] = con_ret;
+    if(level != MQTT5_LEVEL)
+    {
+        p->load = (UINT8*)iotbroker_malloc(p->remain_len, MEM_PROTOCOL);
+        assert(p->load != NULL);
+        write_uint8(p, sp & 0x01);
+        write_uint8(p, con_ret);
+        
+        *packet = p;
+        return;
+    }
     
-    p->load = load;
+    if(CONNECT_RET_OK == con_ret)
+    {
+        props_len = 2 + 2 + ((client->v5->alias_in_max != 0) ? 3 : 0);
+    }
+    p->remain_len += 1 + props_len;
+    
+    p->load = (UINT8*)iotbroker_malloc(p->remain_len, MEM_PROTOCOL);
+    assert(p->load != NULL);
+    write_uint8(p, sp & 0x01);
+    write_uint8(p, connack_reason(con_ret));
+    write_uint8(p, props_len);
+    if(props_len != 0)
+    {
+        write_uint8(p, PROP_RETAIN_AVAILABLE);
+        write_uint8(p, 0);
+        write_uint8(p, PROP_SHARED_SUB_AVAILABLE);
+        write_uint8(p, 0);
+        if(client->v5->alias_in_max != 0)
+        {
+            write_property16(p, PROP_TOPIC_ALIAS_MAX, client->v5->alias_in_max);
+        }
+    }
     
     *packet = p;
 }
@@ -286,13 +534,89 @@ STATIC INT32 handle_disconnect(Client *client)
     return HANDLE_RET_CLOSE_CLIENT;
 }
 
+/*
+ * Topic of an MQTT 5.0 PUBLISH. A topic with an alias binds it, an empty
+ * topic takes the one bound before.
+ */
+STATIC UINT32 resolve_topic_alias(Client *client, Mqtt5Properties *props, UINT8 **topic)
+{
+    CONST UINT8 *bound;
+    UINT32 len;
+    
+    if(0 == props->topic_alias)
+    {
+        return ((*topic)[0] != '\0') ? SUCESS : FAILED;
+    }
+    
+    if((*topic)[0] != '\0')
+    {
+        return iotbroker_mqtt5_alias_in_set(client->v5, props->topic_alias, *topic);
+    }
+    
+    bound = iotbroker_mqtt5_alias_in_get(client->v5, props->topic_alias);
+    INVALID_RETURN_VALUE(bound != NULL, FAILED);
+    
+    len = strlen(bound);
+    iotbroker_free(*topic);
+    *topic = (UINT8*)iotbroker_malloc(len + 1, MEM_MESSAGE);
+    assert(*topic != NULL);
+    memcpy(*topic, bound, len + 1);
+    
+    return SUCESS;
+}
+
+/*
+ * Topic a PUBLISH goes to, read without consuming the packet: the one bound
+ * to the alias for an MQTT 5.0 empty topic. NULL when malformed or the alias
+ * is unknown, handle_publish rejects those.
+ */
+CONST UINT8* handle_publish_topic(Client *client, Packet *packet, UINT32 *len)
+{
+    Packet p = *packet;
+    Mqtt5Properties props;
+    CONST UINT8 *bound;
+    UINT32 topic_len, qos;
+    
+    INVALID_RETURN_VALUE(p.remain_len >= 2, NULL);
+    
+    topic_len = read_uint16(&p);
+    INVALID_RETURN_VALUE(topic_len + 2 <= (UINT32)p.remain_len, NULL);
+    
+    if(topic_len != 0 || NULL == client->v5)
+    {
+        *len = topic_len;
+        return p.load + 2;
+    }
+    
+    /*packet id, then the properties with the alias*/
+    p.load_pos += topic_len;
+    qos = (p.flags & PUBLISH_FLAG_QOS) >> 1;
+    if(qos != QOS0)
+    {
+        INVALID_RETURN_VALUE(load_left(&p) >= 2, NULL);
+        p.load_pos += 2;
+    }
+    INVALID_RETURN_VALUE(read_properties(&p, &props) == SUCESS && props.topic_alias != 0, NULL);
+    
+    bound = iotbroker_mqtt5_alias_in_get(client->v5, props.topic_alias);
+    INVALID_RETURN_VALUE(bound != NULL, NULL);
+    
+    *len = strlen(bound);
+    
+    return bound;
+}
+
 STATIC INT32 handle_publish(Client *client, Packet *packet, Packet **out_packet)
 {
     UINT8 dup, qos, retain;
     UINT8 *topic_name, *topic_content;
+    UINT32 content_len;
     TopicPacket *tp;
     MessageStore *ms;
     UINT16 packet_id = 0;
+    Mqtt5Properties props;
+    
+    memset(&props, 0, sizeof(props));
     
     dup = (packet->flags & PUBLISH_FLAG_DUP) >> 3;
     qos = (packet->flags & PUBLISH_FLAG_QOS) >> 1;
@@ -301,18 +625,57 @@ STATIC INT32 handle_publish(Client *client, Packet *packet, Packet **out_packet)
     /*check qos*/
     if(qos > QOS2)
     {
-        printf("invalid qos!\n");
+        iotbroker_log(LOG_WARN, "%s:%d invalid qos %d", client->address, client->port, qos);
         return HANDLE_RET_CLOSE_CLIENT;
     }
     
-    read_str(packet, &topic_name);
+    read_str(packet, &topic_name, MEM_MESSAGE);
     
     if(qos == QOS1 || qos == QOS2)
     {
         packet_id = read_uint16(packet);
     }
     
-    read_remain_str(packet, &topic_content);
+    /*a QoS2 publish resent before PUBREL was delivered already, it is only acknowledged again*/
+    if(QOS2 == qos && iotbroker_idset_has(client->qos2_in, packet_id))
+    {
+        iotbroker_metrics_add(METRIC_MSG_DUPLICATE, 1);
+        iotbroker_free(topic_name);
+        send_pubrec(out_packet, packet_id);
+        return SUCESS;
+    }
+    
+    if(client->v5 != NULL && (read_properties(packet, &props) != SUCESS
+        || resolve_topic_alias(client, &props, &topic_name) != SUCESS))
+    {
+        iotbroker_log(LOG_WARN, "%s:%d invalid publish properties or topic alias", client->address, client->port);
+        iotbroker_free(topic_name);
+        return HANDLE_RET_CLOSE_CLIENT;
+    }
+    
+    /*a publish the acl_file denies is acknowledged and dropped, the client stays*/
+    if(!iotbroker_acl_publish(client, topic_name))
+    {
+        iotbroker_metrics_add(METRIC_ACL_DENIED, 1);
+        iotbroker_log(LOG_DEBUG, "%s:%d publish to %s denied", client->address, client->port, topic_name);
+        iotbroker_free(topic_name);
+        
+        if(QOS1 == qos)
+        {
+            send_puback(out_packet, packet_id);
+        }
+        else if(QOS2 == qos)
+        {
+            iotbroker_idset_add(&client->qos2_in, packet_id);
+            send_pubrec(out_packet, packet_id);
+        }
+        
+        return SUCESS;
+    }
+    
+    content_len = read_remain_str(packet, &topic_content, MEM_MESSAGE);
+    
+    iotbroker_metrics_add(METRIC_MSG_IN_QOS0 + qos, 1);
     
 #ifdef DEBUG
         printf("\n%s %d \n\
@@ -325,22 +688,29 @@ STATIC INT32 handle_publish(Client *client, Packet *packet, Packet **out_packet)
          __FILE__, __LINE__, dup, qos, retain, topic_name, packet_id, topic_content);
 #endif
     
-    tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket));
+    tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket), MEM_MESSAGE);
     assert(tp != NULL);
 
     tp->packet_id = packet_id;
     tp->topic = topic_name;
+    tp->topic_len = strlen(topic_name);
     tp->content = topic_content;
+    tp->content_len = content_len;
     tp->dup = dup;
     tp->qos = qos;
     tp->retain = retain;
     
     iotbroker_message_store_insert(tp, &ms);
     
+    /*the expiry the publisher asked for wins over the configured one*/
+    iotbroker_message_store_expire(ms, (props.message_expiry != 0) ? props.message_expiry
+        : iotbroker_message_expiry_default(topic_name));
+    
     if(QOS0 == qos)
     {
         /*qos0, insert into subtree*/
         iotbroker_subtree_pub(ms);
+        iotbroker_message_store_deref(ms);
     }
     else if(QOS1 == qos)
     {
@@ -349,53 +719,59 @@ STATIC INT32 handle_publish(Client *client, Packet *packet, Packet **out_packet)
         
         /*insert into subtree*/
         iotbroker_subtree_pub(ms);
+        iotbroker_message_store_deref(ms);
     }  
     else if(QOS2 == qos)
     {
-        MessageQueue *mq, *new_msg;
-        
-        /*qos2: send pubrec and add the msg into msg wait queue*/
-        new_msg = (MessageQueue*)iotbroker_malloc(sizeof(MessageQueue));
-        assert(new_msg != NULL);
-        new_msg->qs = QS_INFLIGHT;
-        new_msg->ps = PS_WAIT_FOR_PUBREL;
-        new_msg->dir = MD_IN;
-        new_msg->resend_count = 0;
-        new_msg->ms = ms;
-        new_msg->qos = qos;
-        new_msg->packet_id = packet_id;
-        
-        mq = client->mq_head;
-        list_add(&new_msg->list_mount, &mq->list_mount);
-        
-        ms->refer_count++;
-        
+        /*qos2: send pubrec, only the packet id waits for pubrel*/
+        iotbroker_idset_add(&client->qos2_in, packet_id);
         send_pubrec(out_packet, packet_id);
+        
+        /*insert into subtree*/
+        iotbroker_subtree_pub(ms);
+        iotbroker_message_store_deref(ms);
     }  
     
     return SUCESS;
 }
 
+/*time since the entry stamp, an age the stamp can not tell goes to the overflow bucket*/
+STATIC VOID record_entry_age(UINT32 hist, MessageEntry *me)
+{
+    U64 now = iotbroker_time_now_us();
+
+    if(MESSAGE_ENTRY_AGE_VALID(me, now))
+    {
+        iotbroker_metrics_record(hist, MESSAGE_ENTRY_AGE(me, now));
+    }
+    else
+    {
+        iotbroker_metrics_overflow(hist);
+    }
+}
+
+/*an ack freed a slot of the in-flight window, the messages held behind it go out*/
+STATIC VOID reopen_window(Client *client)
+{
+    if(client->mq.send != client->mq.tail)
+    {
+        iotbroker_session_ready(client, READY_OUTPUT);
+    }
+}
+
 STATIC INT32 handle_pubrec(Client *client, Packet *packet, Packet **out_packet)
 {
     UINT16 packet_id;
-    MessageQueue *mq_head;
-    struct list_head *pos, *tmp;
+    MessageEntry *me;
     
     packet_id = read_uint16(packet);
-    mq_head = client->mq_head;
     
-    list_for_each_safe(pos, tmp, &mq_head->list_mount)
+    me = iotbroker_message_queue_find(&client->mq, packet_id, PS_WAIT_FOR_PUBREC, NULL);
+    if(me != NULL)
     {
-        MessageQueue *mq = container_of(pos, MessageQueue, list_mount);
-        
-        if(mq->packet_id == packet_id && mq->ps == PS_WAIT_FOR_PUBREC)
-        {
-            mq->dir = MD_IN;
-            mq->ps = PS_WAIT_FOR_PUBCOMP;
-            send_pubrel(out_packet, packet_id);
-            break;
-        }
+        me->dir = MD_IN;
+        me->ps = PS_WAIT_FOR_PUBCOMP;
+        send_pubrel(out_packet, packet_id);
     }
     
     return SUCESS; 
@@ -404,49 +780,32 @@ STATIC INT32 handle_pubrec(Client *client, Packet *packet, Packet **out_packet)
 STATIC INT32 handle_pubcomp(Client *client, Packet *packet)
 {
     UINT16 packet_id;
-    MessageQueue *mq_head;
-    struct list_head *pos, *tmp;
+    MessageEntry *me;
+    UINT32 seq;
     
     packet_id = read_uint16(packet);
-    mq_head = client->mq_head;
     
-    list_for_each_safe(pos, tmp, &mq_head->list_mount)
+    me = iotbroker_message_queue_find(&client->mq, packet_id, PS_WAIT_FOR_PUBCOMP, &seq);
+    if(me != NULL)
     {
-        MessageQueue *mq = container_of(pos, MessageQueue, list_mount);
-        
-        if(mq->packet_id == packet_id && mq->ps == PS_WAIT_FOR_PUBCOMP)
-        {
-            iotbroker_message_store_deref(mq->ms);
-            list_del(&mq->list_mount);
-            break;
-        }
+        record_entry_age(HIST_ACK_QOS2, me);
+        iotbroker_message_store_deref(me->ms);
+        iotbroker_message_queue_remove(&client->mq, seq);
+        reopen_window(client);
     }
     
     return SUCESS; 
 }
 
+/*an unknown id is completed as well, the PUBCOMP sent before may have been lost*/
 STATIC INT32 handle_pubrel(Client *client, Packet *packet, Packet **out_packet)
 {
     UINT16 packet_id;
-    MessageQueue *mq_head;
-    struct list_head *pos, *tmp;
     
     packet_id = read_uint16(packet);
-    mq_head = client->mq_head;
     
-    list_for_each_safe(pos, tmp, &mq_head->list_mount)
-    {
-        MessageQueue *mq = container_of(pos, MessageQueue, list_mount);
-        
-        if(mq->packet_id == packet_id && mq->ps == PS_WAIT_FOR_PUBREL)
-        {
-            iotbroker_subtree_pub(mq->ms);
-            iotbroker_message_store_deref(mq->ms);
-            list_del(&mq->list_mount);
-            send_pubcomp(out_packet, packet_id);
-            break;
-        }
-    }
+    iotbroker_idset_del(&client->qos2_in, packet_id);
+    send_pubcomp(out_packet, packet_id);
     
     return SUCESS;    
 }
@@ -456,11 +815,19 @@ STATIC INT32 handle_subscribe(Client *client, Packet *packet, Packet **out_packe
     UINT16 packet_id, topic_counter = 0;
     struct sub_topic_ret *sub_ret, *tmp_sub_ret;
     INT32 ret = SUCESS;
+    Mqtt5Properties props;
     
     packet_id = read_uint16(packet);
     
-    sub_ret = (struct sub_topic_ret*)iotbroker_malloc(sizeof(struct sub_topic_ret));
+    /*subscription identifiers are not supported, the properties are skipped*/
+    if(client->v5 != NULL && read_properties(packet, &props) != SUCESS)
+    {
+        return HANDLE_RET_CLOSE_CLIENT;
+    }
+    
+    sub_ret = (struct sub_topic_ret*)iotbroker_malloc(sizeof(struct sub_topic_ret), MEM_PROTOCOL);
     assert(sub_ret != NULL);
+    sub_ret->next = NULL;
     tmp_sub_ret = sub_ret;
     
     /*read all topics in load*/
@@ -471,7 +838,7 @@ STATIC INT32 handle_subscribe(Client *client, Packet *packet, Packet **out_packe
         TopicPacket *tp;
         struct sub_topic_ret *sub_ret_node;
         
-        read_str(packet, &topic);
+        read_str(packet, &topic, MEM_PROTOCOL);
         qos = read_uint8(packet);
 #ifdef DEBUG
         printf("\n%s %d \n\
@@ -479,26 +846,43 @@ STATIC INT32 handle_subscribe(Client *client, Packet *packet, Packet **out_packe
         \tqos: %d\n",
          __FILE__, __LINE__, topic, qos);
 #endif   
+        /*subscription options of MQTT 5.0, no local and retain handling are ignored*/
+        if(client->v5 != NULL && !(qos & SUBSCRIBE_OPTION_RESERVED))
+        {
+            qos &= SUBSCRIBE_OPTION_QOS;
+        }
+        
         if(qos > QOS2)
         {
+            iotbroker_free(topic);
             ret = HANDLE_RET_CLOSE_CLIENT;
             goto handle_error;
         }
         
-        tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket));
-        assert(tp != NULL);
-        tp->topic = topic;
-        tp->qos = qos;
-        
-        iotbroker_subtree_sub(tp, client);
+        /*a filter the acl_file denies is refused in its return code*/
+        if(!iotbroker_acl_subscribe(client, topic))
+        {
+            iotbroker_metrics_add(METRIC_ACL_DENIED, 1);
+            iotbroker_log(LOG_DEBUG, "%s:%d subscribe to %s denied", client->address, client->port, topic);
+            qos = (client->v5 != NULL) ? REASON_NOT_AUTHORIZED : SUBACK_RET_FAILURE;
+        }
+        else
+        {
+            tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket), MEM_PROTOCOL);
+            assert(tp != NULL);
+            tp->topic = topic;
+            tp->qos = qos;
+            
+            iotbroker_subtree_sub(tp, client);
+            
+            iotbroker_free(tp);
+            tp = NULL;
+        }
         
         iotbroker_free(topic);
         topic = NULL;
         
-        iotbroker_free(tp);
-        tp = NULL;
-        
-        sub_ret_node = (struct sub_topic_ret*)iotbroker_malloc(sizeof(struct sub_topic_ret));
+        sub_ret_node = (struct sub_topic_ret*)iotbroker_malloc(sizeof(struct sub_topic_ret), MEM_PROTOCOL);
         assert(sub_ret_node != NULL);
         
         sub_ret_node->ret = qos;
@@ -510,7 +894,7 @@ STATIC INT32 handle_subscribe(Client *client, Packet *packet, Packet **out_packe
         topic_counter++;
     }
     
-    send_suback(out_packet, packet_id, sub_ret, topic_counter);
+    send_suback(out_packet, client, packet_id, sub_ret, topic_counter);
 
 handle_error:
     
@@ -527,23 +911,29 @@ handle_error:
 
 STATIC INT32 handle_unsubscribe(Client *client, Packet *packet, Packet **out_packet)
 {
-    UINT16 packet_id;
+    UINT16 packet_id, topic_counter = 0;
+    Mqtt5Properties props;
 
     packet_id = read_uint16(packet);
     
+    if(client->v5 != NULL && read_properties(packet, &props) != SUCESS)
+    {
+        return HANDLE_RET_CLOSE_CLIENT;
+    }
+    
     /*read all topics in load*/
     while(packet->load_pos < packet->remain_len)
     {
         UINT8 *topic;
         TopicPacket *tp;
         
-        read_str(packet, &topic);
+        read_str(packet, &topic, MEM_PROTOCOL);
 #ifdef DEBUG
         printf("\n%s %d \n\
         \ttopic: %s\n",
          __FILE__, __LINE__, topic);
 #endif   
-        tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket));
+        tp = (TopicPacket*)iotbroker_malloc(sizeof(TopicPacket), MEM_PROTOCOL);
         assert(tp != NULL);
         tp->topic = topic;
         
@@ -554,9 +944,11 @@ STATIC INT32 handle_unsubscribe(Client *client, Packet *packet, Packet **out_pac
         
         iotbroker_free(tp);
         tp = NULL;
+        
+        topic_counter++;
     }
     
-    send_unsuback(out_packet, packet_id);
+    send_unsuback(out_packet, client, packet_id, topic_counter);
     
     return SUCESS;
 }
@@ -571,22 +963,18 @@ STATIC INT32 handle_pingreq(Packet **out_packet)
 STATIC INT32 handle_puback(Client *client, Packet *packet)
 {
     UINT16 packet_id;
-    MessageQueue *mq_head;
-    struct list_head *pos, *tmp;
+    MessageEntry *me;
+    UINT32 seq;
     
     packet_id = read_uint16(packet);
-    mq_head = client->mq_head;
     
-    list_for_each_safe(pos, tmp, &mq_head->list_mount)
+    me = iotbroker_message_queue_find(&client->mq, packet_id, PS_WAIT_FOR_PUBACK, &seq);
+    if(me != NULL)
     {
-        MessageQueue *mq = container_of(pos, MessageQueue, list_mount);
-        
-        if(mq->packet_id == packet_id && mq->ps == PS_WAIT_FOR_PUBACK)
-        {
-            iotbroker_message_store_deref(mq->ms);
-            list_del(&mq->list_mount);
-            break;
-        }
+        record_entry_age(HIST_ACK_QOS1, me);
+        iotbroker_message_store_deref(me->ms);
+        iotbroker_message_queue_remove(&client->mq, seq);
+        reopen_window(client);
     }
     
     return SUCESS;
@@ -597,7 +985,7 @@ STATIC VOID build_packet_with_packetid(Packet **out_packet, UINT16 packet_id, UI
     Packet *p;
     INT8 *load;
     
-    p = (Packet*)iotbroker_malloc(sizeof(Packet));
+    p = (Packet*)iotbroker_malloc(sizeof(Packet), MEM_PROTOCOL);
     assert(p != NULL);
     memset(p, 0, sizeof(Packet));
     
@@ -608,7 +996,7 @@ STATIC VOID build_packet_with_packetid(Packet **out_packet, UINT16 packet_id, UI
     p->remain_len = 2; 
     
     /*load*/
-    load = (INT8*)iotbroker_malloc(p->remain_len);
+    load = (INT8*)iotbroker_malloc(p->remain_len, MEM_PROTOCOL);
     assert(load != NULL);
     p->load = load;
     
@@ -627,7 +1015,7 @@ STATIC VOID send_pingresp(Packet **out_packet)
 {
     Packet *p;
     
-    p = (Packet*)iotbroker_malloc(sizeof(Packet));
+    p = (Packet*)iotbroker_malloc(sizeof(Packet), MEM_PROTOCOL);
     assert(p != NULL);
     memset(p, 0, sizeof(Packet));
     
@@ -657,25 +1045,31 @@ STATIC VOID send_pubcomp(Packet **packet, UINT16 packet_id)
     build_packet_with_packetid(packet, packet_id, PUBCOMP);
 }
 
-STATIC VOID send_suback(Packet **packet, UINT16 packet_id, struct sub_topic_ret *sub_ret_head, UINT16 size)
+STATIC VOID send_suback(Packet **packet, Client *client, UINT16 packet_id, struct sub_topic_ret *sub_ret_head, UINT16 size)
 {
     Packet *p;
     INT8 *load;
     struct sub_topic_ret *tmp_sub_ret;
     
-    p = (Packet*)iotbroker_malloc(sizeof(Packet));
+    p = (Packet*)iotbroker_malloc(sizeof(Packet), MEM_PROTOCOL);
     assert(p != NULL);
     memset(p, 0, sizeof(Packet));
     
     p->type = SUBACK;
-    p->remain_len = 2 + size;
+    p->remain_len = 2 + size + ((client->v5 != NULL) ? 1 : 0);
     
-    load = (INT8*)iotbroker_malloc(p->remain_len);
+    load = (INT8*)iotbroker_malloc(p->remain_len, MEM_PROTOCOL);
     assert(load != NULL);
     p->load = load;
     
     write_uint16(p, packet_id);
     
+    /*no properties*/
+    if(client->v5 != NULL)
+    {
+        write_uint8(p, 0);
+    }
+    
     tmp_sub_ret = sub_ret_head->next;
     while(tmp_sub_ret != NULL)
     {
@@ -687,64 +1081,134 @@ STATIC VOID send_suback(Packet **packet, UINT16 packet_id, struct sub_topic_ret
     *packet = p;
 }
 
-STATIC VOID send_unsuback(Packet **packet, UINT16 packet_id)
+/*MQTT 5.0 adds the properties and a reason code per filter, always success*/
+STATIC VOID send_unsuback(Packet **packet, Client *client, UINT16 packet_id, UINT16 size)
 {
-    build_packet_with_packetid(packet, packet_id, UNSUBACK);
+    Packet *p;
+    
+    if(NULL == client->v5)
+    {
+        build_packet_with_packetid(packet, packet_id, UNSUBACK);
+        return;
+    }
+    
+    p = (Packet*)iotbroker_malloc(sizeof(Packet), MEM_PROTOCOL);
+    assert(p != NULL);
+    memset(p, 0, sizeof(Packet));
+    
+    p->type = UNSUBACK;
+    p->remain_len = 2 + 1 + size;
+    
+    p->load = (UINT8*)iotbroker_malloc(p->remain_len, MEM_PROTOCOL);
+    assert(p->load != NULL);
+    
+    write_uint16(p, packet_id);
+    write_uint8(p, 0);
+    memset(p->load + p->load_pos, REASON_SUCCESS, size);
+    p->load_pos += size;
+    
+    *packet = p;
 }
 
-STATIC INT32 send_publish(Client *client, MessageQueue *mq, Packet **out_packet)
+STATIC INT32 send_publish(Client *client, MessageEntry *me, Packet **out_packet)
 {
     Packet *p;
     MessageStore *ms;
     TopicPacket *tp;
     UINT8 *load;
     INT32 ret = HANDLE_RET_REMOVE_MSG;
+    UINT16 alias = 0;
+    UINT32 known = FALSE, expiry = 0, props_len = 0;
     
-    ms = mq->ms;
+    ms = me->ms;
     tp = ms->packet;
     
-    p = (Packet*)iotbroker_malloc(sizeof(Packet));
+    p = (Packet*)iotbroker_malloc(sizeof(Packet), MEM_PROTOCOL);
     assert(p != NULL);
     memset(p, 0, sizeof(Packet));
     
+    /*a topic the client has an alias for goes out empty, the expiry left is passed on*/
+    if(client->v5 != NULL)
+    {
+        alias = iotbroker_mqtt5_alias_out(client->v5, tp->topic, &known);
+        props_len += (alias != 0) ? 3 : 0;
+        
+        if(ms->expire != 0)
+        {
+            expiry = MAX(ms->expire - iotbroker_time_sec(), 1);
+            props_len += 5;
+        }
+    }
+    
     p->type = PUBLISH;
-    p->flags = mq->qos << 1;
-    p->remain_len = 2  + strlen(tp->topic) + strlen(tp->content);
+    p->flags = me->qos << 1;
+    p->remain_len = 2 + (known ? 0 : tp->topic_len) + tp->content_len;
     
-    if(QOS1 == mq->qos || QOS2 == mq->qos)
+    if(QOS1 == me->qos || QOS2 == me->qos)
     {
         p->remain_len += 2;
     }
     
-    load = (UINT8*)iotbroker_malloc(p->remain_len);
+    if(client->v5 != NULL)
+    {
+        p->remain_len += 1 + props_len;
+    }
+    
+    load = (UINT8*)iotbroker_malloc(p->remain_len, MEM_PROTOCOL);
     assert(load != NULL);
     p->load = load;
 
-    write_str(p, tp->topic);    
-    if(QOS1 == mq->qos || QOS2 == mq->qos)
+    write_str(p, known ? (UINT8*)"" : tp->topic);    
+    if(QOS1 == me->qos || QOS2 == me->qos)
     {
-        mq->packet_id = client->packet_id_source;
+        me->packet_id = client->packet_id_source;
         write_uint16(p, client->packet_id_source++);
     }
-    write_remain_str(p, tp->content);
+    if(client->v5 != NULL)
+    {
+        write_uint8(p, props_len);
+        if(alias != 0)
+        {
+            write_property16(p, PROP_TOPIC_ALIAS, alias);
+        }
+        if(expiry != 0)
+        {
+            write_uint8(p, PROP_MESSAGE_EXPIRY);
+            write_uint16(p, expiry >> 16);
+            write_uint16(p, expiry & 0xFFFF);
+        }
+    }
+    write_remain_str(p, tp->content, tp->content_len);
     
-    if(QOS0 == mq->qos)
+    iotbroker_metrics_add(METRIC_MSG_OUT_QOS0 + me->qos, 1);
+    IOTBROKER_PROBE4(send__publish, client->sock_fd, me->qos, tp->topic_len, tp->content_len);
+    iotbroker_metrics_record(HIST_DELIVERY_QOS0 + me->qos, iotbroker_time_now_us() - ms->ingest_time);
+    record_entry_age(HIST_QUEUE_QOS0 + me->qos, me);
+    
+    /*from now on the stamp measures the ack round trip*/
+    me->stamp = (UINT32)iotbroker_time_now_us();
+    
+    if(QOS0 == me->qos)
     {
         /*the routine end*/
         iotbroker_message_store_deref(ms);
     }
-    else if(QOS1 == mq->qos)
+    else if(QOS1 == me->qos)
     {   
         /*wait for puback*/
-        mq->ps = PS_WAIT_FOR_PUBACK;
-        mq->dir = MD_IN;
+        me->ps = PS_WAIT_FOR_PUBACK;
+        me->dir = MD_IN;
+        iotbroker_metrics_add(METRIC_MSG_INFLIGHT, 1);
+        client->mq.inflight++;
         ret = HANDLE_RET_KEEP_MSG;        
     }
-    else if(QOS2 == mq->qos)
+    else if(QOS2 == me->qos)
     {
         /*wait for pubrec*/
-        mq->ps = PS_WAIT_FOR_PUBREC;
-        mq->dir = MD_IN;
+        me->ps = PS_WAIT_FOR_PUBREC;
+        me->dir = MD_IN;
+        iotbroker_metrics_add(METRIC_MSG_INFLIGHT, 1);
+        client->mq.inflight++;
         ret = HANDLE_RET_KEEP_MSG;
     }
     
@@ -753,16 +1217,16 @@ STATIC INT32 send_publish(Client *client, MessageQueue *mq, Packet **out_packet)
     return ret;
 }
 
-INT32 handle_message_queue(Client *client, MessageQueue *mq, Packet **out_packet)
+INT32 handle_message_queue(Client *client, MessageEntry *me, Packet **out_packet)
 {
     INT32 ret = SUCESS;    
     
-    assert(client != NULL && mq != NULL && out_packet != NULL);
+    assert(client != NULL && me != NULL && out_packet != NULL);
     
-    switch(mq->ps)
+    switch(me->ps)
     {
         case PS_WAIT_TO_PUBLISH:
-            ret = send_publish(client, mq, out_packet);
+            ret = send_publish(client, me, out_packet);
             break;
 
         default:
@@ -779,6 +1243,17 @@ INT32 handle_packet(Client *client, Packet *packet, Packet **out_packet)
     assert(packet != NULL);
     assert(out_packet != NULL);
     
+    IOTBROKER_PROBE3(handle__packet, client->sock_fd, packet->type, packet->remain_len);
+    iotbroker_record(REC_PACKET, client->sock_fd, packet->type, packet->remain_len);
+    
+    /*CONNECT comes first and once, nothing is served before it is accepted*/
+    if((CONNECT == packet->type) ? (client->state != CS_WAIT_FOR_CONNECT) : (client->state != CS_CONNECTING))
+    {
+        iotbroker_log(LOG_WARN, "%s:%d packet type %d in session state %d", client->address, client->port,
+            packet->type, client->state);
+        return HANDLE_RET_CLOSE_CLIENT;
+    }
+    
     switch(packet->type)
     {
         case CONNECT:
@@ -5,12 +5,16 @@
 #include "protocol.h"
 #include "message.h"
 #include "session.h"
+#include "mqtt5.h"
 
 /*protocol name length*/
 #define PROTOCOL_NAME_LEN 4
 
 /*current max protocol level*/
-#define PROTOCOL_MAX_LEVEL 4
+#define PROTOCOL_MAX_LEVEL MQTT5_LEVEL
+
+/*level of MQTT 3.1.1*/
+#define PROTOCOL_LEVEL_311 4
 
 /*clietn id max length*/
 #define PROTOCOL_MAX_CLIENTID_LEN 30
@@ -44,6 +48,12 @@
 #define PUBLISH_FLAG_DUP 0x08
 /*==============publish flags end===============*/
 
+/*==============subscription options start===============*/
+#define SUBSCRIBE_OPTION_QOS 0x03
+
+#define SUBSCRIBE_OPTION_RESERVED 0xC0
+/*==============subscription options end===============*/
+
 /*==============connection return code start===============*/
 #define CONNECT_RET_OK 0x0
 
@@ -58,6 +68,10 @@
 #define CONNECT_RET_UNAUTHORIZED 0x05
 /*==============connection return code end===============*/
 
+/*==============subscribe return code start===============*/
+#define SUBACK_RET_FAILURE 0x80
+/*==============subscribe return code end===============*/
+
 /*==============handle return value start===============*/
 #define HANDLE_RET_CLOSE_CLIENT 0x01
 
@@ -72,6 +86,12 @@ struct sub_topic_ret
 };
 
 INT32 handle_packet(Client *client, Packet *packet, Packet **out_packet);
-INT32 handle_message_queue(Client *client, MessageQueue *mq, Packet **out_packet);
+INT32 handle_message_queue(Client *client, MessageEntry *me, Packet **out_packet);
+
+/*topic of a PUBLISH before it is handled, the bound one for an alias, NULL when malformed*/
+CONST UINT8* handle_publish_topic(Client *client, Packet *packet, UINT32 *len);
+
+/*the credentials of the CONNECT were checked, con_ret the CONNACK return code*/
+INT32 handle_connect_done(Client *client, UINT8 con_ret, Packet **out_packet);
 
 #endif
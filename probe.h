@@ -0,0 +1,80 @@
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/*
+ * USDT probes of provider "iotbroker", e.g.
+ *   bpftrace -e 'usdt:./main:iotbroker:subtree__pub { @fanout = hist(arg2); }'
+ * A probe is a single nop in the code plus an ELF note, arguments are only
+ * evaluated into registers. <sys/sdt.h> is used when installed, otherwise
+ * the notes are emitted here in the same format on x86-64, other targets
+ * and "make PROBES=0" get no probes.
+ */
+#if defined(IOTBROKER_NO_PROBES)
+
+#define IOTBROKER_PROBE1(name, a1) do{}while(0)
+#define IOTBROKER_PROBE2(name, a1, a2) do{}while(0)
+#define IOTBROKER_PROBE3(name, a1, a2, a3) do{}while(0)
+#define IOTBROKER_PROBE4(name, a1, a2, a3, a4) do{}while(0)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define IOTBROKER_PROBE1(name, a1) DTRACE_PROBE1(iotbroker, name, a1)
+#define IOTBROKER_PROBE2(name, a1, a2) DTRACE_PROBE2(iotbroker, name, a1, a2)
+#define IOTBROKER_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(iotbroker, name, a1, a2, a3)
+#define IOTBROKER_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(iotbroker, name, a1, a2, a3, a4)
+
+#elif defined(__x86_64__)
+
+/*every argument is passed as a signed 8 byte value*/
+#define IOTBROKER_PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"iotbroker\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define IOTBROKER_PROBE1(name, a1) \
+    __asm__ __volatile__(IOTBROKER_PROBE_NOTE(name, "-8@%0") \
+        :: "nor"((LONG)(a1)))
+
+#define IOTBROKER_PROBE2(name, a1, a2) \
+    __asm__ __volatile__(IOTBROKER_PROBE_NOTE(name, "-8@%0 -8@%1") \
+        :: "nor"((LONG)(a1)), "nor"((LONG)(a2)))
+
+#define IOTBROKER_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__(IOTBROKER_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2") \
+        :: "nor"((LONG)(a1)), "nor"((LONG)(a2)), "nor"((LONG)(a3)))
+
+#define IOTBROKER_PROBE4(name, a1, a2, a3, a4) \
+    __asm__ __volatile__(IOTBROKER_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3") \
+        :: "nor"((LONG)(a1)), "nor"((LONG)(a2)), "nor"((LONG)(a3)), "nor"((LONG)(a4)))
+
+#else
+
+#define IOTBROKER_PROBE1(name, a1) do{}while(0)
+#define IOTBROKER_PROBE2(name, a1, a2) do{}while(0)
+#define IOTBROKER_PROBE3(name, a1, a2, a3) do{}while(0)
+#define IOTBROKER_PROBE4(name, a1, a2, a3, a4) do{}while(0)
+
+#endif
+
+#endif
@@ -1,6 +1,10 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 #include "iotbroker.h"
 #include "memmanager.h"
@@ -10,6 +14,11 @@
 #include "list.h"
 #include "session.h"
 #include "message.h"
+#include "config.h"
+#include "timer.h"
+#include "metrics.h"
+#include "probe.h"
+#include "capture.h"
 
 CONST INT8 *g_control_type_str[] = {
     "INVALID",
@@ -81,7 +90,7 @@ STATIC VOID write_packet(Packet *packet, INT8 **buf, INT32 *buf_len)
 {
     INT8 *tmp_buf;
     
-    tmp_buf = (INT8*)iotbroker_malloc(5 + packet->remain_len);
+    tmp_buf = (INT8*)iotbroker_malloc(5 + packet->remain_len, MEM_PROTOCOL);
     assert(tmp_buf != NULL);
     memset(tmp_buf, 0, 5 + packet->remain_len);
     
@@ -109,10 +118,9 @@ STATIC VOID write_packet(Packet *packet, INT8 **buf, INT32 *buf_len)
             *buf_len, packet->current_pos, packet->load_pos);
 #endif 
    
-    memcpy(tmp_buf + packet->current_pos, packet->load, packet->load_pos);
-    
     if(packet->load != NULL)
     {
+        memcpy(tmp_buf + packet->current_pos, packet->load, packet->load_pos);
         iotbroker_free(packet->load);
     }
     
@@ -124,82 +132,251 @@ STATIC VOID write_packet(Packet *packet, INT8 **buf, INT32 *buf_len)
     *buf = tmp_buf;
 }
 
-INT32 iotbroker_read_packet(UINT32 sock_fd)
-{
-    UINT8 byte_type_flags;
-    UINT32 multiplier = 1, remainlen_value = 0;
-    UINT8 remain_start, remain_counter = 0;
-    INT32 ret;
-    UINT8 *load = NULL;
-    Packet *packet = NULL, *out_packet = NULL;
-    INT8 *write_buf;
-    INT32 write_buf_len;
-    Client *client = NULL;
+/*read buffer of the event loop, complete packets are handled in place*/
+STATIC __thread UINT8 t_read_buf[READ_BUF_SIZE];
 
-    iotbroker_session_get(sock_fd, &client);
-    if(NULL == client)
+/*deliveries of a client encoded back to back, written at once*/
+STATIC __thread UINT8 t_write_buf[WRITE_BUF_SIZE];
+
+/*make the buffer hold at least size bytes, keeping the content*/
+STATIC VOID reserve_buf(UINT8 **buf, UINT32 *buf_size, UINT32 len, UINT32 size)
+{
+    UINT8 *tmp_buf;
+    UINT32 new_size;
+    
+    INVALID_RETURN_NOVALUE(size > *buf_size);
+    
+    new_size = (*buf_size != 0) ? *buf_size : BUF_MIN_SIZE;
+    while(new_size < size)
     {
-        return ERROR_SOCK_CLIENT_NOEXIST;
+        new_size *= 2;
     }
     
-    /*read first byte as type and flags*/
-    ret = read(sock_fd, &byte_type_flags, 1);
-    if(ret <= 0)
+    tmp_buf = (UINT8*)iotbroker_malloc(new_size, MEM_PROTOCOL);
+    assert(tmp_buf != NULL);
+    
+    if(*buf != NULL)
     {
-        goto handle_read_error;
+        memcpy(tmp_buf, *buf, len);
+        iotbroker_free(*buf);
     }
     
+    *buf = tmp_buf;
+    *buf_size = new_size;
+}
+
+/*release a drained buffer, idle connections keep none*/
+STATIC VOID release_buf(UINT8 **buf, UINT32 *buf_size)
+{
+    INVALID_RETURN_NOVALUE(*buf != NULL);
+    
+    iotbroker_free(*buf);
+    *buf = NULL;
+    *buf_size = 0;
+}
+
+/*decode the packet at buf, return its length, 0 when incomplete, -1 when invalid*/
+STATIC INT32 decode_packet(UINT8 *buf, UINT32 len, Packet *packet)
+{
+    UINT32 multiplier = 1, remainlen_value = 0;
+    UINT8 remain_start, remain_counter = 0;
+    
     /*read remain length, invalid when bytes more than MAX_REMAIN_BYTE_LEN*/
     do
     {
-        ret = read(sock_fd, &remain_start, 1);
-        if(ret <= 0)
+        if(remain_counter >= MAX_REMAIN_BYTE_LEN)
         {
-            goto handle_read_error;
-        } 
+            return -1;
+        }
+        
+        if(1 + remain_counter >= len)
+        {
+            return 0;
+        }
+        
+        remain_start = buf[1 + remain_counter];
         remain_counter++;
-             
+        
         remainlen_value += (remain_start & 127) * multiplier;
         multiplier *= 128;
-        if(multiplier > 128*128*128)
+    }while((UINT8)(remain_start & 128) != 0);
+    
+    if(remainlen_value > iotbroker_config_get()->max_packet_size)
+    {
+        return -1;
+    }
+    
+    if(len < 1 + remain_counter + remainlen_value)
+    {
+        return 0;
+    }
+    
+    memset(packet, 0, sizeof(Packet));
+    
+    if(get_packet_type(buf[0], packet) != SUCESS)
+    {
+        return -1;
+    }
+    
+    get_packet_flag(buf[0], packet);
+    
+    packet->current_pos += remain_counter;
+    packet->remain_len = remainlen_value;
+    packet->load = (remainlen_value != 0) ? buf + 1 + remain_counter : NULL;
+    
+    return 1 + remain_counter + remainlen_value;
+}
+
+/*bytes of the encoded packet at buf, which is complete*/
+STATIC UINT32 encoded_packet_len(CONST UINT8 *buf)
+{
+    UINT32 multiplier = 1, remain_len = 0, i = 1;
+    
+    do
+    {
+        remain_len += (buf[i] & 127) * multiplier;
+        multiplier *= 128;
+    }while(buf[i++] & 128);
+    
+    return i + remain_len;
+}
+
+/*
+ * The send buffer has two lanes: tx_buf[0, tx_head) goes out first, the
+ * rest of a packet already partly written and then the control packets,
+ * [tx_head, tx_len) holds the PUBLISH lane, whole packets in queue order.
+ * Acks never wait behind queued PUBLISH bytes and no packet is split.
+ */
+STATIC VOID keep_buf(Client *client, CONST INT8 *buf, UINT32 len, UINT32 lane)
+{
+    UINT32 at = (OUT_LANE_CONTROL == lane) ? client->tx_head : client->tx_len;
+    
+    reserve_buf(&client->tx_buf, &client->tx_size, client->tx_len, client->tx_len + len);
+    memmove(client->tx_buf + at + len, client->tx_buf + at, client->tx_len - at);
+    memcpy(client->tx_buf + at, buf, len);
+    client->tx_len += len;
+    
+    if(OUT_LANE_CONTROL == lane)
+    {
+        client->tx_head += len;
+    }
+}
+
+/*write the whole packets of buf to lane, keep what the socket does not take*/
+STATIC INT32 send_buf(Client *client, INT8 *buf, UINT32 len, UINT32 lane)
+{
+    UINT32 pos = 0;
+    INT32 ret = 0;
+    
+    if(0 == client->tx_len)
+    {
+        ret = write(client->sock_fd, buf, len);
+        if(ret < 0)
         {
-            goto handle_read_error;
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                return ERROR_SOCK_READ_WRITE;
+            }
+            ret = 0;
         }
-    }while((UINT8)(remain_start & 128) != 0);
+        iotbroker_metrics_add(METRIC_BYTES_OUT, ret);
+    }
+    
+    INVALID_RETURN_VALUE((UINT32)ret < len, SUCESS);
+    
+    /*the client does not read at all*/
+    if(client->tx_len + len - ret > iotbroker_config_get()->max_send_buffer)
+    {
+        return ERROR_SOCK_PACKET_ERROR;
+    }
+    
+    /*a started packet must be finished before anything else*/
+    while(pos < (UINT32)ret)
+    {
+        pos += encoded_packet_len((UINT8*)buf + pos);
+    }
+    
+    if(pos > (UINT32)ret)
+    {
+        keep_buf(client, buf + ret, pos - ret, OUT_LANE_CONTROL);
+    }
+    
+    if(pos < len)
+    {
+        keep_buf(client, buf + pos, len - pos, lane);
+    }
+    
+    return SUCESS;
+}
+
+/*write the pending bytes, tx_len stays non zero while the socket is full*/
+STATIC INT32 flush_buf(Client *client)
+{
+    UINT32 pos;
+    INT32 ret;
     
-    /*read load*/
-    if(remainlen_value != 0)
+    INVALID_RETURN_VALUE(client->tx_len != 0, SUCESS);
+    
+    ret = write(client->sock_fd, client->tx_buf, client->tx_len);
+    if(ret < 0)
     {
-        load = (UINT8*)iotbroker_malloc(remainlen_value);
-        assert(load != NULL);
-        memset(load, 0, remainlen_value);
-        ret = read(sock_fd, load, remainlen_value);
-        if(ret <= 0)
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
         {
-            goto handle_read_error;
+            return ERROR_SOCK_READ_WRITE;
         }
+        return SUCESS;
     }
+    iotbroker_metrics_add(METRIC_BYTES_OUT, ret);
     
-    packet = (Packet*)iotbroker_malloc(sizeof(Packet));
-    assert(packet != NULL);
-    memset(packet, 0, sizeof(Packet));
+    /*the rest of the PUBLISH the write stopped in goes first from now on*/
+    for(pos = client->tx_head; pos < (UINT32)ret; )
+    {
+        pos += encoded_packet_len(client->tx_buf + pos);
+    }
+    client->tx_head = pos - ret;
     
-    ret = get_packet_type(byte_type_flags, packet);
-    if(ret != SUCESS)
+    memmove(client->tx_buf, client->tx_buf + ret, client->tx_len - ret);
+    client->tx_len -= ret;
+    
+    if(0 == client->tx_len)
     {
-        goto handle_read_error;
+        release_buf(&client->tx_buf, &client->tx_size);
     }
     
-    get_packet_flag(byte_type_flags, packet);
-    if(ret != SUCESS)
+    return SUCESS;
+}
+
+/*write the answer of a packet on the control lane*/
+STATIC INT32 send_out_packet(Client *client, Packet *out_packet)
+{
+    INT8 *write_buf;
+    INT32 write_buf_len;
+    INT32 ret;
+    
+    write_packet(out_packet, &write_buf, &write_buf_len);
+    
+#ifdef DEBUG
+    print_hex2num(write_buf, write_buf_len);
+#endif   
+    
+    ret = send_buf(client, write_buf, write_buf_len, OUT_LANE_CONTROL);
+ 
+    iotbroker_free(write_buf);
+    write_buf = NULL;
+    
+    /*a refused CONNECT, the CONNACK telling so went out with the write*/
+    if(SUCESS == ret && CS_DISCONNECT == client->state)
     {
-        goto handle_read_error;
+        return ERROR_SOCK_REFUSED;
     }
     
-    packet->current_pos += remain_counter;
-    packet->remain_len = remainlen_value;
-    packet->load = load;
-        
+    return ret;
+}
+
+STATIC INT32 process_packet(Client *client, Packet *packet)
+{
+    Packet *out_packet;
+    
 #ifdef DEBUG
     printf("\n%s %d \n\
         \t type: %s\n\
@@ -219,75 +396,287 @@ INT32 iotbroker_read_packet(UINT32 sock_fd)
     out_packet = NULL;
     if(handle_packet(client, packet, &out_packet) != SUCESS)
     {
-        goto handle_read_error;
+        return ERROR_SOCK_PACKET_ERROR;
     }
     INVALID_RETURN_VALUE(out_packet != NULL, SUCESS);
     
-    write_packet(out_packet, &write_buf, &write_buf_len);
-    ret = write(sock_fd, write_buf,  write_buf_len);
+    return send_out_packet(client, out_packet);
+}
+
+/*
+ * Charge a PUBLISH to the rate limits before anything is allocated for it,
+ * an aliased one to the topic of its alias. A malformed one is left to
+ * handle_publish to reject.
+ */
+STATIC UINT32 within_rate(Client *client, Packet *packet, UINT32 packet_len)
+{
+    CONST UINT8 *topic;
+    UINT32 topic_len;
+
+    INVALID_RETURN_VALUE(PUBLISH == packet->type, TRUE);
+
+    topic = handle_publish_topic(client, packet, &topic_len);
+    INVALID_RETURN_VALUE(topic != NULL, TRUE);
+
+    return SUCESS == iotbroker_ratelimit_publish(&client->limit, topic, topic_len, packet_len);
+}
+
+/*
+ * Handle up to *packets complete packets in data, after the bytes kept in
+ * the client, and keep the rest there. len 0 handles the kept ones only.
+ * A client over its rate is paused with the PUBLISH kept, or dropped.
+ */
+STATIC INT32 receive_bytes(Client *client, UINT8 *data, UINT32 len, UINT32 *packets)
+{
+    UINT32 pos = 0;
+    INT32 packet_len, ret;
     
-#ifdef DEBUG
-    print_hex2num(write_buf, write_buf_len);
-#endif   
- 
-    iotbroker_free(write_buf);
-    write_buf = NULL;
+    if(len != 0)
+    {
+        /*checked lazily by the keepalive timer*/
+        client->last_seen = (UINT32)iotbroker_time_now();
+        iotbroker_metrics_add(METRIC_BYTES_IN, len);
+    }
     
-    if(ret <= 0)
+    /*continue a partial packet, or the packets the budget left*/
+    if(client->rx_len != 0)
     {
-        goto handle_read_error;
+        if(len != 0)
+        {
+            reserve_buf(&client->rx_buf, &client->rx_size, client->rx_len, client->rx_len + len);
+            memcpy(client->rx_buf + client->rx_len, data, len);
+            client->rx_len += len;
+        }
+        
+        data = client->rx_buf;
+        len = client->rx_len;
+    }
+    
+    while(pos < len && *packets != 0)
+    {
+        Packet packet;
+        
+        packet_len = decode_packet(data + pos, len - pos, &packet);
+        if(packet_len < 0)
+        {
+            return ERROR_SOCK_PACKET_ERROR;
+        }
+        else if(0 == packet_len)
+        {
+            break;
+        }
+        
+        if(!within_rate(client, &packet, packet_len))
+        {
+            if(RATE_LIMIT_DISCONNECT == iotbroker_config_get()->rate_limit_action)
+            {
+                return ERROR_SOCK_RATE_LIMIT;
+            }
+            
+            iotbroker_session_ready(client, READY_PAUSED);
+            break;
+        }
+        
+        ret = process_packet(client, &packet);
+        if(ret != SUCESS)
+        {
+            return ret;
+        }
+        
+        pos += packet_len;
+        (*packets)--;
+        
+        /*the packets behind a CONNECT wait for its credential check*/
+        if(CS_AUTHENTICATING == client->state)
+        {
+            break;
+        }
     }
     
-    if(load != NULL)
+    if(data == client->rx_buf)
+    {
+        memmove(client->rx_buf, client->rx_buf + pos, len - pos);
+    }
+    else if(pos < len)
     {
-        iotbroker_free(load);
-        load = NULL;
+        reserve_buf(&client->rx_buf, &client->rx_size, 0, len - pos);
+        memcpy(client->rx_buf, data + pos, len - pos);
     }
+    client->rx_len = len - pos;
     
-    if(packet != NULL)
+    if(0 == client->rx_len)
     {
-        iotbroker_free(packet);
-        packet = NULL;
+        release_buf(&client->rx_buf, &client->rx_size);
     }
     
     return SUCESS;
+}
+
+INT32 iotbroker_receive_bytes(UINT32 sock_fd, UINT8 *data, UINT32 len)
+{
+    Client *client = NULL;
+    
+    UINT32 packets = BUDGET_UNLIMITED;
+    
+    iotbroker_session_get(sock_fd, &client);
+    INVALID_RETURN_VALUE(client != NULL, ERROR_SOCK_CLIENT_NOEXIST);
+    
+    INVALID_RETURN_VALUE(SUCESS == receive_bytes(client, data, len, &packets), ERROR_SOCK_PACKET_ERROR);
+    
+    return SUCESS;
+}
+
+/*the rate limits or a credential check stopped the reads of the client*/
+STATIC UINT32 is_paused(Client *client)
+{
+    return (client->ready & CLIENT_READY(READY_PAUSED)) != 0 || CS_AUTHENTICATING == client->state;
+}
+
+INT32 iotbroker_connect_done(UINT32 sock_fd, UINT8 con_ret)
+{
+    Client *client = NULL;
+    Packet *out_packet = NULL;
+    INT32 ret;
     
-handle_read_error:
+    iotbroker_session_get(sock_fd, &client);
+    INVALID_RETURN_VALUE(client != NULL, ERROR_SOCK_CLIENT_NOEXIST);
     
-    if(load != NULL)
+    handle_connect_done(client, con_ret, &out_packet);
+    ret = send_out_packet(client, out_packet);
+    INVALID_RETURN_VALUE(SUCESS == ret, ret);
+    
+    /*packets read behind the CONNECT are handled in the next round*/
+    if(client->rx_len != 0)
     {
-        iotbroker_free(load);
-        load = NULL;
+        iotbroker_session_ready(client, READY_INPUT);
     }
     
-    if(packet != NULL)
+    return SUCESS;
+}
+
+/*
+ * Read and handle what the budgets of the round allow. A client stopped
+ * by them is marked READY_INPUT and carries on in the next round, the
+ * socket may still hold bytes or the buffer complete packets. A paused
+ * client is not read, its socket fills up and TCP slows the sender down.
+ */
+INT32 iotbroker_read_packet(UINT32 sock_fd)
+{
+    CONST Config *config = iotbroker_config_get();
+    Client *client = NULL;
+    UINT32 bytes, packets, size, more = TRUE;
+    INT32 ret, err;
+
+    iotbroker_session_get(sock_fd, &client);
+    if(NULL == client)
     {
-        iotbroker_free(packet);
-        packet = NULL;
+        return ERROR_SOCK_CLIENT_NOEXIST;
     }
     
-    if(0 == ret)
+    INVALID_RETURN_VALUE(!is_paused(client), SUCESS);
+    
+    bytes = (config->read_budget != 0) ? config->read_budget : BUDGET_UNLIMITED;
+    packets = (config->packet_budget != 0) ? config->packet_budget : BUDGET_UNLIMITED;
+    
+    if(client->rx_len != 0)
     {
-        return ERROR_SOCK_CLIENT_CLOSE;
+        err = receive_bytes(client, NULL, 0, &packets);
+        if(err != SUCESS)
+        {
+            return err;
+        }
     }
-    else if(-1 == ret)
+    
+    while(packets != 0 && bytes != 0 && !is_paused(client))
     {
-        return ERROR_SOCK_READ_WRITE;
+        size = MIN(READ_BUF_SIZE, bytes);
+        ret = read(sock_fd, t_read_buf, size);
+        if(0 == ret)
+        {
+            return ERROR_SOCK_CLIENT_CLOSE;
+        }
+        else if(ret < 0)
+        {
+            if(EINTR == errno)
+            {
+                continue;
+            }
+            
+            if(EAGAIN == errno || EWOULDBLOCK == errno)
+            {
+                more = FALSE;
+                break;
+            }
+            
+            return ERROR_SOCK_READ_WRITE;
+        }
+        
+        IOTBROKER_PROBE2(read__packet, sock_fd, ret);
+        iotbroker_capture_data(sock_fd, t_read_buf, ret);
+        bytes -= ret;
+        
+        err = receive_bytes(client, t_read_buf, ret, &packets);
+        if(err != SUCESS)
+        {
+            return err;
+        }
+        
+        /*drained, no need for another read call*/
+        if((UINT32)ret < size)
+        {
+            more = (0 == packets);
+            break;
+        }
     }
-    else
+    
+    if(more && !is_paused(client))
     {
-        return ERROR_SOCK_PACKET_ERROR;
+        iotbroker_session_ready(client, READY_INPUT);
     }
+    
+    return SUCESS;
 }
 
 /*write packet to buffer*/
-INT32 iotbroker_write_packet(UINT32 sock_fd)
+/*payload bytes of the deliveries waiting, counted up to limit*/
+STATIC UINT32 queued_bytes(MessageQueue *mq, UINT32 limit)
+{
+    UINT32 seq, bytes = 0;
+
+    for(seq = mq->send; seq != mq->tail && bytes < limit; seq++)
+    {
+        MessageEntry *me = MESSAGE_QUEUE_ENTRY(mq, seq);
+
+        if(me->ms != NULL && MD_OUT == me->dir)
+        {
+            bytes += me->ms->packet->content_len;
+        }
+    }
+
+    return bytes;
+}
+
+/*a corked socket sends full segments only, uncorking pushes the rest*/
+STATIC VOID set_cork(Client *client, INT32 cork)
 {
+    setsockopt(client->sock_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+/*
+ * The deliveries of a round are encoded into t_write_buf and leave in one
+ * write, or one per WRITE_BUF_SIZE. A client of a latency listener writes
+ * them in the round they are queued. One of a throughput listener holds
+ * them in READY_BATCH until the window closes or batch_bytes are waiting,
+ * then writes them corked, in full segments.
+ */
+INT32 iotbroker_write_packet(UINT32 sock_fd, UINT32 flush)
+{
+    CONST Config *config = iotbroker_config_get();
     Client *client = NULL;
-    struct list_head *pos;
-    MessageQueue *mq_head;
+    MessageQueue *mq;
     Packet *packet;
-    INT32 ret = SUCESS;
+    UINT32 packets, window, now_sec, batched = 0, corked = FALSE;
+    INT32 ret;
     
     iotbroker_session_get(sock_fd, &client);
     if(NULL == client)
@@ -295,54 +684,122 @@ INT32 iotbroker_write_packet(UINT32 sock_fd)
         return ERROR_SOCK_CLIENT_NOEXIST;
     }
     
-    mq_head = client->mq_head;
-    list_for_each(pos, &mq_head->list_mount)
+    ret = flush_buf(client);
+    if(ret != SUCESS)
+    {
+        return ret;
+    }
+    
+    packets = (config->packet_budget != 0) ? config->packet_budget : BUDGET_UNLIMITED;
+    window = iotbroker_session_inflight_window(client);
+    now_sec = iotbroker_time_sec();
+    mq = &client->mq;
+    
+    if(client->batching && mq->send != mq->tail && 0 == client->tx_len)
+    {
+        if(!flush && queued_bytes(mq, config->batch_bytes) < config->batch_bytes)
+        {
+            iotbroker_session_ready(client, READY_BATCH);
+            return SUCESS;
+        }
+        set_cork(client, TRUE);
+        corked = TRUE;
+    }
+    
+    /*stop when the socket is full, the rest stays queued*/
+    while(mq->send != mq->tail && 0 == client->tx_len)
     {
+        /*the budget is spent, the rest goes out in the next round*/
+        if(0 == packets)
+        {
+            iotbroker_session_ready(client, READY_OUTPUT);
+            break;
+        }
+        
         INT8 *out_buf;
         INT32 write_buf_len;
-        INT32 ret;
+        UINT32 seq = mq->send;
         
-        MessageQueue *mq = container_of(pos, MessageQueue, list_mount);
+        MessageEntry *me = MESSAGE_QUEUE_ENTRY(mq, seq);
+        
+        /*the in-flight window is full, the rest stays queued in order until acks open it*/
+        if(me->ms != NULL && MD_OUT == me->dir && me->qos != QOS0 && window != 0 && mq->inflight >= window)
+        {
+            break;
+        }
+        mq->send++;
+        
+        if(NULL == me->ms || MD_IN == me->dir)
+        {
+            continue;
+        }
         
-        if(MD_IN == mq->dir)
+        /*expired while queued, dropped instead of delivered late*/
+        if(iotbroker_message_queue_expire(mq, seq, now_sec))
         {
             continue;
         }
         
-        if(HANDLE_RET_REMOVE_MSG == handle_message_queue(client, mq, &packet))
+        packet = NULL;
+        if(HANDLE_RET_REMOVE_MSG == handle_message_queue(client, me, &packet))
         {
-            list_del(pos);         
+            iotbroker_message_queue_remove(mq, seq);
+        }
+        
+        if(NULL == packet)
+        {
+            continue;
         }
         
         write_packet(packet, &out_buf, &write_buf_len);
 #ifdef DEBUG
         print_hex2num(out_buf, write_buf_len);
 #endif            
-        ret = write(sock_fd, out_buf, write_buf_len);
+        ret = SUCESS;
+        if(batched + write_buf_len > WRITE_BUF_SIZE)
+        {
+            ret = send_buf(client, t_write_buf, batched, OUT_LANE_PUBLISH);
+            batched = 0;
+        }
+        
+        /*too large to batch*/
+        if(SUCESS == ret && write_buf_len > WRITE_BUF_SIZE)
+        {
+            ret = send_buf(client, out_buf, write_buf_len, OUT_LANE_PUBLISH);
+        }
+        else if(SUCESS == ret)
+        {
+            memcpy(t_write_buf + batched, out_buf, write_buf_len);
+            batched += write_buf_len;
+        }
             
         iotbroker_free(out_buf);
         out_buf = NULL;
             
-        if(ret <= 0)
+        if(ret != SUCESS)
         {
-            goto handle_write_error;
+            return ret;
         }  
+        packets--;
     }
     
-    return SUCESS;
-    
-handle_write_error:
-
-    if(0 == ret)
-    {
-        return ERROR_SOCK_CLIENT_CLOSE;
-    }
-    else if(-1 == ret)
+    if(batched != 0)
     {
-        return ERROR_SOCK_READ_WRITE;
+        ret = send_buf(client, t_write_buf, batched, OUT_LANE_PUBLISH);
+        if(ret != SUCESS)
+        {
+            return ret;
+        }
     }
-    else
+    
+    if(corked)
     {
-        return ERROR_SOCK_PACKET_ERROR;
+        set_cork(client, FALSE);
     }
+    
+    iotbroker_message_queue_shrink(mq);
+    
+    IOTBROKER_PROBE3(write__packet, sock_fd, mq->tail - mq->send, client->tx_len);
+    
+    return SUCESS;
 }
@@ -14,6 +14,41 @@
 
 #define ERROR_SOCK_CLIENT_NOEXIST 0x04
 
+#define ERROR_SOCK_RATE_LIMIT 0x05
+
+#define ERROR_SOCK_REFUSED 0x06
+
+/*largest remain length accepted, default of max_packet_size*/
+#define PACKET_MAX_LEN (256 * 1024)
+
+/*bytes read from a socket at a time*/
+#define READ_BUF_SIZE (64 * 1024)
+
+/*bytes and packets a client gets per round, defaults of read_budget and packet_budget*/
+#define READ_BUDGET (256 * 1024)
+#define PACKET_BUDGET 256
+#define BUDGET_UNLIMITED 0xFFFFFFFF
+
+/*deliveries coalesced into one write*/
+#define WRITE_BUF_SIZE (64 * 1024)
+
+/*defaults of batch_delay, microseconds, and batch_bytes*/
+#define BATCH_DELAY 1000
+#define BATCH_BYTES (16 * 1024)
+
+/*first size of the receive and send buffers*/
+#define BUF_MIN_SIZE 256
+
+/*unsent bytes kept for a client before it is dropped, default of max_send_buffer*/
+#define SEND_BUF_MAX_LEN (1024 * 1024)
+
+/*lanes of the send buffer*/
+enum out_lane
+{
+    OUT_LANE_CONTROL, /*CONNACK, acks, SUBACK, PINGRESP, ahead of the queued PUBLISH bytes*/
+    OUT_LANE_PUBLISH, /*deliveries, in queue order*/
+};
+
 enum control_type
 {
     MIN_CONTROL_TYPE = 0,
@@ -37,8 +72,10 @@ enum control_type
 typedef struct
 {
     UINT16 packet_id;
+    UINT16 topic_len; /*topic bytes of a published message*/
     UINT8 *topic;
-    UINT8 *content;
+    UINT8 *content; /*zero terminated for the debug dumps only*/
+    UINT32 content_len; /*payload bytes, they may contain zeros*/
     UINT8 qos;
     UINT8 dup;
     UINT8 retain;
@@ -54,10 +91,23 @@ typedef struct
     UINT32 load_pos;
 } Packet;
 
-/*read packet from buffer*/
+/*name of every control type, indexed by enum control_type*/
+extern CONST INT8 *g_control_type_str[];
+
+/*read and handle packets within the budgets of the round*/
 INT32 iotbroker_read_packet(UINT32 sock_fd);
 
-/*write packet to buffer*/
-INT32 iotbroker_write_packet(UINT32 sock_fd);
+/*handle bytes as if read from the socket, the replay tool feeds captures through it*/
+INT32 iotbroker_receive_bytes(UINT32 sock_fd, UINT8 *data, UINT32 len);
+
+/*
+ * Write the queued messages within the packet budget of the round. A
+ * client of a throughput listener holds them until flush is TRUE or
+ * batch_bytes are waiting.
+ */
+INT32 iotbroker_write_packet(UINT32 sock_fd, UINT32 flush);
+
+/*send the CONNACK of a CONNECT whose credentials were checked, reads resume*/
+INT32 iotbroker_connect_done(UINT32 sock_fd, UINT8 con_ret);
 
 #endif
@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include "iotbroker.h"
+#include "ratelimit.h"
+#include "config.h"
+#include "timer.h"
+#include "metrics.h"
+#include "debug.h"
+
+/*buckets of config topic_limit, by index, kept across reloads*/
+STATIC RateLimit g_topic_limit[CONFIG_MAX_TOPIC_LIMITS];
+
+/*add the tokens earned since the stamp, the stamp moves by the time they took*/
+STATIC VOID bucket_refill(TokenBucket *tb, UINT32 rate, UINT32 now)
+{
+    UINT32 elapsed = now - tb->stamp;
+    U64 earned;
+
+    if(elapsed >= 1000)
+    {
+        tb->tokens = rate;
+        tb->stamp = now;
+        return;
+    }
+
+    earned = (U64)elapsed * rate / 1000;
+    INVALID_RETURN_NOVALUE(earned != 0);
+
+    tb->stamp += earned * 1000 / rate;
+    tb->tokens = MIN((U64)rate, tb->tokens + earned);
+    if(tb->tokens == rate)
+    {
+        tb->stamp = now;
+    }
+}
+
+/*a cost above the burst passes on a full bucket*/
+STATIC UINT32 bucket_enough(TokenBucket *tb, UINT32 rate, UINT32 cost, UINT32 now)
+{
+    INVALID_RETURN_VALUE(rate != 0, TRUE);
+
+    bucket_refill(tb, rate, now);
+
+    return tb->tokens >= MIN(cost, rate);
+}
+
+STATIC VOID bucket_take(TokenBucket *tb, UINT32 rate, UINT32 cost)
+{
+    INVALID_RETURN_NOVALUE(rate != 0);
+
+    tb->tokens -= MIN(cost, tb->tokens);
+}
+
+UINT32 iotbroker_ratelimit_publish(RateLimit *client_limit, CONST UINT8 *topic, UINT32 topic_len, UINT32 len)
+{
+    CONST Config *config = iotbroker_config_get();
+    CONST TopicLimitConfig *tl = NULL;
+    RateLimit *topic_limit = NULL;
+    UINT32 now = (UINT32)iotbroker_time_now();
+    UINT32 i;
+
+    /*the first prefix listed wins*/
+    for(i = 0; i < config->topic_limit_num; i++)
+    {
+        UINT32 prefix_len = strlen(config->topic_limit[i].prefix);
+
+        if(prefix_len <= topic_len && 0 == memcmp(topic, config->topic_limit[i].prefix, prefix_len))
+        {
+            tl = &config->topic_limit[i];
+            topic_limit = &g_topic_limit[i];
+            break;
+        }
+    }
+
+    if(!bucket_enough(&client_limit->msgs, config->client_msg_rate, 1, now)
+        || !bucket_enough(&client_limit->bytes, config->client_byte_rate, len, now)
+        || (tl != NULL && (!bucket_enough(&topic_limit->msgs, tl->msg_rate, 1, now)
+            || !bucket_enough(&topic_limit->bytes, tl->byte_rate, len, now))))
+    {
+        iotbroker_metrics_add(METRIC_MSG_RATE_LIMITED, 1);
+        return FAILED;
+    }
+
+    bucket_take(&client_limit->msgs, config->client_msg_rate, 1);
+    bucket_take(&client_limit->bytes, config->client_byte_rate, len);
+    if(tl != NULL)
+    {
+        bucket_take(&topic_limit->msgs, tl->msg_rate, 1);
+        bucket_take(&topic_limit->bytes, tl->byte_rate, len);
+    }
+
+    return SUCESS;
+}
@@ -0,0 +1,37 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include "iotbroker.h"
+
+/*what happens to a client publishing over its rate, rate_limit_action*/
+enum rate_limit_action
+{
+    RATE_LIMIT_PAUSE, /*the socket is not read until the buckets refill*/
+    RATE_LIMIT_DISCONNECT, /*the connection is dropped*/
+};
+
+/*
+ * Holds up to one second worth of rate, refilled lazily from the cached
+ * millisecond clock when taken from. A zeroed bucket is full.
+ */
+typedef struct
+{
+    UINT32 tokens;
+    UINT32 stamp; /*ms clock the tokens were refilled up to*/
+}TokenBucket;
+
+/*the message and byte buckets of a client or a topic prefix*/
+typedef struct
+{
+    TokenBucket msgs;
+    TokenBucket bytes;
+}RateLimit;
+
+/*
+ * Charge a PUBLISH of len bytes on topic to the client and to the topic
+ * prefix it falls under, FAILED and nothing charged when a bucket is short.
+ * topic need not be terminated.
+ */
+UINT32 iotbroker_ratelimit_publish(RateLimit *client_limit, CONST UINT8 *topic, UINT32 topic_len, UINT32 len);
+
+#endif
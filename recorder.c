@@ -0,0 +1,284 @@
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "iotbroker.h"
+#include "memmanager.h"
+#include "recorder.h"
+#include "protocol.h"
+#include "net.h"
+#include "debug.h"
+
+/*a line never gets close to this*/
+#define RECORDER_LINE_LEN 128
+
+/*stack of the fatal signal handler, a stack overflow leaves none*/
+#define RECORDER_ALTSTACK_SIZE (64 * 1024)
+
+STATIC CONST INT8 *g_recorder_type_name[REC_TYPE_NUM] = {
+    "accept",
+    "close",
+    "packet",
+    "queue_limit",
+    "timer",
+    "reload",
+    "signal",
+    "overload",
+};
+
+STATIC CONST INT8 *g_recorder_close_name[CLOSE_REASON_NUM] = {
+    "read_error",
+    "write_error",
+    "connect_timeout",
+    "keepalive",
+};
+
+STATIC CONST INT8 *g_recorder_timer_name[REC_TIMER_NUM] = {
+    "connect",
+    "keepalive",
+    "metrics",
+    "http",
+};
+
+STATIC CONST INT32 g_recorder_fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+/*shared by the threads never registered, e.g. before main registers*/
+STATIC RecorderThread g_recorder_unregistered;
+
+STATIC RecorderThread *g_recorder_threads = &g_recorder_unregistered;
+
+STATIC UINT32 g_recorder_thread_num = 0;
+
+STATIC pthread_mutex_t g_recorder_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread RecorderThread *t_recorder_thread = &g_recorder_unregistered;
+
+STATIC INT8 g_recorder_file[RECORDER_PATH_LEN] = RECORDER_DEFAULT_FILE;
+
+STATIC volatile sig_atomic_t g_recorder_dump_requested = FALSE;
+
+STATIC UINT8 g_recorder_altstack[RECORDER_ALTSTACK_SIZE];
+
+VOID iotbroker_recorder_register()
+{
+    RecorderThread *rt;
+
+    INVALID_RETURN_NOVALUE(t_recorder_thread == &g_recorder_unregistered);
+
+    rt = (RecorderThread*)iotbroker_malloc(sizeof(RecorderThread), MEM_OTHER);
+    assert(rt != NULL);
+    memset(rt, 0, sizeof(RecorderThread));
+
+    pthread_mutex_lock(&g_recorder_lock);
+    rt->id = ++g_recorder_thread_num;
+    rt->next = g_recorder_threads;
+    /*the signal handler walks the list without the lock*/
+    __atomic_store_n(&g_recorder_threads, rt, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_recorder_lock);
+
+    t_recorder_thread = rt;
+}
+
+VOID iotbroker_recorder_set_file(CONST INT8 *path)
+{
+    assert(path != NULL);
+
+    strncpy(g_recorder_file, path, RECORDER_PATH_LEN - 1);
+}
+
+STATIC UINT32 append_str(INT8 *buf, UINT32 len, CONST INT8 *str)
+{
+    while(*str != '\0' && len < RECORDER_LINE_LEN - 1)
+    {
+        buf[len++] = *str++;
+    }
+
+    return len;
+}
+
+/*snprintf is not async signal safe*/
+STATIC UINT32 append_num(INT8 *buf, UINT32 len, LONG num)
+{
+    INT8 digits[24];
+    UINT32 i = 0;
+    ULONG value = (num < 0) ? -(ULONG)num : (ULONG)num;
+
+    do
+    {
+        digits[i++] = '0' + value % 10;
+        value /= 10;
+    }while(value != 0);
+
+    if(num < 0)
+    {
+        digits[i++] = '-';
+    }
+
+    while(i > 0 && len < RECORDER_LINE_LEN - 1)
+    {
+        buf[len++] = digits[--i];
+    }
+
+    return len;
+}
+
+/*name of the code, NULL when the type has none*/
+STATIC CONST INT8* code_name(CONST RecorderEvent *ev)
+{
+    switch(ev->type)
+    {
+        case REC_CLOSE:
+            return (ev->code < CLOSE_REASON_NUM) ? g_recorder_close_name[ev->code] : NULL;
+
+        case REC_PACKET:
+            return (ev->code < MAX_CONTROL_TYPE) ? g_control_type_str[ev->code] : NULL;
+
+        case REC_TIMER:
+            return (ev->code < REC_TIMER_NUM) ? g_recorder_timer_name[ev->code] : NULL;
+
+        default:
+            return NULL;
+    }
+}
+
+/*"time type fd=N code value"*/
+STATIC UINT32 format_event(CONST RecorderEvent *ev, INT8 *buf)
+{
+    CONST INT8 *name = code_name(ev);
+    UINT32 len = 0;
+
+    len = append_num(buf, len, ev->time);
+    len = append_str(buf, len, " ");
+    len = append_str(buf, len, (ev->type < REC_TYPE_NUM) ? g_recorder_type_name[ev->type] : "unknown");
+    len = append_str(buf, len, " fd=");
+    len = append_num(buf, len, ev->fd);
+    len = append_str(buf, len, " ");
+    len = (name != NULL) ? append_str(buf, len, name) : append_num(buf, len, ev->code);
+    len = append_str(buf, len, " ");
+    len = append_num(buf, len, ev->value);
+    buf[len++] = '\n';
+
+    return len;
+}
+
+VOID iotbroker_recorder_dump(VOID (*out)(CONST INT8 *line, UINT32 len, VOID *arg), VOID *arg)
+{
+    RecorderThread *rt;
+    INT8 line[RECORDER_LINE_LEN];
+    UINT32 len;
+
+    assert(out != NULL);
+
+    for(rt = __atomic_load_n(&g_recorder_threads, __ATOMIC_ACQUIRE); rt != NULL; rt = rt->next)
+    {
+        U64 pos = __atomic_load_n(&rt->pos, __ATOMIC_RELAXED);
+        U64 i = (pos > RECORDER_EVENTS) ? pos - RECORDER_EVENTS : 0;
+
+        if(0 == pos)
+        {
+            continue;
+        }
+
+        len = append_str(line, 0, "# thread ");
+        len = append_num(line, len, rt->id);
+        len = append_str(line, len, ", ");
+        len = append_num(line, len, pos);
+        len = append_str(line, len, " events, clock ");
+        len = append_num(line, len, (UINT32)iotbroker_time_now());
+        line[len++] = '\n';
+        out(line, len, arg);
+
+        for( ; i < pos; i++)
+        {
+            len = format_event(&rt->event[i % RECORDER_EVENTS], line);
+            out(line, len, arg);
+        }
+    }
+}
+
+STATIC VOID write_line(CONST INT8 *line, UINT32 len, VOID *arg)
+{
+    INT32 fd = *(INT32*)arg;
+
+    while(len > 0)
+    {
+        ssize_t ret = write(fd, line, len);
+
+        if(ret <= 0)
+        {
+            return;
+        }
+        line += ret;
+        len -= ret;
+    }
+}
+
+STATIC UINT32 dump_to_file()
+{
+    INT32 fd;
+
+    INVALID_RETURN_VALUE(g_recorder_file[0] != '\0', FAILED);
+
+    fd = open(g_recorder_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    INVALID_RETURN_VALUE(fd >= 0, FAILED);
+
+    iotbroker_recorder_dump(write_line, &fd);
+    close(fd);
+
+    return SUCESS;
+}
+
+STATIC VOID handle_fatal_signal(INT32 signo)
+{
+    iotbroker_record(REC_SIGNAL, -1, signo, 0);
+    dump_to_file();
+
+    /*SA_RESETHAND put the default action back, die of the signal once it returns*/
+    raise(signo);
+}
+
+STATIC VOID handle_sigusr1(INT32 signo)
+{
+    g_recorder_dump_requested = TRUE;
+}
+
+VOID iotbroker_recorder_run()
+{
+    INVALID_RETURN_NOVALUE(g_recorder_dump_requested);
+    g_recorder_dump_requested = FALSE;
+
+    if(SUCESS == dump_to_file())
+    {
+        iotbroker_log(LOG_INFO, "flight recorder written to %s", g_recorder_file);
+    }
+    else
+    {
+        iotbroker_log(LOG_WARN, "can not write the flight recorder to \"%s\"", g_recorder_file);
+    }
+}
+
+VOID iotbroker_recorder_init()
+{
+    struct sigaction sa;
+    stack_t ss;
+    UINT32 i;
+
+    ss.ss_sp = g_recorder_altstack;
+    ss.ss_size = RECORDER_ALTSTACK_SIZE;
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_fatal_signal;
+    sa.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    for(i = 0; i < sizeof(g_recorder_fatal_signals) / sizeof(g_recorder_fatal_signals[0]); i++)
+    {
+        sigaction(g_recorder_fatal_signals[i], &sa, NULL);
+    }
+
+    signal(SIGUSR1, handle_sigusr1);
+}
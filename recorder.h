@@ -0,0 +1,93 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include "iotbroker.h"
+#include "timer.h"
+
+/*events kept per thread, a power of two*/
+#define RECORDER_EVENTS 4096
+
+/*longest dump path*/
+#define RECORDER_PATH_LEN 256
+
+/*dump file when the config sets none*/
+#define RECORDER_DEFAULT_FILE "iotbroker-recorder.log"
+
+enum recorder_type
+{
+    REC_ACCEPT, /*fd, value: peer port*/
+    REC_CLOSE, /*fd, code: close_reason, value: error code*/
+    REC_PACKET, /*fd, code: control type, value: remain length*/
+    REC_QUEUE_LIMIT, /*fd, value: queued messages, the new one is dropped*/
+    REC_TIMER, /*fd or -1, code: recorder_timer, value: handler specific*/
+    REC_RELOAD, /*config reloaded*/
+    REC_SIGNAL, /*code: signal number*/
+    REC_OVERLOAD, /*code: shedding started or stopped, value: heap MB*/
+    REC_TYPE_NUM,
+};
+
+enum recorder_timer
+{
+    REC_TIMER_CONNECT, /*CONNECT not received in time*/
+    REC_TIMER_KEEPALIVE, /*value: idle milliseconds*/
+    REC_TIMER_METRICS, /*$SYS publication*/
+    REC_TIMER_HTTP, /*slow admin connection*/
+    REC_TIMER_NUM,
+};
+
+/*16 bytes, the thread number and order come from the ring*/
+typedef struct
+{
+    UINT32 time; /*low 32 bits of the millisecond clock*/
+    UINT16 type;
+    UINT16 code;
+    INT32 fd;
+    UINT32 value;
+}RecorderEvent;
+
+typedef struct recorder_thread
+{
+    U64 pos; /*events recorded, the next goes to pos % RECORDER_EVENTS*/
+    UINT32 id; /*registration order*/
+    RecorderEvent event[RECORDER_EVENTS];
+    struct recorder_thread *next;
+}RecorderThread;
+
+extern __thread RecorderThread *t_recorder_thread;
+
+/*always on, a handful of plain stores into the thread's own ring*/
+static inline VOID iotbroker_record(UINT32 type, INT32 fd, UINT32 code, UINT32 value)
+{
+    RecorderThread *rt = t_recorder_thread;
+    RecorderEvent *ev = &rt->event[rt->pos % RECORDER_EVENTS];
+
+    ev->time = (UINT32)iotbroker_time_now();
+    ev->type = type;
+    ev->code = code;
+    ev->fd = fd;
+    ev->value = value;
+    rt->pos++;
+}
+
+/*
+ * Dump the rings to the recorder file on SIGSEGV, SIGBUS, SIGFPE, SIGILL
+ * and SIGABRT, then die of the signal as before, and on SIGUSR1.
+ */
+VOID iotbroker_recorder_init();
+
+/*give the calling thread its own ring*/
+VOID iotbroker_recorder_register();
+
+/*file written by the signals, "" writes none*/
+VOID iotbroker_recorder_set_file(CONST INT8 *path);
+
+/*write the dump requested by SIGUSR1*/
+VOID iotbroker_recorder_run();
+
+/*
+ * Text form of every ring, oldest event first, one line per event. Only
+ * uses async signal safe calls, the fatal signal handler calls it.
+ */
+VOID iotbroker_recorder_dump(VOID (*out)(CONST INT8 *line, UINT32 len, VOID *arg), VOID *arg);
+
+#endif
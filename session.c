@@ -6,171 +6,413 @@
 #include "session.h"
 #include "message.h"
 #include "list.h"
-#include "uthash.h"
 #include "debug.h"
+#include "subtree.h"
+#include "epoch.h"
+#include "config.h"
+#include "timer.h"
+#include "net.h"
+#include "metrics.h"
+#include "probe.h"
+#include "recorder.h"
+#include "capture.h"
+#include "acl.h"
+#include "auth.h"
 
-STATIC Client *g_client_session_head = NULL;
+/*sessions indexed by socket fd*/
+STATIC Client **g_client_table = NULL;
 
-STATIC VOID display_session_table()
+STATIC UINT32 g_client_table_size = 0;
+
+STATIC UINT32 g_client_num = 0;
+
+typedef struct
+{
+    INT32 *fds;
+    UINT32 num;
+    UINT32 size;
+}ReadyList;
+
+/*fds of the clients marked ready since the round of each kind began*/
+STATIC ReadyList g_ready[READY_KIND_NUM];
+
+/*fds of the round being served*/
+STATIC ReadyList g_ready_round[READY_KIND_NUM];
+
+/*make the table cover sockfd*/
+STATIC VOID grow_session_table(UINT32 sockfd)
 {
-    Client *c_debug, *c_tmp;
-    
-    printf("\nclient session table as follow:\n");
-    printf("=====================================\n");
-    printf(" socknum        ip:port        state\n");
-    printf("-------------------------------------\n");
-    HASH_ITER(hh, g_client_session_head, c_debug, c_tmp)
+    Client **table;
+    UINT32 size;
+
+    size = (g_client_table_size != 0) ? g_client_table_size : iotbroker_config_get()->session_table_size;
+    while(size <= sockfd)
     {
-        printf("%8d %s:%d %6d\n", c_debug->sock_fd, c_debug->address, c_debug->port, c_debug->state);
+        size *= 2;
     }
-    printf("=====================================\n");
+
+    table = (Client**)iotbroker_malloc(size * sizeof(Client*), MEM_SESSION);
+    assert(table != NULL);
+    memset(table, 0, size * sizeof(Client*));
+
+    if(g_client_table != NULL)
+    {
+        memcpy(table, g_client_table, g_client_table_size * sizeof(Client*));
+        iotbroker_free(g_client_table);
+    }
+
+    g_client_table = table;
+    g_client_table_size = size;
+}
+
+STATIC Client* find_session(UINT32 sockfd)
+{
+    INVALID_RETURN_VALUE(sockfd < g_client_table_size, NULL);
+
+    return g_client_table[sockfd];
 }
 
 VOID iotbroker_session_get(UINT32 sockfd, Client **client)
 {
     assert(client != NULL);
-    
-    HASH_FIND_INT(g_client_session_head, &sockfd, *client); 
+
+    *client = find_session(sockfd);
+}
+
+/*
+ * The timer is not moved on every packet: when it fires and bytes came in
+ * since, it is armed again for the rest of the period.
+ */
+STATIC VOID keepalive_expired(TimerNode *tn)
+{
+    Client *c = container_of(tn, Client, keepalive_timer);
+    UINT32 timeout, idle;
+
+    if(CS_WAIT_FOR_CONNECT == c->state)
+    {
+        iotbroker_log(LOG_INFO, "%s:%d sent no CONNECT in time", c->address, c->port);
+        iotbroker_record(REC_TIMER, c->sock_fd, REC_TIMER_CONNECT, 0);
+        iotbroker_net_close(c->sock_fd, CLOSE_CONNECT_TIMEOUT);
+        return;
+    }
+
+    /*one and a half keep alive period as the spec says*/
+    timeout = c->keepalive * 1500;
+    idle = (UINT32)iotbroker_time_now() - c->last_seen;
+    iotbroker_record(REC_TIMER, c->sock_fd, REC_TIMER_KEEPALIVE, idle);
+    if(idle < timeout)
+    {
+        iotbroker_timer_add(tn, timeout - idle);
+        return;
+    }
+
+    iotbroker_log(LOG_INFO, "%s:%d keep alive expired", c->address, c->port);
+    iotbroker_net_close(c->sock_fd, CLOSE_KEEPALIVE);
 }
 
 VOID iotbroker_session_add(UINT32 sockfd, CONST UINT8 *ip, UINT32 port)
 {
+    CONST Config *config = iotbroker_config_get();
     Client *c;
-    UINT8 *ip_str, ip_len;
-    MessageQueue *mq_head;
-    
+
     assert(ip != NULL);
-    
-    HASH_FIND_INT(g_client_session_head, &sockfd, c); 
+
+    c = find_session(sockfd);
     INVALID_RETURN_NOVALUE(c == NULL);
-    
-    c = (Client*)iotbroker_malloc(sizeof(Client));
+
+    c = (Client*)iotbroker_malloc(sizeof(Client), MEM_SESSION);
     assert(c != NULL);
     memset(c, 0, sizeof(Client));
-    
+
     c->sock_fd = sockfd;
-    
-    ip_len = strlen(ip);
-    ip_str = (UINT8*)iotbroker_malloc(ip_len + 1);
-    assert(ip_str != NULL);
-    memset(ip_str, 0, ip_len + 1);
-    strncpy(ip_str, ip, ip_len);
-    c->address = ip_str;
-    
+
+    strncpy(c->address, ip, INET_ADDRSTRLEN - 1);
+
     c->port = port;
     c->state = CS_WAIT_FOR_CONNECT;
     c->packet_id_source = 1;
-    
-    mq_head = (MessageQueue*)iotbroker_malloc(sizeof(MessageQueue));
-    assert(mq_head != NULL);
-    memset(mq_head, 0, sizeof(mq_head));
-    INIT_LIST_HEAD(&mq_head->list_mount);
-    c->mq_head = mq_head;
-    
-    /*add to hash table*/
-    HASH_ADD_INT(g_client_session_head, sock_fd, c);
- 
-#ifdef DEBUG   
-    display_session_table();
-#endif
 
+    iotbroker_message_queue_init(&c->mq);
+
+    INIT_LIST_HEAD(&c->sub_head);
+
+    c->last_seen = (UINT32)iotbroker_time_now();
+    iotbroker_timer_node_init(&c->keepalive_timer, keepalive_expired);
+    if(config->connect_timeout != 0)
+    {
+        iotbroker_timer_add(&c->keepalive_timer, config->connect_timeout * 1000);
+    }
+
+    /*add to session table*/
+    if(sockfd >= g_client_table_size)
+    {
+        grow_session_table(sockfd);
+    }
+    g_client_table[sockfd] = c;
+    g_client_num++;
+    iotbroker_metrics_add(METRIC_CLIENTS_CONNECTED, 1);
+    iotbroker_metrics_add(METRIC_CLIENTS_TOTAL, 1);
+
+    IOTBROKER_PROBE2(session__add, sockfd, g_client_num);
+    iotbroker_capture_open(sockfd);
 }
 
-UINT32 iotbroker_session_auth(UINT32 sockfd, UINT8 *username, UINT8 *password)
+UINT32 iotbroker_session_auth(UINT32 sockfd, UINT8 *username)
 {
     Client *c = NULL;
-    
-    /*username or password should not be NULL*/
-    assert(username != NULL || password != NULL);
-    
-    HASH_FIND_INT(g_client_session_head, &sockfd, c); 
+
+    assert(username != NULL);
+
+    c = find_session(sockfd);
     INVALID_RETURN_VALUE(c != NULL, FAILED);
-    
+
     c->username = username;
-    c->password = password;
-    
+
     return SUCESS;
 }
 
 VOID iotbroker_session_setid(UINT32 sockfd, UINT8 *client_id)
 {
     Client *c = NULL;
-    
+    UINT32 len;
+
     /*username or password should not be NULL*/
     assert(client_id != NULL);
-    
-    HASH_FIND_INT(g_client_session_head, &sockfd, c); 
+
+    c = find_session(sockfd);
     INVALID_RETURN_NOVALUE(c != NULL);
-    
+
+    if(c->client_id != NULL && c->client_id != c->client_id_buf)
+    {
+        iotbroker_free(c->client_id);
+    }
+
+    /*short ids live in the session, no allocation kept per connection*/
+    len = strlen(client_id);
+    if(len < CLIENT_ID_INLINE_LEN)
+    {
+        memcpy(c->client_id_buf, client_id, len + 1);
+        iotbroker_free(client_id);
+        client_id = c->client_id_buf;
+    }
+
     c->client_id = client_id;
 }
 
-VOID iotbroker_session_clean(UINT32 sockfd)
+/*free the client after every publisher walking the subtree passed a quiescent point*/
+STATIC VOID free_client(VOID *ptr)
 {
-    Client *c = NULL;
-    MessageQueue *mq_head;
-    struct list_head *node_pos, *node_tmp;
-    
-    HASH_FIND_INT(g_client_session_head, &sockfd, c); 
-    INVALID_RETURN_NOVALUE(c != NULL);
-    
-    if(c->client_id != NULL)
+    Client *c = (Client*)ptr;
+
+    if(c->client_id != NULL && c->client_id != c->client_id_buf)
     {
         iotbroker_free(c->client_id);
     }
-    
+
     if(c->username != NULL)
     {
         iotbroker_free(c->username);
     }
-    
-    if(c->password != NULL)
+
+    if(c->rx_buf != NULL)
     {
-        iotbroker_free(c->password);
+        iotbroker_free(c->rx_buf);
     }
-    
-    if(c->address != NULL)
+
+    if(c->tx_buf != NULL)
     {
-        iotbroker_free(c->address);
+        iotbroker_free(c->tx_buf);
     }
-    
-    mq_head = c->mq_head;
-    list_for_each_safe(node_pos, node_tmp, &mq_head->list_mount)
+
+    if(c->v5 != NULL)
     {
-        MessageQueue *mq_tmp;
-        
-        list_del(node_pos);
-        mq_tmp = container_of(node_pos, MessageQueue, list_mount);
-        iotbroker_message_store_deref(mq_tmp->ms);
-        iotbroker_free(mq_tmp);
+        iotbroker_mqtt5_free(c->v5);
     }
-	
-    iotbroker_free(mq_head);
-    HASH_DEL(g_client_session_head, c);
+
+    iotbroker_idset_free(&c->qos2_in);
+    iotbroker_acl_cache_free(c);
+
+    iotbroker_message_queue_clean(&c->mq);
     iotbroker_free(c);
-    
-#ifdef DEBUG   
-    display_session_table();
-#endif
+}
+
+VOID iotbroker_session_clean(UINT32 sockfd)
+{
+    Client *c = NULL;
+
+    c = find_session(sockfd);
+    INVALID_RETURN_NOVALUE(c != NULL);
 
+    /*no new message can reach the client after this*/
+    iotbroker_subtree_unsub_all(c);
+
+    iotbroker_timer_del(&c->keepalive_timer);
+
+    /*a check still in the workers must not answer a later client on this fd*/
+    iotbroker_auth_cancel(c);
+
+    g_client_table[sockfd] = NULL;
+    g_client_num--;
+    iotbroker_metrics_add(METRIC_CLIENTS_CONNECTED, -1);
+
+    iotbroker_capture_close(sockfd);
+    IOTBROKER_PROBE3(session__clean, sockfd, c->mq.tail - c->mq.head - c->mq.dead, g_client_num);
+    iotbroker_epoch_defer(c, free_client);
 }
 
 VOID iotbroker_session_state_mod(UINT32 sockfd, enum client_sate newstate)
 {
     Client *c = NULL;
-    
-    HASH_FIND_INT(g_client_session_head, &sockfd, c); 
-    
+
+    c = find_session(sockfd);
+
     if(NULL == c)
     {
 		/*TODO:disconnect*/
         return;
     }
-    
+
     c->state = newstate;
-    
-#ifdef DEBUG   
-    display_session_table();
-#endif
+}
+
+UINT16 iotbroker_session_keepalive(Client *client, UINT16 keepalive)
+{
+    CONST Config *config = iotbroker_config_get();
+
+    assert(client != NULL);
+
+    if(0 == keepalive)
+    {
+        keepalive = config->keepalive_default;
+    }
+
+    if(config->keepalive_max != 0 && (0 == keepalive || keepalive > config->keepalive_max))
+    {
+        keepalive = config->keepalive_max;
+    }
+
+    client->keepalive = keepalive;
 
+    if(0 == keepalive)
+    {
+        iotbroker_timer_del(&client->keepalive_timer);
+    }
+    else
+    {
+        iotbroker_timer_add(&client->keepalive_timer, keepalive * 1500);
+    }
+
+    return keepalive;
+}
+
+UINT32 iotbroker_session_inflight_window(Client *client)
+{
+    UINT32 window = iotbroker_config_get()->max_inflight;
+
+    if(client->v5 != NULL && (0 == window || client->v5->receive_max < window))
+    {
+        window = client->v5->receive_max;
+    }
+
+    return window;
+}
+
+VOID iotbroker_session_ready(Client *client, UINT32 kind)
+{
+    ReadyList *rl = &g_ready[kind];
+
+    assert(client != NULL && kind < READY_KIND_NUM);
+
+    INVALID_RETURN_NOVALUE(!(client->ready & CLIENT_READY(kind)));
+
+    if(rl->num == rl->size)
+    {
+        INT32 *fds;
+        UINT32 size = (rl->size != 0) ? rl->size * 2 : SESSION_TABLE_MIN_SIZE;
+
+        fds = (INT32*)iotbroker_malloc(size * sizeof(INT32), MEM_SESSION);
+        assert(fds != NULL);
+
+        if(rl->fds != NULL)
+        {
+            memcpy(fds, rl->fds, rl->num * sizeof(INT32));
+            iotbroker_free(rl->fds);
+        }
+
+        rl->fds = fds;
+        rl->size = size;
+    }
+
+    client->ready |= CLIENT_READY(kind);
+    rl->fds[rl->num++] = client->sock_fd;
+}
+
+VOID iotbroker_session_ready_round(UINT32 kind)
+{
+    ReadyList tmp;
+
+    assert(kind < READY_KIND_NUM);
+
+    /*what the previous round did not pop is served first*/
+    INVALID_RETURN_NOVALUE(0 == g_ready_round[kind].num);
+
+    tmp = g_ready_round[kind];
+    g_ready_round[kind] = g_ready[kind];
+    g_ready[kind] = tmp;
+}
+
+UINT32 iotbroker_session_ready_pop(UINT32 kind, INT32 *sockfd)
+{
+    ReadyList *rl = &g_ready_round[kind];
+
+    assert(sockfd != NULL && kind < READY_KIND_NUM);
+
+    while(rl->num > 0)
+    {
+        INT32 fd = rl->fds[--rl->num];
+        Client *c = find_session(fd);
+
+        /*the client may be gone, or the fd reused by a new one*/
+        if(c != NULL && (c->ready & CLIENT_READY(kind)))
+        {
+            c->ready &= ~CLIENT_READY(kind);
+            *sockfd = fd;
+            return SUCESS;
+        }
+    }
+
+    return FAILED;
+}
+
+UINT32 iotbroker_session_ready_pending()
+{
+    UINT32 kind;
+
+    /*the batching window and the paused reads wait for deadlines of their own*/
+    for(kind = 0; kind < READY_BATCH; kind++)
+    {
+        if(iotbroker_session_ready_num(kind) != 0)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+UINT32 iotbroker_session_ready_num(UINT32 kind)
+{
+    assert(kind < READY_KIND_NUM);
+
+    return g_ready[kind].num + g_ready_round[kind].num;
+}
+
+UINT32 iotbroker_session_count()
+{
+    return g_client_num;
+}
+
+UINT32 iotbroker_session_table_size()
+{
+    return g_client_table_size;
 }
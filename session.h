@@ -1,35 +1,103 @@
 #ifndef _SESSION_H_
 #define _SESSION_H_
 
+#include <netinet/in.h>
+
 #include "message.h"
-#include "uthash.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "mqtt5.h"
+#include "idset.h"
+
+/*client id shorter than this is kept inside the session*/
+#define CLIENT_ID_INLINE_LEN 24
+
+/*first size of the fd indexed session table*/
+#define SESSION_TABLE_MIN_SIZE 1024
+
+/*default of max_inflight*/
+#define MAX_INFLIGHT 32
 
 enum client_sate
 {
     CS_WAIT_FOR_CONNECT,
     CS_CONNECTING,
     CS_DISCONNECT,
+    CS_AUTHENTICATING, /*CONNECT read, its password is hashed by the auth workers*/
 };
 
+/*work a client has left for a later round*/
+enum ready_kind
+{
+    READY_OUTPUT, /*messages to drain*/
+    READY_INPUT, /*input the read budget left over*/
+    READY_BATCH, /*deliveries held until the batching window closes, see iotbroker_net_flush*/
+    READY_PAUSED, /*reads stopped by the rate limits, retried every timer tick*/
+    READY_KIND_NUM,
+};
+
+#define CLIENT_READY(kind) (1U << (kind))
+
+/*
+ * Memory budget of an idle connection, which has no partial packet, no
+ * unsent bytes and an empty message queue: sizeof(Client), 240 bytes on
+ * LP64, and its 16 byte accounting header (memmanager.h), plus its 8 byte
+ * slot in the fd indexed session table, about 272 bytes with malloc
+ * overhead. Receive, send and queue buffers are
+ * allocated when traffic shows up and released once drained. Kernel
+ * socket and epoll memory come on top. bench/bench_idle measures it.
+ */
 typedef struct
 {
     INT32 sock_fd; /*client socket fd*/
-    
-    UINT8 *client_id; /*client id*/
-    
+
+    enum client_sate state; /*client state*/
+
     UINT16 packet_id_source; /*packet id gen*/
-    
-    UINT8 *username; /*client username*/
-    UINT8 *password; /*client password*/
-    
-    UINT8 *address; /*client ip address*/
+
     UINT16 port; /*client port*/
-    
-    enum client_sate state; /*client state*/
-    
-    MessageQueue *mq_head; /*message queue*/
-    
-    UT_hash_handle hh; /*hashtable handle*/
+
+    UINT8 ready; /*queued in the ready lists, CLIENT_READY bits*/
+
+    UINT8 epoll_out : 1; /*EPOLLOUT registered*/
+    UINT8 batching : 1; /*accepted on a throughput listener*/
+    UINT8 epoll_paused : 1; /*EPOLLIN removed while READY_PAUSED*/
+
+    UINT16 keepalive; /*negotiated keep alive seconds, 0 never expires*/
+
+    UINT32 last_seen; /*ms clock of the last bytes received*/
+
+    UINT32 tx_head; /*bytes of tx_buf ahead of the PUBLISH lane, see send_buf*/
+
+    TimerNode keepalive_timer; /*connect timeout, then keep alive*/
+
+    UINT8 *client_id; /*client id, points to client_id_buf when short*/
+    UINT8 client_id_buf[CLIENT_ID_INLINE_LEN];
+
+    UINT8 *username; /*client username*/
+    struct auth_job *auth_job; /*credential check in the auth workers (auth.h), NULL when none*/
+
+    UINT8 address[INET_ADDRSTRLEN]; /*client ip address*/
+
+    MessageQueue mq; /*message queue*/
+
+    struct list_head sub_head; /*subscribe list*/
+
+    UINT8 *rx_buf; /*partial packet received, NULL when none*/
+    UINT32 rx_len;
+    UINT32 rx_size;
+
+    UINT8 *tx_buf; /*bytes the socket did not take yet, NULL when none*/
+    UINT32 tx_len;
+    UINT32 tx_size;
+
+    RateLimit limit; /*publish rate of the client*/
+
+    SessionV5 *v5; /*MQTT 5.0 state, NULL for 3.1.1*/
+
+    PacketIdSet *qos2_in; /*ids of QoS2 publishes delivered and waiting for PUBREL, NULL when none*/
+
+    struct acl_cache *acl_cache; /*publish decisions of the acl_file rules (acl.h), NULL until the first*/
 } Client;
 
 VOID iotbroker_session_add(UINT32 sockfd, CONST UINT8 *ip, UINT32 port);
@@ -40,7 +108,41 @@ VOID iotbroker_session_setid(UINT32 sockfd, UINT8 *client_id);
 
 VOID iotbroker_session_clean(UINT32 sockfd);
 
-UINT32 iotbroker_session_auth(UINT32 sockfd, UINT8 *username, UINT8 *password);
+/*the username of CONNECT, the password is checked by iotbroker_auth_check and not kept*/
+UINT32 iotbroker_session_auth(UINT32 sockfd, UINT8 *username);
 
 VOID iotbroker_session_state_mod(UINT32 sockfd, enum client_sate newstate);
+
+/*
+ * Outgoing QoS1 and QoS2 messages the client may leave unacknowledged,
+ * max_inflight bounded by the Receive Maximum of MQTT 5.0, 0 no limit.
+ */
+UINT32 iotbroker_session_inflight_window(Client *client);
+
+/*apply the keep alive of CONNECT, bounded by the config, return the value used*/
+UINT16 iotbroker_session_keepalive(Client *client, UINT16 keepalive);
+
+/*the client has work of kind left, it is served in the next round*/
+VOID iotbroker_session_ready(Client *client, UINT32 kind);
+
+/*
+ * Start a round of kind: the clients marked so far are popped, the ones
+ * marked meanwhile wait for the next round. A round not popped empty
+ * carries on instead.
+ */
+VOID iotbroker_session_ready_round(UINT32 kind);
+
+/*pop a client of the round of kind, FAILED when empty*/
+UINT32 iotbroker_session_ready_pop(UINT32 kind, INT32 *sockfd);
+
+/*any client is marked ready but for READY_BATCH and READY_PAUSED, the event loop must not sleep*/
+UINT32 iotbroker_session_ready_pending();
+
+/*clients marked ready of kind, the ones gone since included*/
+UINT32 iotbroker_session_ready_num(UINT32 kind);
+
+UINT32 iotbroker_session_count();
+
+/*fd slots of the session table, for scans with iotbroker_session_get*/
+UINT32 iotbroker_session_table_size();
 #endif
@@ -0,0 +1,213 @@
+#include <string.h>
+
+#include "iotbroker.h"
+#include "sha256.h"
+#include "debug.h"
+
+STATIC CONST UINT32 g_sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+STATIC VOID compress(UINT32 state[8], CONST UINT8 *block)
+{
+    UINT32 w[64];
+    UINT32 a, b, c, d, e, f, g, h, t1, t2;
+    UINT32 i;
+
+    for(i = 0; i < 16; i++)
+    {
+        w[i] = ((UINT32)block[4 * i] << 24) | ((UINT32)block[4 * i + 1] << 16)
+            | ((UINT32)block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+
+    for(i = 16; i < 64; i++)
+    {
+        UINT32 s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        UINT32 s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for(i = 0; i < 64; i++)
+    {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+VOID iotbroker_sha256_init(Sha256 *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->len = 0;
+    ctx->block_len = 0;
+}
+
+VOID iotbroker_sha256_update(Sha256 *ctx, CONST UINT8 *data, UINT32 len)
+{
+    ctx->len += len;
+
+    if(ctx->block_len != 0)
+    {
+        UINT32 n = MIN(len, SHA256_BLOCK_LEN - ctx->block_len);
+
+        memcpy(ctx->block + ctx->block_len, data, n);
+        ctx->block_len += n;
+        data += n;
+        len -= n;
+
+        INVALID_RETURN_NOVALUE(SHA256_BLOCK_LEN == ctx->block_len);
+        compress(ctx->state, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    while(len >= SHA256_BLOCK_LEN)
+    {
+        compress(ctx->state, data);
+        data += SHA256_BLOCK_LEN;
+        len -= SHA256_BLOCK_LEN;
+    }
+
+    memcpy(ctx->block, data, len);
+    ctx->block_len = len;
+}
+
+VOID iotbroker_sha256_final(Sha256 *ctx, UINT8 out[SHA256_LEN])
+{
+    U64 bits = ctx->len * 8;
+    UINT32 i;
+
+    ctx->block[ctx->block_len++] = 0x80;
+    if(ctx->block_len > SHA256_BLOCK_LEN - 8)
+    {
+        memset(ctx->block + ctx->block_len, 0, SHA256_BLOCK_LEN - ctx->block_len);
+        compress(ctx->state, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    memset(ctx->block + ctx->block_len, 0, SHA256_BLOCK_LEN - 8 - ctx->block_len);
+    for(i = 0; i < 8; i++)
+    {
+        ctx->block[SHA256_BLOCK_LEN - 1 - i] = (UINT8)(bits >> (8 * i));
+    }
+    compress(ctx->state, ctx->block);
+
+    for(i = 0; i < 8; i++)
+    {
+        out[4 * i] = (UINT8)(ctx->state[i] >> 24);
+        out[4 * i + 1] = (UINT8)(ctx->state[i] >> 16);
+        out[4 * i + 2] = (UINT8)(ctx->state[i] >> 8);
+        out[4 * i + 3] = (UINT8)ctx->state[i];
+    }
+}
+
+/*HMAC of data with the padded keys hashed already*/
+STATIC VOID hmac(CONST Sha256 *inner, CONST Sha256 *outer, CONST UINT8 *data, UINT32 len, UINT8 out[SHA256_LEN])
+{
+    Sha256 ctx;
+
+    ctx = *inner;
+    iotbroker_sha256_update(&ctx, data, len);
+    iotbroker_sha256_final(&ctx, out);
+
+    ctx = *outer;
+    iotbroker_sha256_update(&ctx, out, SHA256_LEN);
+    iotbroker_sha256_final(&ctx, out);
+}
+
+VOID iotbroker_pbkdf2_sha256(CONST UINT8 *password, UINT32 password_len, CONST UINT8 *salt, UINT32 salt_len,
+    UINT32 iterations, UINT8 *out, UINT32 out_len)
+{
+    UINT8 key[SHA256_BLOCK_LEN], pad[SHA256_BLOCK_LEN];
+    UINT8 u[SHA256_LEN], t[SHA256_LEN], count[4];
+    Sha256 inner, outer, ctx;
+    UINT32 block, i, j, n;
+
+    /*a key longer than a block is hashed first*/
+    memset(key, 0, sizeof(key));
+    if(password_len > SHA256_BLOCK_LEN)
+    {
+        iotbroker_sha256_init(&ctx);
+        iotbroker_sha256_update(&ctx, password, password_len);
+        iotbroker_sha256_final(&ctx, key);
+    }
+    else
+    {
+        memcpy(key, password, password_len);
+    }
+
+    for(i = 0; i < SHA256_BLOCK_LEN; i++)
+    {
+        pad[i] = key[i] ^ 0x36;
+    }
+    iotbroker_sha256_init(&inner);
+    iotbroker_sha256_update(&inner, pad, SHA256_BLOCK_LEN);
+
+    for(i = 0; i < SHA256_BLOCK_LEN; i++)
+    {
+        pad[i] = key[i] ^ 0x5c;
+    }
+    iotbroker_sha256_init(&outer);
+    iotbroker_sha256_update(&outer, pad, SHA256_BLOCK_LEN);
+
+    for(block = 1; out_len != 0; block++)
+    {
+        count[0] = (UINT8)(block >> 24);
+        count[1] = (UINT8)(block >> 16);
+        count[2] = (UINT8)(block >> 8);
+        count[3] = (UINT8)block;
+
+        ctx = inner;
+        iotbroker_sha256_update(&ctx, salt, salt_len);
+        iotbroker_sha256_update(&ctx, count, sizeof(count));
+        iotbroker_sha256_final(&ctx, u);
+        ctx = outer;
+        iotbroker_sha256_update(&ctx, u, SHA256_LEN);
+        iotbroker_sha256_final(&ctx, u);
+        memcpy(t, u, SHA256_LEN);
+
+        for(i = 1; i < iterations; i++)
+        {
+            hmac(&inner, &outer, u, SHA256_LEN, u);
+            for(j = 0; j < SHA256_LEN; j++)
+            {
+                t[j] ^= u[j];
+            }
+        }
+
+        n = MIN(out_len, SHA256_LEN);
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+
+    /*no key material left on the stack*/
+    memset(key, 0, sizeof(key));
+    memset(pad, 0, sizeof(pad));
+    memset(u, 0, sizeof(u));
+    memset(t, 0, sizeof(t));
+}
@@ -0,0 +1,31 @@
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include "iotbroker.h"
+
+#define SHA256_LEN 32
+
+#define SHA256_BLOCK_LEN 64
+
+typedef struct
+{
+    UINT32 state[8];
+    U64 len; /*bytes hashed*/
+    UINT8 block[SHA256_BLOCK_LEN];
+    UINT32 block_len;
+}Sha256;
+
+VOID iotbroker_sha256_init(Sha256 *ctx);
+
+VOID iotbroker_sha256_update(Sha256 *ctx, CONST UINT8 *data, UINT32 len);
+
+VOID iotbroker_sha256_final(Sha256 *ctx, UINT8 out[SHA256_LEN]);
+
+/*
+ * PBKDF2 with HMAC-SHA256 (RFC 8018), out_len bytes of key. The padded
+ * HMAC keys are hashed once, each iteration costs two compressions.
+ */
+VOID iotbroker_pbkdf2_sha256(CONST UINT8 *password, UINT32 password_len, CONST UINT8 *salt, UINT32 salt_len,
+    UINT32 iterations, UINT8 *out, UINT32 out_len);
+
+#endif
@@ -1,329 +1,868 @@
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "iotbroker.h"
 #include "memmanager.h"
 #include "subtree.h"
 #include "protocol.h"
-#include "uthash.h"
 #include "session.h"
 #include "list.h"
 #include "debug.h"
 #include "message.h"
+#include "epoch.h"
+#include "config.h"
+#include "metrics.h"
+#include "probe.h"
+#include "recorder.h"
+#include "packet_handle.h"
+#include "overload.h"
 
-STATIC TreeNode *g_subtree_head = NULL;
+/*
+ * The subscribe tree has one node per topic level. Publishers walk it without
+ * any lock: child tables are replaced as a whole and subscribe lists are RCU
+ * lists, writers are serialized by g_subtree_lock and retire what they unlink
+ * through the epoch module.
+ */
+STATIC TreeNode g_subtree_root;
 
-STATIC VOID get_topic_tokens(UINT8 *topic, struct topic_token *tt_head)
+STATIC pthread_mutex_t g_subtree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+STATIC UINT32 g_hash_wildcard_single;
+
+STATIC UINT32 g_hash_wildcard_multi;
+
+/*FNV-1a hash of one topic level*/
+STATIC UINT32 level_hash(CONST UINT8 *name, UINT32 len)
 {
-    INT32 topic_len, pos, start = -1;
-    struct topic_token *tmp_tt_head = tt_head;
- 
- #ifdef DEBUG
-    struct topic_token *debug_tt_head;
- #endif
-    
-    topic_len = strlen(topic);
-    
-    /*contain '\0'*/
-    for(pos = 0; pos <= topic_len; pos++)
+    UINT32 hash = 2166136261u;
+    UINT32 i;
+
+    for(i = 0; i < len; i++)
+    {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*length of the topic level starting at name*/
+STATIC UINT32 level_len(CONST UINT8 *name)
+{
+    CONST UINT8 *end = name;
+
+    while(*end != '\0' && *end != TOPIC_LEVEL_SEPARATOR)
     {
-        /*level separator*/
-        if('/' == topic[pos] || '\0' == topic[pos])
+        end++;
+    }
+
+    return end - name;
+}
+
+/*first index in the child table whose hash is not less than hash*/
+STATIC UINT32 child_lower_bound(ChildTable *ct, UINT32 hash)
+{
+    UINT32 low = 0, high = ct->num;
+
+    while(low < high)
+    {
+        UINT32 mid = (low + high) / 2;
+
+        if(ct->node[mid]->hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
         {
-            UINT8 *token_name;
-            UINT32 token_len = pos - start - 1;
-            struct topic_token *tt;
-            
-            token_name = (UINT8*)iotbroker_malloc(token_len + 1);
-            assert(token_name != NULL);
-            memset(token_name, 0, token_len + 1);
-            memcpy(token_name, topic + start + 1, token_len);
-            
-            tt = (struct topic_token*)iotbroker_malloc(sizeof(struct topic_token));
-            assert(tt != NULL);
-            tt->name = token_name;
-            tt->next = NULL;
-            
-            tmp_tt_head->next = tt;
-            tmp_tt_head = tt;
-            
-            start = pos;
+            high = mid;
         }
     }
-#ifdef DEBUG
-    printf("\ntopic %s is separated as follow:\n", topic);
-    printf("=====================================\n");
-    
-    debug_tt_head = tt_head->next;
-    while(debug_tt_head != NULL)
+
+    return low;
+}
+
+/*order of the children, level hash then name*/
+STATIC INT32 child_cmp(TreeNode *child, UINT32 hash, CONST UINT8 *name, UINT32 len)
+{
+    INT32 ret;
+
+    if(child->hash != hash)
+    {
+        return (child->hash > hash) - (child->hash < hash);
+    }
+
+    ret = memcmp(child->topic, name, MIN(child->topic_len, len));
+    if(ret != 0)
+    {
+        return ret;
+    }
+
+    return (child->topic_len > len) - (child->topic_len < len);
+}
+
+/*first index in the child table not ordered before the level name*/
+STATIC UINT32 child_position(ChildTable *ct, UINT32 hash, CONST UINT8 *name, UINT32 len)
+{
+    UINT32 i = child_lower_bound(ct, hash);
+
+    while(i < ct->num && child_cmp(ct->node[i], hash, name, len) < 0)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+/*find the child level, safe for lock free readers*/
+STATIC TreeNode* find_child(TreeNode *tn, CONST UINT8 *name, UINT32 len, UINT32 hash)
+{
+    ChildTable *ct;
+    UINT32 i;
+
+    ct = __atomic_load_n(&tn->children, __ATOMIC_ACQUIRE);
+    INVALID_RETURN_VALUE(ct != NULL, NULL);
+
+    for(i = child_lower_bound(ct, hash); i < ct->num && ct->node[i]->hash == hash; i++)
     {
-        printf("[%s] ", debug_tt_head->name); 
-        debug_tt_head = debug_tt_head->next;
+        TreeNode *child = ct->node[i];
+
+        if(child->topic_len == len && 0 == memcmp(child->topic, name, len))
+        {
+            return child;
+        }
     }
-    
-    printf("\n");
-    printf("=====================================\n");    
-#endif
+
+    return NULL;
 }
 
-STATIC VOID free_topic_tokens(struct topic_token *tt_head)
+/*publish a copy of the child table with child added, writer only*/
+STATIC VOID add_child(TreeNode *tn, TreeNode *child)
 {
-    struct topic_token *tt_tmp;
-    
-    tt_head = tt_head->next;
-    
-    while(tt_head != NULL)
+    ChildTable *ct, *new_ct;
+    UINT32 num, pos;
+
+    ct = tn->children;
+    num = (ct != NULL) ? ct->num : 0;
+    pos = (ct != NULL) ? child_position(ct, child->hash, child->topic, child->topic_len) : 0;
+
+    new_ct = (ChildTable*)iotbroker_malloc(sizeof(ChildTable) + (num + 1) * sizeof(TreeNode*), MEM_SUBTREE);
+    assert(new_ct != NULL);
+    new_ct->num = num + 1;
+
+    if(ct != NULL)
     {
-        tt_tmp = tt_head->next;
-        iotbroker_free(tt_head->name);
-        iotbroker_free(tt_head);
-        tt_head = tt_tmp;
+        memcpy(new_ct->node, ct->node, pos * sizeof(TreeNode*));
+        memcpy(new_ct->node + pos + 1, ct->node + pos, (num - pos) * sizeof(TreeNode*));
+    }
+    new_ct->node[pos] = child;
+
+    __atomic_store_n(&tn->children, new_ct, __ATOMIC_RELEASE);
+
+    if(ct != NULL)
+    {
+        iotbroker_epoch_defer(ct, iotbroker_free);
     }
 }
 
-STATIC VOID display_subtree()
+/*publish a copy of the child table with child removed, writer only*/
+STATIC VOID del_child(TreeNode *tn, TreeNode *child)
 {
-    TreeNode *tn, *tmp;
-       
-    printf("\nsubscribe table as follow:\n");
-    printf("=====================================\n");
-    HASH_ITER(hh, g_subtree_head, tn, tmp)
+    ChildTable *ct, *new_ct = NULL;
+    UINT32 i, j;
+
+    ct = tn->children;
+    assert(ct != NULL);
+
+    if(ct->num > 1)
     {
-        SubNode *sub_list;
-        struct list_head *pos;
-        
-        printf("%s\n", tn->topic);
-        
-        sub_list = &tn->sublist;
-        list_for_each(pos, &sub_list->list_mount)
+        new_ct = (ChildTable*)iotbroker_malloc(sizeof(ChildTable) + (ct->num - 1) * sizeof(TreeNode*), MEM_SUBTREE);
+        assert(new_ct != NULL);
+        new_ct->num = ct->num - 1;
+
+        for(i = 0, j = 0; i < ct->num; i++)
         {
-            SubNode *sub_node = container_of(pos, SubNode, list_mount);
-            Client *client = sub_node->client;
-            
-            printf("          %s:%d QoS%d\n", client->address, client->port, sub_node->qos);
-        }      
+            if(ct->node[i] != child)
+            {
+                assert(j < new_ct->num);
+                new_ct->node[j++] = ct->node[i];
+            }
+        }
     }
-    printf("=====================================\n");
+
+    __atomic_store_n(&tn->children, new_ct, __ATOMIC_RELEASE);
+    iotbroker_epoch_defer(ct, iotbroker_free);
 }
 
-STATIC INT32 insert_message_to_subtree(UINT8 *topic_name, MessageStore *ms)
+STATIC VOID free_tree_node(VOID *ptr)
+{
+    TreeNode *tn = (TreeNode*)ptr;
+
+    iotbroker_free(tn->topic);
+    iotbroker_free(tn);
+}
+
+/*create the child level, writer only*/
+STATIC TreeNode* new_child(TreeNode *parent, CONST UINT8 *name, UINT32 len, UINT32 hash)
 {
     TreeNode *tn;
-    SubNode *sublist;
-    struct list_head *pos;
-    
-    HASH_FIND_STR(g_subtree_head, topic_name, tn);
-    INVALID_RETURN_VALUE(tn != NULL, FAILED);
-    
-    sublist = &tn->sublist;
-    
-    if(list_empty(&sublist->list_mount))
+
+    tn = (TreeNode*)iotbroker_malloc(sizeof(TreeNode), MEM_SUBTREE);
+    assert(tn != NULL);
+    memset(tn, 0, sizeof(TreeNode));
+
+    tn->topic = (UINT8*)iotbroker_malloc(len + 1, MEM_SUBTREE);
+    assert(tn->topic != NULL);
+    memcpy(tn->topic, name, len);
+    tn->topic[len] = '\0';
+    tn->topic_len = len;
+    tn->hash = hash;
+    tn->parent = parent;
+    INIT_LIST_HEAD(&tn->sublist);
+
+    add_child(parent, tn);
+
+    return tn;
+}
+
+/*remove the empty levels from tn up to the root, writer only*/
+STATIC VOID prune_tree_node(TreeNode *tn)
+{
+    while(tn != &g_subtree_root && list_empty(&tn->sublist) && NULL == tn->children)
+    {
+        TreeNode *parent = tn->parent;
+
+        del_child(parent, tn);
+        iotbroker_epoch_defer(tn, free_tree_node);
+        tn = parent;
+    }
+}
+
+/*find the node of the topic filter, create the missing levels when create is TRUE*/
+STATIC TreeNode* walk_filter(CONST UINT8 *filter, UINT32 create)
+{
+    TreeNode *tn = &g_subtree_root;
+    CONST UINT8 *level = filter;
+
+    for( ; ; )
+    {
+        UINT32 len = level_len(level);
+        UINT32 hash = level_hash(level, len);
+        TreeNode *child;
+
+        child = find_child(tn, level, len, hash);
+        if(NULL == child)
+        {
+            INVALID_RETURN_VALUE(create, NULL);
+            child = new_child(tn, level, len, hash);
+        }
+        tn = child;
+
+        if('\0' == level[len])
+        {
+            break;
+        }
+        level += len + 1;
+    }
+
+    return tn;
+}
+
+STATIC VOID free_sub_node(VOID *ptr)
+{
+    SubNode *sn = (SubNode*)ptr;
+
+    if(sn->pending != NULL)
+    {
+        iotbroker_free(sn->pending);
+    }
+    iotbroker_free(sn);
+}
+
+/*keep the subscription totals from tn up to the root, writer only*/
+STATIC VOID account_sub_node(TreeNode *tn, INT32 delta)
+{
+    for( ; tn != NULL; tn = tn->parent)
+    {
+        __atomic_store_n(&tn->sub_total, tn->sub_total + delta, __ATOMIC_RELAXED);
+    }
+
+    iotbroker_metrics_add(METRIC_SUBSCRIPTIONS, delta);
+}
+
+/*unlink the subscription, writer only*/
+STATIC VOID remove_sub_node(SubNode *sn)
+{
+    account_sub_node(sn->tn, -1);
+    list_del_rcu(&sn->list_mount);
+    list_del(&sn->client_mount);
+    iotbroker_epoch_defer(sn, free_sub_node);
+}
+
+/*
+ * Conflation. The table of a subscription has the owner of the client
+ * queue it indexes: publishers walk the subscriber lists without
+ * g_subtree_lock, but the queue pushes and the table updates below are
+ * all made by the event loop thread, threads is clamped to 1 (config.c).
+ * The table is written and freed in place. A second event loop has to hand
+ * the deliveries to the thread of the subscriber before calling these.
+ */
+
+/*the QoS0 delivery of topic at seq, NULL when it went out or the entry is another one*/
+STATIC MessageEntry* waiting_entry(MessageQueue *mq, UINT32 seq, CONST UINT8 *topic)
+{
+    MessageEntry *me;
+
+    INVALID_RETURN_VALUE(seq - mq->send < mq->tail - mq->send, NULL);
+
+    me = MESSAGE_QUEUE_ENTRY(mq, seq);
+    INVALID_RETURN_VALUE(me->ms != NULL && MD_OUT == me->dir && QOS0 == me->qos
+        && PS_WAIT_TO_PUBLISH == me->ps, NULL);
+    INVALID_RETURN_VALUE(0 == strcmp(me->ms->packet->topic, topic), NULL);
+
+    return me;
+}
+
+/*slot of hash, or the free slot ending its probe sequence*/
+STATIC UINT32 conflate_slot(ConflateTable *ct, UINT32 hash)
+{
+    UINT32 i = hash & (ct->size - 1);
+
+    while(ct->slot[i].hash != 0 && ct->slot[i].hash != hash)
+    {
+        i = (i + 1) & (ct->size - 1);
+    }
+
+    return i;
+}
+
+STATIC ConflateTable* new_conflate_table(UINT32 size)
+{
+    ConflateTable *ct;
+    UINT32 bytes = sizeof(ConflateTable) + size * sizeof(ct->slot[0]);
+
+    ct = (ConflateTable*)iotbroker_malloc(bytes, MEM_SUBTREE);
+    assert(ct != NULL);
+    memset(ct, 0, bytes);
+    ct->size = size;
+
+    return ct;
+}
+
+/*
+ * A compaction renumbered the queue since the sequences were taken, forget
+ * them. The counter wraps after 65536 compactions, a slot that survives
+ * that still points to a waiting delivery of its own topic or is refused
+ * by waiting_entry.
+ */
+STATIC VOID forget_renumbered(SubNode *sn)
+{
+    ConflateTable *ct = sn->pending;
+    UINT16 compactions = sn->client->mq.compactions;
+
+    INVALID_RETURN_NOVALUE(ct != NULL && ct->compactions != compactions);
+
+    memset(ct->slot, 0, ct->size * sizeof(ct->slot[0]));
+    ct->used = 0;
+    ct->compactions = compactions;
+}
+
+/*drop the slots of deliveries gone out, resize for the ones still waiting*/
+STATIC VOID rebuild_conflate_table(SubNode *sn)
+{
+    ConflateTable *old = sn->pending, *ct;
+    MessageQueue *mq = &sn->client->mq;
+    UINT32 i, live = 0, size = CONFLATE_TABLE_MIN_SIZE;
+
+    for(i = 0; i < old->size; i++)
+    {
+        live += (old->slot[i].hash != 0 && old->slot[i].seq - mq->send < mq->tail - mq->send);
+    }
+
+    while(size < live * 4)
+    {
+        size *= 2;
+    }
+
+    ct = new_conflate_table(size);
+    ct->compactions = old->compactions;
+    for(i = 0; i < old->size; i++)
+    {
+        if(old->slot[i].hash != 0 && old->slot[i].seq - mq->send < mq->tail - mq->send)
+        {
+            ct->slot[conflate_slot(ct, old->slot[i].hash)] = old->slot[i];
+            ct->used++;
+        }
+    }
+
+    iotbroker_free(old);
+    sn->pending = ct;
+}
+
+/*replace the waiting delivery of the topic with ms, FAILED when there is none*/
+STATIC UINT32 conflate_message(SubNode *sn, MessageStore *ms, UINT32 hash)
+{
+    ConflateTable *ct;
+    MessageEntry *me;
+    UINT32 i;
+
+    forget_renumbered(sn);
+    ct = sn->pending;
+    INVALID_RETURN_VALUE(ct != NULL, FAILED);
+
+    i = conflate_slot(ct, hash);
+    INVALID_RETURN_VALUE(ct->slot[i].hash != 0, FAILED);
+
+    me = waiting_entry(&sn->client->mq, ct->slot[i].seq, ms->packet->topic);
+    INVALID_RETURN_VALUE(me != NULL, FAILED);
+
+    iotbroker_message_store_deref(me->ms);
+    me->ms = ms;
+    me->stamp = (UINT32)iotbroker_time_now_us();
+    iotbroker_message_store_ref(ms);
+    iotbroker_metrics_add(METRIC_MSG_CONFLATED, 1);
+
+    return SUCESS;
+}
+
+/*the delivery of the topic waits at seq*/
+STATIC VOID remember_conflated(SubNode *sn, UINT32 hash, UINT32 seq)
+{
+    ConflateTable *ct;
+    UINT32 i;
+
+    forget_renumbered(sn);
+    if(NULL == sn->pending)
+    {
+        sn->pending = new_conflate_table(CONFLATE_TABLE_MIN_SIZE);
+        sn->pending->compactions = sn->client->mq.compactions;
+    }
+
+    ct = sn->pending;
+    i = conflate_slot(ct, hash);
+    if(0 == ct->slot[i].hash)
+    {
+        ct->slot[i].hash = hash;
+        ct->used++;
+    }
+    ct->slot[i].seq = seq;
+
+    if(ct->used * 2 > ct->size)
     {
-        return FAILED;
+        rebuild_conflate_table(sn);
     }
-    
-    list_for_each(pos, &sublist->list_mount)
+}
+
+/*queue the message to every subscriber of the node, return the deliveries queued*/
+STATIC UINT32 insert_message_to_subtree(TreeNode *tn, MessageStore *ms)
+{
+    CONST Config *config = iotbroker_config_get();
+    UINT32 max_queued = config->max_queued_messages;
+    UINT32 shedding = iotbroker_overload_shedding();
+    UINT32 fanout = 0, topic_hash = 0;
+    struct list_head *pos;
+
+    list_for_each_rcu(pos, &tn->sublist)
     {
         SubNode *sn;
         Client *client;
-        MessageQueue *mq, *new_msg;
-        
+        MessageEntry *new_msg;
+        UINT8 qos, conflate;
+
         sn = container_of(pos, SubNode, list_mount);
         client = sn->client;
-        mq = client->mq_head;
-        
-        new_msg = (MessageQueue*)iotbroker_malloc(sizeof(MessageQueue));
-        assert(new_msg != NULL);
-        new_msg->qs = QS_INFLIGHT;
+        qos = __atomic_load_n(&sn->qos, __ATOMIC_RELAXED);
+        qos = MIN(ms->packet->qos, qos);
+        conflate = __atomic_load_n(&sn->conflate, __ATOMIC_RELAXED) && QOS0 == qos;
+
+        if(conflate)
+        {
+            /*non zero, 0 marks the free slots*/
+            if(0 == topic_hash)
+            {
+                topic_hash = level_hash(ms->packet->topic, strlen(ms->packet->topic)) | 1;
+            }
+
+            /*the client did not get the previous value yet, it gets this one instead*/
+            if(SUCESS == conflate_message(sn, ms, topic_hash))
+            {
+                continue;
+            }
+        }
+
+        /*overloaded, the QoS0 deliveries of subscribers falling behind go first*/
+        if(shedding && QOS0 == qos
+            && (client->mq.tail - client->mq.send >= config->shed_queue_depth || client->tx_len != 0))
+        {
+            iotbroker_metrics_add(METRIC_MSG_SHED, 1);
+            continue;
+        }
+
+        /*a client not draining its queue loses new messages*/
+        if(max_queued != 0 && client->mq.tail - client->mq.head - client->mq.dead >= max_queued)
+        {
+            iotbroker_metrics_add(METRIC_MSG_DROPPED, 1);
+            iotbroker_record(REC_QUEUE_LIMIT, client->sock_fd, 0, max_queued);
+            continue;
+        }
+
+        new_msg = iotbroker_message_queue_push(&client->mq);
         new_msg->ps = PS_WAIT_TO_PUBLISH;
         new_msg->dir = MD_OUT;
-        new_msg->resend_count = 0;
         new_msg->ms = ms;
-        new_msg->qos = MIN(ms->packet->qos, sn->qos);
-        list_add(&new_msg->list_mount, &mq->list_mount);
-        
-        ms->refer_count++;
+        new_msg->qos = qos;
+        iotbroker_session_ready(client, READY_OUTPUT);
+
+        if(conflate)
+        {
+            remember_conflated(sn, topic_hash, client->mq.tail - 1);
+        }
+
+        iotbroker_message_store_ref(ms);
+        fanout++;
     }
-    
-    return SUCESS;
+
+    return fanout;
 }
 
-STATIC VOID insert_pub_message(struct topic_token *tt, UINT8 *topic_buf, MessageStore *ms)
+/*tn matched the levels before level, level is NULL when the topic is consumed*/
+STATIC UINT32 insert_pub_message(TreeNode *tn, CONST UINT8 *level, MessageStore *ms)
 {
-    UINT8 *token_cur;
-    UINT32 token_cur_len, topic_buf_len;
-    
-    /*end of calling*/
-    if(NULL == tt)
+    TreeNode *child;
+    CONST UINT8 *next;
+    UINT32 len, wildcard, fanout = 0;
+
+    if(NULL == level)
     {
-        return;
-    }    
-    
-    topic_buf_len = strlen(topic_buf);
-    
-    /*1.find current token*/
-    token_cur = tt->name;
-    token_cur_len = strlen(token_cur);
-    memcpy(topic_buf+topic_buf_len, token_cur, token_cur_len);
-#ifdef DEBUG
-    printf("%s\n", topic_buf);
-#endif
-
-    if(SUCESS == insert_message_to_subtree(topic_buf, ms))
-    {
-        topic_buf[topic_buf_len + token_cur_len] = '/';
-        insert_pub_message(tt->next, topic_buf, ms);
-    }    
-    memset(topic_buf+topic_buf_len, 0, token_cur_len);
-    
-    /*2.find +*/
-    topic_buf[topic_buf_len] = '+';
-#ifdef DEBUG
-    printf("%s\n", topic_buf);
-#endif 
-
-    if(SUCESS == insert_message_to_subtree(topic_buf, ms))
-    {
-        topic_buf[topic_buf_len + 1] = '/';
-        insert_pub_message(tt->next, topic_buf, ms);
-        topic_buf[topic_buf_len + 1] = 0;
-    }
-    topic_buf[topic_buf_len] = 0;
-    
-    /*3.find #*/
-    topic_buf[topic_buf_len] = '#';
-    insert_message_to_subtree(topic_buf, ms);
-#ifdef DEBUG
-    printf("%s\n", topic_buf);
-#endif    
-    topic_buf[topic_buf_len] = 0;
+        fanout += insert_message_to_subtree(tn, ms);
+
+        /*"a/#" matches "a" as well*/
+        child = find_child(tn, "#", 1, g_hash_wildcard_multi);
+        if(child != NULL)
+        {
+            fanout += insert_message_to_subtree(child, ms);
+        }
+        return fanout;
+    }
+
+    /*wildcards in the first level never match topics starting with '$'*/
+    wildcard = !(tn == &g_subtree_root && '$' == level[0]);
+
+    if(wildcard)
+    {
+        child = find_child(tn, "#", 1, g_hash_wildcard_multi);
+        if(child != NULL)
+        {
+            fanout += insert_message_to_subtree(child, ms);
+        }
+    }
+
+    len = level_len(level);
+    next = ('\0' == level[len]) ? NULL : level + len + 1;
+
+    child = find_child(tn, level, len, level_hash(level, len));
+    if(child != NULL)
+    {
+        fanout += insert_pub_message(child, next, ms);
+    }
+
+    if(wildcard)
+    {
+        child = find_child(tn, "+", 1, g_hash_wildcard_single);
+        if(child != NULL)
+        {
+            fanout += insert_pub_message(child, next, ms);
+        }
+    }
+
+    return fanout;
+}
+
+VOID iotbroker_subtree_init()
+{
+    memset(&g_subtree_root, 0, sizeof(TreeNode));
+    INIT_LIST_HEAD(&g_subtree_root.sublist);
+
+    g_hash_wildcard_single = level_hash("+", 1);
+    g_hash_wildcard_multi = level_hash("#", 1);
 }
 
 VOID iotbroker_subtree_pub(MessageStore *ms)
 {
     TopicPacket *tp;
-    struct topic_token tt;
-    UINT32 topic_len;
-    UINT8 *topic_buf;
-    
+    UINT32 fanout;
+
     assert(ms != NULL);
-    
+
     tp = ms->packet;
-    assert(tp != NULL);
-    
-    get_topic_tokens(tp->topic, &tt);
-    
-    topic_len = strlen(tp->topic);
-    topic_buf = (UINT8*)iotbroker_malloc(topic_len+1); /*1 for '+' or '#'*/
-    assert(topic_buf);
-    memset(topic_buf, 0, topic_len+1);
-    
-    insert_pub_message(tt.next, topic_buf, ms);
-    
-    iotbroker_free(topic_buf);
-    free_topic_tokens(&tt);
+    assert(tp != NULL && tp->topic != NULL);
+
+    fanout = insert_pub_message(&g_subtree_root, tp->topic, ms);
+
+    IOTBROKER_PROBE3(subtree__pub, tp->topic_len, tp->qos, fanout);
+}
+
+/*the filter without SUBTREE_CONFLATE_PREFIX*/
+STATIC CONST UINT8* strip_conflate(CONST UINT8 *filter, UINT8 *conflate)
+{
+    UINT32 len = strlen(SUBTREE_CONFLATE_PREFIX);
+
+    *conflate = (0 == strncmp(filter, SUBTREE_CONFLATE_PREFIX, len));
+
+    return *conflate ? filter + len : filter;
 }
 
 VOID iotbroker_subtree_sub(TopicPacket *tp, Client *client)
 {
     TreeNode *tn;
     SubNode *sn;
-    
+    struct list_head *pos;
+    CONST UINT8 *filter;
+    UINT8 conflate;
+
     assert(tp != NULL && client != NULL);
 
-    sn = (SubNode*)iotbroker_malloc(sizeof(SubNode));
-    assert(sn != NULL);
-    sn->client = client;  
-    sn->qos = tp->qos;  
-        
-    HASH_FIND_STR(g_subtree_head, tp->topic, tn);
-    
-    if(NULL == tn)
+    filter = strip_conflate(tp->topic, &conflate);
+
+    pthread_mutex_lock(&g_subtree_lock);
+
+    tn = walk_filter(filter, TRUE);
+
+    list_for_each(pos, &tn->sublist)
     {
-        UINT8 *topic_name;
-        UINT16 topic_len;
-        SubNode *sn_head;
-        
-        tn = (TreeNode*)iotbroker_malloc(sizeof(TreeNode));
-        assert(tn != NULL);
-        
-        /*copy topic name*/
-        topic_len = strlen(tp->topic);
-        topic_name = (UINT8*)iotbroker_malloc(topic_len + 1);
-        assert(topic_name != NULL);
-        memset(topic_name, 0, topic_len + 1);
-        strncpy(topic_name, tp->topic, topic_len);
-        tn->topic = topic_name;
-        
-        sn_head = &tn->sublist;
-        INIT_LIST_HEAD(&sn_head->list_mount);
-        list_add(&sn->list_mount, &sn_head->list_mount);
-        
-        HASH_ADD_STR(g_subtree_head, topic, tn);
-    }
-    else
-    {
-        SubNode *sn_head = &tn->sublist;
-        struct list_head *pos;
-        
-        list_for_each(pos, &sn_head->list_mount)
+        SubNode *tmp = container_of(pos, SubNode, list_mount);
+
+        /*simple replace*/
+        if(tmp->client == client)
         {
-            SubNode *tmp = container_of(pos, SubNode, list_mount);
-            
-            /*simple replace*/
-            if(0 == strcmp(tmp->client->client_id, client->client_id))
-            {
-                iotbroker_free(sn);
-                sn = NULL;
-                tmp->qos = tp->qos;
-                break;
-            }
-        }
-        
-        if(pos == &sn_head->list_mount)
-        {   
-            list_add(&sn->list_mount, &sn_head->list_mount);
+            __atomic_store_n(&tmp->qos, tp->qos, __ATOMIC_RELAXED);
+            __atomic_store_n(&tmp->conflate, conflate, __ATOMIC_RELAXED);
+            break;
         }
     }
-#ifdef DEBUG
-    display_subtree();
-#endif
+
+    if(pos == &tn->sublist)
+    {
+        sn = (SubNode*)iotbroker_malloc(sizeof(SubNode), MEM_SUBTREE);
+        assert(sn != NULL);
+        sn->client = client;
+        sn->qos = tp->qos;
+        sn->conflate = conflate;
+        sn->tn = tn;
+        sn->pending = NULL;
+
+        list_add(&sn->client_mount, &client->sub_head);
+        list_add_rcu(&sn->list_mount, &tn->sublist);
+        account_sub_node(tn, 1);
+    }
+
+    pthread_mutex_unlock(&g_subtree_lock);
 }
 
 VOID iotbroker_subtree_unsub(TopicPacket *tp, Client *client)
 {
     TreeNode *tn;
-    SubNode *sub_head;
     struct list_head *pos, *tmp;
-    
-    assert(tp != NULL);
-    
-    HASH_FIND_STR(g_subtree_head, tp->topic, tn);
-    INVALID_RETURN_NOVALUE(tn != NULL);
-    
-    sub_head = &tn->sublist;
-    list_for_each_safe(pos, tmp, &sub_head->list_mount)
-    {
-        SubNode *sub_node;
-        
-        sub_node= container_of(pos, SubNode, list_mount);
-        if(0 == strcmp(sub_node->client->client_id, client->client_id))
+    CONST UINT8 *filter;
+    UINT8 conflate;
+
+    assert(tp != NULL && client != NULL);
+
+    filter = strip_conflate(tp->topic, &conflate);
+
+    pthread_mutex_lock(&g_subtree_lock);
+
+    tn = walk_filter(filter, FALSE);
+    if(NULL == tn)
+    {
+        pthread_mutex_unlock(&g_subtree_lock);
+        return;
+    }
+
+    list_for_each_safe(pos, tmp, &tn->sublist)
+    {
+        SubNode *sub_node = container_of(pos, SubNode, list_mount);
+
+        if(sub_node->client == client)
         {
-            list_del(pos);
-            iotbroker_free(sub_node);
-            sub_node = NULL;
+            remove_sub_node(sub_node);
             break;
         }
     }
-    
-    if(list_empty(&sub_head->list_mount))
+
+    prune_tree_node(tn);
+
+    pthread_mutex_unlock(&g_subtree_lock);
+}
+
+VOID iotbroker_subtree_unsub_all(Client *client)
+{
+    struct list_head *pos, *tmp;
+
+    assert(client != NULL);
+
+    pthread_mutex_lock(&g_subtree_lock);
+
+    list_for_each_safe(pos, tmp, &client->sub_head)
     {
-        iotbroker_free(tn->topic);
-        tn->topic = NULL;
-        HASH_DEL(g_subtree_head, tn);
+        SubNode *sub_node = container_of(pos, SubNode, client_mount);
+        TreeNode *tn = sub_node->tn;
+
+        remove_sub_node(sub_node);
+        prune_tree_node(tn);
     }
-#ifdef DEBUG
-    display_subtree();
-#endif
+
+    pthread_mutex_unlock(&g_subtree_lock);
 }
 
+UINT32 iotbroker_subtree_count()
+{
+    return __atomic_load_n(&g_subtree_root.sub_total, __ATOMIC_RELAXED);
+}
+
+typedef struct
+{
+    UINT32 depth; /*level of the reported prefixes*/
+    UINT32 limit; /*prefixes still to report*/
+    UINT8 prefix[SUBTREE_PREFIX_MAX_LEN];
+    UINT8 after[SUBTREE_PREFIX_MAX_LEN]; /*the walk resumes after this prefix*/
+    subtree_prefix_handler handler;
+    VOID *arg;
+}PrefixWalk;
+
+/*hand one prefix to the handler, FALSE once the limit is reached*/
+STATIC UINT32 report_prefix(PrefixWalk *pw, UINT32 count)
+{
+    INVALID_RETURN_VALUE(pw->limit != 0, FALSE);
+    pw->limit--;
+
+    pw->handler(pw->prefix, count, pw->arg);
+
+    return TRUE;
+}
+
+/*subscriptions on the node itself, not below it*/
+STATIC UINT32 own_sub_count(TreeNode *tn, ChildTable *ct)
+{
+    UINT32 count = __atomic_load_n(&tn->sub_total, __ATOMIC_RELAXED);
+    UINT32 i;
+
+    for(i = 0; i < ct->num; i++)
+    {
+        count -= __atomic_load_n(&ct->node[i]->sub_total, __ATOMIC_RELAXED);
+    }
+
+    /*writers may be in the middle of an update*/
+    return ((INT32)count > 0) ? count : 0;
+}
+
+/*
+ * Report the prefixes of pw->depth levels below tn, FALSE once the limit is
+ * reached. A prefix is reported after the ones below it, so after holds the
+ * levels of the last prefix reported below tn: the walk starts at its level
+ * or the next one still there, NULL to walk all of tn.
+ */
+STATIC UINT32 walk_prefix(TreeNode *tn, UINT32 level, UINT32 len, PrefixWalk *pw, CONST UINT8 *after)
+{
+    ChildTable *ct = __atomic_load_n(&tn->children, __ATOMIC_ACQUIRE);
+    CONST UINT8 *rest = NULL;
+    UINT32 i = 0;
+
+    INVALID_RETURN_VALUE(ct != NULL, TRUE);
+
+    if(after != NULL)
+    {
+        UINT32 after_len = level_len(after);
+        UINT32 after_hash = level_hash(after, after_len);
+
+        i = child_position(ct, after_hash, after, after_len);
+        if(i < ct->num && 0 == child_cmp(ct->node[i], after_hash, after, after_len))
+        {
+            rest = after + after_len;
+        }
+    }
+
+    for( ; i < ct->num; i++)
+    {
+        TreeNode *child = ct->node[i];
+        ChildTable *child_ct = __atomic_load_n(&child->children, __ATOMIC_ACQUIRE);
+        CONST UINT8 *child_after = NULL;
+        UINT32 child_len = len;
+        UINT32 own;
+
+        /*the level of the last prefix reported, that prefix went out after all below it*/
+        if(rest != NULL)
+        {
+            child_after = ('\0' == *rest) ? NULL : rest + 1;
+            rest = NULL;
+            if(NULL == child_after)
+            {
+                continue;
+            }
+        }
+
+        /*deeper levels than the buffer holds are not reported*/
+        if(len + child->topic_len + 2 > SUBTREE_PREFIX_MAX_LEN)
+        {
+            continue;
+        }
+
+        if(level != 0)
+        {
+            pw->prefix[child_len++] = TOPIC_LEVEL_SEPARATOR;
+        }
+        memcpy(pw->prefix + child_len, child->topic, child->topic_len);
+        child_len += child->topic_len;
+        pw->prefix[child_len] = '\0';
+
+        if(level + 1 == pw->depth || NULL == child_ct)
+        {
+            INVALID_RETURN_VALUE(report_prefix(pw, __atomic_load_n(&child->sub_total, __ATOMIC_RELAXED)), FALSE);
+            continue;
+        }
+
+        INVALID_RETURN_VALUE(walk_prefix(child, level + 1, child_len, pw, child_after), FALSE);
+
+        /*a shorter filter stops here*/
+        own = own_sub_count(child, child_ct);
+        if(own != 0)
+        {
+            pw->prefix[child_len] = '\0';
+            INVALID_RETURN_VALUE(report_prefix(pw, own), FALSE);
+        }
+    }
+
+    return TRUE;
+}
+
+UINT32 iotbroker_subtree_prefix(UINT32 depth, CONST UINT8 *after, UINT32 limit, subtree_prefix_handler handler, VOID *arg)
+{
+    PrefixWalk *pw;
+    UINT32 more;
+
+    assert(handler != NULL && depth != 0);
+
+    pw = (PrefixWalk*)iotbroker_malloc(sizeof(PrefixWalk), MEM_ADMIN);
+    assert(pw != NULL);
+
+    pw->depth = depth;
+    pw->limit = limit;
+    pw->prefix[0] = '\0';
+    pw->handler = handler;
+    pw->arg = arg;
+
+    /*the handler may keep the prefixes reported in after*/
+    if(after != NULL)
+    {
+        UINT32 after_len = MIN(strlen(after), SUBTREE_PREFIX_MAX_LEN - 1);
+
+        memcpy(pw->after, after, after_len);
+        pw->after[after_len] = '\0';
+    }
+
+    more = !walk_prefix(&g_subtree_root, 0, 0, pw, (after != NULL) ? pw->after : NULL);
+
+    iotbroker_free(pw);
+
+    return more;
+}
@@ -4,32 +4,91 @@
 #include "iotbroker.h"
 #include "list.h"
 #include "session.h"
-#include "uthash.h"
+
+/*topic level separator and wildcards*/
+#define TOPIC_LEVEL_SEPARATOR '/'
+#define TOPIC_WILDCARD_SINGLE '+'
+#define TOPIC_WILDCARD_MULTI '#'
+
+/*
+ * A filter subscribed as "$conflate/<filter>" conflates: a QoS0 delivery
+ * still waiting in the client queue is replaced by a newer message of the
+ * same topic, so a slow client queues one message per topic at most.
+ */
+#define SUBTREE_CONFLATE_PREFIX "$conflate/"
+
+struct tree_node;
+
+/*queue sequence of the waiting QoS0 delivery of each topic, open addressing*/
+typedef struct
+{
+    UINT32 size; /*slot number, power of 2*/
+    UINT32 used; /*slots taken, stale ones included*/
+    UINT16 compactions; /*of the queue when the sequences were taken*/
+    struct
+    {
+        UINT32 hash; /*topic hash, 0 for a free slot*/
+        UINT32 seq;
+    }slot[0];
+}ConflateTable;
+
+#define CONFLATE_TABLE_MIN_SIZE 16
 
 typedef struct
 {
     Client *client; /*the subscriber*/
     UINT8 qos;
-    struct list_head list_mount;
+    UINT8 conflate; /*subscribed with SUBTREE_CONFLATE_PREFIX*/
+    struct list_head list_mount; /*mount point in the tree node, walked by lock free readers*/
+    struct list_head client_mount; /*mount point in the client subscribe list*/
+    struct tree_node *tn; /*the tree node subscribed*/
+    ConflateTable *pending; /*created by the first conflated delivery, owned like the client queue*/
 }SubNode;
 
-typedef struct
+typedef struct child_table
 {
-    UINT8 *topic; /*topic name*/
-    SubNode sublist; /*subscribe list*/
-    UT_hash_handle hh;
-}TreeNode;
+    UINT32 num; /*child number*/
+    struct tree_node *node[0]; /*sorted by level hash*/
+}ChildTable;
 
-struct topic_token
+typedef struct tree_node
 {
-    UINT8 *name;
-    struct topic_token *next;
-};
+    UINT8 *topic; /*topic level name*/
+    UINT32 topic_len; /*topic level name length*/
+    UINT32 hash; /*topic level hash*/
+    struct tree_node *parent; /*parent level*/
+    ChildTable *children; /*child levels, replaced as a whole by writers*/
+    struct list_head sublist; /*subscribe list*/
+    UINT32 sub_total; /*subscriptions in this node and below, written by writers only*/
+}TreeNode;
+
+/*longest prefix reported by iotbroker_subtree_prefix*/
+#define SUBTREE_PREFIX_MAX_LEN 1024
+
+typedef VOID (*subtree_prefix_handler)(CONST UINT8 *prefix, UINT32 count, VOID *arg);
+
+VOID iotbroker_subtree_init();
 
 VOID iotbroker_subtree_sub(TopicPacket *tp, Client *client);
 
 VOID iotbroker_subtree_unsub(TopicPacket *tp, Client *client);
 
+VOID iotbroker_subtree_unsub_all(Client *client);
+
 VOID iotbroker_subtree_pub(MessageStore *ms);
 
+/*subscriptions in the tree*/
+UINT32 iotbroker_subtree_count();
+
+/*
+ * Report at most limit filter prefixes of depth levels with their
+ * subscription count, following the prefix after, NULL from the first.
+ * Shorter filters stop at their last level. The order is fixed, levels by
+ * hash then name with a prefix after the ones below it, so a walk resumed
+ * after the last prefix it reported goes on where it stopped even when
+ * the tree changed meanwhile. Lock free, the caller must be an online
+ * epoch thread. Return TRUE when more prefixes are left.
+ */
+UINT32 iotbroker_subtree_prefix(UINT32 depth, CONST UINT8 *after, UINT32 limit, subtree_prefix_handler handler, VOID *arg);
+
 #endif
@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "iotbroker.h"
+#include "timer.h"
+#include "list.h"
+#include "debug.h"
+
+/*
+ * Hashed timing wheel: a timer lives in slot expire % TIMER_WHEEL_SIZE and
+ * stays there for as many revolutions as needed. Adding and deleting are
+ * O(1), a tick only walks one slot.
+ */
+STATIC struct list_head g_timer_wheel[TIMER_WHEEL_SIZE];
+
+STATIC UINT32 g_timer_num = 0;
+
+/*last tick handled*/
+STATIC UINT32 g_timer_tick = 0;
+
+STATIC U64 g_time_start = 0;
+
+STATIC U64 g_time_now = 0;
+
+STATIC U64 g_time_now_us = 0;
+
+STATIC U64 read_clock_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (U64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*ticks since start*/
+STATIC UINT32 current_tick()
+{
+    return (g_time_now - g_time_start) / TIMER_TICK_MS;
+}
+
+VOID iotbroker_timer_init()
+{
+    UINT32 i;
+
+    for(i = 0; i < TIMER_WHEEL_SIZE; i++)
+    {
+        INIT_LIST_HEAD(&g_timer_wheel[i]);
+    }
+
+    g_time_now_us = read_clock_us();
+    g_time_start = g_time_now_us / 1000;
+    g_time_now = g_time_start;
+    g_timer_tick = 0;
+}
+
+VOID iotbroker_time_update()
+{
+    g_time_now_us = read_clock_us();
+    g_time_now = g_time_now_us / 1000;
+}
+
+U64 iotbroker_time_now()
+{
+    return g_time_now;
+}
+
+U64 iotbroker_time_now_us()
+{
+    return g_time_now_us;
+}
+
+UINT32 iotbroker_time_sec()
+{
+    return (g_time_now - g_time_start) / 1000;
+}
+
+VOID iotbroker_timer_node_init(TimerNode *tn, timer_handler handler)
+{
+    assert(tn != NULL && handler != NULL);
+
+    INIT_LIST_HEAD(&tn->list_mount);
+    tn->handler = handler;
+    tn->expire = 0;
+}
+
+VOID iotbroker_timer_add(TimerNode *tn, UINT32 timeout_ms)
+{
+    UINT32 ticks;
+
+    assert(tn != NULL);
+
+    iotbroker_timer_del(tn);
+
+    /*never fire earlier than asked*/
+    ticks = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    tn->expire = current_tick() + (ticks != 0 ? ticks : 1);
+
+    list_add_tail(&tn->list_mount, &g_timer_wheel[tn->expire & (TIMER_WHEEL_SIZE - 1)]);
+    g_timer_num++;
+}
+
+VOID iotbroker_timer_del(TimerNode *tn)
+{
+    assert(tn != NULL);
+
+    INVALID_RETURN_NOVALUE(!list_empty(&tn->list_mount));
+
+    list_del_init(&tn->list_mount);
+    g_timer_num--;
+}
+
+UINT32 iotbroker_timer_pending(TimerNode *tn)
+{
+    assert(tn != NULL);
+
+    return !list_empty(&tn->list_mount);
+}
+
+VOID iotbroker_timer_run()
+{
+    UINT32 now = current_tick();
+
+    while((INT32)(now - g_timer_tick) > 0)
+    {
+        struct list_head *slot, *pos, *tmp, expired;
+
+        g_timer_tick++;
+        slot = &g_timer_wheel[g_timer_tick & (TIMER_WHEEL_SIZE - 1)];
+
+        /*move the due timers out first, a handler may re-arm itself*/
+        INIT_LIST_HEAD(&expired);
+        list_for_each_safe(pos, tmp, slot)
+        {
+            TimerNode *tn = container_of(pos, TimerNode, list_mount);
+
+            if((INT32)(tn->expire - g_timer_tick) <= 0)
+            {
+                list_del(pos);
+                list_add_tail(pos, &expired);
+            }
+        }
+
+        while(!list_empty(&expired))
+        {
+            TimerNode *tn = container_of(expired.next, TimerNode, list_mount);
+
+            list_del_init(&tn->list_mount);
+            g_timer_num--;
+            tn->handler(tn);
+        }
+    }
+}
+
+INT32 iotbroker_timer_next_timeout()
+{
+    U64 next;
+    UINT32 i;
+
+    INVALID_RETURN_VALUE(g_timer_num != 0, -1);
+
+    /*first busy slot, its timers may be due in a later revolution, waking early is harmless*/
+    for(i = 1; i < TIMER_WHEEL_SIZE; i++)
+    {
+        if(!list_empty(&g_timer_wheel[(g_timer_tick + i) & (TIMER_WHEEL_SIZE - 1)]))
+        {
+            break;
+        }
+    }
+
+    next = g_time_start + (U64)(g_timer_tick + i) * TIMER_TICK_MS;
+    INVALID_RETURN_VALUE(next > g_time_now, 0);
+
+    return next - g_time_now;
+}
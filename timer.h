@@ -0,0 +1,54 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include "iotbroker.h"
+#include "list.h"
+
+/*wheel resolution*/
+#define TIMER_TICK_MS 100
+
+/*slot number, power of 2, one revolution is about 100 seconds*/
+#define TIMER_WHEEL_SIZE 1024
+
+struct timer_node;
+
+typedef VOID (*timer_handler)(struct timer_node *tn);
+
+typedef struct timer_node
+{
+    struct list_head list_mount; /*mount point in the wheel slot*/
+    timer_handler handler; /*called once when expired*/
+    UINT32 expire; /*expire tick*/
+}TimerNode;
+
+VOID iotbroker_timer_init();
+
+/*refresh the cached clock, once per event loop iteration*/
+VOID iotbroker_time_update();
+
+/*cached monotonic clock in milliseconds*/
+U64 iotbroker_time_now();
+
+/*cached monotonic clock in microseconds*/
+U64 iotbroker_time_now_us();
+
+/*cached monotonic clock in seconds*/
+UINT32 iotbroker_time_sec();
+
+VOID iotbroker_timer_node_init(TimerNode *tn, timer_handler handler);
+
+/*(re)arm the timer, it fires once*/
+VOID iotbroker_timer_add(TimerNode *tn, UINT32 timeout_ms);
+
+VOID iotbroker_timer_del(TimerNode *tn);
+
+/*armed and not fired yet*/
+UINT32 iotbroker_timer_pending(TimerNode *tn);
+
+/*fire the expired timers*/
+VOID iotbroker_timer_run();
+
+/*epoll_wait timeout until the next busy tick, -1 without timers*/
+INT32 iotbroker_timer_next_timeout();
+
+#endif